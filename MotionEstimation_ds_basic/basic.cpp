@@ -23,6 +23,7 @@
 #include <exception>
 #include <vector>
 #include <cerrno>
+#include <cstdint>
 
 #include "basic.hpp"
 
@@ -224,6 +225,30 @@ void destructorException ()
 }
 
 
+cl_uint zeroCopyPtrAlignment ()
+{
+    // Please refer to Intel Zero Copy Tutorial and OpenCL Performance Guide
+    return 4096;
+}
+
+
+size_t zeroCopySizeAlignment (size_t requiredSize)
+{
+    // Please refer to Intel Zero Copy Tutorial and OpenCL Performance Guide
+    // The following statement rounds requiredSize up to the next 64-byte boundary
+    return requiredSize + (~requiredSize + 1) % 64;   // or even shorter: requiredSize + (-requiredSize) % 64
+}
+
+
+bool verifyZeroCopyPtr (void* ptr, size_t sizeOfContentsOfPtr)
+{
+    return                                  // To enable zero-copy for buffer objects
+        (std::uintptr_t)ptr % 4096  ==  0   // pointer should be aligned to 4096 bytes boundary
+        &&                                  // and
+        sizeOfContentsOfPtr % 64  ==  0;    // size of memory should be aligned to 64 bytes boundary.
+}
+
+
 cl_uint requiredOpenCLAlignment (cl_device_id device)
 {
     cl_uint result = 0;
@@ -128,7 +128,7 @@ public:
     CmdParser(argc, argv),
         out_to_bmp(*this,        'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is on", ""),
         help(*this,              'h',"help","","Show this help text and exit."),
-        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv file format)","video_1920x1080_5frames.yuv"),
+        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","video_1920x1080_5frames.yuv"),
         overlayFileName(*this,   0,"output","string", "Output video sequence with overlaid motion vectors filename ","output.yuv"),
         width(*this,             0, "width",    "<integer>", "Frame width for the input file", 1920),
         height(*this,            0, "height","<integer>", "Frame height for the input file",1080),
@@ -142,6 +142,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -218,9 +231,8 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // Create a built-in VME kernel
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d, "", NULL, NULL);
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "", &err));
 
      size_t  buildLogSize = 0;
     clGetProgramBuildInfo(p(),d,CL_PROGRAM_BUILD_LOG,0,NULL,&buildLogSize );
@@ -278,9 +290,9 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
         mbImageWidth * mbImageHeight * sizeof(cl_short2), predMem, NULL);
 
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-    pCapture->GetSample(0, currImage);
+    // Bootstrap video sequence reading, the frames are read ahead on a background thread
+    PrefetchCapture prefetch(pCapture);
+    PlanarImage * currImage = prefetch.Acquire(0);
     cl::size_t<3> origin;
     origin[0] = 0;
     origin[1] = 0;
@@ -291,22 +303,24 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     region[2] = 1;
     // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
     queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+    prefetch.Release(0);
 
     // Process all frames
-    double ioStat = 0;//file i/o
+    double ioStat = 0;//image upload and read back
     double meStat = 0;//motion estimation itself
 
     double overallStart  = time_stamp();
     // First frame is already in srcImg, so we start with the second frame
     for (int i = 1; i < numPics; i++)
     {
-        double ioStart = time_stamp();
-        // Load next picture
-        pCapture->GetSample(i, currImage);
+        // Next picture, normally read already
+        currImage = prefetch.Acquire(i);
 
+        double ioStart = time_stamp();
         std::swap(refImage, srcImage);
         // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
         queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+        prefetch.Release(i);
         ioStat += (time_stamp() -ioStart);
 
         double meStart = time_stamp();
@@ -337,9 +351,10 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     double overallStat  = time_stamp() - overallStart;
     std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
     std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
-    std::cout << "Average frame file I/O time per frame " << 1000*ioStat/numPics << " ms\n";
+    std::cout << "Average wait for frame time per frame " << 1000*prefetch.GetWaitTime()/numPics << " ms\n";
+    std::cout << "Average frame file read time per frame (background) " << 1000*prefetch.GetReadTime()/numPics << " ms\n";
+    std::cout << "Average frame upload/read back time per frame " << 1000*ioStat/numPics << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/numPics << " ms\n";
-    ReleaseImage(currImage);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -546,7 +561,7 @@ int main( int argc, const char** argv )
         }
 #endif
         // Generate sequence with overlaid motion vectors
-        FrameWriter * pWriter = FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+        FrameWriter * pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
         PlanarImage * srcImage = CreatePlanarImage(width, height);
 
         int mvImageWidth, mvImageHeight;
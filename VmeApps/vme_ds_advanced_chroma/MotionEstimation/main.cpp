@@ -45,6 +45,7 @@
 #include "yuv_utils.h"
 #include "cmdparser.hpp"
 #include "oclobject.hpp"
+#include "cpu_vme.hpp"
 
 #ifdef __linux
 void fopen_s(FILE **f, const char *name, const char *mode) {
@@ -127,6 +128,11 @@ class CmdParserMV : public CmdParser
 public:
     CmdOption<bool>        out_to_bmp;
     CmdOption<bool>        help;
+    CmdOption<std::string>         backend;
+    CmdEnum<std::string>           backend_gpu;
+    CmdEnum<std::string>           backend_cpu;
+    CmdOption<int>        threads;
+    CmdOption<std::string>         cost_table;
     CmdOption<std::string>         fileName;
     CmdOption<std::string>         overlayFileName;
     CmdOption<int>        width;
@@ -137,21 +143,26 @@ public:
         CmdParser(argc, argv),
         out_to_bmp(*this, 'b', "nobmp", "", "Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is off", true, "nobmp"),
         help(*this, 'h', "help", "", "Show this help text and exit."),
+        backend(*this, 0, "backend", "string", "Motion estimation backend: VME on an Intel GPU or the host CPU implementation, which searches the windows of all predictors of a MB as their union (no skip check or intra search)", "gpu"),
+        backend_gpu(backend, "gpu"),
+        backend_cpu(backend, "cpu"),
+        threads(*this, 0, "threads", "<integer>", "Number of worker threads for the cpu backend -- 0 uses all hardware threads", 0),
+        cost_table(*this, 0, "cost_table", "string", "Packed motion vector cost table of the cpu backend as its two 32-bit words s0,s1 -- by default an approximation of the kernel's high penalty table, the gpu backend of ime_mv_extract prints the device's tables", ""),
 
 #if USE_HD
-        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv file format)", "video_1920x1080_5frames.yuv"),
+        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv or .y4m file format)", "video_1920x1080_5frames.yuv"),
         overlayFileName(*this, 0, "output", "string", "Output video sequence with overlaid motion vectors filename ", "video_1920x1080_5frames_output.yuv"),
         width(*this,  0, "width", "<integer>", "Frame width for the input file", 1920),
         height(*this, 0, "height", "<integer>", "Frame height for the input file", 1080),
         frames(*this, 5, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 5)
 #elif USE_SD
-        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv file format)", "goal_1280x720.yuv"),
+        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv or .y4m file format)", "goal_1280x720.yuv"),
         overlayFileName(*this, 0, "output", "string", "Output video sequence with overlaid motion vectors filename ", "goal_1280x720_output.yuv"),
         width(*this,  0, "width", "<integer>", "Frame width for the input file", 1280),
         height(*this, 0, "height", "<integer>", "Frame height for the input file", 720),
         frames(*this, 5, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 5)
 #else
-        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv file format)", "boat_qcif_176x144.yuv"),
+        fileName(*this, 0, "input", "string", "Input video sequence filename (.yuv or .y4m file format)", "boat_qcif_176x144.yuv"),
         overlayFileName(*this, 0, "output", "string", "Output video sequence with overlaid motion vectors filename ", "boat_qcif_176x144_output.yuv"),
         width(*this,  0, "width", "<integer>", "Frame width for the input file", 176),
         height(*this, 0, "height", "<integer>", "Frame height for the input file", 144),
@@ -166,6 +177,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if (!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if ((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -241,9 +265,8 @@ typedef struct CLInit {
         // Create a built-in VME kernel
         cl_int err = 0;
         const cl_device_id & d = device();
-        program = cl::Program(clCreateProgramWithSource(context(), 1, (const char**)&programSource, NULL, &err));
-
-        err = clBuildProgram(program(), 1, &d, "", NULL, NULL);
+        // Reuse the program binary cached by an earlier run when there is one
+        program = cl::Program(buildProgramWithCache(context(), d, programSource, "", &err));
 
         if (err != CL_SUCCESS) {
             size_t  buildLogSize = 0;
@@ -364,6 +387,50 @@ cl_int WriteYUVImageToOCLNV12(
 
 #endif
 
+// Search predictors of every MB: kCount of the 8 predictors per MB are used
+void InitPredictors(int numMBs, cl_short2 * countMem, cl_short2 * predMem)
+{
+    for (int i = 0; i < numMBs; i++)
+    {
+        countMem[i].s[0] = kCount;
+        countMem[i].s[1] = 0;
+    }
+
+    for (int i = 0; i < numMBs; i++)
+    {
+        for (int j = 0; j < 1; j++)
+        {
+            predMem[i * 8 + j].s[0] = 0;
+            predMem[i * 8 + j].s[1] = 0;
+        }
+        for (int j = 1; j < 2; j++)
+        {
+            predMem[i * 8 + j].s[0] = kPredictorX0;
+            predMem[i * 8 + j].s[1] = kPredictorY0;
+        }
+        for (int j = 2; j < 3; j++)
+        {
+            predMem[i * 8 + j].s[0] = -kPredictorX0;
+            predMem[i * 8 + j].s[1] = kPredictorY0;
+        }
+        for (int j = 3; j < 4; j++)
+        {
+            predMem[i * 8 + j].s[0] = kPredictorX0;
+            predMem[i * 8 + j].s[1] = -kPredictorY0;
+        }
+        for (int j = 4; j < 5; j++)
+        {
+            predMem[i * 8 + j].s[0] = -kPredictorX0;
+            predMem[i * 8 + j].s[1] = -kPredictorY0;
+        }
+        for (int j = 5; j < 8; j++)
+        {
+            predMem[i * 8 + j].s[0] = kPredictorX1;
+            predMem[i * 8 + j].s[1] = kPredictorY1;
+        }
+    }
+}
+
 void ExtractMotionVectorsFullFrameWithOpenCL(
     CLInit * clInit, 
     Capture * pCapture,
@@ -414,46 +481,8 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
  
 
     cl_short2 *countMem = new cl_short2[mbImageWidth * mbImageHeight];
-    for (int i = 0; i < mbImageWidth * mbImageHeight; i++)
-    {
-        countMem[i].s[0] = kCount;
-        countMem[i].s[1] = 0;
-    }
-
     cl_short2 *predMem = new cl_short2[mbImageWidth * mbImageHeight * 8];
-    for (int i = 0; i < mbImageWidth * mbImageHeight; i++)
-    {
-        for (int j = 0; j < 1; j++)
-        {
-            predMem[i * 8 + j].s[0] = 0;
-            predMem[i * 8 + j].s[1] = 0;
-        }
-        for (int j = 1; j < 2; j++)
-        {
-            predMem[i * 8 + j].s[0] = kPredictorX0;
-            predMem[i * 8 + j].s[1] = kPredictorY0;
-        }
-        for (int j = 2; j < 3; j++)
-        {
-            predMem[i * 8 + j].s[0] = -kPredictorX0;
-            predMem[i * 8 + j].s[1] = kPredictorY0;
-        }
-        for (int j = 3; j < 4; j++)
-        {
-            predMem[i * 8 + j].s[0] = kPredictorX0;
-            predMem[i * 8 + j].s[1] = -kPredictorY0;
-        }
-        for (int j = 4; j < 5; j++)
-        {
-            predMem[i * 8 + j].s[0] = -kPredictorX0;
-            predMem[i * 8 + j].s[1] = -kPredictorY0;
-        }
-        for (int j = 5; j < 8; j++)
-        {
-            predMem[i * 8 + j].s[0] = kPredictorX1;
-            predMem[i * 8 + j].s[1] = kPredictorY1;
-        }
-    }
+    InitPredictors(mbImageWidth * mbImageHeight, countMem, predMem);
 
     cl::Buffer countBuffer(
         clInit->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
@@ -469,18 +498,18 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         clInit->context, CL_MEM_WRITE_ONLY,
         mvImageWidth * mvImageHeight * sizeof(cl_ushort));
 
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-
-    pCapture->GetSample(0, currImage);
+    // Bootstrap video sequence reading, the frames are read ahead on a background thread
+    PrefetchCapture prefetch(pCapture);
+    PlanarImage * currImage = prefetch.Acquire(0);
     cl::size_t<3> origin, region;
     SET(origin, 0, 0, 0);
     SET(region, width, height, 1);
     
     clInit->queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y, NULL, 0);
+    prefetch.Release(0);
 
     // Process all frames
-    double ioStat = 0;//file i/o
+    double ioStat = 0;//image upload and read back
     double ioTileStat = 0;
     int count = 0;
 
@@ -497,10 +526,10 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // First frame is already in srcImg, so we start with the second frame
     for (int i = 1; i < numPics; i++, count++)
     {
-        double ioStart = time_stamp();
+        // Next picture, normally read already
+        currImage = prefetch.Acquire(i);
 
-        // Load next picture
-        pCapture->GetSample(i, currImage);
+        double ioStart = time_stamp();
 
         std::swap(refImage, srcImage);
 
@@ -510,6 +539,7 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         clInit->queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y, NULL, 0);
 
         ioTileStat += (time_stamp() - ioTileStart);
+        prefetch.Release(i);
 
         ioStat += (time_stamp() - ioStart);
 
@@ -559,10 +589,107 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
     std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n";
     std::cout << "Average frame tile I/O time per frame " << 1000 * ioTileStat / count << " ms\n";
-    std::cout << "Average frame file I/O time per frame " << 1000 * ioStat / count << " ms\n";
+    std::cout << "Average wait for frame time per frame " << 1000 * prefetch.GetWaitTime() / count << " ms\n";
+    std::cout << "Average frame file read time per frame (background) " << 1000 * prefetch.GetReadTime() / count << " ms\n";
+    std::cout << "Average frame upload/read back time per frame " << 1000 * ioStat / count << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << ndRangeTime / count << " ms\n";
+}
 
-    ReleaseImage(currImage);
+// Host counterpart of ExtractMotionVectorsFullFrameWithOpenCL: same count
+// and predictor buffers, same search settings. The kCount windows of a MB
+// are searched as their union instead of one IME each, so the windows that
+// overlap (here all of the (0, 0) ones) are only searched once.
+void ExtractMotionVectorsFullFrameCPU(
+    Capture * pCapture,
+    std::vector<MotionVector> &MVs,
+    std::vector<cl_ushort> &SADs,
+    const CmdParserMV& cmd)
+{
+    CPUVme::SearchDesc desc;
+    switch (kMBBlockType) {
+    case CL_ME_MB_TYPE_16x16_INTEL: desc.partitionMask = CPUVme::kPartitionMask16x16; break;
+    case CL_ME_MB_TYPE_8x8_INTEL:   desc.partitionMask = CPUVme::kPartitionMask8x8; break;
+    case CL_ME_MB_TYPE_4x4_INTEL:   desc.partitionMask = CPUVme::kPartitionMask4x4; break;
+    default:                        desc.partitionMask = CPUVme::kPartitionMaskAll; break;
+    }
+    desc.sadAdjustMode = kSADAdjust == CL_ME_SAD_ADJUST_MODE_HAAR_INTEL ? CPUVme::SAD_ADJUST_MODE_HAAR : CPUVme::SAD_ADJUST_MODE_NONE;
+    switch (kPixelMode) {
+    case CL_ME_SUBPIXEL_MODE_QPEL_INTEL:    desc.subPixelMode = CPUVme::SUBPIXEL_MODE_QPEL; break;
+    case CL_ME_SUBPIXEL_MODE_HPEL_INTEL:    desc.subPixelMode = CPUVme::SUBPIXEL_MODE_HPEL; break;
+    case CL_ME_SUBPIXEL_MODE_INTEGER_INTEL: desc.subPixelMode = CPUVme::SUBPIXEL_MODE_INTEGER; break;
+    }
+    desc.costTable = cmd.cost_table.getValue().empty()
+        ? CPUVme::GetCostTable((CPUVme::CostPenalty)kCostPenalty)
+        : CPUVme::ParseCostTable(cmd.cost_table.getValue());
+    desc.costPrecision = (CPUVme::CostPrecision)kCostPrecision;
+
+    int numPics = pCapture->GetNumFrames();
+    int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
+    int mvImageWidth, mvImageHeight;
+    int mbImageWidth, mbImageHeight;
+    ComputeNumMVs(kMBBlockType, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
+    const int numMBs = mbImageWidth * mbImageHeight;
+    const int mvsPerMB = (mvImageWidth * mvImageHeight) / numMBs;
+
+    MVs.resize(numPics * mvImageWidth * mvImageHeight);
+    SADs.resize(numPics * mvImageWidth * mvImageHeight);
+
+    // Same predictors as the GPU path
+    std::vector<cl_short2> countMem(numMBs);
+    std::vector<cl_short2> predMem(numMBs * CPUVme::kMaxPredictors);
+    InitPredictors(numMBs, &countMem[0], &predMem[0]);
+
+    CPUVme::MotionEstimator estimator(width, height, desc, cmd.threads.getValue());
+    CPUVme::Plane srcPlane(width, height), refPlane(width, height);
+    CPUVme::Plane * src = &srcPlane;
+    CPUVme::Plane * ref = &refPlane;
+    std::vector<cl_short2> mbMVs(numMBs * 16);
+    std::vector<cl_ushort> mbSADs(numMBs * 16);
+    std::vector<cl_uchar2> mbShapes(numMBs);
+
+    // Bootstrap video sequence reading, the frames are read ahead on a background thread
+    PrefetchCapture prefetch(pCapture);
+    PlanarImage * currImage = prefetch.Acquire(0);
+    ref->Load(currImage->Y, currImage->PitchY);
+    prefetch.Release(0);
+    ref->Interpolate();
+
+    double meStat = 0;//motion estimation itself
+    int count = 0;
+
+    double overallStart = time_stamp();
+    for (int i = 1; i < numPics; i++, count++)
+    {
+        currImage = prefetch.Acquire(i);
+
+        double meStart = time_stamp();
+        src->Load(currImage->Y, currImage->PitchY);
+        prefetch.Release(i);
+        estimator.EstimateFrameMultiPredictor(*src, *ref, &countMem[0], &predMem[0], &mbMVs[0], &mbSADs[0], &mbShapes[0]);
+
+        // Keep the entries the kernel writes: the first sub-block of every
+        // 16x16, 8x8 or 4x4 block, in the VME sub-block order
+        for (int mb = 0; mb < numMBs; mb++)
+        {
+            for (int k = 0; k < mvsPerMB; k++)
+            {
+                MVs[(i * numMBs + mb) * mvsPerMB + k] = mbMVs[mb * 16 + k * (16 / mvsPerMB)];
+                SADs[(i * numMBs + mb) * mvsPerMB + k] = mbSADs[mb * 16 + k * (16 / mvsPerMB)];
+            }
+        }
+
+        // This frame is the reference of the next one
+        std::swap(src, ref);
+        ref->Interpolate();
+        meStat += (time_stamp() - meStart);
+    }
+    double overallStat = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n";
+    std::cout << "Average wait for frame time per frame " << 1000 * prefetch.GetWaitTime() / count << " ms\n";
+    std::cout << "Average frame file read time per frame (background) " << 1000 * prefetch.GetReadTime() / count << " ms\n";
+    std::cout << "Average Motion Estimation time per frame is " << 1000 * meStat / count << " ms\n";
 }
 
 void ComputeCheckMotionVectorsFullFrameWithOpenCL(
@@ -714,10 +841,14 @@ void ComputeCheckMotionVectorsFullFrameWithOpenCL(
 
     cl_short2 *skipMVMem = new cl_short2[mvImageWidth * mvImageHeight * 8];
 
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
+    // The skip check input changes every frame, the buffer is refilled rather than re-created
+    const size_t skipMVSize = mvImageWidth * mvImageHeight * 8 * sizeof(cl_short2);
+    OpenCLBufferPool buffers(clInit->context());
+    cl::Buffer skipMVBuffer(buffers.acquire(0, skipMVSize, CL_MEM_READ_ONLY));
 
-    pCapture->GetSample(0, currImage);
+    // Bootstrap video sequence reading, the frames are read ahead on a background thread
+    PrefetchCapture prefetch(pCapture);
+    PlanarImage * currImage = prefetch.Acquire(0);
 
     cl::size_t<3> origin, region;
     SET(origin, 0, 0, 0);
@@ -729,10 +860,11 @@ void ComputeCheckMotionVectorsFullFrameWithOpenCL(
 #else
 	WriteYUVImageToOCLNV12(srcImage, srcYImage, srcUVImage, clInit->context, clInit->queue, currImage);
 #endif
+    prefetch.Release(0);
 
     // Process all frames
     double ioTileStat = 0;
-    double ioStat = 0;//file i/o
+    double ioStat = 0;//image upload and read back
 #if DO_INTRA
 #if !DO_CHROMA_INTRA
     unsigned flags = 0x2;
@@ -772,16 +904,14 @@ void ComputeCheckMotionVectorsFullFrameWithOpenCL(
         }
 #endif
 
-        cl::Buffer skipMVBuffer(
-            clInit->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            mvImageWidth * mvImageHeight * 8 * sizeof(cl_short2), skipMVMem, NULL);
+        // skipMVMem stays untouched until the motion estimation below has completed
+        clInit->queue.enqueueWriteBuffer(skipMVBuffer, CL_FALSE, 0, skipMVSize, skipMVMem);
 
-        // Load next picture
+        // Next picture, normally read already
+        currImage = prefetch.Acquire(i);
 
         double ioStart = time_stamp();
 
-        pCapture->GetSample(i, currImage);
-
         std::swap(refImage, srcImage);
 
 #if DO_CHROMA_INTRA
@@ -799,6 +929,7 @@ void ComputeCheckMotionVectorsFullFrameWithOpenCL(
 		WriteYUVImageToOCLNV12(srcImage, srcYImage, srcUVImage, clInit->context, clInit->queue, currImage);
 #endif
 		ioTileStat += (time_stamp() - ioTileStart);
+        prefetch.Release(i);
         ioStat += (time_stamp() - ioStart);
 
         // Schedule full-frame motion estimation
@@ -864,10 +995,11 @@ void ComputeCheckMotionVectorsFullFrameWithOpenCL(
     int count = numPics - 1;
     std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n";
     std::cout << "Average frame tile I/O time per frame " << 1000 * ioTileStat / count << " ms\n";
-    std::cout << "Average frame file I/O time per frame " << 1000 * ioStat / count << " ms\n";
+    std::cout << "Average wait for frame time per frame " << 1000 * prefetch.GetWaitTime() / count << " ms\n";
+    std::cout << "Average frame file read time per frame (background) " << 1000 * prefetch.GetReadTime() / count << " ms\n";
+    std::cout << "Average frame upload/read back time per frame " << 1000 * ioStat / count << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << ndRangeTime / count << " ms\n";
-
-    ReleaseImage(currImage);
+    std::cout << "Device buffer allocations " << buffers.allocations << " (" << buffers.allocated_bytes / 1024 << " KB)\n";
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1031,7 +1163,7 @@ int main(int argc, const char** argv)
         std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
         std::vector<MotionVector> MVs1;
         std::vector<cl_ushort> SADs;
-        CLInit *clInit = new CLInit();
+        CLInit *clInit = (ONLY_INTRA || !cmd.backend_cpu.isSet()) ? new CLInit() : NULL;
 
 #if ONLY_INTRA
 		std::vector<MotionVector> MVs2;
@@ -1046,8 +1178,19 @@ int main(int argc, const char** argv)
 		PrintIntraDists( intraSADs, width, height );
 #endif
 #else
-        ExtractMotionVectorsFullFrameWithOpenCL(clInit, pCapture, MVs1, SADs, cmd);
-        if (kMBBlockType < CL_ME_MB_TYPE_4x4_INTEL)
+        if (cmd.backend_cpu.isSet())
+        {
+            ExtractMotionVectorsFullFrameCPU(pCapture, MVs1, SADs, cmd);
+        }
+        else
+        {
+            ExtractMotionVectorsFullFrameWithOpenCL(clInit, pCapture, MVs1, SADs, cmd);
+        }
+        if (cmd.backend_cpu.isSet())
+        {
+            std::cout << "Skip test not enabled for the cpu backend !\n";
+        }
+        else if (kMBBlockType < CL_ME_MB_TYPE_4x4_INTEL)
         {
             std::vector<MotionVector> MVs2;
             std::vector<cl_ushort> searchSADs;
@@ -1108,7 +1251,7 @@ int main(int argc, const char** argv)
 #endif
 
         // Generate sequence with overlaid motion vectors
-        FrameWriter * pWriter = FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+        FrameWriter * pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
         PlanarImage * srcImage = CreatePlanarImage(width, height);
 
         int mvImageWidth, mvImageHeight;
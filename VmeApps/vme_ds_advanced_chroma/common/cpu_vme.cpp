@@ -0,0 +1,1388 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+#include "cpu_vme.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+#include <smmintrin.h>
+#include <immintrin.h>
+
+#ifdef __GNUC__
+#define CPU_VME_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_VME_ALIGN(n) __attribute__((aligned(n)))
+#else
+#define CPU_VME_TARGET_AVX2
+#define CPU_VME_ALIGN(n) __declspec(align(n))
+#endif
+
+namespace CPUVme
+{
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // SIMD kernels
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Computes 16x16 SADs of one source MB against count horizontally consecutive
+    // reference positions starting at ref.
+    typedef void (*SadRowFn)(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out);
+
+    static void SadRow16x16_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out)
+    {
+        __m128i s[16];
+        for (int y = 0; y < 16; ++y)
+        {
+            s[y] = _mm_load_si128((const __m128i *)(src + y * srcPitch));
+        }
+
+        for (int x = 0; x < count; ++x)
+        {
+            const uint8_t * r = ref + x;
+            __m128i acc = _mm_setzero_si128();
+            for (int y = 0; y < 16; ++y)
+            {
+                acc = _mm_add_epi32(acc, _mm_sad_epu8(s[y], _mm_loadu_si128((const __m128i *)(r + y * refPitch))));
+            }
+            out[x] = _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+        }
+    }
+
+    // Two candidate positions per iteration: position x in the low lane,
+    // position x + 1 in the high lane, against the source row broadcast to both.
+    CPU_VME_TARGET_AVX2
+    static void SadRow16x16_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out)
+    {
+        int x = 0;
+        for (; x + 1 < count; x += 2)
+        {
+            const uint8_t * r = ref + x;
+            __m256i acc = _mm256_setzero_si256();
+            for (int y = 0; y < 16; ++y)
+            {
+                __m256i s = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(src + y * srcPitch)));
+                __m256i rr = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(r + y * refPitch))),
+                    _mm_loadu_si128((const __m128i *)(r + y * refPitch + 1)), 1);
+                acc = _mm256_add_epi32(acc, _mm256_sad_epu8(s, rr));
+            }
+            out[x]     = _mm256_extract_epi32(acc, 0) + _mm256_extract_epi32(acc, 2);
+            out[x + 1] = _mm256_extract_epi32(acc, 4) + _mm256_extract_epi32(acc, 6);
+        }
+        if (x < count)
+        {
+            SadRow16x16_SSE41(src, srcPitch, ref + x, refPitch, 1, out + x);
+        }
+    }
+
+    static bool HasAVX2()
+    {
+#ifdef __GNUC__
+        return __builtin_cpu_supports("avx2") != 0;
+#else
+        return false;
+#endif
+    }
+
+    static SadRowFn SelectSadRow()
+    {
+        return HasAVX2() ? SadRow16x16_AVX2 : SadRow16x16_SSE41;
+    }
+
+    // H.264 6-tap filter (1, -5, 20, 20, -5, 1) on eight 16 bit lanes, unscaled.
+    static inline __m128i Tap6_16(__m128i a, __m128i b, __m128i c, __m128i d, __m128i e, __m128i f)
+    {
+        const __m128i sum05 = _mm_add_epi16(a, f);
+        const __m128i sum14 = _mm_add_epi16(b, e);
+        const __m128i sum23 = _mm_add_epi16(c, d);
+        return _mm_add_epi16(_mm_sub_epi16(sum05, _mm_mullo_epi16(sum14, _mm_set1_epi16(5))),
+                             _mm_mullo_epi16(sum23, _mm_set1_epi16(20)));
+    }
+
+    // Filters 16 consecutive pixels whose six taps start at p[0], p[step], ...
+    // Returns the unscaled sums in lo (pixels 0..7) and hi (pixels 8..15).
+    static inline void Tap6_U8(const uint8_t * p, int step, __m128i & lo, __m128i & hi)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v[6];
+        for (int i = 0; i < 6; ++i)
+        {
+            v[i] = _mm_loadu_si128((const __m128i *)(p + i * step));
+        }
+        lo = Tap6_16(_mm_unpacklo_epi8(v[0], zero), _mm_unpacklo_epi8(v[1], zero), _mm_unpacklo_epi8(v[2], zero),
+                     _mm_unpacklo_epi8(v[3], zero), _mm_unpacklo_epi8(v[4], zero), _mm_unpacklo_epi8(v[5], zero));
+        hi = Tap6_16(_mm_unpackhi_epi8(v[0], zero), _mm_unpackhi_epi8(v[1], zero), _mm_unpackhi_epi8(v[2], zero),
+                     _mm_unpackhi_epi8(v[3], zero), _mm_unpackhi_epi8(v[4], zero), _mm_unpackhi_epi8(v[5], zero));
+    }
+
+    // (sum + 16) >> 5, clipped to [0, 255].
+    static inline __m128i Round5_U8(__m128i lo, __m128i hi)
+    {
+        const __m128i bias = _mm_set1_epi16(16);
+        return _mm_packus_epi16(_mm_srai_epi16(_mm_add_epi16(lo, bias), 5),
+                                _mm_srai_epi16(_mm_add_epi16(hi, bias), 5));
+    }
+
+    // Second (vertical) filter pass of the center sample over unscaled
+    // horizontal sums: (sum + 512) >> 10 in 32 bit, clipped to [0, 255].
+    static inline __m128i Tap6Center_16(const __m128i * r)
+    {
+        const __m128i k01 = _mm_set_epi16(-5, 1, -5, 1, -5, 1, -5, 1);
+        const __m128i k23 = _mm_set1_epi16(20);
+        const __m128i k45 = _mm_set_epi16(1, -5, 1, -5, 1, -5, 1, -5);
+        const __m128i bias = _mm_set1_epi32(512);
+
+        __m128i lo = _mm_add_epi32(_mm_add_epi32(
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[0], r[1]), k01),
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[2], r[3]), k23)),
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[4], r[5]), k45));
+        __m128i hi = _mm_add_epi32(_mm_add_epi32(
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[0], r[1]), k01),
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[2], r[3]), k23)),
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[4], r[5]), k45));
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), 10);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), 10);
+        return _mm_packs_epi32(lo, hi);
+    }
+
+    template <int W> static inline __m128i LoadBlockRow(const uint8_t * p);
+
+    template <> inline __m128i LoadBlockRow<16>(const uint8_t * p)
+    {
+        return _mm_loadu_si128((const __m128i *)p);
+    }
+
+    template <> inline __m128i LoadBlockRow<8>(const uint8_t * p)
+    {
+        return _mm_loadl_epi64((const __m128i *)p);
+    }
+
+    template <> inline __m128i LoadBlockRow<4>(const uint8_t * p)
+    {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return _mm_cvtsi32_si128(v);
+    }
+
+    // SAD of a W x h source block against the prediction p1, or the rounded
+    // average of p1 and p2 when p2 is set (quarter-pel samples).
+    template <int W>
+    static uint32_t PredictionSad(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch, int h)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (int y = 0; y < h; ++y)
+        {
+            __m128i pred = LoadBlockRow<W>(p1 + y * refPitch);
+            if (p2)
+            {
+                pred = _mm_avg_epu8(pred, LoadBlockRow<W>(p2 + y * refPitch));
+            }
+            acc = _mm_add_epi32(acc, _mm_sad_epu8(LoadBlockRow<W>(src + y * srcPitch), pred));
+        }
+        return _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+    }
+
+    // Sums the absolute 4x4 Hadamard coefficients of two side by side 4x4
+    // difference blocks, one row of both per register (16 bit lanes).
+    static inline __m128i Hadamard4x4Pair(__m128i d0, __m128i d1, __m128i d2, __m128i d3)
+    {
+        const __m128i a0 = _mm_add_epi16(d0, d1), a1 = _mm_sub_epi16(d0, d1);
+        const __m128i a2 = _mm_add_epi16(d2, d3), a3 = _mm_sub_epi16(d2, d3);
+        const __m128i rows[4] = { _mm_add_epi16(a0, a2), _mm_add_epi16(a1, a3),
+                                  _mm_sub_epi16(a0, a2), _mm_sub_epi16(a1, a3) };
+
+        __m128i acc = _mm_setzero_si128();
+        for (int i = 0; i < 4; ++i)
+        {
+            // Horizontal butterflies inside each group of 4 lanes. Differences
+            // come out negated, which the absolute value makes irrelevant.
+            __m128i v = rows[i];
+            __m128i sw = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_blend_epi16(_mm_add_epi16(v, sw), _mm_sub_epi16(sw, v), 0xAA);
+            sw = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(1, 0, 3, 2)), _MM_SHUFFLE(1, 0, 3, 2));
+            v = _mm_blend_epi16(_mm_add_epi16(v, sw), _mm_sub_epi16(sw, v), 0xCC);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_abs_epi16(v), _mm_set1_epi16(1)));
+        }
+        return acc;
+    }
+
+    // SATD (sum of absolute 4x4 Hadamard transformed differences, halved) of a
+    // W x h source block against the same prediction as PredictionSad().
+    template <int W>
+    static uint32_t PredictionSatd(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch, int h)
+    {
+        static const int kChunk = W < 8 ? W : 8;
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        for (int y = 0; y < h; y += 4)
+        {
+            for (int x = 0; x < W; x += kChunk)
+            {
+                __m128i d[4];
+                for (int r = 0; r < 4; ++r)
+                {
+                    const int offset = (y + r) * refPitch + x;
+                    __m128i pred = LoadBlockRow<kChunk>(p1 + offset);
+                    if (p2)
+                    {
+                        pred = _mm_avg_epu8(pred, LoadBlockRow<kChunk>(p2 + offset));
+                    }
+                    d[r] = _mm_sub_epi16(_mm_unpacklo_epi8(LoadBlockRow<kChunk>(src + (y + r) * srcPitch + x), zero),
+                                         _mm_unpacklo_epi8(pred, zero));
+                }
+                acc = _mm_add_epi32(acc, Hadamard4x4Pair(d[0], d[1], d[2], d[3]));
+            }
+        }
+        acc = _mm_hadd_epi32(acc, acc);
+        acc = _mm_hadd_epi32(acc, acc);
+        return ((uint32_t)_mm_cvtsi128_si32(acc) + 1) >> 1;
+    }
+
+    // Half-pel planes averaged to form each quarter-pel phase, indexed by
+    // (qy & 3) * 4 + (qx & 3); see Plane::SubpelPtr() for the plane numbering.
+    static const int kQpelPlane0[16] = { 0, 1, 1, 1, 0, 1, 1, 1, 2, 3, 3, 3, 0, 1, 1, 1 };
+    static const int kQpelPlane1[16] = { 0, 0, 1, 0, 2, 2, 3, 2, 2, 2, 3, 2, 2, 2, 3, 2 };
+
+    // SAD, or SATD when haar is set, of a w x h source block against the
+    // prediction p1, or the rounded average of p1 and p2 when p2 is set.
+    static uint32_t BlockDistortion(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch,
+                                    int w, int h, bool haar)
+    {
+        if (haar)
+        {
+            switch (w)
+            {
+            case 16: return PredictionSatd<16>(src, srcPitch, p1, p2, refPitch, h);
+            case 8:  return PredictionSatd<8>(src, srcPitch, p1, p2, refPitch, h);
+            default: return PredictionSatd<4>(src, srcPitch, p1, p2, refPitch, h);
+            }
+        }
+        switch (w)
+        {
+        case 16: return PredictionSad<16>(src, srcPitch, p1, p2, refPitch, h);
+        case 8:  return PredictionSad<8>(src, srcPitch, p1, p2, refPitch, h);
+        default: return PredictionSad<4>(src, srcPitch, p1, p2, refPitch, h);
+        }
+    }
+
+    // Full/half-pel samples forming the prediction at the absolute QPEL
+    // position (qx, qy): p1, averaged with p2 unless p2 is NULL.
+    static inline void SubpelSamples(const Plane & ref, int qx, int qy, const uint8_t * & p1, const uint8_t * & p2)
+    {
+        const int phase = ((qy & 3) << 2) + (qx & 3);
+        const int x = qx >> 2;
+        const int y = qy >> 2;
+        p1 = ref.SubpelPtr(kQpelPlane0[phase], x, y + ((qy & 3) == 3));
+        p2 = (phase & 5) ? ref.SubpelPtr(kQpelPlane1[phase], x + ((qx & 3) == 3), y) : NULL;
+    }
+
+    // SAD, or SATD when haar is set, of the w x h source block against the
+    // reference at the absolute QPEL position (qx, qy) of its top left sample.
+    static uint32_t SubpelDistortion(const Plane & ref, const uint8_t * src, int srcPitch, int qx, int qy, int w, int h, bool haar)
+    {
+        const uint8_t * p1;
+        const uint8_t * p2;
+        SubpelSamples(ref, qx, qy, p1, p2);
+        return BlockDistortion(src, srcPitch, p1, p2, ref.GetPitch(), w, h, haar);
+    }
+
+    // One refinement step: the 8 neighbours of mv at distance step (QPEL units)
+    // are tried and the cheapest (distortion + MV cost) replaces mv. Ties keep
+    // the current vector.
+    static void RefineStep(const Plane & ref, const uint8_t * src, int srcPitch, int x, int y, int w, int h,
+                           bool haar, const CostModel & costModel, cl_short2 costCenter,
+                           int step, cl_short2 & mv, uint32_t & dist)
+    {
+        const int centerX = mv.s[0];
+        const int centerY = mv.s[1];
+        uint32_t bestCost = dist + costModel.Cost(centerX - costCenter.s[0], centerY - costCenter.s[1]);
+        for (int dy = -step; dy <= step; dy += step)
+        {
+            for (int dx = -step; dx <= step; dx += step)
+            {
+                if (dx == 0 && dy == 0)
+                {
+                    continue;
+                }
+                const uint32_t d = SubpelDistortion(ref, src, srcPitch, x * 4 + centerX + dx, y * 4 + centerY + dy, w, h, haar);
+                const uint32_t cost = d + costModel.Cost(centerX + dx - costCenter.s[0], centerY + dy - costCenter.s[1]);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    dist = d;
+                    mv.s[0] = (cl_short)(centerX + dx);
+                    mv.s[1] = (cl_short)(centerY + dy);
+                }
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // Variable block size search
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // The 41 H.264 inter partitions of a MB, grouped by size in the bit order
+    // of the partition mask: 16x16, 16x8 (2), 8x16 (2), 8x8 (4), 8x4 (8),
+    // 4x8 (8), 4x4 (16). Sub-partitions follow their 8x8 quadrant.
+    enum
+    {
+        PART_16x16 = 0,
+        PART_16x8 = 1,
+        PART_8x16 = 3,
+        PART_8x8 = 5,
+        PART_8x4 = 9,
+        PART_4x8 = 17,
+        PART_4x4 = 25,
+        NUM_PARTITIONS = 41
+    };
+
+    static const int kPartitionFirst[7] = { PART_16x16, PART_16x8, PART_8x16, PART_8x8, PART_8x4, PART_4x8, PART_4x4 };
+    static const int kPartitionCount[7] = { 1, 2, 2, 4, 8, 8, 16 };
+
+    // Pixel rectangle of partition p inside the MB
+    static void GetPartitionRect(int p, int & x, int & y, int & w, int & h)
+    {
+        if (p >= PART_4x4)
+        {
+            const int q = (p - PART_4x4) >> 2, s = (p - PART_4x4) & 3;
+            x = (q & 1) * 8 + (s & 1) * 4; y = (q >> 1) * 8 + (s >> 1) * 4; w = 4; h = 4;
+        }
+        else if (p >= PART_4x8)
+        {
+            const int q = (p - PART_4x8) >> 1, n = (p - PART_4x8) & 1;
+            x = (q & 1) * 8 + n * 4; y = (q >> 1) * 8; w = 4; h = 8;
+        }
+        else if (p >= PART_8x4)
+        {
+            const int q = (p - PART_8x4) >> 1, n = (p - PART_8x4) & 1;
+            x = (q & 1) * 8; y = (q >> 1) * 8 + n * 4; w = 8; h = 4;
+        }
+        else if (p >= PART_8x8)
+        {
+            const int q = p - PART_8x8;
+            x = (q & 1) * 8; y = (q >> 1) * 8; w = 8; h = 8;
+        }
+        else if (p >= PART_8x16)
+        {
+            x = (p - PART_8x16) * 8; y = 0; w = 8; h = 16;
+        }
+        else if (p >= PART_16x8)
+        {
+            x = 0; y = (p - PART_16x8) * 8; w = 16; h = 8;
+        }
+        else
+        {
+            x = 0; y = 0; w = 16; h = 16;
+        }
+    }
+
+    // Per lane (= per candidate column) best distortion of every partition,
+    // with the L1 vector length used to break ties and the packed
+    // window position ((dy index << 8) | dx index) of the winner.
+    struct PartitionTracker
+    {
+        __m128i sad[NUM_PARTITIONS];
+        __m128i length[NUM_PARTITIONS];
+        __m128i pos[NUM_PARTITIONS];
+
+        void Reset()
+        {
+            for (int p = 0; p < NUM_PARTITIONS; ++p)
+            {
+                sad[p] = _mm_set1_epi16(-1);
+                length[p] = _mm_set1_epi16(0x7FFF);
+                pos[p] = _mm_setzero_si128();
+            }
+        }
+    };
+
+    // Best integer vector (QPEL units), its distortion and its MV cost, for
+    // every partition
+    struct PartitionResults
+    {
+        uint32_t dist[NUM_PARTITIONS];
+        uint32_t cost[NUM_PARTITIONS];
+        cl_short2 mv[NUM_PARTITIONS];
+    };
+
+    static inline void Track(PartitionTracker & t, int p, __m128i sad, __m128i pos, __m128i length)
+    {
+        // Unsigned 16 bit compare: sad < best, or sad == best with a shorter vector
+        const __m128i eq = _mm_cmpeq_epi16(sad, t.sad[p]);
+        const __m128i le = _mm_cmpeq_epi16(_mm_min_epu16(sad, t.sad[p]), sad);
+        const __m128i take = _mm_or_si128(_mm_andnot_si128(eq, le),
+                                          _mm_and_si128(eq, _mm_cmpgt_epi16(t.length[p], length)));
+        t.sad[p] = _mm_min_epu16(sad, t.sad[p]);
+        t.length[p] = _mm_blendv_epi8(t.length[p], length, take);
+        t.pos[p] = _mm_blendv_epi8(t.pos[p], pos, take);
+    }
+
+    // Sums the 4x4 SADs (raster order) of 8 candidates into every enabled
+    // partition, adds the MV cost of the candidates and tracks the winners.
+    // 16 bit lanes are enough: a 16x16 SAD is at most 65280, and the cost is
+    // added with saturation.
+    static inline void UpdatePartitions(const __m128i * sad4x4, __m128i pos, __m128i length, const __m128i * cost,
+                                        unsigned enabled, PartitionTracker & t)
+    {
+        __m128i part[NUM_PARTITIONS];
+        for (int q = 0; q < 4; ++q)
+        {
+            const int b = (q >> 1) * 8 + (q & 1) * 2;
+            const __m128i s0 = sad4x4[b], s1 = sad4x4[b + 1], s2 = sad4x4[b + 4], s3 = sad4x4[b + 5];
+            part[PART_4x4 + 4 * q + 0] = s0;
+            part[PART_4x4 + 4 * q + 1] = s1;
+            part[PART_4x4 + 4 * q + 2] = s2;
+            part[PART_4x4 + 4 * q + 3] = s3;
+            part[PART_8x4 + 2 * q + 0] = _mm_add_epi16(s0, s1);
+            part[PART_8x4 + 2 * q + 1] = _mm_add_epi16(s2, s3);
+            part[PART_4x8 + 2 * q + 0] = _mm_add_epi16(s0, s2);
+            part[PART_4x8 + 2 * q + 1] = _mm_add_epi16(s1, s3);
+            part[PART_8x8 + q] = _mm_add_epi16(part[PART_8x4 + 2 * q], part[PART_8x4 + 2 * q + 1]);
+        }
+        part[PART_16x8 + 0] = _mm_add_epi16(part[PART_8x8 + 0], part[PART_8x8 + 1]);
+        part[PART_16x8 + 1] = _mm_add_epi16(part[PART_8x8 + 2], part[PART_8x8 + 3]);
+        part[PART_8x16 + 0] = _mm_add_epi16(part[PART_8x8 + 0], part[PART_8x8 + 2]);
+        part[PART_8x16 + 1] = _mm_add_epi16(part[PART_8x8 + 1], part[PART_8x8 + 3]);
+        part[PART_16x16] = _mm_add_epi16(part[PART_16x8 + 0], part[PART_16x8 + 1]);
+
+        for (int size = 0; size < 7; ++size)
+        {
+            if (enabled & (1 << size))
+            {
+                for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                {
+                    Track(t, p, cost ? _mm_adds_epu16(part[p], *cost) : part[p], pos, length);
+                }
+            }
+        }
+    }
+
+    // MV costs of the search window, one entry per column (padded to a whole
+    // number of 16 lane groups) and per row. NULL x means no cost.
+    struct WindowCosts
+    {
+        const uint16_t * x;
+        const uint16_t * y;
+    };
+
+    // Candidate positions, vector lengths and MV costs of 8 window columns starting at dx
+    static inline void CandidateLanes(int dx, int dy, int centerX, int centerY, const WindowCosts & costs,
+                                      __m128i & pos, __m128i & length, __m128i & cost)
+    {
+        const __m128i lane = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const int mvX = centerX - kSearchRadiusX + dx;
+        const int mvY = centerY - kSearchRadiusY + dy;
+        pos = _mm_add_epi16(_mm_set1_epi16((short)((dy << 8) | dx)), lane);
+        length = _mm_add_epi16(_mm_abs_epi16(_mm_add_epi16(_mm_set1_epi16((short)mvX), lane)),
+                               _mm_set1_epi16((short)abs(mvY)));
+        if (costs.x)
+        {
+            cost = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(costs.x + dx)), _mm_set1_epi16((short)costs.y[dy]));
+        }
+    }
+
+    // 4x4 SADs of the MB against 8 horizontally consecutive positions starting
+    // at ref: lane i of sad4x4[by * 4 + bx] is block (bx, by) at position i.
+    // mpsadbw matches one 4 byte source group against 8 sliding windows.
+    static inline void Sad4x4Grid_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, __m128i * sad4x4)
+    {
+        for (int by = 0; by < 4; ++by)
+        {
+            __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+            for (int r = 0; r < 4; ++r)
+            {
+                const int y = by * 4 + r;
+                const __m128i s = _mm_load_si128((const __m128i *)(src + y * srcPitch));
+                const __m128i a0 = _mm_loadu_si128((const __m128i *)(ref + y * refPitch));
+                const __m128i a8 = _mm_loadu_si128((const __m128i *)(ref + y * refPitch + 8));
+                acc0 = _mm_add_epi16(acc0, _mm_mpsadbw_epu8(a0, s, 0));
+                acc1 = _mm_add_epi16(acc1, _mm_mpsadbw_epu8(a0, s, 5));
+                acc2 = _mm_add_epi16(acc2, _mm_mpsadbw_epu8(a8, s, 2));
+                acc3 = _mm_add_epi16(acc3, _mm_mpsadbw_epu8(a8, s, 7));
+            }
+            sad4x4[by * 4 + 0] = acc0;
+            sad4x4[by * 4 + 1] = acc1;
+            sad4x4[by * 4 + 2] = acc2;
+            sad4x4[by * 4 + 3] = acc3;
+        }
+    }
+
+    // Same as above for 16 positions: positions 0..7 in lo, 8..15 in hi.
+    CPU_VME_TARGET_AVX2
+    static inline void Sad4x4Grid_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, __m128i * lo, __m128i * hi)
+    {
+        for (int by = 0; by < 4; ++by)
+        {
+            __m256i acc[4];
+            for (int k = 0; k < 4; ++k)
+            {
+                acc[k] = _mm256_setzero_si256();
+            }
+            for (int r = 0; r < 4; ++r)
+            {
+                const int y = by * 4 + r;
+                const __m256i s = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(src + y * srcPitch)));
+                const __m256i v = _mm256_loadu_si256((const __m256i *)(ref + y * refPitch));
+                const __m256i a0 = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(2, 1, 1, 0));    // bytes 0..15 | 8..23
+                const __m256i a8 = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 2, 2, 1));    // bytes 8..23 | 16..31
+                acc[0] = _mm256_add_epi16(acc[0], _mm256_mpsadbw_epu8(a0, s, 0 | (0 << 3)));
+                acc[1] = _mm256_add_epi16(acc[1], _mm256_mpsadbw_epu8(a0, s, 5 | (5 << 3)));
+                acc[2] = _mm256_add_epi16(acc[2], _mm256_mpsadbw_epu8(a8, s, 2 | (2 << 3)));
+                acc[3] = _mm256_add_epi16(acc[3], _mm256_mpsadbw_epu8(a8, s, 7 | (7 << 3)));
+            }
+            for (int k = 0; k < 4; ++k)
+            {
+                lo[by * 4 + k] = _mm256_castsi256_si128(acc[k]);
+                hi[by * 4 + k] = _mm256_extracti128_si256(acc[k], 1);
+            }
+        }
+    }
+
+    // Searches the whole window for every enabled partition at once.
+    // ref points at the top left candidate of the window.
+    typedef void (*PartitionSearchFn)(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                      int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                      PartitionTracker & t);
+
+    // The 33 window columns as groups of 8 (16); the last group overlaps the
+    // previous one, which is harmless since re-tracking a candidate is a no-op.
+    static const int kGroupStarts8[] = { 0, 8, 16, 24, 2 * kSearchRadiusX + 1 - 8 };
+    static const int kGroupStarts16[] = { 0, 16, 2 * kSearchRadiusX + 1 - 16 };
+
+    static void SearchPartitions_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                       int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                       PartitionTracker & t)
+    {
+        __m128i sad4x4[16];
+        for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+        {
+            for (size_t g = 0; g < sizeof(kGroupStarts8) / sizeof(kGroupStarts8[0]); ++g)
+            {
+                const int dx = kGroupStarts8[g];
+                __m128i pos, length, cost;
+                CandidateLanes(dx, dy, centerX, centerY, costs, pos, length, cost);
+                Sad4x4Grid_SSE41(src, srcPitch, ref + dy * refPitch + dx, refPitch, sad4x4);
+                UpdatePartitions(sad4x4, pos, length, costs.x ? &cost : NULL, enabled, t);
+            }
+        }
+    }
+
+    CPU_VME_TARGET_AVX2
+    static void SearchPartitions_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                      int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                      PartitionTracker & t)
+    {
+        __m128i lo[16], hi[16];
+        for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+        {
+            for (size_t g = 0; g < sizeof(kGroupStarts16) / sizeof(kGroupStarts16[0]); ++g)
+            {
+                const int dx = kGroupStarts16[g];
+                __m128i pos, length, cost;
+                Sad4x4Grid_AVX2(src, srcPitch, ref + dy * refPitch + dx, refPitch, lo, hi);
+                CandidateLanes(dx, dy, centerX, centerY, costs, pos, length, cost);
+                UpdatePartitions(lo, pos, length, costs.x ? &cost : NULL, enabled, t);
+                CandidateLanes(dx + 8, dy, centerX, centerY, costs, pos, length, cost);
+                UpdatePartitions(hi, pos, length, costs.x ? &cost : NULL, enabled, t);
+            }
+        }
+    }
+
+    static PartitionSearchFn SelectPartitionSearch()
+    {
+        return HasAVX2() ? SearchPartitions_AVX2 : SearchPartitions_SSE41;
+    }
+
+    // Folds the 8 lanes of partition p into its best vector. dist receives
+    // the tracked value, which includes the MV cost.
+    static void ReduceTracker(const PartitionTracker & t, int p, int centerX, int centerY, PartitionResults & r)
+    {
+        uint16_t sad[8], length[8], pos[8];
+        _mm_storeu_si128((__m128i *)sad, t.sad[p]);
+        _mm_storeu_si128((__m128i *)length, t.length[p]);
+        _mm_storeu_si128((__m128i *)pos, t.pos[p]);
+
+        int best = 0;
+        for (int i = 1; i < 8; ++i)
+        {
+            if (sad[i] < sad[best] || (sad[i] == sad[best] && length[i] < length[best]))
+            {
+                best = i;
+            }
+        }
+        r.dist[p] = sad[best];
+        r.mv[p].s[0] = (cl_short)((centerX - kSearchRadiusX + (pos[best] & 0xFF)) * 4);
+        r.mv[p].s[1] = (cl_short)((centerY - kSearchRadiusY + (pos[best] >> 8)) * 4);
+    }
+
+    static inline uint32_t Total(const PartitionResults & r, int p)
+    {
+        return r.dist[p] + r.cost[p];
+    }
+
+    // Chooses the cheapest enabled partitioning (distortion plus MV cost of
+    // every partition, so more vectors cost more); ties go to the larger
+    // partitions. Fills the partitions of the chosen shape into parts, and
+    // its cost into totalCost when set.
+    static int DecideShape(const PartitionResults & r, unsigned enabled, cl_uchar2 & shape, int * parts,
+                           uint32_t * totalCost = NULL)
+    {
+        if (enabled == 1)
+        {
+            // 16x16 only, the other partitions were not searched
+            shape.s[0] = 0;     // CL_AVC_ME_MAJOR_16x16_INTEL
+            shape.s[1] = 0;
+            parts[0] = PART_16x16;
+            if (totalCost)
+            {
+                *totalCost = Total(r, PART_16x16);
+            }
+            return 1;
+        }
+
+        // Best sub-shape of every 8x8 quadrant (minor shape codes 0..3 are
+        // 8x8, 8x4, 4x8 and 4x4, the same order as enable bits 3..6)
+        uint32_t quadCost[4];
+        int quadMinor[4];
+        uint32_t cost8x8 = 0;
+        for (int q = 0; q < 4; ++q)
+        {
+            const uint32_t costs[4] = {
+                Total(r, PART_8x8 + q),
+                Total(r, PART_8x4 + 2 * q) + Total(r, PART_8x4 + 2 * q + 1),
+                Total(r, PART_4x8 + 2 * q) + Total(r, PART_4x8 + 2 * q + 1),
+                Total(r, PART_4x4 + 4 * q) + Total(r, PART_4x4 + 4 * q + 1) + Total(r, PART_4x4 + 4 * q + 2) + Total(r, PART_4x4 + 4 * q + 3) };
+            quadCost[q] = 0xFFFFFFFF;
+            quadMinor[q] = 0;
+            for (int m = 0; m < 4; ++m)
+            {
+                if ((enabled & (8 << m)) && costs[m] < quadCost[q])
+                {
+                    quadCost[q] = costs[m];
+                    quadMinor[q] = m;
+                }
+            }
+            cost8x8 += quadCost[q];
+        }
+
+        const uint32_t majorCosts[4] = {
+            Total(r, PART_16x16),
+            Total(r, PART_16x8) + Total(r, PART_16x8 + 1),
+            Total(r, PART_8x16) + Total(r, PART_8x16 + 1),
+            cost8x8 };
+        const unsigned majorEnabled = (enabled & 7) | ((enabled & 0x78) ? 8 : 0);
+        int major = 0;
+        uint32_t bestCost = 0xFFFFFFFF;
+        for (int m = 0; m < 4; ++m)
+        {
+            if ((majorEnabled & (1 << m)) && majorCosts[m] < bestCost)
+            {
+                bestCost = majorCosts[m];
+                major = m;
+            }
+        }
+
+        int count = 0;
+        cl_uchar minor = 0;
+        if (major < 3)
+        {
+            const int size = major;  // major shape codes match enable bits 0..2
+            for (int i = 0; i < kPartitionCount[size]; ++i)
+            {
+                parts[count++] = kPartitionFirst[size] + i;
+            }
+        }
+        else
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                const int size = 3 + quadMinor[q];
+                const int n = kPartitionCount[size] / 4;
+                for (int i = 0; i < n; ++i)
+                {
+                    parts[count++] = kPartitionFirst[size] + q * n + i;
+                }
+                minor |= (cl_uchar)(quadMinor[q] << (2 * q));
+            }
+        }
+        shape.s[0] = (cl_uchar)major;
+        shape.s[1] = minor;
+        if (totalCost)
+        {
+            *totalCost = bestCost;
+        }
+        return count;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // MV cost
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Distances (in cost precision units) of the 8 packed table entries
+    static const int kCostTableDistances[8] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+    cl_uint2 GetCostTable(CostPenalty penalty)
+    {
+        // Made up, see CostPenalty: roughly log2 of the distance, doubling
+        // from one penalty level to the next.
+        // Decoded: low 0 2 4 6 10 16 24 32, normal 0 4 8 12 20 32 48 64,
+        // high 0 8 16 24 40 64 96 128.
+        static const cl_uint kTables[4][2] = {
+            { 0x00000000, 0x00000000 },
+            { 0x06040200, 0x281C180A },
+            { 0x0C080400, 0x382C2825 },
+            { 0x1C180800, 0x483C382A },
+        };
+        cl_uint2 table;
+        table.s[0] = kTables[penalty][0];
+        table.s[1] = kTables[penalty][1];
+        return table;
+    }
+
+    cl_uint2 ParseCostTable(const std::string & text)
+    {
+        cl_uint2 table;
+        const char * p = text.c_str();
+        for (int i = 0; i < 2; ++i)
+        {
+            char * end = NULL;
+            const unsigned long long word = strtoull(p, &end, 0);
+            if (end == p || *p == '-' || *end != (i == 0 ? ',' : '\0') || word > 0xFFFFFFFFull)
+            {
+                throw std::runtime_error("CPUVme::ParseCostTable: expected the two words of a packed cost table as s0,s1, got \"" + text + "\".");
+            }
+            table.s[i] = (cl_uint)word;
+            p = end + 1;
+        }
+        return table;
+    }
+
+    CostModel::CostModel(cl_uint2 packedTable, CostPrecision precision)
+        : m_shift((int)precision), m_zero(true)
+    {
+        int costs[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            const cl_uint packed = (packedTable.s[i / 4] >> (8 * (i % 4))) & 0xFF;
+            costs[i] = (packed & 0xF) << (packed >> 4);
+            m_zero = m_zero && costs[i] == 0;
+        }
+
+        int entry = 0;
+        for (int d = 0; d < kLutSize; ++d)
+        {
+            while (entry < 7 && d >= kCostTableDistances[entry + 1])
+            {
+                ++entry;
+            }
+            int cost = costs[entry];
+            if (entry < 7)
+            {
+                const int span = kCostTableDistances[entry + 1] - kCostTableDistances[entry];
+                cost += (costs[entry + 1] - costs[entry]) * (d - kCostTableDistances[entry]) / span;
+            }
+            m_lut[d] = (uint16_t)std::min(std::max(cost, 0), 0xFFFF);
+        }
+    }
+
+    void CostModel::FillIntegerCosts(int base, int count, uint16_t * out) const
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            out[i] = m_lut[Index(4 * i - base)];
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // Plane
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    Plane::Plane(int width, int height)
+        : m_origin(NULL), m_width(width), m_height(height)
+    {
+        if (width <= 0 || height <= 0)
+        {
+            throw std::runtime_error("CPUVme::Plane: invalid dimensions.");
+        }
+
+        m_paddedWidth = (width + 15) & ~15;
+        m_paddedHeight = (height + 15) & ~15;
+        // 16 bytes of slack so the last vector of a filtered row stays in its row
+        m_pitch = (m_paddedWidth + 2 * kPlaneBorder + 16 + 63) & ~63;
+
+        // One extra row and the alignment slack keep the vector loads of the
+        // right-most candidates inside the allocation.
+        const size_t rows = m_paddedHeight + 2 * kPlaneBorder + 1;
+        m_storage.resize(rows * m_pitch + 64);
+        m_origin = AlignedOrigin(m_storage);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            m_subpelOrigin[i] = NULL;
+        }
+        m_interpolated = false;
+    }
+
+    uint8_t * Plane::AlignedOrigin(std::vector<uint8_t> & storage) const
+    {
+        uintptr_t base = (uintptr_t)&storage[0];
+        uintptr_t aligned = (base + 63) & ~(uintptr_t)63;
+        return (uint8_t *)aligned + kPlaneBorder * m_pitch + kPlaneBorder;
+    }
+
+    void Plane::Load(const uint8_t * pSrc, int pitch)
+    {
+        for (int y = 0; y < m_height; ++y)
+        {
+            memcpy(Row(y), pSrc + y * pitch, m_width);
+        }
+
+        ExtendBorder();
+    }
+
+    void Plane::ExtendBorder()
+    {
+        for (int y = 0; y < m_height; ++y)
+        {
+            uint8_t * pDst = Row(y);
+            memset(pDst - kPlaneBorder, pDst[0], kPlaneBorder);
+            memset(pDst + m_width, pDst[m_width - 1], m_paddedWidth - m_width + kPlaneBorder);
+        }
+
+        const size_t rowBytes = m_paddedWidth + 2 * kPlaneBorder;
+        for (int y = -kPlaneBorder; y < 0; ++y)
+        {
+            memcpy(Row(y) - kPlaneBorder, Row(0) - kPlaneBorder, rowBytes);
+        }
+        for (int y = m_height; y < m_paddedHeight + kPlaneBorder; ++y)
+        {
+            memcpy(Row(y) - kPlaneBorder, Row(m_height - 1) - kPlaneBorder, rowBytes);
+        }
+
+        m_interpolated = false;
+    }
+
+    void Plane::Interpolate()
+    {
+        if (m_subpelStorage[0].empty())
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                m_subpelStorage[i].resize(m_storage.size());
+                m_subpelOrigin[i] = AlignedOrigin(m_subpelStorage[i]);
+            }
+        }
+
+        // Every sample whose 6 taps fall inside the border; candidates are
+        // kept kInterpolationMargin pixels away from its edge, so that is all
+        // the refinement can reach.
+        const int first = -kPlaneBorder + 2;
+        const int lastX = m_paddedWidth + kPlaneBorder - 3;
+        const int lastY = m_paddedHeight + kPlaneBorder - 3;
+        const int numVectors = (lastX - first + 15) / 16;
+
+        // Unscaled horizontal sums of the 6 rows feeding the center samples
+        std::vector<int16_t> ring(6 * 16 * numVectors);
+
+        for (int y = first - 2; y < lastY + 3; ++y)
+        {
+            int16_t * sums = &ring[((y - first + 2) % 6) * 16 * numVectors];
+            const uint8_t * pRow = Ptr(first, y);
+            uint8_t * pH = m_subpelOrigin[0] + y * m_pitch + first;
+            for (int v = 0; v < numVectors; ++v)
+            {
+                __m128i lo, hi;
+                Tap6_U8(pRow + v * 16 - 2, 1, lo, hi);
+                _mm_storeu_si128((__m128i *)(sums + v * 16), lo);
+                _mm_storeu_si128((__m128i *)(sums + v * 16 + 8), hi);
+                if (y >= first && y < lastY)
+                {
+                    _mm_storeu_si128((__m128i *)(pH + v * 16), Round5_U8(lo, hi));
+                }
+            }
+
+            // Row y is the last tap of the center row y - 3
+            const int cy = y - 3;
+            if (cy < first)
+            {
+                continue;
+            }
+            const uint8_t * pCol = Ptr(first, cy - 2);
+            uint8_t * pV = m_subpelOrigin[1] + cy * m_pitch + first;
+            uint8_t * pC = m_subpelOrigin[2] + cy * m_pitch + first;
+            for (int v = 0; v < numVectors; ++v)
+            {
+                __m128i lo, hi;
+                Tap6_U8(pCol + v * 16, m_pitch, lo, hi);
+                _mm_storeu_si128((__m128i *)(pV + v * 16), Round5_U8(lo, hi));
+
+                __m128i rowsLo[6], rowsHi[6];
+                for (int i = 0; i < 6; ++i)
+                {
+                    const int16_t * tap = &ring[((cy - first + i) % 6) * 16 * numVectors] + v * 16;
+                    rowsLo[i] = _mm_loadu_si128((const __m128i *)tap);
+                    rowsHi[i] = _mm_loadu_si128((const __m128i *)(tap + 8));
+                }
+                _mm_storeu_si128((__m128i *)(pC + v * 16),
+                                 _mm_packus_epi16(Tap6Center_16(rowsLo), Tap6Center_16(rowsHi)));
+            }
+        }
+
+        m_interpolated = true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // MotionEstimator
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Search center of one MB as the kernels compute it: integer part of the
+    // QPEL predictor, vertical component forced even. The center is clamped
+    // so that the whole window (plus the interpolation margin) stays inside
+    // the replicated border.
+    static void SearchCenter(const cl_short2 * predMVs, int mbIndex, int x0, int y0, int paddedWidth, int paddedHeight,
+                             int & centerX, int & centerY)
+    {
+        const int marginX = kPlaneBorder - kSearchRadiusX - kInterpolationMargin;
+        const int marginY = kPlaneBorder - kSearchRadiusY - kInterpolationMargin;
+
+        centerX = 0;
+        centerY = 0;
+        if (predMVs)
+        {
+            centerX = predMVs[mbIndex].s[0] / 4;
+            centerY = (predMVs[mbIndex].s[1] / 4) & ~1;
+        }
+        centerX = std::min(std::max(centerX, -marginX - x0), paddedWidth - 16 + marginX - x0);
+        centerY = std::min(std::max(centerY, -marginY - y0), paddedHeight - 16 + marginY - y0);
+    }
+
+    // Splits the tracked values of the integer search into distortion and MV
+    // cost. The integer scan ranks candidates by SAD; with Haar adjustment the
+    // winners are re-measured in SATD before the shape decision, so only the
+    // partitions actually compared pay for the transform.
+    static void SplitCosts(const Plane & src, const Plane & ref, int x0, int y0, cl_short2 costCenter,
+                           const CostModel & costModel, unsigned enabled, bool haar, PartitionResults & results)
+    {
+        for (int size = 0; size < 7; ++size)
+        {
+            if (!(enabled & (1 << size)))
+            {
+                continue;
+            }
+            for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+            {
+                results.cost[p] = costModel.Cost(results.mv[p].s[0] - costCenter.s[0], results.mv[p].s[1] - costCenter.s[1]);
+                if (haar || results.dist[p] >= 0xFFFF)
+                {
+                    // Saturated 16 bit sums are measured again as well
+                    int px, py, pw, ph;
+                    GetPartitionRect(p, px, py, pw, ph);
+                    results.dist[p] = SubpelDistortion(ref, src.Ptr(x0 + px, y0 + py), src.GetPitch(),
+                        (x0 + px) * 4 + results.mv[p].s[0], (y0 + py) * 4 + results.mv[p].s[1], pw, ph, haar);
+                }
+                else
+                {
+                    results.dist[p] -= results.cost[p];
+                }
+            }
+        }
+    }
+
+    // Window columns of row dy that none of the windows centered at
+    // covered[0 .. numCovered) holds, as a bit mask (bit i - column i).
+    static uint64_t UncoveredColumns(const int (*covered)[2], int numCovered, int centerX, int centerY, int dy)
+    {
+        const int numCandidatesX = 2 * kSearchRadiusX + 1;
+        const int mvY = centerY - kSearchRadiusY + dy;
+
+        uint64_t columns = (1ull << numCandidatesX) - 1;
+        for (int k = 0; k < numCovered; ++k)
+        {
+            if (abs(mvY - covered[k][1]) > kSearchRadiusY)
+            {
+                continue;
+            }
+            const int first = std::max(covered[k][0] - centerX, 0);
+            const int last = std::min(covered[k][0] - centerX + 2 * kSearchRadiusX, numCandidatesX - 1);
+            if (first <= last)
+            {
+                columns &= ~(((1ull << (last - first + 1)) - 1) << first);
+            }
+        }
+        return columns;
+    }
+
+    // Integer search of the MB at (x0, y0) over the union of the windows
+    // centered at centers[0 .. numCenters), with one cost center. Every
+    // position is evaluated once, in the first window that holds it, so the
+    // results are those of one search over all the positions of the union:
+    // the windows of close predictors cost little more than one window.
+    // Ties go to the shorter vector.
+    static void SearchIntegerUnion(const Plane & src, const Plane & ref, int x0, int y0, const int (*centers)[2],
+                                   int numCenters, cl_short2 costCenter, const CostModel & costModel, unsigned enabled,
+                                   bool haar, PartitionTracker & tracker, PartitionResults & results)
+    {
+        static const SadRowFn sadRow = SelectSadRow();
+        static const PartitionSearchFn searchPartitions = SelectPartitionSearch();
+        const int numCandidatesX = 2 * kSearchRadiusX + 1;
+        const uint64_t allColumns = (1ull << numCandidatesX) - 1;
+
+        uint64_t columns[2 * kSearchRadiusY + 1];
+        uint32_t rowSads[2 * kSearchRadiusX + 2];
+        uint16_t costX[48];
+        uint16_t costY[2 * kSearchRadiusY + 1];
+        uint32_t bestLength[NUM_PARTITIONS];
+        PartitionResults windowResults;
+
+        const uint8_t * pSrc = src.Ptr(x0, y0);
+
+        uint32_t bestSad = 0xFFFFFFFF;
+        int bestX = 0;
+        int bestY = 0;
+        for (int p = 0; p < NUM_PARTITIONS; ++p)
+        {
+            results.dist[p] = 0xFFFFFFFF;
+            bestLength[p] = 0xFFFFFFFF;
+        }
+
+        for (int c = 0; c < numCenters; ++c)
+        {
+            const int centerX = centers[c][0];
+            const int centerY = centers[c][1];
+
+            bool full = true;
+            bool empty = true;
+            for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+            {
+                columns[dy] = UncoveredColumns(centers, c, centerX, centerY, dy);
+                full = full && columns[dy] == allColumns;
+                empty = empty && columns[dy] == 0;
+            }
+            if (empty)
+            {
+                continue;
+            }
+
+            const uint8_t * pWindow = ref.Ptr(x0 + centerX - kSearchRadiusX, y0 + centerY - kSearchRadiusY);
+            WindowCosts windowCosts = { NULL, costY };
+            if (!costModel.IsZero())
+            {
+                costModel.FillIntegerCosts(costCenter.s[0] - (centerX - kSearchRadiusX) * 4, 48, costX);
+                costModel.FillIntegerCosts(costCenter.s[1] - (centerY - kSearchRadiusY) * 4, 2 * kSearchRadiusY + 1, costY);
+                windowCosts.x = costX;
+            }
+
+            if (enabled == 1)
+            {
+                // 16x16 only: whole-MB SADs of every run of uncovered columns
+                for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+                {
+                    const int mvY = centerY - kSearchRadiusY + dy;
+                    for (int first = 0; first < numCandidatesX; )
+                    {
+                        if (!((columns[dy] >> first) & 1))
+                        {
+                            ++first;
+                            continue;
+                        }
+                        int last = first;
+                        while (last < numCandidatesX && ((columns[dy] >> last) & 1))
+                        {
+                            ++last;
+                        }
+
+                        sadRow(pSrc, src.GetPitch(), pWindow + dy * ref.GetPitch() + first, ref.GetPitch(), last - first, rowSads);
+                        for (int i = first; i < last; ++i)
+                        {
+                            const uint32_t sad = rowSads[i - first] + (windowCosts.x ? costX[i] + costY[dy] : 0);
+                            const int mvX = centerX - kSearchRadiusX + i;
+                            if (sad < bestSad ||
+                                (sad == bestSad && abs(mvX) + abs(mvY) < abs(bestX) + abs(bestY)))
+                            {
+                                bestSad = sad;
+                                bestX = mvX;
+                                bestY = mvY;
+                            }
+                        }
+                        first = last;
+                    }
+                }
+                continue;
+            }
+
+            tracker.Reset();
+            if (full)
+            {
+                searchPartitions(pSrc, src.GetPitch(), pWindow, ref.GetPitch(), centerX, centerY, windowCosts, enabled, tracker);
+            }
+            else
+            {
+                // Groups of 8 columns with at least one uncovered column; the
+                // covered lanes get the largest cost and length, so they
+                // never replace a tracked winner.
+                const __m128i laneBits = _mm_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128);
+                __m128i sad4x4[16];
+                for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+                {
+                    for (size_t g = 0; g < sizeof(kGroupStarts8) / sizeof(kGroupStarts8[0]); ++g)
+                    {
+                        const int dx = kGroupStarts8[g];
+                        const int bits = (int)((columns[dy] >> dx) & 0xFF);
+                        if (!bits)
+                        {
+                            continue;
+                        }
+                        const __m128i live = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16((short)bits), laneBits), laneBits);
+
+                        __m128i pos, length, cost = _mm_setzero_si128();
+                        CandidateLanes(dx, dy, centerX, centerY, windowCosts, pos, length, cost);
+                        cost = _mm_or_si128(cost, _mm_andnot_si128(live, _mm_set1_epi16(-1)));
+                        length = _mm_blendv_epi8(_mm_set1_epi16(0x7FFF), length, live);
+                        Sad4x4Grid_SSE41(pSrc, src.GetPitch(), pWindow + dy * ref.GetPitch() + dx, ref.GetPitch(), sad4x4);
+                        UpdatePartitions(sad4x4, pos, length, &cost, enabled, tracker);
+                    }
+                }
+            }
+
+            // Each partition keeps the best position of the windows so far
+            for (int size = 0; size < 7; ++size)
+            {
+                if (!(enabled & (1 << size)))
+                {
+                    continue;
+                }
+                for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                {
+                    ReduceTracker(tracker, p, centerX, centerY, windowResults);
+                    const uint32_t length = (abs(windowResults.mv[p].s[0]) + abs(windowResults.mv[p].s[1])) / 4;
+                    if (windowResults.dist[p] < results.dist[p] ||
+                        (windowResults.dist[p] == results.dist[p] && length < bestLength[p]))
+                    {
+                        results.dist[p] = windowResults.dist[p];
+                        results.mv[p] = windowResults.mv[p];
+                        bestLength[p] = length;
+                    }
+                }
+            }
+        }
+
+        if (enabled == 1)
+        {
+            results.dist[PART_16x16] = bestSad;
+            results.mv[PART_16x16].s[0] = (cl_short)(bestX * 4);
+            results.mv[PART_16x16].s[1] = (cl_short)(bestY * 4);
+        }
+
+        SplitCosts(src, ref, x0, y0, costCenter, costModel, enabled, haar, results);
+    }
+
+    // Fractional refinement of one partition, as the FME stage does:
+    // half-pel neighbours first, then quarter-pel.
+    static void RefinePartition(const Plane & ref, const Plane & src, int x, int y, int w, int h, SubPixelMode mode, bool haar,
+                                const CostModel & costModel, cl_short2 costCenter, cl_short2 & mv, uint32_t & dist)
+    {
+        if (mode != SUBPIXEL_MODE_INTEGER)
+        {
+            RefineStep(ref, src.Ptr(x, y), src.GetPitch(), x, y, w, h, haar, costModel, costCenter, 2, mv, dist);
+        }
+        if (mode == SUBPIXEL_MODE_QPEL)
+        {
+            RefineStep(ref, src.Ptr(x, y), src.GetPitch(), x, y, w, h, haar, costModel, costCenter, 1, mv, dist);
+        }
+    }
+
+    // Index of entry (bx, by) of the 4x4 grid of a MB in VME sub-block order
+    static inline int SubBlockIndex(int bx, int by)
+    {
+        return ((by >> 1) * 2 + (bx >> 1)) * 4 + (by & 1) * 2 + (bx & 1);
+    }
+
+    // Number of worker threads for numRows MB rows; 0 selects the number of
+    // hardware threads.
+    static int WorkerThreads(int numThreads, int numRows)
+    {
+        if (numThreads <= 0)
+        {
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        return std::min(numThreads, numRows);
+    }
+
+    // Runs rows(firstRow, lastRow) over contiguous ranges of numRows MB rows
+    // on numThreads worker threads.
+    template <typename RowsFn>
+    static void ForEachRowRange(int numRows, int numThreads, RowsFn rows)
+    {
+        if (numThreads == 1)
+        {
+            rows(0, numRows);
+            return;
+        }
+
+        // MB rows are independent, so hand out contiguous row ranges.
+        std::vector<std::thread> workers;
+        const int rowsPerThread = (numRows + numThreads - 1) / numThreads;
+        for (int first = 0; first < numRows; first += rowsPerThread)
+        {
+            workers.push_back(std::thread(rows, first, std::min(first + rowsPerThread, numRows)));
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].join();
+        }
+    }
+
+    MotionEstimator::MotionEstimator(int width, int height, const SearchDesc & desc, int numThreads)
+        : m_desc(desc), m_costModel(desc.costTable, desc.costPrecision),
+          m_width(width), m_height(height), m_numThreads(numThreads)
+    {
+        m_mbWidth = (width + 15) / 16;
+        m_mbHeight = (height + 15) / 16;
+
+        if ((m_desc.partitionMask & 0x7F) == 0x7F)
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: the partition mask disables every shape.");
+        }
+
+        m_numThreads = WorkerThreads(m_numThreads, m_mbHeight);
+    }
+
+    void MotionEstimator::CheckPlane(const Plane & plane, bool reference) const
+    {
+        if (plane.GetWidth() != m_width || plane.GetHeight() != m_height)
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: plane size mismatch.");
+        }
+        if (reference && m_desc.subPixelMode != SUBPIXEL_MODE_INTEGER && !plane.IsInterpolated())
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: sub-pel search needs an interpolated reference.");
+        }
+    }
+
+    void MotionEstimator::EstimateFrameMultiPredictor(
+        const Plane & src,
+        const Plane & ref,
+        const cl_short2 * counts,
+        const cl_short2 * predMVs,
+        cl_short2 * mvs,
+        cl_ushort * residuals,
+        cl_uchar2 * shapes) const
+    {
+        CheckPlane(src, false);
+        CheckPlane(ref, true);
+
+        ForEachRowRange(m_mbHeight, m_numThreads, [&](int firstRow, int lastRow) {
+            EstimateRowsMultiPredictor(firstRow, lastRow, src, ref, counts, predMVs, mvs, residuals, shapes);
+        });
+    }
+
+    void MotionEstimator::EstimateRowsMultiPredictor(
+        int firstRow,
+        int lastRow,
+        const Plane & src,
+        const Plane & ref,
+        const cl_short2 * counts,
+        const cl_short2 * predMVs,
+        cl_short2 * mvs,
+        cl_ushort * residuals,
+        cl_uchar2 * shapes) const
+    {
+        const unsigned enabled = ~m_desc.partitionMask & 0x7F;
+        const bool haar = m_desc.sadAdjustMode == SAD_ADJUST_MODE_HAAR;
+
+        PartitionTracker tracker;
+        PartitionResults results;
+        int parts[16];
+
+        for (int mbY = firstRow; mbY < lastRow; ++mbY)
+        {
+            for (int mbX = 0; mbX < m_mbWidth; ++mbX)
+            {
+                const int mbIndex = mbX + mbY * m_mbWidth;
+                const int x0 = mbX * 16;
+                const int y0 = mbY * 16;
+
+                // As the kernel, which runs one IME per SIMD lane below the count
+                const int numPredictors = std::min((int)counts[mbIndex].s[0], kMaxPredictors);
+                if (numPredictors <= 0)
+                {
+                    continue;
+                }
+                const cl_short2 * predictors = predMVs + mbIndex * kMaxPredictors;
+
+                // Cost center: the unclamped integer center of the first window
+                cl_short2 costCenter;
+                costCenter.s[0] = (cl_short)(predictors[0].s[0] / 4 * 4);
+                costCenter.s[1] = (cl_short)(((predictors[0].s[1] / 4) & ~1) * 4);
+
+                // Predictors in the same window (often all of them) search it once
+                int centers[kMaxPredictors][2];
+                int numCenters = 0;
+                for (int i = 0; i < numPredictors; ++i)
+                {
+                    int & centerX = centers[numCenters][0];
+                    int & centerY = centers[numCenters][1];
+                    SearchCenter(predictors, i, x0, y0, m_mbWidth * 16, m_mbHeight * 16, centerX, centerY);
+                    int c = 0;
+                    while (c < numCenters && (centers[c][0] != centerX || centers[c][1] != centerY))
+                    {
+                        ++c;
+                    }
+                    if (c == numCenters)
+                    {
+                        ++numCenters;
+                    }
+                }
+                SearchIntegerUnion(src, ref, x0, y0, centers, numCenters, costCenter, m_costModel, enabled, haar,
+                                   tracker, results);
+
+                cl_uchar2 shape;
+                const int numParts = DecideShape(results, enabled, shape, parts);
+
+                for (int i = 0; i < numParts; ++i)
+                {
+                    const int p = parts[i];
+                    int px, py, pw, ph;
+                    GetPartitionRect(p, px, py, pw, ph);
+                    RefinePartition(ref, src, x0 + px, y0 + py, pw, ph, m_desc.subPixelMode, haar, m_costModel, costCenter,
+                                    results.mv[p], results.dist[p]);
+
+                    const cl_ushort dist = (cl_ushort)std::min(results.dist[p], 0xFFFFu);
+                    for (int by = py / 4; by < (py + ph) / 4; ++by)
+                    {
+                        for (int bx = px / 4; bx < (px + pw) / 4; ++bx)
+                        {
+                            const int b = mbIndex * 16 + SubBlockIndex(bx, by);
+                            mvs[b] = results.mv[p];
+                            if (residuals)
+                            {
+                                residuals[b] = dist;
+                            }
+                        }
+                    }
+                }
+                shapes[mbIndex] = shape;
+            }
+        }
+    }
+
+} // namespace CPUVme
@@ -0,0 +1,276 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// This file contains a host (CPU) implementation of the motion search
+// performed by block_advanced_motion_estimate_check_intel: integer search
+// around up to kMaxPredictors predictors per MB followed by the optional
+// half/quarter-pel refinement.
+// It produces the motion vector, residual and shape buffers in exactly the
+// same layout as the VME kernels, so the code consuming those buffers does
+// not need to know which backend produced them.
+
+
+#ifndef _CPU_VME_HPP_
+#define _CPU_VME_HPP_
+
+#include <CL/cl.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CPUVme
+{
+    // Search window of CL_ME_SEARCH_PATH_RADIUS_16_12_INTEL:
+    // candidates are [-16, 16] x [-12, 12] pixels around the search center.
+    static const int kSearchRadiusX = 16;
+    static const int kSearchRadiusY = 12;
+
+    // Size of the replicated border around every plane. Search centers are
+    // clamped so that no candidate (and no interpolation tap) leaves it.
+    static const int kPlaneBorder = 64;
+
+    // Distance kept between any integer candidate and the edge of the border,
+    // so that sub-pel refinement (one more pixel) and the 6-tap filter taps
+    // only ever read computed samples.
+    static const int kInterpolationMargin = 6;
+
+    // Number of predictors per MB of the multi-predictor search, the 8
+    // IMEs of block_advanced_motion_estimate_check_intel.
+    static const int kMaxPredictors = 8;
+
+    // Motion vector precision, the CPU counterpart of CL_ME_SUBPIXEL_MODE_*_INTEL.
+    enum SubPixelMode
+    {
+        SUBPIXEL_MODE_INTEGER,
+        SUBPIXEL_MODE_HPEL,
+        SUBPIXEL_MODE_QPEL
+    };
+
+    // Distortion metric, the CPU counterpart of CL_ME_SAD_ADJUST_MODE_*_INTEL.
+    // HAAR reports SATD: the halved sum of absolute 4x4 Hadamard coefficients.
+    enum SadAdjustMode
+    {
+        SAD_ADJUST_MODE_NONE,
+        SAD_ADJUST_MODE_HAAR
+    };
+
+    // MV cost precision, same values as CL_AVC_ME_COST_PRECISION_*_INTEL:
+    // the unit in which the distance to the cost center is measured.
+    enum CostPrecision
+    {
+        COST_PRECISION_QPEL,
+        COST_PRECISION_HPEL,
+        COST_PRECISION_PEL,
+        COST_PRECISION_DPEL
+    };
+
+    // Cost tables of increasing strength for the CPU search. The driver's
+    // tables (intel_sub_group_avc_mce_get_default_*_penalty_cost_table())
+    // are not documented and these are not copies of them, only tables in
+    // the same layout that grow with the distance. To get the MV costs of
+    // the kernels exactly, pass the device's table (ParseCostTable).
+    enum CostPenalty
+    {
+        COST_PENALTY_NONE,
+        COST_PENALTY_LOW,
+        COST_PENALTY_NORMAL,
+        COST_PENALTY_HIGH
+    };
+
+    // Packed cost table in the layout of the kernels' uint2: 8 bytes, byte i
+    // (little endian, s[0] first) holding the cost of a distance of
+    // 0, 1, 2, 4, 8, 16, 32, 64 units in U4U4 format (value = (b & 0xF) << (b >> 4)).
+    cl_uint2 GetCostTable(CostPenalty penalty);
+
+    // Packed table given as its two 32-bit words "s0,s1" (decimal or 0x hex),
+    // e.g. what ime_mv_extract --print_cost_tables reads back from the device.
+    // Throws std::runtime_error for anything else.
+    cl_uint2 ParseCostTable(const std::string & text);
+
+    // MV cost of a vector: table cost of |dx| plus table cost of |dy|, where
+    // (dx, dy) is the distance to the cost center in cost precision units.
+    // Distances between two table entries are interpolated linearly,
+    // distances beyond 64 units cost the last entry.
+    class CostModel
+    {
+    public:
+        CostModel(cl_uint2 packedTable, CostPrecision precision);
+
+        // (dx, dy) in QPEL units
+        uint32_t Cost(int dx, int dy) const { return m_lut[Index(dx)] + m_lut[Index(dy)]; }
+
+        // Cost of every QPEL distance 4 * i - base for i in [0, count)
+        void FillIntegerCosts(int base, int count, uint16_t * out) const;
+
+        bool IsZero() const { return m_zero; }
+
+    private:
+        static const int kLutSize = 65;
+
+        int Index(int d) const
+        {
+            d = (d < 0 ? -d : d) >> m_shift;
+            return d < kLutSize ? d : kLutSize - 1;
+        }
+
+        uint16_t m_lut[kLutSize];
+        int m_shift;
+        bool m_zero;
+    };
+
+    // Partition masks, same values as CL_AVC_ME_PARTITION_MASK_*_INTEL: a set
+    // bit disables a partition size, masks are combined with '&'.
+    static const cl_uchar kPartitionMaskAll   = 0x00;
+    static const cl_uchar kPartitionMask16x16 = 0x7E;
+    static const cl_uchar kPartitionMask16x8  = 0x7D;
+    static const cl_uchar kPartitionMask8x16  = 0x7B;
+    static const cl_uchar kPartitionMask8x8   = 0x77;
+    static const cl_uchar kPartitionMask8x4   = 0x6F;
+    static const cl_uchar kPartitionMask4x8   = 0x5F;
+    static const cl_uchar kPartitionMask4x4   = 0x3F;
+
+    // Search parameters, the CPU counterpart of cl_motion_estimation_desc_intel.
+    struct SearchDesc
+    {
+        SearchDesc()
+            : subPixelMode(SUBPIXEL_MODE_QPEL), sadAdjustMode(SAD_ADJUST_MODE_NONE), partitionMask(kPartitionMaskAll),
+              costTable(GetCostTable(COST_PENALTY_NORMAL)), costPrecision(COST_PRECISION_QPEL) {}
+
+        SubPixelMode subPixelMode;
+        SadAdjustMode sadAdjustMode;
+        cl_uchar partitionMask;
+        cl_uint2 costTable;
+        CostPrecision costPrecision;
+    };
+
+    // Luma plane padded to a whole number of macroblocks and surrounded by a
+    // replicated border. This is the CPU counterpart of a CL_R/CL_UNORM_INT8
+    // image sampled with clamp-to-edge addressing.
+    class Plane
+    {
+    public:
+        Plane(int width, int height);
+
+        // Copies a width x height luma plane and rebuilds the border.
+        // Invalidates the sub-pel planes.
+        void Load(const uint8_t * pSrc, int pitch);
+
+        // Builds the H.264 half-pel planes (6-tap filter) of the loaded picture.
+        // Called once per reference frame; quarter-pel samples are then
+        // averages of two full/half-pel samples and need no further filtering.
+        void Interpolate();
+        bool IsInterpolated() const { return m_interpolated; }
+
+        // (x, y) may point into the border, down to -kPlaneBorder.
+        const uint8_t * Ptr(int x, int y) const { return m_origin + y * m_pitch + x; }
+
+        // Sample planes by half-pel phase: 0 - full-pel, 1 - (x + 1/2, y),
+        // 2 - (x, y + 1/2), 3 - (x + 1/2, y + 1/2). Same pitch as Ptr().
+        const uint8_t * SubpelPtr(int phase, int x, int y) const
+        {
+            return (phase ? m_subpelOrigin[phase - 1] : m_origin) + y * m_pitch + x;
+        }
+
+        int GetWidth() const { return m_width; }
+        int GetHeight() const { return m_height; }
+        int GetPitch() const { return m_pitch; }
+
+    private:
+        uint8_t * Row(int y) { return m_origin + y * m_pitch; }
+        uint8_t * AlignedOrigin(std::vector<uint8_t> & storage) const;
+        void ExtendBorder();
+
+        std::vector<uint8_t> m_storage;
+        uint8_t * m_origin;
+        std::vector<uint8_t> m_subpelStorage[3];
+        uint8_t * m_subpelOrigin[3];
+        bool m_interpolated;
+        int m_width;
+        int m_height;
+        int m_paddedWidth;
+        int m_paddedHeight;
+        int m_pitch;
+    };
+
+    // Exhaustive integer-pel block matching on the CPU (SSE4.1, with an AVX2
+    // path selected at run time). The 4x4 SADs of every candidate are summed
+    // into all enabled partitions, so the whole major/minor shape decision
+    // costs one search; the chosen partitions are then refined to half or
+    // quarter pel as selected by the search descriptor. MB rows are
+    // distributed over numThreads worker threads; 0 selects the number of
+    // hardware threads.
+    class MotionEstimator
+    {
+    public:
+        MotionEstimator(int width, int height, const SearchDesc & desc, int numThreads = 0);
+
+        // Same contract as the search of block_advanced_motion_estimate_check_intel:
+        //  - counts holds one entry per MB, s[0] being its number of
+        //    predictors (0 to kMaxPredictors); MBs without any are not written,
+        //  - predMVs holds kMaxPredictors QPEL predictors per MB, each one
+        //    the center of a search window,
+        //  - the MV cost center is the integer center of the first predictor,
+        //  - mvs and residuals (may be NULL) hold 16 entries per MB, in the VME
+        //    sub-block order (8x8 blocks in raster order, 4x4 blocks in raster
+        //    order inside them),
+        //  - shapes holds one (major, minor) pair per MB.
+        // Overlapping windows are searched as their union: every position is
+        // evaluated once, in the first window that holds it, and each
+        // partition keeps the best position of the union. Unless the
+        // descriptor selects integer search, ref must be interpolated.
+        void EstimateFrameMultiPredictor(
+            const Plane & src,
+            const Plane & ref,
+            const cl_short2 * counts,
+            const cl_short2 * predMVs,
+            cl_short2 * mvs,
+            cl_ushort * residuals,
+            cl_uchar2 * shapes) const;
+
+        int GetMBWidth() const { return m_mbWidth; }
+        int GetMBHeight() const { return m_mbHeight; }
+
+    private:
+        void CheckPlane(const Plane & plane, bool reference) const;
+
+        void EstimateRowsMultiPredictor(
+            int firstRow,
+            int lastRow,
+            const Plane & src,
+            const Plane & ref,
+            const cl_short2 * counts,
+            const cl_short2 * predMVs,
+            cl_short2 * mvs,
+            cl_ushort * residuals,
+            cl_uchar2 * shapes) const;
+
+        SearchDesc m_desc;
+        CostModel m_costModel;
+        int m_width;
+        int m_height;
+        int m_mbWidth;
+        int m_mbHeight;
+        int m_numThreads;
+    };
+
+} // namespace CPUVme
+
+#endif  // end of include guard
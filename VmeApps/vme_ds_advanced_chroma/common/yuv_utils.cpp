@@ -20,12 +20,31 @@
 
 #include "yuv_utils.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <cstring>
 #include <CL/cl.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 namespace YUVUtils
 {
@@ -33,14 +52,38 @@ namespace YUVUtils
     {
     public:
         YUVCapture(const std::string & fn, int width, int height, int frames = 0);
+        virtual ~YUVCapture();
         virtual void GetSample(int frameNum, PlanarImage * im);
+        virtual PlanarImage ViewSample(int frameNum, PlanarImage * im);
 
     protected:
+        // Opens and maps fn, for captures that work out the layout themselves
+        explicit YUVCapture(const std::string & fn);
+
+        // Start of frame frameNum in the mapped file, NULL when the file isn't mapped
+        uint8_t * MappedFrame(int frameNum);
+        // Offset of the planes of frame frameNum in the file
+        virtual size_t FrameOffset(int frameNum) const;
+
         std::ifstream m_file;
+        uint8_t * m_map;        // whole file, read-only
+        size_t m_mapSize;
+        size_t m_fileSize;
     };
 
-    YUVCapture::YUVCapture( const std::string & fn, int width, int height, int frames )
-        :    m_file (fn.c_str(), std::ios::binary | std::ios::ate)
+    // Copies height rows of width bytes between planes of different pitches
+    static void CopyPlane(const uint8_t * pSrc, size_t srcPitch, size_t width, size_t height, uint8_t * pDst, size_t dstPitch)
+    {
+        for (size_t i = 0; i < height; ++i)
+        {
+            memcpy(pDst, pSrc, width);
+            pSrc += srcPitch;
+            pDst += dstPitch;
+        }
+    }
+
+    YUVCapture::YUVCapture( const std::string & fn )
+        :    m_file (fn.c_str(), std::ios::binary | std::ios::ate), m_map(NULL), m_mapSize(0), m_fileSize(0)
     {
 
         if (!m_file.good())
@@ -50,19 +93,79 @@ namespace YUVUtils
 		    throw std::runtime_error(ss.str().c_str());
         }
 
-        const size_t fileSize = static_cast<size_t>(m_file.tellg());
+        m_fileSize = static_cast<size_t>(m_file.tellg());
+        m_file.seekg(0, std::ios::beg);
+
+#ifdef __linux__
+        // Map the file, so frames are copied straight out of the page cache
+        // instead of being read row by row, or not copied at all (ViewSample).
+        // The stream stays as the fallback for files that can't be mapped.
+        int fd = open(fn.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            void * map = (m_fileSize > 0) ? mmap(NULL, m_fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (map != MAP_FAILED)
+            {
+                m_map = (uint8_t *)map;
+                m_mapSize = m_fileSize;
+                // Frames are mostly read in order, let the kernel read ahead aggressively
+                madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+                m_file.close();
+            }
+        }
+#endif
+    }
+
+    YUVCapture::YUVCapture( const std::string & fn, int width, int height, int frames )
+        :    YUVCapture(fn)
+    {
         const size_t frameSize = width * height * 3 / 2 * sizeof(uint8_t);
-        if (fileSize % frameSize)
+        if (m_fileSize % frameSize)
         {
 		    throw std::runtime_error("YUV file file size error. Wrong dimensions?");
 		}
-        m_file.seekg(0, std::ios::beg);
 
-        m_numFrames = (frames == 0)? ((int)(fileSize) / (int)frameSize) : frames;
+        m_numFrames = (frames == 0)? ((int)(m_fileSize) / (int)frameSize) : frames;
         m_width = width;
         m_height = height;
     }
 
+    YUVCapture::~YUVCapture()
+    {
+#ifdef __linux__
+        if (m_map)
+        {
+            munmap(m_map, m_mapSize);
+        }
+#endif
+    }
+
+    uint8_t * YUVCapture::MappedFrame(int frameNum)
+    {
+        if (!m_map)
+        {
+            return NULL;
+        }
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const size_t offset = (frameNum < 0) ? m_mapSize : FrameOffset(frameNum);
+        if (offset + frameSize > m_mapSize)
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+        uint8_t * pFrame = m_map + offset;
+#ifdef __linux__
+        // Start paging in the next frame while this one is processed
+        if (offset + 2 * frameSize <= m_mapSize)
+        {
+            const size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+            uint8_t * pNext = (uint8_t *)((size_t)(pFrame + frameSize) & ~pageMask);
+            madvise(pNext, pFrame + 2 * frameSize - pNext, MADV_WILLNEED);
+        }
+#endif
+        return pFrame;
+    }
+
     void YUVCapture::GetSample( int frameNum, PlanarImage * im )
     {
         if (im->Width != (size_t)m_width || im->Height != (size_t)m_height)
@@ -71,8 +174,27 @@ namespace YUVUtils
         }
 
         const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const uint8_t * pFrame = MappedFrame(frameNum);
+        if (pFrame)
+        {
+            // One copy when the image is packed like the file, row by row for a padded pitch
+            const size_t lumaSize = m_width * m_height;
+            if (im->PitchY == m_width && im->U == im->Y + lumaSize && im->V == im->U + lumaSize / 4 &&
+                im->PitchU == m_width / 2 && im->PitchV == m_width / 2)
+            {
+                memcpy(im->Y, pFrame, frameSize);
+            }
+            else
+            {
+                CopyPlane(pFrame, m_width, m_width, m_height, im->Y, im->PitchY);
+                CopyPlane(pFrame + lumaSize, m_width / 2, m_width / 2, m_height / 2, im->U, im->PitchU);
+                CopyPlane(pFrame + lumaSize * 5 / 4, m_width / 2, m_width / 2, m_height / 2, im->V, im->PitchV);
+            }
+            return;
+        }
+
         m_file.clear();
-        m_file.seekg(frameNum * frameSize);
+        m_file.seekg(FrameOffset(frameNum));
 
         size_t inRowSize = m_width * sizeof(uint8_t);
         size_t outRowSize = im->PitchY * sizeof(uint8_t);
@@ -102,11 +224,554 @@ namespace YUVUtils
         }
     }
 
-    Capture * Capture::CreateFileCapture(const std::string & fn, int width, int height, int frames)
+    PlanarImage YUVCapture::ViewSample( int frameNum, PlanarImage * im )
+    {
+        uint8_t * pFrame = MappedFrame(frameNum);
+        // A padded pitch needs the copy
+        if (!pFrame || im->PitchY != m_width)
+        {
+            return Capture::ViewSample(frameNum, im);
+        }
+
+        PlanarImage view;
+        view.Y = pFrame;
+        view.U = view.Y + m_width * m_height;
+        view.V = view.U + m_width * m_height / 4;
+        view.Width = m_width;
+        view.Height = m_height;
+        view.PitchY = m_width;
+        view.PitchU = m_width / 2;
+        view.PitchV = m_width / 2;
+        return view;
+    }
+
+    size_t YUVCapture::FrameOffset( int frameNum ) const
+    {
+        return frameNum * (m_width * m_height * 3 / 2 * sizeof(uint8_t));
+    }
+
+    static const char kY4MMagic[] = "YUV4MPEG2";
+    static const char kY4MFrameMarker[] = "FRAME";
+
+    static bool IsY4M(const std::string & fn)
+    {
+        return strstr(fn.c_str(), ".y4m") != NULL;
+    }
+
+    // Parameters of a YUV4MPEG2 stream header
+    struct Y4MHeader
+    {
+        int width;
+        int height;
+        Capture::FieldOrder fieldOrder;
+    };
+
+    // Parses the header line, without its newline. The frames are read like
+    // YV12, so only 8-bit 4:2:0 chroma is accepted, with any chroma siting.
+    static Y4MHeader ParseY4MHeader(const std::string & line)
+    {
+        std::stringstream tokens(line);
+        std::string token;
+        if (!(tokens >> token) || token != kY4MMagic)
+        {
+            throw std::runtime_error("Not a YUV4MPEG2 file.");
+        }
+
+        Y4MHeader header = { 0, 0, Capture::FIELD_ORDER_UNKNOWN };
+        std::string chroma = "420jpeg";
+        while (tokens >> token)
+        {
+            const std::string value = token.substr(1);
+            switch (token[0])
+            {
+            case 'W': header.width = atoi(value.c_str()); break;
+            case 'H': header.height = atoi(value.c_str()); break;
+            case 'C': chroma = value; break;
+            case 'I':
+                if (value == "p") header.fieldOrder = Capture::FIELD_ORDER_PROGRESSIVE;
+                else if (value == "t") header.fieldOrder = Capture::FIELD_ORDER_TOP_FIRST;
+                else if (value == "b") header.fieldOrder = Capture::FIELD_ORDER_BOTTOM_FIRST;
+                else if (value == "m") header.fieldOrder = Capture::FIELD_ORDER_MIXED;
+                break;
+            default:
+                // Frame rate, aspect ratio and extensions don't matter here
+                break;
+            }
+        }
+
+        if (header.width <= 0 || header.height <= 0 || header.width % 2 || header.height % 2)
+        {
+            throw std::runtime_error("Y4M header without a valid frame size.");
+        }
+        if (chroma != "420jpeg" && chroma != "420paldv" && chroma != "420mpeg2" && chroma != "420")
+        {
+            throw std::runtime_error("Unsupported Y4M chroma format C" + chroma + ", only 8-bit 4:2:0 can be read.");
+        }
+        return header;
+    }
+
+    // Header of the .y4m files written. The frame rate isn't known here, the
+    // fields written by the interlaced sample are progressive pictures too.
+    static std::string Y4MStreamHeader(int width, int height)
+    {
+        std::stringstream ss;
+        ss << kY4MMagic << " W" << width << " H" << height << " F30:1 Ip A0:0 C420jpeg\n";
+        return ss.str();
+    }
+
+    // YUV4MPEG2 file: a header line with the frame size and format, then every
+    // frame after a FRAME line of its own. The frames are indexed when the file
+    // is opened, so a frame is found in O(1) and read like in a raw file.
+    class Y4MCapture : public YUVCapture
+    {
+    public:
+        Y4MCapture(const std::string & fn, int frames = 0);
+
+    protected:
+        virtual size_t FrameOffset(int frameNum) const;
+
+    private:
+        // Line starting at offset, without its newline; offset moves past it
+        std::string ReadLine(size_t & offset);
+
+        std::vector<size_t> m_index;    // file offset of the planes of every frame
+    };
+
+    Y4MCapture::Y4MCapture( const std::string & fn, int frames )
+        :    YUVCapture(fn)
+    {
+        size_t offset = 0;
+        const Y4MHeader header = ParseY4MHeader(ReadLine(offset));
+        m_width = header.width;
+        m_height = header.height;
+        m_fieldOrder = header.fieldOrder;
+
+        // A FRAME line may carry parameters of its own, which are skipped
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        while (offset < m_fileSize)
+        {
+            if (ReadLine(offset).compare(0, sizeof(kY4MFrameMarker) - 1, kY4MFrameMarker) != 0)
+            {
+                throw std::runtime_error("Y4M frame header missing. Corrupted file?");
+            }
+            if (offset + frameSize > m_fileSize)
+            {
+                throw std::runtime_error("Y4M file ends in the middle of a frame.");
+            }
+            m_index.push_back(offset);
+            offset += frameSize;
+        }
+
+        m_numFrames = (frames == 0) ? (int)m_index.size() : frames;
+    }
+
+    std::string Y4MCapture::ReadLine( size_t & offset )
+    {
+        // Longer lines are no Y4M header, whatever extensions they carry
+        static const size_t kMaxLine = 1024;
+
+        std::string line;
+        bool found = false;
+        if (m_map)
+        {
+            const char * pLine = (const char *)m_map + offset;
+            const char * pEnd = (const char *)memchr(pLine, '\n', std::min(kMaxLine, m_mapSize - offset));
+            if (pEnd)
+            {
+                line.assign(pLine, pEnd);
+                found = true;
+            }
+        }
+        else
+        {
+            m_file.clear();
+            m_file.seekg(offset);
+            found = std::getline(m_file, line) && !m_file.eof() && line.size() < kMaxLine;
+        }
+        if (!found)
+        {
+            throw std::runtime_error("Y4M header line missing or too long. Corrupted file?");
+        }
+        offset += line.size() + 1;
+        return line;
+    }
+
+    size_t Y4MCapture::FrameOffset( int frameNum ) const
+    {
+        if (frameNum < 0 || frameNum >= (int)m_index.size())
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+        return m_index[frameNum];
+    }
+
+    // Frames a stream keeps in memory after reading them
+    static const int kStreamWindow = 4;
+
+    // Reads raw frames sequentially from stdin, a named pipe or a character
+    // device, which can be neither mapped nor sought. The last kStreamWindow
+    // frames read stay in memory, so a pipelined reader may run a few frames
+    // ahead of the frame being consumed; frames that dropped out of the window
+    // can't be read again.
+    class StreamCapture : public Capture
+    {
+    public:
+        StreamCapture(const std::string & fn, int width, int height, int frames = 0);
+        virtual ~StreamCapture();
+        virtual void GetSample(int frameNum, PlanarImage * im);
+        virtual bool TryGetSample(int frameNum, PlanarImage * im);
+
+    private:
+        FILE * m_file;
+        std::vector<std::vector<uint8_t> > m_window;
+        int m_read;         // frames read from the input so far
+        bool m_ended;       // the input ended after m_read frames
+        size_t m_peeked;    // bytes of frame 0 the constructor already read
+    };
+
+    StreamCapture::StreamCapture( const std::string & fn, int width, int height, int frames )
+        :    m_file(NULL), m_window(kStreamWindow), m_read(0), m_ended(false), m_peeked(0)
+    {
+        if (fn == "-")
+        {
+            m_file = stdin;
+#ifdef _WIN32
+            _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        }
+        else
+        {
+            m_file = fopen(fn.c_str(), "rb");
+            if (!m_file)
+            {
+                std::stringstream ss;
+                ss << "Unable to load YUV file: " << fn;
+                throw std::runtime_error(ss.str().c_str());
+            }
+        }
+
+        const size_t frameSize = width * height * 3 / 2 * sizeof(uint8_t);
+        for (size_t i = 0; i < m_window.size(); ++i)
+        {
+            m_window[i].resize(frameSize);
+        }
+
+        // Raw frames can't be told from a YUV4MPEG2 stream by the name, so the
+        // start of the input is checked. The bytes read stay in the first slot
+        // as the start of frame 0.
+        const size_t magicSize = std::min(frameSize, sizeof(kY4MMagic) - 1);
+        m_peeked = fread(&m_window[0][0], 1, magicSize, m_file);
+        if (m_peeked == sizeof(kY4MMagic) - 1 && memcmp(&m_window[0][0], kY4MMagic, m_peeked) == 0)
+        {
+            if (m_file != stdin)
+            {
+                fclose(m_file);
+            }
+            throw std::runtime_error("Y4M on a stream is not supported; give it a .y4m file or raw frames.");
+        }
+
+        m_numFrames = (frames == 0) ? kUnboundedFrames : frames;
+        m_width = width;
+        m_height = height;
+    }
+
+    StreamCapture::~StreamCapture()
+    {
+        if (m_file && m_file != stdin)
+        {
+            fclose(m_file);
+        }
+    }
+
+    bool StreamCapture::TryGetSample( int frameNum, PlanarImage * im )
+    {
+        if (im->Width != (size_t)m_width || im->Height != (size_t)m_height)
+        {
+            throw std::runtime_error("Capture::GetFrame: output image size mismatch.");
+        }
+        if (frameNum < 0 || frameNum < m_read - kStreamWindow)
+        {
+            std::stringstream ss;
+            ss << "StreamCapture: frame " << frameNum << " is no longer in memory, a stream is only read once.";
+            throw std::runtime_error(ss.str().c_str());
+        }
+        if (frameNum >= m_numFrames)
+        {
+            return false;
+        }
+
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        while (m_read <= frameNum && !m_ended)
+        {
+            std::vector<uint8_t> & slot = m_window[m_read % kStreamWindow];
+            // Frame 0 starts with the bytes the constructor looked at
+            const size_t start = (m_read == 0) ? m_peeked : 0;
+            const size_t got = start + fread(&slot[0] + start, 1, frameSize - start, m_file);
+            if (got == frameSize)
+            {
+                ++m_read;
+            }
+            else if (got == 0 && !ferror(m_file))
+            {
+                m_ended = true;
+            }
+            else if (got != 0)
+            {
+                throw std::runtime_error("YUV stream ends in the middle of a frame. Wrong dimensions?");
+            }
+            else
+            {
+                throw std::runtime_error("Failed reading the YUV stream.");
+            }
+        }
+        if (frameNum >= m_read)
+        {
+            // Only the end of an unbounded stream is expected, the samples size
+            // their loops and buffers by the frame count asked for
+            if (m_numFrames != kUnboundedFrames)
+            {
+                std::stringstream ss;
+                ss << "YUV stream ended after " << m_read << " of the " << m_numFrames << " frames asked for.";
+                throw std::runtime_error(ss.str().c_str());
+            }
+            return false;
+        }
+
+        const uint8_t * pFrame = &m_window[frameNum % kStreamWindow][0];
+        const size_t lumaSize = m_width * m_height;
+        CopyPlane(pFrame, m_width, m_width, m_height, im->Y, im->PitchY);
+        CopyPlane(pFrame + lumaSize, m_width / 2, m_width / 2, m_height / 2, im->U, im->PitchU);
+        CopyPlane(pFrame + lumaSize * 5 / 4, m_width / 2, m_width / 2, m_height / 2, im->V, im->PitchV);
+        return true;
+    }
+
+    void StreamCapture::GetSample( int frameNum, PlanarImage * im )
+    {
+        if (!TryGetSample(frameNum, im))
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+    }
+
+    // True for inputs that have to be read sequentially
+    static bool IsStream(const std::string & fn)
+    {
+        if (fn == "-")
+        {
+            return true;
+        }
+#ifdef __linux__
+        struct stat st;
+        if (stat(fn.c_str(), &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISCHR(st.st_mode)))
+        {
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    static double PrefetchTimeStamp()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    PrefetchCapture::PrefetchCapture(Capture * source, int ringSize, int ahead)
+        :   m_source(source), m_ring(std::max(ringSize, 1)),
+            m_ahead(std::min(std::max(ahead, 1), std::max(ringSize, 1))),
+            m_next(0), m_released(0), m_read(0), m_end(0), m_generation(0), m_stop(false),
+            m_waitTime(0), m_readTime(0)
+    {
+        m_width = source->GetWidth();
+        m_height = source->GetHeight();
+        m_numFrames = source->GetNumFrames();
+        m_end = m_numFrames;
+        for (size_t i = 0; i < m_ring.size(); ++i)
+        {
+            m_ring[i] = CreatePlanarImage(m_width, m_height);
+        }
+        m_reader = std::thread(&PrefetchCapture::ReadLoop, this);
+    }
+
+    PrefetchCapture::~PrefetchCapture()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_readerCond.notify_one();
+        m_reader.join();
+        for (size_t i = 0; i < m_ring.size(); ++i)
+        {
+            ReleaseImage(m_ring[i]);
+        }
+    }
+
+    void PrefetchCapture::ReadLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            // Room in the ring and within the ahead window of the consumer
+            while (!m_stop && (m_error || m_read >= m_end ||
+                m_read >= m_released + (int)m_ring.size() || m_read >= m_next + m_ahead))
+            {
+                m_readerCond.wait(lock);
+            }
+            if (m_stop)
+            {
+                return;
+            }
+
+            const int frame = m_read;
+            const unsigned generation = m_generation;
+            PlanarImage * im = m_ring[frame % m_ring.size()];
+            lock.unlock();
+
+            std::exception_ptr error;
+            bool ended = false;
+            const double readStart = PrefetchTimeStamp();
+            try
+            {
+                ended = !m_source->TryGetSample(frame, im);
+            }
+            catch (...)
+            {
+                error = std::current_exception();
+            }
+            const double readTime = PrefetchTimeStamp() - readStart;
+
+            lock.lock();
+            m_readTime += readTime;
+            if (generation == m_generation)
+            {
+                if (error)
+                {
+                    m_error = error;
+                }
+                else if (ended)
+                {
+                    m_end = frame;
+                }
+                else
+                {
+                    ++m_read;
+                }
+                m_frameCond.notify_all();
+            }
+        }
+    }
+
+    PlanarImage * PrefetchCapture::Acquire(int frameNum)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (frameNum < 0 || frameNum >= m_numFrames)
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+        if (frameNum != m_next)
+        {
+            if (m_released != m_next)
+            {
+                throw std::runtime_error("PrefetchCapture: frames have to be released before seeking.");
+            }
+            // Whatever the reader is busy with is dropped when it finishes
+            ++m_generation;
+            m_next = m_released = m_read = frameNum;
+            m_error = std::exception_ptr();
+            m_readerCond.notify_one();
+        }
+
+        const double waitStart = PrefetchTimeStamp();
+        while (m_read <= frameNum && !m_error && frameNum < m_end)
+        {
+            m_frameCond.wait(lock);
+        }
+        m_waitTime += PrefetchTimeStamp() - waitStart;
+        if (m_read <= frameNum)
+        {
+            // The frames read before a failure or the end of a stream are still handed out
+            if (m_error)
+            {
+                std::rethrow_exception(m_error);
+            }
+            return NULL;
+        }
+
+        ++m_next;
+        // The ahead window moved
+        m_readerCond.notify_one();
+        return m_ring[frameNum % m_ring.size()];
+    }
+
+    void PrefetchCapture::Release(int frameNum)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (frameNum != m_released || frameNum >= m_next)
+            {
+                throw std::runtime_error("PrefetchCapture: frames have to be released in the order they were acquired.");
+            }
+            ++m_released;
+        }
+        m_readerCond.notify_one();
+    }
+
+    bool PrefetchCapture::TryGetSample(int frameNum, PlanarImage * im)
+    {
+        if (im->Width != (size_t)m_width || im->Height != (size_t)m_height)
+        {
+            throw std::runtime_error("Capture::GetFrame: output image size mismatch.");
+        }
+
+        const PlanarImage * frame = Acquire(frameNum);
+        if (!frame)
+        {
+            return false;
+        }
+        CopyPlane(frame->Y, frame->PitchY, m_width, m_height, im->Y, im->PitchY);
+        CopyPlane(frame->U, frame->PitchU, m_width / 2, m_height / 2, im->U, im->PitchU);
+        CopyPlane(frame->V, frame->PitchV, m_width / 2, m_height / 2, im->V, im->PitchV);
+        Release(frameNum);
+        return true;
+    }
+
+    void PrefetchCapture::GetSample(int frameNum, PlanarImage * im)
+    {
+        if (!TryGetSample(frameNum, im))
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+    }
+
+    double PrefetchCapture::GetWaitTime() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_waitTime;
+    }
+
+    double PrefetchCapture::GetReadTime() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_readTime;
+    }
+
+    Capture * Capture::CreateFileCapture(const std::string & fn, int width, int height, int frames, bool allowStream)
     {
         Capture * cap = NULL;
 
-        if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
+        if (IsStream(fn))
+        {
+            if (!allowStream)
+            {
+                throw std::runtime_error("This sample reads the sequence more than once, it can't read from a stream; give it a file.");
+            }
+            cap = new StreamCapture(fn, width, height, frames);
+        }
+        else if (IsY4M(fn))
+        {
+            cap = new Y4MCapture(fn, frames);
+        }
+        else if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
         {
             cap = new YUVCapture(fn, width, height, frames);
         }
@@ -118,6 +783,27 @@ namespace YUVUtils
         return cap;
     }
 
+    bool Capture::ReadFileGeometry(const std::string & fn, int & width, int & height)
+    {
+        if (IsStream(fn) || !IsY4M(fn))
+        {
+            return false;
+        }
+
+        std::ifstream file(fn.c_str(), std::ios::binary);
+        std::string line;
+        if (!std::getline(file, line))
+        {
+            std::stringstream ss;
+            ss << "Unable to load YUV file: " << fn;
+            throw std::runtime_error(ss.str().c_str());
+        }
+        const Y4MHeader header = ParseY4MHeader(line);
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
     void Capture::Release(Capture * cap)
     {
         delete cap;
@@ -252,7 +938,21 @@ namespace YUVUtils
         {
 		    throw std::runtime_error("Failed opening output file.");
         }
-        outfile.write((char*)&m_data[0], m_data.size());
+        if (IsY4M(fn))
+        {
+            const std::string header = Y4MStreamHeader(m_width, m_height);
+            const size_t frameSize = m_width * m_height * 3 / 2;
+            outfile.write(header.c_str(), header.size());
+            for (int f = 0; f < m_currFrame; ++f)
+            {
+                outfile << kY4MFrameMarker << '\n';
+                outfile.write((char*)&m_data[f * frameSize], frameSize);
+            }
+        }
+        else
+        {
+            outfile.write((char*)&m_data[0], m_data.size());
+        }
         outfile.close();
     }
 
@@ -297,11 +997,272 @@ namespace YUVUtils
         }
     }
 
+    // Size the frames are batched to before they are handed to the writer thread
+    static const size_t kStreamChunkSize = 4 << 20;
+
+    // Writes the frames to the file while the sequence is processed. AppendFrame
+    // packs the frame into a page-aligned chunk of several frames; full chunks
+    // go through a bounded queue to a writer thread, which writes each one with
+    // a single unbuffered write. AppendFrame only blocks when every chunk is
+    // still queued, so the memory use doesn't grow with the sequence.
+    class StreamingYUVWriter : public FrameWriter
+    {
+    public:
+        StreamingYUVWriter(const std::string & fn, int width, int height, int queueDepth);
+        virtual ~StreamingYUVWriter();
+
+        void AppendFrame(PlanarImage * im);
+        // Waits for the queued frames and closes the file
+        void WriteToFile(const char * fn);
+
+    private:
+        void WriteLoop();
+        void Submit();
+        void Close();
+
+        std::string m_fileName;
+        FILE * m_file;
+        std::string m_frameHeader;  // goes before every frame, the FRAME line in a .y4m
+        size_t m_frameSize;         // of a frame in the file, with its header
+        size_t m_chunkCapacity;
+        std::vector<uint8_t *> m_chunks;
+        std::vector<size_t> m_chunkSizes;
+        std::deque<int> m_free;
+        std::deque<int> m_queued;
+        int m_current;          // chunk being filled, -1 when there is none
+        bool m_stop;
+        std::string m_error;    // set by the writer thread
+
+        std::mutex m_mutex;
+        std::condition_variable m_writerCond;  // a chunk was queued
+        std::condition_variable m_freeCond;    // a chunk was written
+        std::thread m_writer;
+    };
+
+    StreamingYUVWriter::StreamingYUVWriter( const std::string & fn, int width, int height, int queueDepth )
+        : FrameWriter(width, height), m_fileName(fn), m_file(NULL),
+          m_frameSize(width * height * 3 / 2 * sizeof(uint8_t)), m_current(-1), m_stop(false)
+    {
+        m_file = fopen(fn.c_str(), "wb");
+        if (!m_file)
+        {
+            throw std::runtime_error("Failed opening output file.");
+        }
+        // The chunks are written straight from their pages
+        setvbuf(m_file, NULL, _IONBF, 0);
+
+        if (IsY4M(fn))
+        {
+            const std::string header = Y4MStreamHeader(width, height);
+            if (fwrite(header.c_str(), 1, header.size(), m_file) != header.size())
+            {
+                fclose(m_file);
+                throw std::runtime_error("Failed writing output file " + fn);
+            }
+            m_frameHeader = std::string(kY4MFrameMarker) + '\n';
+            m_frameSize += m_frameHeader.size();
+        }
+
+        m_chunkCapacity = std::max(kStreamChunkSize / m_frameSize, (size_t)1) * m_frameSize;
+        m_chunks.resize(std::max(queueDepth, 2), NULL);
+        m_chunkSizes.resize(m_chunks.size(), 0);
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+#ifdef __linux__
+            if (posix_memalign((void**)&m_chunks[c], 0x1000, m_chunkCapacity))
+            {
+                m_chunks[c] = NULL;
+            }
+#else
+            m_chunks[c] = (uint8_t *)_aligned_malloc(m_chunkCapacity, 0x1000);
+#endif
+            if (!m_chunks[c])
+            {
+                fclose(m_file);
+                for (size_t k = 0; k < c; ++k)
+                {
+#ifdef __linux__
+                    free(m_chunks[k]);
+#else
+                    _aligned_free(m_chunks[k]);
+#endif
+                }
+                throw std::runtime_error("Allocation failed");
+            }
+            m_free.push_back((int)c);
+        }
+        m_writer = std::thread(&StreamingYUVWriter::WriteLoop, this);
+    }
+
+    StreamingYUVWriter::~StreamingYUVWriter()
+    {
+        if (m_file)
+        {
+            try
+            {
+                Close();
+            }
+            catch (...)
+            {
+                // Nothing to report to from a destructor, WriteToFile throws instead
+            }
+        }
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+#ifdef __linux__
+            free(m_chunks[c]);
+#else
+            _aligned_free(m_chunks[c]);
+#endif
+        }
+    }
+
+    void StreamingYUVWriter::WriteLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            while (m_queued.empty() && !m_stop)
+            {
+                m_writerCond.wait(lock);
+            }
+            // Everything queued is written before stopping
+            if (m_queued.empty())
+            {
+                return;
+            }
+            const int c = m_queued.front();
+            m_queued.pop_front();
+            const bool failed = !m_error.empty();
+            lock.unlock();
+
+            const bool written = !failed && fwrite(m_chunks[c], 1, m_chunkSizes[c], m_file) == m_chunkSizes[c];
+
+            lock.lock();
+            if (!written && m_error.empty())
+            {
+                m_error = "Failed writing output file " + m_fileName;
+            }
+            m_free.push_back(c);
+            m_freeCond.notify_one();
+        }
+    }
+
+    void StreamingYUVWriter::AppendFrame( PlanarImage * im )
+    {
+        if (!m_file)
+        {
+            throw std::runtime_error("StreamingYUVWriter: the output file is already closed.");
+        }
+        if (m_current < 0)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_free.empty())
+            {
+                m_freeCond.wait(lock);
+            }
+            if (!m_error.empty())
+            {
+                throw std::runtime_error(m_error);
+            }
+            m_current = m_free.front();
+            m_free.pop_front();
+            m_chunkSizes[m_current] = 0;
+        }
+
+        uint8_t * pDst = m_chunks[m_current] + m_chunkSizes[m_current];
+        memcpy(pDst, m_frameHeader.data(), m_frameHeader.size());
+        pDst += m_frameHeader.size();
+
+        uint8_t * pSrc = (uint8_t*)im->Y;
+        for (unsigned int y = 0; y < im->Height; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width);
+            pSrc += im->PitchY;
+            pDst += im->Width;
+        }
+
+        pSrc = (uint8_t*)im->U;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchU;
+            pDst += im->Width / 2;
+        }
+
+        pSrc = (uint8_t*)im->V;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchV;
+            pDst += im->Width / 2;
+        }
+
+        m_chunkSizes[m_current] += m_frameSize;
+        ++m_currFrame;
+        if (m_chunkSizes[m_current] + m_frameSize > m_chunkCapacity)
+        {
+            Submit();
+        }
+    }
+
+    void StreamingYUVWriter::Submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued.push_back(m_current);
+        }
+        m_current = -1;
+        m_writerCond.notify_one();
+    }
+
+    void StreamingYUVWriter::Close()
+    {
+        if (m_current >= 0)
+        {
+            Submit();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_writerCond.notify_one();
+        m_writer.join();
+
+        const bool closed = fclose(m_file) == 0;
+        m_file = NULL;
+        if (!m_error.empty())
+        {
+            throw std::runtime_error(m_error);
+        }
+        if (!closed)
+        {
+            throw std::runtime_error("Failed writing output file " + m_fileName);
+        }
+    }
+
+    void StreamingYUVWriter::WriteToFile( const char * fn )
+    {
+        if (fn && m_fileName != fn)
+        {
+            throw std::runtime_error("StreamingYUVWriter: the frames are written to " + m_fileName);
+        }
+        if (m_file)
+        {
+            Close();
+        }
+    }
+
     FrameWriter * FrameWriter::CreateFrameWriter(int width, int height, int frameNumHint, bool bFormatBMPHint)
     {
         return new YUVWriter(width, height, frameNumHint, bFormatBMPHint);
     }
 
+    FrameWriter * FrameWriter::CreateStreamingFrameWriter(const std::string & fn, int width, int height, int queueDepth)
+    {
+        return new StreamingYUVWriter(fn, width, height, queueDepth);
+    }
+
     void FrameWriter::Release(FrameWriter * writer)
     {
         delete writer;
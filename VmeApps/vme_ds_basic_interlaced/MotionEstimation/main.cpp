@@ -33,6 +33,7 @@
 #include "yuv_utils.h"
 #include "cmdparser.hpp"
 #include "oclobject.hpp"
+#include "cpu_vme.hpp"
 
 #ifdef __linux
 void fopen_s(FILE **f, const char *name, const char *mode) {
@@ -173,6 +174,11 @@ class CmdParserMV : public CmdParser
 public:
     CmdOption<bool>        out_to_bmp;
     CmdOption<bool>     help;
+    CmdOption<std::string>         backend;
+    CmdEnum<std::string>           backend_gpu;
+    CmdEnum<std::string>           backend_cpu;
+    CmdOption<int>      threads;
+    CmdOption<std::string>         cost_table;
     CmdOption<std::string>         fileName;
     CmdOption<std::string>         overlayFileName;
     CmdOption<int>      width;
@@ -183,7 +189,12 @@ public:
     CmdParser(argc, argv),
         out_to_bmp(*this,        'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is on", ""),
         help(*this,              'h',"help","","Show this help text and exit."),
-        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv file format)","in_1280x720.yuv"),
+        backend(*this,           0,"backend","string","Motion estimation backend: VME on an Intel GPU or the host CPU implementation, which reads every frame once and searches both fields at once","gpu"),
+        backend_gpu(backend,     "gpu"),
+        backend_cpu(backend,     "cpu"),
+        threads(*this,           0,"threads","<integer>","Number of worker threads for the cpu backend -- 0 uses all hardware threads",0),
+        cost_table(*this,        0,"cost_table","string","Packed motion vector cost table of the cpu backend as its two 32-bit words s0,s1 -- by default an approximation of the kernel's high penalty table, the gpu backend of ime_mv_extract prints the device's tables",""),
+        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","in_1280x720.yuv"),
         overlayFileName(*this,   0,"output","string", "Output video sequence with overlaid motion vectors filename ","out.yuv"),
         width(*this,             0, "width",    "<integer>", "Frame width for the input file", 1280),
         height(*this,            0, "height","<integer>", "Frame height for the input file",720),
@@ -197,6 +208,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -301,9 +325,8 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // Create a built-in VME kernel
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d, "", NULL, NULL);
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "", &err));
 
     size_t  buildLogSize = 0;
     clGetProgramBuildInfo(p(), d, CL_PROGRAM_BUILD_LOG,0,NULL, &buildLogSize );
@@ -443,6 +466,105 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     ReleaseImage(currImage);
 }
 
+// Host counterpart of ExtractMotionVectorsFullFrameWithOpenCL for both
+// polarities at once: every frame is read once and split into its fields,
+// and each field is searched in the same polarity field of the previous
+// frame, as the kernel does with interlaced set. The results of the first
+// frame are left zeroed, as on the GPU path.
+void ExtractFieldMotionVectorsCPU(
+    Capture * pCapture, 
+    std::vector<MotionVector> & TopMVs, std::vector<cl_ushort> & TopSADs, std::vector<cl_uchar2> & TopShapes, 
+    std::vector<MotionVector> & BotMVs, std::vector<cl_ushort> & BotSADs, std::vector<cl_uchar2> & BotShapes, 
+    const CmdParserMV& cmd)
+{
+    const int numPics = pCapture->GetNumFrames();
+    const int width = cmd.width.getValue();
+    const int height = cmd.height.getValue();
+    int mvImageWidth, mvImageHeight;
+    int mbImageWidth, mbImageHeight;
+    ComputeNumMVs(kMBBlockType, width, height / 2, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
+    TopMVs.resize(numPics * mvImageWidth * mvImageHeight);
+    TopSADs.resize(numPics * mvImageWidth * mvImageHeight);
+    TopShapes.resize(numPics * mbImageWidth * mbImageHeight);
+    BotMVs.resize(numPics * mvImageWidth * mvImageHeight);
+    BotSADs.resize(numPics * mvImageWidth * mvImageHeight);
+    BotShapes.resize(numPics * mbImageWidth * mbImageHeight);
+
+    // Same search as vme_basic.cl: all partitions, quarter pel, high penalty
+    // cost table (approximated unless --cost_table gives the device's one)
+    // around a (0, 0) cost center, (0, 0) predictors
+    CPUVme::SearchDesc desc;
+    desc.costTable = cmd.cost_table.getValue().empty()
+        ? CPUVme::GetCostTable(CPUVme::COST_PENALTY_HIGH)
+        : CPUVme::ParseCostTable(cmd.cost_table.getValue());
+    CPUVme::MotionEstimator estimator(width, height / 2, desc, cmd.threads.getValue());
+
+    CPUVme::Plane srcTop(width, height / 2), srcBot(width, height / 2);
+    CPUVme::Plane refTop(width, height / 2), refBot(width, height / 2);
+    CPUVme::Plane * srcFields[2] = { &srcTop, &srcBot };
+    CPUVme::Plane * refFields[2] = { &refTop, &refBot };
+    const cl_short2 * predMVs[2] = { NULL, NULL };
+
+    // Bootstrap video sequence reading
+    PlanarImage * currImage = CreatePlanarImage(width, height);
+    pCapture->GetSample(0, currImage);
+    CPUVme::Plane::LoadFields(currImage->Y, currImage->PitchY, refTop, refBot);
+    refTop.Interpolate();
+    refBot.Interpolate();
+
+    double ioStat = 0;//file i/o
+    double meStat = 0;//motion estimation itself
+
+    double overallStart  = time_stamp();
+    for (int i = 1; i < numPics; i++)
+    {
+        double ioStart = time_stamp();
+        pCapture->GetSample(i, currImage);
+        ioStat += (time_stamp() - ioStart);
+
+        double meStart = time_stamp();
+        CPUVme::Plane::LoadFields(currImage->Y, currImage->PitchY, *srcFields[0], *srcFields[1]);
+
+        const CPUVme::Plane * src[2] = { srcFields[0], srcFields[1] };
+        const CPUVme::Plane * ref[2] = { refFields[0], refFields[1] };
+        cl_short2 * mvs[2] = { &TopMVs[i * mvImageWidth * mvImageHeight], &BotMVs[i * mvImageWidth * mvImageHeight] };
+        cl_ushort * sads[2] = { &TopSADs[i * mvImageWidth * mvImageHeight], &BotSADs[i * mvImageWidth * mvImageHeight] };
+        cl_uchar2 * shapes[2] = { &TopShapes[i * mbImageWidth * mbImageHeight], &BotShapes[i * mbImageWidth * mbImageHeight] };
+        estimator.EstimateFields(src, ref, predMVs, mvs, sads, shapes);
+
+        // The fields of this frame are the references of the next one
+        std::swap(srcFields[0], refFields[0]);
+        std::swap(srcFields[1], refFields[1]);
+        refFields[0]->Interpolate();
+        refFields[1]->Interpolate();
+        meStat += (time_stamp() - meStart);
+    }
+    double overallStat  = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
+    std::cout << "Average frame file I/O time per frame " << 1000*ioStat/numPics << " ms\n";
+    std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/numPics << " ms\n";
+    ReleaseImage(currImage);
+}
+
+// Splits a frame into its top and bottom fields: the images GetSample reads
+// with interlaced set, luma and chroma rows alternating between the fields.
+void SplitFields(const PlanarImage * frame, PlanarImage * top, PlanarImage * bot)
+{
+    for (unsigned int y = 0; y < top->Height; y++)
+    {
+        memcpy(top->Y + y * top->PitchY, frame->Y + 2 * y * frame->PitchY, top->Width);
+        memcpy(bot->Y + y * bot->PitchY, frame->Y + (2 * y + 1) * frame->PitchY, bot->Width);
+    }
+    for (unsigned int y = 0; y < top->Height / 2; y++)
+    {
+        memcpy(top->U + y * top->PitchU, frame->U + 2 * y * frame->PitchU, top->Width / 2);
+        memcpy(bot->U + y * bot->PitchU, frame->U + (2 * y + 1) * frame->PitchU, bot->Width / 2);
+        memcpy(top->V + y * top->PitchV, frame->V + 2 * y * frame->PitchV, top->Width / 2);
+        memcpy(bot->V + y * bot->PitchV, frame->V + (2 * y + 1) * frame->PitchV, bot->Width / 2);
+    }
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Overlay routines
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -632,20 +754,47 @@ int main( int argc, const char** argv )
         {
             throw std::runtime_error("Failed opening video input sequence...");
         }
+        // A .y4m header tells how the frames were captured, raw files are taken as interlaced
+        switch (pCapture->GetFieldOrder())
+        {
+        case Capture::FIELD_ORDER_PROGRESSIVE:
+            std::cout << "Warning: the input is progressive, both fields of a frame are from the same instant" << std::endl;
+            break;
+        case Capture::FIELD_ORDER_BOTTOM_FIRST:
+            std::cout << "The input is bottom field first, the bottom field of a frame is the earlier one" << std::endl;
+            break;
+        case Capture::FIELD_ORDER_MIXED:
+            std::cout << "The input has mixed field order, it may change from frame to frame" << std::endl;
+            break;
+        default:
+            break;
+        }
 
         // Process sequence
         std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
         std::vector<MotionVector> TopMVs, BotMVs;
         std::vector<cl_ushort> TopSADs, BotSADs;
         std::vector<cl_uchar2> TopShapes, BotShapes;
-        ExtractMotionVectorsFullFrameWithOpenCL(pCapture, 0, TopMVs, TopSADs, TopShapes, cmd);
-        ExtractMotionVectorsFullFrameWithOpenCL(pCapture, 1, BotMVs, BotSADs, BotShapes, cmd);
+        if (cmd.backend_cpu.isSet())
+        {
+            ExtractFieldMotionVectorsCPU(pCapture, TopMVs, TopSADs, TopShapes, BotMVs, BotSADs, BotShapes, cmd);
+        }
+        else
+        {
+            ExtractMotionVectorsFullFrameWithOpenCL(pCapture, 0, TopMVs, TopSADs, TopShapes, cmd);
+            ExtractMotionVectorsFullFrameWithOpenCL(pCapture, 1, BotMVs, BotSADs, BotShapes, cmd);
+        }
 
         // Generate sequence with overlaid motion vectors
-        FrameWriter * pTopWriter = FrameWriter::CreateFrameWriter(width, height / 2, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
-        FrameWriter * pBotWriter = FrameWriter::CreateFrameWriter(width, height / 2, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+        std::string topOverlayFileName = "top_fields_";
+        topOverlayFileName += cmd.overlayFileName.getValue();
+        std::string botOverlayFileName = "bot_fields_";
+        botOverlayFileName += cmd.overlayFileName.getValue();
+        FrameWriter * pTopWriter = FrameWriter::CreateStreamingFrameWriter(topOverlayFileName, width, height / 2);
+        FrameWriter * pBotWriter = FrameWriter::CreateStreamingFrameWriter(botOverlayFileName, width, height / 2);
         PlanarImage * srcTopFieldImage = CreatePlanarImage(width, height / 2);
         PlanarImage * srcBotFieldImage = CreatePlanarImage(width, height / 2);
+        PlanarImage * srcFrameImage = CreatePlanarImage(width, height);
 
         int mvImageWidth, mvImageHeight;
         int mbImageWidth, mbImageHeight;
@@ -654,8 +803,8 @@ int main( int argc, const char** argv )
 
         for (int k = 0; k < pCapture->GetNumFrames(); k++)
         {
-            pCapture->GetSample(k, srcTopFieldImage, true, 0);
-            pCapture->GetSample(k, srcBotFieldImage, true, 1);
+            pCapture->GetSample(k, srcFrameImage);
+            SplitFields(srcFrameImage, srcTopFieldImage, srcBotFieldImage);
             // Overlay MVs on Top/Bot Src picture, except the very first one
             if(k>0) {
                 OverlayVectors(subBlockSize, TopMVs, TopShapes, srcTopFieldImage, k, width, height / 2);
@@ -665,13 +814,9 @@ int main( int argc, const char** argv )
             pBotWriter->AppendFrame(srcBotFieldImage);
         }
 
-        std::string topOverlayFileName = "top_fields_";
-        topOverlayFileName += cmd.overlayFileName.getValue();
         std::cout << "Writing " << pCapture->GetNumFrames() << " frames to " << topOverlayFileName << "..." << std::endl;
         pTopWriter->WriteToFile(topOverlayFileName.c_str());
 
-        std::string botOverlayFileName = "bot_fields_";
-        botOverlayFileName += cmd.overlayFileName.getValue();
         std::cout << "Writing " << pCapture->GetNumFrames() << " frames to " << botOverlayFileName << "..." << std::endl;
         pBotWriter->WriteToFile(botOverlayFileName.c_str());
 
@@ -680,6 +825,7 @@ int main( int argc, const char** argv )
         Capture::Release(pCapture);
         ReleaseImage(srcTopFieldImage);
         ReleaseImage(srcBotFieldImage);
+        ReleaseImage(srcFrameImage);
 
         PrintInterDists(TopSADs, 0, width, height / 2);
         PrintInterDists(BotSADs, 1, width, height / 2);
@@ -20,12 +20,26 @@
 
 #include "yuv_utils.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <cstring>
 #include <CL/cl.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace YUVUtils
 {
@@ -34,15 +48,39 @@ namespace YUVUtils
     public:
 
         YUVCapture(const std::string & fn, int width, int height, int frames = 0);
+        virtual ~YUVCapture();
         
         virtual void GetSample(int frameNum, PlanarImage * im, bool interlaced = false, unsigned char polarity = 0);
+        virtual PlanarImage ViewSample(int frameNum, PlanarImage * im);
 
     protected:
+        // Opens and maps fn, for captures that work out the layout themselves
+        explicit YUVCapture(const std::string & fn);
+
+        // Start of frame frameNum in the mapped file, NULL when the file isn't mapped
+        uint8_t * MappedFrame(int frameNum);
+        // Offset of the planes of frame frameNum in the file
+        virtual size_t FrameOffset(int frameNum) const;
+
         std::ifstream m_file;
+        uint8_t * m_map;        // whole file, read-only
+        size_t m_mapSize;
+        size_t m_fileSize;
     };
 
-    YUVCapture::YUVCapture( const std::string & fn, int width, int height, int frames )
-        :    m_file (fn.c_str(), std::ios::binary | std::ios::ate)
+    // Copies height rows of width bytes between planes of different pitches
+    static void CopyPlane(const uint8_t * pSrc, size_t srcPitch, size_t width, size_t height, uint8_t * pDst, size_t dstPitch)
+    {
+        for (size_t i = 0; i < height; ++i)
+        {
+            memcpy(pDst, pSrc, width);
+            pSrc += srcPitch;
+            pDst += dstPitch;
+        }
+    }
+
+    YUVCapture::YUVCapture( const std::string & fn )
+        :    m_file (fn.c_str(), std::ios::binary | std::ios::ate), m_map(NULL), m_mapSize(0), m_fileSize(0)
     {
 
         if (!m_file.good())
@@ -52,19 +90,79 @@ namespace YUVUtils
 		    throw std::runtime_error(ss.str().c_str());
         }
 
-        const size_t fileSize = static_cast<size_t>(m_file.tellg());
+        m_fileSize = static_cast<size_t>(m_file.tellg());
+        m_file.seekg(0, std::ios::beg);
+
+#ifdef __linux__
+        // Map the file, so frames are copied straight out of the page cache
+        // instead of being read row by row, or not copied at all (ViewSample).
+        // The stream stays as the fallback for files that can't be mapped.
+        int fd = open(fn.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            void * map = (m_fileSize > 0) ? mmap(NULL, m_fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (map != MAP_FAILED)
+            {
+                m_map = (uint8_t *)map;
+                m_mapSize = m_fileSize;
+                // Frames are mostly read in order, let the kernel read ahead aggressively
+                madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+                m_file.close();
+            }
+        }
+#endif
+    }
+
+    YUVCapture::YUVCapture( const std::string & fn, int width, int height, int frames )
+        :    YUVCapture(fn)
+    {
         const size_t frameSize = width * height * 3 / 2 * sizeof(uint8_t);
-        if (fileSize % frameSize)
+        if (m_fileSize % frameSize)
         {
 		    throw std::runtime_error("YUV file file size error. Wrong dimensions?");
 		}
-        m_file.seekg(0, std::ios::beg);
 
-        m_numFrames = (frames == 0)? ((int)(fileSize) / (int)frameSize) : frames;
+        m_numFrames = (frames == 0)? ((int)(m_fileSize) / (int)frameSize) : frames;
         m_width = width;
         m_height = height;
     }
 
+    YUVCapture::~YUVCapture()
+    {
+#ifdef __linux__
+        if (m_map)
+        {
+            munmap(m_map, m_mapSize);
+        }
+#endif
+    }
+
+    uint8_t * YUVCapture::MappedFrame(int frameNum)
+    {
+        if (!m_map)
+        {
+            return NULL;
+        }
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const size_t offset = (frameNum < 0) ? m_mapSize : FrameOffset(frameNum);
+        if (offset + frameSize > m_mapSize)
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+        uint8_t * pFrame = m_map + offset;
+#ifdef __linux__
+        // Start paging in the next frame while this one is processed
+        if (offset + 2 * frameSize <= m_mapSize)
+        {
+            const size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+            uint8_t * pNext = (uint8_t *)((size_t)(pFrame + frameSize) & ~pageMask);
+            madvise(pNext, pFrame + 2 * frameSize - pNext, MADV_WILLNEED);
+        }
+#endif
+        return pFrame;
+    }
+
     void YUVCapture::GetSample( int frameNum, PlanarImage * im, bool interlaced, unsigned char polarity )
     {
         size_t divisor = interlaced ? 2 : 1;
@@ -74,8 +172,29 @@ namespace YUVUtils
         }
 
         const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const uint8_t * pFrame = MappedFrame(frameNum);
+        if (pFrame)
+        {
+            // A field is every other row, starting with the second one for polarity 1.
+            // One copy when a frame is packed like the file, row by row otherwise
+            const size_t lumaSize = m_width * m_height;
+            const int field = interlaced ? polarity : 0;
+            if (!interlaced && im->PitchY == m_width && im->U == im->Y + lumaSize && im->V == im->U + lumaSize / 4 &&
+                im->PitchU == m_width / 2 && im->PitchV == m_width / 2)
+            {
+                memcpy(im->Y, pFrame, frameSize);
+            }
+            else
+            {
+                CopyPlane(pFrame + field * m_width, m_width * divisor, m_width, im->Height, im->Y, im->PitchY);
+                CopyPlane(pFrame + lumaSize + field * (m_width / 2), (m_width / 2) * divisor, m_width / 2, im->Height / 2, im->U, im->PitchU);
+                CopyPlane(pFrame + lumaSize * 5 / 4 + field * (m_width / 2), (m_width / 2) * divisor, m_width / 2, im->Height / 2, im->V, im->PitchV);
+            }
+            return;
+        }
+
         m_file.clear();
-        m_file.seekg(frameNum * frameSize);
+        m_file.seekg(FrameOffset(frameNum));
 
         size_t inRowSize = m_width * sizeof(uint8_t);
         size_t outRowSize = im->PitchY * sizeof(uint8_t);
@@ -123,11 +242,196 @@ namespace YUVUtils
         }
     }
 
+    PlanarImage YUVCapture::ViewSample( int frameNum, PlanarImage * im )
+    {
+        uint8_t * pFrame = MappedFrame(frameNum);
+        // A padded pitch needs the copy
+        if (!pFrame || im->PitchY != m_width)
+        {
+            return Capture::ViewSample(frameNum, im);
+        }
+
+        PlanarImage view;
+        view.Y = pFrame;
+        view.U = view.Y + m_width * m_height;
+        view.V = view.U + m_width * m_height / 4;
+        view.Width = m_width;
+        view.Height = m_height;
+        view.PitchY = m_width;
+        view.PitchU = m_width / 2;
+        view.PitchV = m_width / 2;
+        return view;
+    }
+
+    size_t YUVCapture::FrameOffset( int frameNum ) const
+    {
+        return frameNum * (m_width * m_height * 3 / 2 * sizeof(uint8_t));
+    }
+
+    static const char kY4MMagic[] = "YUV4MPEG2";
+    static const char kY4MFrameMarker[] = "FRAME";
+
+    static bool IsY4M(const std::string & fn)
+    {
+        return strstr(fn.c_str(), ".y4m") != NULL;
+    }
+
+    // Parameters of a YUV4MPEG2 stream header
+    struct Y4MHeader
+    {
+        int width;
+        int height;
+        Capture::FieldOrder fieldOrder;
+    };
+
+    // Parses the header line, without its newline. The frames are read like
+    // YV12, so only 8-bit 4:2:0 chroma is accepted, with any chroma siting.
+    static Y4MHeader ParseY4MHeader(const std::string & line)
+    {
+        std::stringstream tokens(line);
+        std::string token;
+        if (!(tokens >> token) || token != kY4MMagic)
+        {
+            throw std::runtime_error("Not a YUV4MPEG2 file.");
+        }
+
+        Y4MHeader header = { 0, 0, Capture::FIELD_ORDER_UNKNOWN };
+        std::string chroma = "420jpeg";
+        while (tokens >> token)
+        {
+            const std::string value = token.substr(1);
+            switch (token[0])
+            {
+            case 'W': header.width = atoi(value.c_str()); break;
+            case 'H': header.height = atoi(value.c_str()); break;
+            case 'C': chroma = value; break;
+            case 'I':
+                if (value == "p") header.fieldOrder = Capture::FIELD_ORDER_PROGRESSIVE;
+                else if (value == "t") header.fieldOrder = Capture::FIELD_ORDER_TOP_FIRST;
+                else if (value == "b") header.fieldOrder = Capture::FIELD_ORDER_BOTTOM_FIRST;
+                else if (value == "m") header.fieldOrder = Capture::FIELD_ORDER_MIXED;
+                break;
+            default:
+                // Frame rate, aspect ratio and extensions don't matter here
+                break;
+            }
+        }
+
+        if (header.width <= 0 || header.height <= 0 || header.width % 2 || header.height % 2)
+        {
+            throw std::runtime_error("Y4M header without a valid frame size.");
+        }
+        if (chroma != "420jpeg" && chroma != "420paldv" && chroma != "420mpeg2" && chroma != "420")
+        {
+            throw std::runtime_error("Unsupported Y4M chroma format C" + chroma + ", only 8-bit 4:2:0 can be read.");
+        }
+        return header;
+    }
+
+    // Header of the .y4m files written. The frame rate isn't known here, the
+    // fields written by the interlaced sample are progressive pictures too.
+    static std::string Y4MStreamHeader(int width, int height)
+    {
+        std::stringstream ss;
+        ss << kY4MMagic << " W" << width << " H" << height << " F30:1 Ip A0:0 C420jpeg\n";
+        return ss.str();
+    }
+
+    // YUV4MPEG2 file: a header line with the frame size and format, then every
+    // frame after a FRAME line of its own. The frames are indexed when the file
+    // is opened, so a frame is found in O(1) and read like in a raw file.
+    class Y4MCapture : public YUVCapture
+    {
+    public:
+        Y4MCapture(const std::string & fn, int frames = 0);
+
+    protected:
+        virtual size_t FrameOffset(int frameNum) const;
+
+    private:
+        // Line starting at offset, without its newline; offset moves past it
+        std::string ReadLine(size_t & offset);
+
+        std::vector<size_t> m_index;    // file offset of the planes of every frame
+    };
+
+    Y4MCapture::Y4MCapture( const std::string & fn, int frames )
+        :    YUVCapture(fn)
+    {
+        size_t offset = 0;
+        const Y4MHeader header = ParseY4MHeader(ReadLine(offset));
+        m_width = header.width;
+        m_height = header.height;
+        m_fieldOrder = header.fieldOrder;
+
+        // A FRAME line may carry parameters of its own, which are skipped
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        while (offset < m_fileSize)
+        {
+            if (ReadLine(offset).compare(0, sizeof(kY4MFrameMarker) - 1, kY4MFrameMarker) != 0)
+            {
+                throw std::runtime_error("Y4M frame header missing. Corrupted file?");
+            }
+            if (offset + frameSize > m_fileSize)
+            {
+                throw std::runtime_error("Y4M file ends in the middle of a frame.");
+            }
+            m_index.push_back(offset);
+            offset += frameSize;
+        }
+
+        m_numFrames = (frames == 0) ? (int)m_index.size() : frames;
+    }
+
+    std::string Y4MCapture::ReadLine( size_t & offset )
+    {
+        // Longer lines are no Y4M header, whatever extensions they carry
+        static const size_t kMaxLine = 1024;
+
+        std::string line;
+        bool found = false;
+        if (m_map)
+        {
+            const char * pLine = (const char *)m_map + offset;
+            const char * pEnd = (const char *)memchr(pLine, '\n', std::min(kMaxLine, m_mapSize - offset));
+            if (pEnd)
+            {
+                line.assign(pLine, pEnd);
+                found = true;
+            }
+        }
+        else
+        {
+            m_file.clear();
+            m_file.seekg(offset);
+            found = std::getline(m_file, line) && !m_file.eof() && line.size() < kMaxLine;
+        }
+        if (!found)
+        {
+            throw std::runtime_error("Y4M header line missing or too long. Corrupted file?");
+        }
+        offset += line.size() + 1;
+        return line;
+    }
+
+    size_t Y4MCapture::FrameOffset( int frameNum ) const
+    {
+        if (frameNum < 0 || frameNum >= (int)m_index.size())
+        {
+            throw std::runtime_error("Capture::GetFrame: frame number out of range.");
+        }
+        return m_index[frameNum];
+    }
+
     Capture * Capture::CreateFileCapture(const std::string & fn, int width, int height, int frames)
     {
         Capture * cap = NULL;
 
-        if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
+        if (IsY4M(fn))
+        {
+            cap = new Y4MCapture(fn, frames);
+        }
+        else if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
         {
             cap = new YUVCapture(fn, width, height, frames);
         }
@@ -139,6 +443,27 @@ namespace YUVUtils
         return cap;
     }
 
+    bool Capture::ReadFileGeometry(const std::string & fn, int & width, int & height)
+    {
+        if (!IsY4M(fn))
+        {
+            return false;
+        }
+
+        std::ifstream file(fn.c_str(), std::ios::binary);
+        std::string line;
+        if (!std::getline(file, line))
+        {
+            std::stringstream ss;
+            ss << "Unable to load YUV file: " << fn;
+            throw std::runtime_error(ss.str().c_str());
+        }
+        const Y4MHeader header = ParseY4MHeader(line);
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
     void Capture::Release(Capture * cap)
     {
         delete cap;
@@ -273,7 +598,21 @@ namespace YUVUtils
         {
 		    throw std::runtime_error("Failed opening output file.");
         }
-        outfile.write((char*)&m_data[0], m_data.size());
+        if (IsY4M(fn))
+        {
+            const std::string header = Y4MStreamHeader(m_width, m_height);
+            const size_t frameSize = m_width * m_height * 3 / 2;
+            outfile.write(header.c_str(), header.size());
+            for (int f = 0; f < m_currFrame; ++f)
+            {
+                outfile << kY4MFrameMarker << '\n';
+                outfile.write((char*)&m_data[f * frameSize], frameSize);
+            }
+        }
+        else
+        {
+            outfile.write((char*)&m_data[0], m_data.size());
+        }
         outfile.close();
     }
 
@@ -318,11 +657,272 @@ namespace YUVUtils
         }
     }
 
+    // Size the frames are batched to before they are handed to the writer thread
+    static const size_t kStreamChunkSize = 4 << 20;
+
+    // Writes the frames to the file while the sequence is processed. AppendFrame
+    // packs the frame into a page-aligned chunk of several frames; full chunks
+    // go through a bounded queue to a writer thread, which writes each one with
+    // a single unbuffered write. AppendFrame only blocks when every chunk is
+    // still queued, so the memory use doesn't grow with the sequence.
+    class StreamingYUVWriter : public FrameWriter
+    {
+    public:
+        StreamingYUVWriter(const std::string & fn, int width, int height, int queueDepth);
+        virtual ~StreamingYUVWriter();
+
+        void AppendFrame(PlanarImage * im);
+        // Waits for the queued frames and closes the file
+        void WriteToFile(const char * fn);
+
+    private:
+        void WriteLoop();
+        void Submit();
+        void Close();
+
+        std::string m_fileName;
+        FILE * m_file;
+        std::string m_frameHeader;  // goes before every frame, the FRAME line in a .y4m
+        size_t m_frameSize;         // of a frame in the file, with its header
+        size_t m_chunkCapacity;
+        std::vector<uint8_t *> m_chunks;
+        std::vector<size_t> m_chunkSizes;
+        std::deque<int> m_free;
+        std::deque<int> m_queued;
+        int m_current;          // chunk being filled, -1 when there is none
+        bool m_stop;
+        std::string m_error;    // set by the writer thread
+
+        std::mutex m_mutex;
+        std::condition_variable m_writerCond;  // a chunk was queued
+        std::condition_variable m_freeCond;    // a chunk was written
+        std::thread m_writer;
+    };
+
+    StreamingYUVWriter::StreamingYUVWriter( const std::string & fn, int width, int height, int queueDepth )
+        : FrameWriter(width, height), m_fileName(fn), m_file(NULL),
+          m_frameSize(width * height * 3 / 2 * sizeof(uint8_t)), m_current(-1), m_stop(false)
+    {
+        m_file = fopen(fn.c_str(), "wb");
+        if (!m_file)
+        {
+            throw std::runtime_error("Failed opening output file.");
+        }
+        // The chunks are written straight from their pages
+        setvbuf(m_file, NULL, _IONBF, 0);
+
+        if (IsY4M(fn))
+        {
+            const std::string header = Y4MStreamHeader(width, height);
+            if (fwrite(header.c_str(), 1, header.size(), m_file) != header.size())
+            {
+                fclose(m_file);
+                throw std::runtime_error("Failed writing output file " + fn);
+            }
+            m_frameHeader = std::string(kY4MFrameMarker) + '\n';
+            m_frameSize += m_frameHeader.size();
+        }
+
+        m_chunkCapacity = std::max(kStreamChunkSize / m_frameSize, (size_t)1) * m_frameSize;
+        m_chunks.resize(std::max(queueDepth, 2), NULL);
+        m_chunkSizes.resize(m_chunks.size(), 0);
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+#ifdef __linux__
+            if (posix_memalign((void**)&m_chunks[c], 0x1000, m_chunkCapacity))
+            {
+                m_chunks[c] = NULL;
+            }
+#else
+            m_chunks[c] = (uint8_t *)_aligned_malloc(m_chunkCapacity, 0x1000);
+#endif
+            if (!m_chunks[c])
+            {
+                fclose(m_file);
+                for (size_t k = 0; k < c; ++k)
+                {
+#ifdef __linux__
+                    free(m_chunks[k]);
+#else
+                    _aligned_free(m_chunks[k]);
+#endif
+                }
+                throw std::runtime_error("Allocation failed");
+            }
+            m_free.push_back((int)c);
+        }
+        m_writer = std::thread(&StreamingYUVWriter::WriteLoop, this);
+    }
+
+    StreamingYUVWriter::~StreamingYUVWriter()
+    {
+        if (m_file)
+        {
+            try
+            {
+                Close();
+            }
+            catch (...)
+            {
+                // Nothing to report to from a destructor, WriteToFile throws instead
+            }
+        }
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+#ifdef __linux__
+            free(m_chunks[c]);
+#else
+            _aligned_free(m_chunks[c]);
+#endif
+        }
+    }
+
+    void StreamingYUVWriter::WriteLoop()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            while (m_queued.empty() && !m_stop)
+            {
+                m_writerCond.wait(lock);
+            }
+            // Everything queued is written before stopping
+            if (m_queued.empty())
+            {
+                return;
+            }
+            const int c = m_queued.front();
+            m_queued.pop_front();
+            const bool failed = !m_error.empty();
+            lock.unlock();
+
+            const bool written = !failed && fwrite(m_chunks[c], 1, m_chunkSizes[c], m_file) == m_chunkSizes[c];
+
+            lock.lock();
+            if (!written && m_error.empty())
+            {
+                m_error = "Failed writing output file " + m_fileName;
+            }
+            m_free.push_back(c);
+            m_freeCond.notify_one();
+        }
+    }
+
+    void StreamingYUVWriter::AppendFrame( PlanarImage * im )
+    {
+        if (!m_file)
+        {
+            throw std::runtime_error("StreamingYUVWriter: the output file is already closed.");
+        }
+        if (m_current < 0)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_free.empty())
+            {
+                m_freeCond.wait(lock);
+            }
+            if (!m_error.empty())
+            {
+                throw std::runtime_error(m_error);
+            }
+            m_current = m_free.front();
+            m_free.pop_front();
+            m_chunkSizes[m_current] = 0;
+        }
+
+        uint8_t * pDst = m_chunks[m_current] + m_chunkSizes[m_current];
+        memcpy(pDst, m_frameHeader.data(), m_frameHeader.size());
+        pDst += m_frameHeader.size();
+
+        uint8_t * pSrc = (uint8_t*)im->Y;
+        for (unsigned int y = 0; y < im->Height; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width);
+            pSrc += im->PitchY;
+            pDst += im->Width;
+        }
+
+        pSrc = (uint8_t*)im->U;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchU;
+            pDst += im->Width / 2;
+        }
+
+        pSrc = (uint8_t*)im->V;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchV;
+            pDst += im->Width / 2;
+        }
+
+        m_chunkSizes[m_current] += m_frameSize;
+        ++m_currFrame;
+        if (m_chunkSizes[m_current] + m_frameSize > m_chunkCapacity)
+        {
+            Submit();
+        }
+    }
+
+    void StreamingYUVWriter::Submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued.push_back(m_current);
+        }
+        m_current = -1;
+        m_writerCond.notify_one();
+    }
+
+    void StreamingYUVWriter::Close()
+    {
+        if (m_current >= 0)
+        {
+            Submit();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_writerCond.notify_one();
+        m_writer.join();
+
+        const bool closed = fclose(m_file) == 0;
+        m_file = NULL;
+        if (!m_error.empty())
+        {
+            throw std::runtime_error(m_error);
+        }
+        if (!closed)
+        {
+            throw std::runtime_error("Failed writing output file " + m_fileName);
+        }
+    }
+
+    void StreamingYUVWriter::WriteToFile( const char * fn )
+    {
+        if (fn && m_fileName != fn)
+        {
+            throw std::runtime_error("StreamingYUVWriter: the frames are written to " + m_fileName);
+        }
+        if (m_file)
+        {
+            Close();
+        }
+    }
+
     FrameWriter * FrameWriter::CreateFrameWriter(int width, int height, int frameNumHint, bool bFormatBMPHint)
     {
         return new YUVWriter(width, height, frameNumHint, bFormatBMPHint);
     }
 
+    FrameWriter * FrameWriter::CreateStreamingFrameWriter(const std::string & fn, int width, int height, int queueDepth)
+    {
+        return new StreamingYUVWriter(fn, width, height, queueDepth);
+    }
+
     void FrameWriter::Release(FrameWriter * writer)
     {
         delete writer;
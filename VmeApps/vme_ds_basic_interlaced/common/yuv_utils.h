@@ -79,22 +79,45 @@ namespace YUVUtils
     class Capture
     {
     public:
+        // Field order recorded in the input, unknown for raw files
+        enum FieldOrder
+        {
+            FIELD_ORDER_UNKNOWN,
+            FIELD_ORDER_PROGRESSIVE,
+            FIELD_ORDER_TOP_FIRST,
+            FIELD_ORDER_BOTTOM_FIRST,
+            FIELD_ORDER_MIXED
+        };
+
+        // Opens a raw YV12 file, or a YUV4MPEG2 (.y4m) file, whose header gives
+        // the frame size instead of width and height
         static Capture * CreateFileCapture(const std::string & fn, int width, int height, int frames);
+        // Frame size in the header of fn, for inputs that have one (.y4m).
+        // Returns false for raw files, which need it given.
+        static bool ReadFileGeometry(const std::string & fn, int & width, int & height);
         static void Release(Capture * cap);
 
         virtual ~Capture() {}
         virtual void GetSample(int frameNum, PlanarImage * im, bool interlaced = false, unsigned char polarity = 0) = 0;
 
+        // Returns frame frameNum without copying it where the capture can: the
+        // planes then point into read-only memory of the capture, which stays
+        // valid until the capture is released. Otherwise, or when im has a padded
+        // pitch, the frame is read into im and *im is returned.
+        virtual PlanarImage ViewSample(int frameNum, PlanarImage * im) { GetSample(frameNum, im); return *im; }
+
         int GetWidth() const { return m_width; }
         int GetHeight() const { return m_height; }
+        FieldOrder GetFieldOrder() const { return m_fieldOrder; }
         int GetNumFrames() const { return m_numFrames; }
 
     protected:
-        Capture() : m_width(0), m_height(0), m_numFrames(0) {};
+        Capture() : m_width(0), m_height(0), m_numFrames(0), m_fieldOrder(FIELD_ORDER_UNKNOWN) {};
 
         int m_width;
         int m_height;
         int m_numFrames;
+        FieldOrder m_fieldOrder;
 
     private:
         Capture(const Capture&);
@@ -103,7 +126,13 @@ namespace YUVUtils
     class FrameWriter
     {
     public:
+        // Keeps the appended frames in memory until WriteToFile, fine for short clips
         static FrameWriter * CreateFrameWriter(int width, int height, int frameNumHint = 0, bool bFormatBMPHint = false);
+        // Opens fn right away and writes the frames on a background thread as
+        // they are appended, queueDepth chunks of a few MB at most in memory.
+        // WriteToFile(fn) waits for the last frames and closes the file.
+        // Either writer writes YUV4MPEG2 to a file name ending in .y4m.
+        static FrameWriter * CreateStreamingFrameWriter(const std::string & fn, int width, int height, int queueDepth = 3);
         static void Release(FrameWriter * cap);
 
         virtual void AppendFrame(PlanarImage * im) = 0;
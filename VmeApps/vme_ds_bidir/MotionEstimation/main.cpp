@@ -45,6 +45,7 @@
 #include "../common/yuv_utils.h"
 #include "../common/cmdparser.hpp"
 #include "../common/oclobject.hpp"
+#include "../common/cpu_vme.hpp"
 
 #ifdef __linux
 void fopen_s(FILE **f, const char *name, const char *mode) {
@@ -147,25 +148,36 @@ public:
     CmdOption<bool>		help;
     CmdOption<bool>		out_to_bmp;
 
+    CmdOption<std::string>	backend;
+    CmdEnum<std::string>	backend_gpu;
+    CmdEnum<std::string>	backend_cpu;
+    CmdOption<int>		threads;
+    CmdOption<std::string>	cost_table;
+
     CmdParserMV  (int argc, const char** argv) :
     CmdParser(argc, argv),
         out_to_bmp(*this,		'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is off", false, "nobmp"),
         help(*this,				'h',"help","","Show this help text and exit."),
+        backend(*this,			0,"backend","string","Motion estimation backend: VME on an Intel GPU or the host CPU implementation","gpu"),
+        backend_gpu(backend,	"gpu"),
+        backend_cpu(backend,	"cpu"),
+        threads(*this,			0,"threads","<integer>","Number of worker threads for the cpu backend -- 0 uses all hardware threads",0),
+        cost_table(*this,		0,"cost_table","string","Packed motion vector cost table of the cpu backend as its two 32-bit words s0,s1 -- by default an approximation of the kernel's medium penalty table, the gpu backend of ime_mv_extract prints the device's tables",""),
 
 #if USE_HD
-        fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv file format)","../BasketballDrive_1920x1080_15.yuv"),
+        fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","../BasketballDrive_1920x1080_15.yuv"),
 		overlayFileName(*this,	0,"output","string", "Output video sequence with overlaid motion vectors filename ","BasketballDrive_1920x1080_15_output.yuv"),
         width(*this,			0, "width",	"<integer>", "Frame width for the input file", 1920),
         height(*this,			0, "height","<integer>", "Frame height for the input file", 1080),
 		frames(*this,			15, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 15)
 #elif USE_SD
-		fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv file format)","../goal_1280x720.yuv"),
+		fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","../goal_1280x720.yuv"),
         overlayFileName(*this,	0,"output","string", "Output video sequence with overlaid motion vectors filename ","goal_1280x720_output.yuv"),
         width(*this,			0, "width",	"<integer>", "Frame width for the input file", 1280),
         height(*this,			0, "height","<integer>", "Frame height for the input file", 720),
 		frames(*this,			0, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 0)
 #else
-		fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv file format)","../boat_qcif_176x144.yuv"),
+		fileName(*this,			0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","../boat_qcif_176x144.yuv"),
         overlayFileName(*this,	0,"output","string", "Output video sequence with overlaid motion vectors filename ","boat_qcif_176x144_output.yuv"),
         width(*this,			0, "width",	"<integer>", "Frame width for the input file", 176),
         height(*this,			0, "height","<integer>", "Frame height for the input file", 144),
@@ -180,6 +192,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 
@@ -363,96 +388,199 @@ void FillMV(
 	}
 }
 
-void IntraPred(  
-	Capture * pCapture, 
-	std::vector<BMotionVector>& MV,
-	std::vector<cl_uchar2>& Shapes,
-	std::vector<cl_uchar>& Dirs,
-	const CmdParserMV& cmd)
+// OpenCL state shared by all GPU stages of the sample: the context, queue, the
+// vme_ds_bidir.cl program (built once) with its kernels, and the luma planes of
+// the sequence. A frame is read and copied to a tiled image the first time a
+// stage asks for it and stays resident while it is within the last kFrameWindow
+// frames asked for, which covers frames i - 2 .. i of a bidirectional stage; the
+// device memory does not grow with the length of the clip.
+struct VmeSession
 {
-	 //MV, Shapes, Dirs assumed to be initialized earlier, this function only fills for Frame 0
+    cl::Context context;
+    cl::Device device;
+    cl::CommandQueue queue;
+    cl::Program program;
+
+    cl::Kernel intraKernel;
+    cl::Kernel fwdKernel;
+    cl::Kernel bidirKernel;
+    cl::Kernel skipFwdKernel;
+    cl::Kernel skipBiDirKernel;
+
+    double uploadTime;  // time spent copying frames to tiled image memory
+
+    // Per-frame input buffers of the stages, allocated once and refilled every frame
+    OpenCLBufferPool * buffers;
+    enum { SKIP_MV_SLOT, SKIP_DIR_SLOT };
+
+    VmeSession(Capture * pCapture, int width, int height) :
+        uploadTime(0),
+        buffers(NULL),
+        m_pCapture(pCapture), m_width(width), m_height(height),
+        m_currImage(CreatePlanarImage(width, height))
+    {
+        for (int slot = 0; slot < kFrameWindow; ++slot)
+        {
+            m_frameIndex[slot] = -1;
+        }
 
-	 // OpenCL initialization
-    OpenCLBasic init("Intel", "GPU");
-    
-    //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
+        // OpenCL initialization
+        OpenCLBasic init("Intel", "GPU");
+        //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
 
-    cl::Context context = cl::Context(init.context); clRetainContext(init.context);
-    cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
-    cl::CommandQueue queue = cl::CommandQueue(init.queue); clRetainCommandQueue(init.queue);
+        context = cl::Context(init.context); clRetainContext(init.context);
+        device  = cl::Device(init.device);   clRetainDevice(init.device);
+        queue = cl::CommandQueue(init.queue); clRetainCommandQueue(init.queue);
+        buffers = new OpenCLBufferPool(init.context);
 
-    std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
-	   
-	if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
-    {
-        printf("WARNING: The selected device doesn't officially support device side motion estimation extension!");
-    }
+        std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
+        if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
+        {
+            printf("WARNING: The selected device doesn't officially support motion estimation or accelerator extensions!");
+        }
 
-    char* programSource = NULL;
-    
-    // Load the kernel source from the passed in file.
-    if( LoadSourceFromFile( 
-            "vme_ds_bidir.cl",
-            programSource ) )
-    {
-        printf("Error: Couldn't load kernel source from file.\n" );
-    }    
-
-    // Create a built-in VME kernel
-    cl_int err = 0;
-    const cl_device_id & d = device();    
-    cl::Program p(
-        clCreateProgramWithSource(
-            context(),
-            1,
-            ( const char** )&programSource,
-            NULL,
-            &err));
+        char* programSource = NULL;
 
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed creating vme program(s)");
-    }
+        // Load the kernel source from the passed in file.
+        if( LoadSourceFromFile( 
+                "vme_ds_bidir.cl",
+                programSource ) )
+        {
+            printf("Error: Couldn't load kernel source from file.\n" );
+        }    
+
+        // Create the VME program, all stages share it. The binary cached by an
+        // earlier run is reused when the device, driver and source still match
+        cl_int err = 0;
+        const cl_device_id & d = device();    
+        program = cl::Program(
+            buildProgramWithCache(
+                context(),
+                d,
+                programSource,
+                "",
+                &err));
+        delete [] programSource;
+
+        if (program() == NULL)
+        {
+            throw cl::Error(err, "Failed creating vme program(s)");
+        }
 
-    err = clBuildProgram(
-            p(), 
-            1, 
-            &d,
-            "",   
-            NULL,
-            NULL );
-
-    size_t  buildLogSize = 0;
-    clGetProgramBuildInfo(
-        p(),
-        d,
-        CL_PROGRAM_BUILD_LOG,
-        0,  
-        NULL,
-        &buildLogSize );
-
-    cl_char*    buildLog = new cl_char[ buildLogSize ];
-    if( buildLog )
-    {
+        size_t  buildLogSize = 0;
         clGetProgramBuildInfo(
-            p(),
+            program(),
             d,
             CL_PROGRAM_BUILD_LOG,
-            buildLogSize,
-            buildLog,
-            NULL );
+            0,  
+            NULL,
+            &buildLogSize );
+
+        cl_char*    buildLog = new cl_char[ buildLogSize ];
+        if( buildLog )
+        {
+            clGetProgramBuildInfo(
+                program(),
+                d,
+                CL_PROGRAM_BUILD_LOG,
+                buildLogSize,
+                buildLog,
+                NULL );
+
+            std::cout << ">>> Build Log:\n";
+            std::cout << buildLog;
+            std::cout << ">>>End of Build Log\n";
+            delete [] buildLog;
+        }
+
+        if (err != CL_SUCCESS)
+        {
+            throw cl::Error(err, "Failed building vme program(s)");
+        }  
+
+        intraKernel = cl::Kernel(program, "block_intrapred_intel");
+        fwdKernel = cl::Kernel(program, "block_motion_estimate_fwd_intel");
+        bidirKernel = cl::Kernel(program, "block_motion_estimate_bidir_intel");
+        skipFwdKernel = cl::Kernel(program, "block_skip_check_fwd_intel");
+        skipBiDirKernel = cl::Kernel(program, "block_skip_check_bidir_intel");
+    }
 
-        std::cout << ">>> Build Log:\n";
-        std::cout << buildLog;
-        std::cout << ">>>End of Build Log\n";
+    ~VmeSession()
+    {
+        delete buffers;
+        ReleaseImage(m_currImage);
+    }
+
+    int GetNumFrames() const
+    {
+        return m_pCapture->GetNumFrames();
     }
 
-    if (err != CL_SUCCESS)
+    // Returns the tiled luma image of frame i, reading and uploading it unless it
+    // is still in the window. The reference is valid until frame i + kFrameWindow
+    // (or i - kFrameWindow) is asked for
+    const cl::Image2D & Frame(int i)
     {
-        throw cl::Error(err, "Failed building vme program(s)");
-    }  
+        const int slot = i % kFrameWindow;
+        cl::Image2D & image = m_frames[slot];
+        if (m_frameIndex[slot] != i)
+        {
+            // Uploaded straight from the mapped file when the capture allows it
+            PlanarImage sample = m_pCapture->ViewSample(i, m_currImage);
+
+            double uploadStart = time_stamp();
+
+            if (image() == NULL)
+            {
+                cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
+                image = cl::Image2D(context, CL_MEM_READ_ONLY, imageFormat, m_width, m_height, 0, 0);
+            }
+
+            cl::size_t<3> origin;
+            origin[0] = 0;
+            origin[1] = 0;
+            origin[2] = 0;
+            cl::size_t<3> region;
+            region[0] = m_width;
+            region[1] = m_height;
+            region[2] = 1;
+
+            // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline.
+            // The queue is in order, so kernels still reading the evicted frame finish before the overwrite
+            queue.enqueueWriteImage(image, CL_TRUE, origin, region, sample.PitchY, 0, sample.Y);
+            m_frameIndex[slot] = i;
+
+            uploadTime += time_stamp() - uploadStart;
+        }
+        return image;
+    }
+
+private:
+    enum { kFrameWindow = 3 };
+
+    Capture * m_pCapture;
+    int m_width;
+    int m_height;
+    PlanarImage * m_currImage;
+    cl::Image2D m_frames[kFrameWindow];
+    int m_frameIndex[kFrameWindow];
 
-    cl::Kernel kernel(p, "block_intrapred_intel");
+    VmeSession(const VmeSession &);
+    VmeSession & operator=(const VmeSession &);
+};
+
+void IntraPred(  
+	VmeSession & session, 
+	std::vector<BMotionVector>& MV,
+	std::vector<cl_uchar2>& Shapes,
+	std::vector<cl_uchar>& Dirs,
+	const CmdParserMV& cmd)
+{
+	 //MV, Shapes, Dirs assumed to be initialized earlier, this function only fills for Frame 0
+
+    cl::Context & context = session.context;
+    cl::CommandQueue & queue = session.queue;
+    cl::Kernel & kernel = session.intraKernel;
 
 	int width = cmd.width.getValue();
     int height = cmd.height.getValue();
@@ -462,9 +590,6 @@ void IntraPred(
 
     ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
 
-	cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);    
-
 	cl::Buffer modeBuffer(
 		context, CL_MEM_WRITE_ONLY, 
 		mbImageWidth * mbImageHeight * 22 *  sizeof(cl_uchar));
@@ -486,22 +611,8 @@ void IntraPred(
     dists.resize(mbImageWidth * mbImageHeight);
 	blksizes.resize(mbImageWidth * mbImageHeight);
 	
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-
-    pCapture->GetSample(0, currImage);
-
-    cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-
-    // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+    // Frame 0 was evicted by the motion estimation unless the clip is short
+    const cl::Image2D & srcImage = session.Frame(0);
 
 	double overallStart  = time_stamp();
 
@@ -533,100 +644,73 @@ void IntraPred(
 	FillMV(MV, Shapes,Dirs,width,height,cmd, modes,blksizes);	 	
 }
 
-
-void MotionEstimationFwd( 
+void IntraPredCPU(  
 	Capture * pCapture, 
-	std::vector<BMotionVector> &MVs, 
-	std::vector<cl_ushort> &SADs,
-	std::vector<cl_uchar2> &Shapes,
-	std::vector<cl_uchar>  &Dirs, //needed for overlay, kernel will set all to fwd
-    const CmdParserMV& cmd, 
-	int skp_check_type)
+	std::vector<BMotionVector>& MV,
+	std::vector<cl_uchar2>& Shapes,
+	std::vector<cl_uchar>& Dirs,
+	const CmdParserMV& cmd)
 {
+	 //MV, Shapes, Dirs assumed to be initialized earlier, this function only fills for Frame 0
 
-    // OpenCL initialization
-    OpenCLBasic init("Intel", "GPU");
-    //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
+	int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
 
-    cl::Context context = cl::Context(init.context); clRetainContext(init.context);
-    cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
-    cl::CommandQueue queue = cl::CommandQueue(init.queue); clRetainCommandQueue(init.queue);
+	int mvImageWidth, mvImageHeight;
+	int mbImageWidth, mbImageHeight;
 
-    std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
-    if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
-    {
-        printf("WARNING: The selected device doesn't officially support motion estimation or accelerator extensions!");
-    }
+    ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
 
-    char* programSource = NULL;
-    
-    // Load the kernel source from the passed in file.
-    if( LoadSourceFromFile( 
-            "vme_ds_bidir.cl",
-            programSource ) )
-    {
-        printf("Error: Couldn't load kernel source from file.\n" );
-    }    
-
-    // Create a built-in VME kernel
-    cl_int err = 0;
-    const cl_device_id & d = device();    
-    cl::Program p(
-        clCreateProgramWithSource(
-            context(),
-            1,
-            ( const char** )&programSource,
-            NULL,
-            &err));
+	// Same block sizes as block_intrapred_intel, luma only
+	CPUVme::IntraEstimator estimator(width, height, intraPartMask, CPUVme::SAD_ADJUST_MODE_NONE, cmd.threads.getValue());
+	CPUVme::Plane srcPlane(width, height);
 
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed creating vme program(s)");
-    }
+	//local arrays receiving the modes, residuals and block sizes, same layout as the kernel buffers
+	std::vector<cl_char>  modes;
+	std::vector<cl_ushort>  dists;
+	std::vector<cl_uchar>  blksizes;
 
-    err = clBuildProgram(
-            p(), 
-            1, 
-            &d,
-            "",   
-            NULL,
-            NULL );
-
-    size_t  buildLogSize = 0;
-    clGetProgramBuildInfo(
-        p(),
-        d,
-        CL_PROGRAM_BUILD_LOG,
-        0,  
-        NULL,
-        &buildLogSize );
-
-    cl_char*    buildLog = new cl_char[ buildLogSize ];
-    if( buildLog )
-    {
-        clGetProgramBuildInfo(
-            p(),
-            d,
-            CL_PROGRAM_BUILD_LOG,
-            buildLogSize,
-            buildLog,
-            NULL );
+	modes.resize(mbImageWidth * mbImageHeight * CPUVme::kIntraModesPerMB);
+    dists.resize(mbImageWidth * mbImageHeight);
+	blksizes.resize(mbImageWidth * mbImageHeight);
+	
+    // Bootstrap video sequence reading
+    PlanarImage * currImage = CreatePlanarImage(width, height);
 
-        std::cout << ">>> Build Log:\n";
-        std::cout << buildLog;
-        std::cout << ">>>End of Build Log\n";
-    }
+    PlanarImage sample = pCapture->ViewSample(0, currImage);
+	srcPlane.Load(sample.Y, sample.PitchY);
+
+	double overallStart  = time_stamp();
 
+	estimator.EstimateFrame(srcPlane, NULL, NULL, &modes[0], &dists[0], &blksizes[0]);
 
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed building vme program(s)");
-    }  
+	double overallStat  = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Intra prediction time for frame 0 " << 1000*overallStat << " ms\n";
+
+    ReleaseImage(currImage);
+
+	// Use the modes and blk sizes to fill bidir MV, Shapes and Dirs for Frame 0, use to overlay 
+	FillMV(MV, Shapes,Dirs,width,height,cmd, modes,blksizes);	 	
+}
+
+
+void MotionEstimationFwd( 
+	VmeSession & session, 
+	std::vector<BMotionVector> &MVs, 
+	std::vector<cl_ushort> &SADs,
+	std::vector<cl_uchar2> &Shapes,
+	std::vector<cl_uchar>  &Dirs, //needed for overlay, kernel will set all to fwd
+    const CmdParserMV& cmd, 
+	int skp_check_type)
+{
 
-    cl::Kernel kernel(p, "block_motion_estimate_fwd_intel");
+    cl::Context & context = session.context;
+    cl::CommandQueue & queue = session.queue;
+    cl::Kernel & kernel = session.fwdKernel;
 
    
-    int numPics = pCapture->GetNumFrames();
+    int numPics = session.GetNumFrames();
     int width = cmd.width.getValue();
     int height = cmd.height.getValue();
 
@@ -641,9 +725,6 @@ void MotionEstimationFwd(
 	Dirs.resize(numPics * mbImageWidth * mbImageHeight); 
 
 	// Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);    
 	cl::Buffer shapeBuffer(context, CL_MEM_WRITE_ONLY, mbImageWidth * mbImageHeight * sizeof(cl_uchar2));
 	cl::Buffer DirBuffer(context, CL_MEM_WRITE_ONLY, mbImageWidth * mbImageHeight * sizeof(cl_uchar));
 
@@ -667,23 +748,6 @@ void MotionEstimationFwd(
 		context, CL_MEM_WRITE_ONLY, 
 		mvImageWidth * mvImageHeight * sizeof(cl_ushort));
 	
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-
-    pCapture->GetSample(0, currImage);
-
-    cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-
-    // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-    
     // Process all frames
     double ioStat = 0;
 	double ioTileStat = 0;
@@ -697,21 +761,18 @@ void MotionEstimationFwd(
 
     double overallStart  = time_stamp();
 
-    // First frame is already in srcImg, so we start with the second frame
+    // The first frame is only a reference, so we start with the second frame
     for (int i = 1; i < numPics; i++, count++)
     {	            
 		double ioStart = time_stamp();
+		double uploadStart = session.uploadTime;
 
-		// Load next picture
-        pCapture->GetSample(i, currImage);
-
-        std::swap(refImage, srcImage);		
-
-		double ioTileStart = time_stamp();
-        // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-        queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+		// Frame i - 1 is resident since the previous iteration, frame i is
+		// read and uploaded unless an earlier stage did it
+        const cl::Image2D & refImage = session.Frame(i - 1);
+        const cl::Image2D & srcImage = session.Frame(i);
 				
-		ioTileStat += (time_stamp() -ioTileStart);
+		ioTileStat += session.uploadTime - uploadStart;
         ioStat += (time_stamp() -ioStart);
         double meStart = time_stamp();
         // Schedule full-frame motion estimation
@@ -773,15 +834,12 @@ void MotionEstimationFwd(
 	std::cout << "Average frame tile I/O time per frame " << 1000*ioTileStat/count << " ms\n";
     std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/count << " ms\n";
-
-  
-    ReleaseImage(currImage);
 }
 
 
 
 void MotionEstimationBiDir( 
-	Capture * pCapture, 
+	VmeSession & session, 
 	std::vector<BMotionVector> &MVs, 
 	std::vector<cl_ushort> &SADs, 
 	std::vector<cl_uchar2> &Shapes,
@@ -790,88 +848,12 @@ void MotionEstimationBiDir(
 	int skp_check_type)
 {
 
-    // OpenCL initialization
-    OpenCLBasic init("Intel", "GPU");
-    //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
-
-    cl::Context context = cl::Context(init.context); clRetainContext(init.context);
-    cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
-    cl::CommandQueue queue = cl::CommandQueue(init.queue);clRetainCommandQueue(init.queue);
-
-    std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
-    	
-	if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
-    {
-        printf("Error: The selected device doesn't offcially support device side motion estimation extensions!");
-    }
-	
-    char* programSource = NULL;
-    
-    // Load the kernel source from the passed in file.
-    if( LoadSourceFromFile("vme_ds_bidir.cl", programSource ) )
-    {
-        printf("Error: Couldn't load kernel source from file.\n" );
-    }    
-
-    // Create a built-in VME kernel
-    cl_int err = 0;
-    const cl_device_id & d = device();    
-    cl::Program p(
-		    clCreateProgramWithSource(
-            context(),
-            1,
-            ( const char** )&programSource,
-            NULL,
-            &err));
-
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed creating vme program(s)");
-    }
-
-    err = clBuildProgram(
-            p(), 
-            1, 
-            &d,
-            "",
-            NULL,
-            NULL );
-
-    size_t  buildLogSize = 0;
-    clGetProgramBuildInfo(
-        p(),
-        d,
-        CL_PROGRAM_BUILD_LOG,
-        0,
-        NULL,
-        &buildLogSize );
-
-    cl_char*    buildLog = new cl_char[ buildLogSize ];
-    if( buildLog )
-    {
-        clGetProgramBuildInfo(
-            p(),
-            d,
-            CL_PROGRAM_BUILD_LOG,
-            buildLogSize,
-            buildLog,
-            NULL );
-
-        std::cout << ">>> Build Log:\n";
-        std::cout << buildLog;
-        std::cout << ">>>End of Build Log\n";
-    }
-
-
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed building vme program(s)");
-    }  
-
-    cl::Kernel kernel(p, "block_motion_estimate_bidir_intel");
+    cl::Context & context = session.context;
+    cl::CommandQueue & queue = session.queue;
+    cl::Kernel & kernel = session.bidirKernel;
 
    
-    int numPics = pCapture->GetNumFrames();
+    int numPics = session.GetNumFrames();
     int width = cmd.width.getValue();
     int height = cmd.height.getValue();
 
@@ -886,10 +868,6 @@ void MotionEstimationBiDir(
 	Dirs.resize(numPics * mbImageWidth * mbImageHeight); 
 
     // Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage0(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);  
-	cl::Image2D refImage1(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
     cl::Buffer mvBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(BMotionVector));
     cl::Buffer residualBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(cl_ushort));
 	cl::Buffer ShapeBuffer(context, CL_MEM_WRITE_ONLY, mbImageWidth * mbImageHeight * sizeof(cl_uchar2));
@@ -915,26 +893,6 @@ void MotionEstimationBiDir(
         context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
 		mbImageWidth * mbImageHeight * sizeof(cl_short2), bwPredMem, NULL);
 
-
-	cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-    
-	pCapture->GetSample(0, currImage);
-	queue.enqueueWriteImage(refImage0, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-
-	pCapture->GetSample(1, currImage);
-	queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-
    
     // Process all frames
     double ioStat = 0;//file i/o
@@ -949,21 +907,21 @@ void MotionEstimationBiDir(
     double overallStart  = time_stamp();
     
 
-	// Frame 0 is already in refImg0, Frame 1 is in srcImage, start with Frame 2
-   	// fw prediction uses refImg0 as reference, bw prediction uses refImg1 as reference
+	// Frame i - 1 is searched with Frame i - 2 (refImg0) as fw reference and Frame i (refImg1) as bw reference
 	// Motion estimates done for Frame1 through FrameNumPics-2, Frame0, FrameNumPics-1 used only for reference
 
     for (int i = 2; i < numPics; i++, count++)
     {	            
 		double ioStart = time_stamp();
+		double uploadStart = session.uploadTime;
 
-		// Load next picture
-        pCapture->GetSample(i, currImage);
-
-		double ioTileStart = time_stamp();
-		queue.enqueueWriteImage(refImage1, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+		// Frames i - 2 and i - 1 are resident since the previous iterations, frame i is
+		// read and uploaded unless an earlier stage did it
+        const cl::Image2D & refImage0 = session.Frame(i - 2);
+        const cl::Image2D & srcImage = session.Frame(i - 1);
+        const cl::Image2D & refImage1 = session.Frame(i);
        				        		
-		ioTileStat += (time_stamp() -ioTileStart);
+		ioTileStat += session.uploadTime - uploadStart;
 
         ioStat += (time_stamp() -ioStart);
 
@@ -1018,9 +976,6 @@ void MotionEstimationBiDir(
 		  }
 		}
 #endif
-	
-		std::swap(refImage1, srcImage);
-		std::swap(refImage0, refImage1);
 
         ioStat += (time_stamp() -ioStart);
     }
@@ -1031,96 +986,155 @@ void MotionEstimationBiDir(
 	std::cout << "Average frame tile I/O time per frame " << 1000*ioTileStat/count << " ms\n";
     std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/count << " ms\n";
-
-  
-    ReleaseImage(currImage);
 }
 
 
-void ComputeCheckMotionVectorsBiDir( 
+// Host counterpart of MotionEstimationFwd (bidir = false) and
+// MotionEstimationBiDir (bidir = true): same search settings, frame rotation
+// and result layout, computed by the CPU implementation in cpu_vme.cpp, so no
+// OpenCL device is needed.
+void MotionEstimationCPU( 
 	Capture * pCapture, 
-	std::vector<BMotionVector> & searchBMVs, 
-	std::vector<cl_ushort> &skipSADs, 	
+	std::vector<BMotionVector> &MVs, 
+	std::vector<cl_ushort> &SADs, 
+	std::vector<cl_uchar2> &Shapes,
 	std::vector<cl_uchar>  &Dirs,
-    const CmdParserMV& cmd,
-	int skp_check_type)
+	const CmdParserMV& cmd, 
+	int skp_check_type,
+	bool bidir)
 {
-    // OpenCL initialization
-    OpenCLBasic init("Intel", "GPU");
-    //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
+    int numPics = pCapture->GetNumFrames();
+    int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
 
-    cl::Context context = cl::Context(init.context); clRetainContext(init.context);
-    cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
-    cl::CommandQueue queue = cl::CommandQueue(init.queue);clRetainCommandQueue(init.queue);
+    int mvImageWidth, mvImageHeight;
+	int mbImageWidth, mbImageHeight;
 
-    std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
-    if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
-    {
-        printf("WARNING: The selected device doesn't officially support motion estimation or accelerator extensions!");
-    }
+    ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
 
-    char* programSource = NULL;
-    
-    // Load the kernel source from the passed in file.
-    if( LoadSourceFromFile( 
-            "vme_ds_bidir.cl",
-            programSource ) )
-    {
-        printf("Error: Couldn't load kernel source from file.\n" );
-    }    
-	  
-    // Create a built-in VME kernel
-    cl_int err = 0;
-    const cl_device_id & d = device();    
-    cl::Program p(
-        clCreateProgramWithSource(
-            context(),
-            1,
-            ( const char** )&programSource,
-            NULL,
-            &err));
+    MVs.resize(numPics * mvImageWidth * mvImageHeight);      //16 MV per mb
+	SADs.resize(numPics * mvImageWidth * mvImageHeight);     //16 SAD per mb
+	Shapes.resize(numPics * mbImageWidth * mbImageHeight); 
+	Dirs.resize(numPics * mbImageWidth * mbImageHeight); 
 
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed creating vme program(s)");
+	// Same settings as the kernels: QPEL search, partition sizes limited by the skip check type
+	CPUVme::SearchDesc desc;
+	if (skp_check_type == SKP_CHK_8)
+		desc.partitionMask = CPUVme::kPartitionMask8x8;
+	if (skp_check_type == SKP_CHK_16)
+		desc.partitionMask = CPUVme::kPartitionMask16x16;
+	desc.costTable = cmd.cost_table.getValue().empty()
+	    ? CPUVme::GetCostTable((CPUVme::CostPenalty)kCostPenalty)
+	    : CPUVme::ParseCostTable(cmd.cost_table.getValue());
+	desc.costPrecision = (CPUVme::CostPrecision)kCostPrecision;
+	CPUVme::MotionEstimator estimator(width, height, desc, cmd.threads.getValue());
+
+	// Host counterparts of refImage0 (forward), srcImage and refImage1 (backward)
+	CPUVme::Plane refPlane0(width, height);
+	CPUVme::Plane srcPlane(width, height);
+	CPUVme::Plane refPlane1(width, height);
+
+	std::vector<cl_short2> fwPredMem(mbImageWidth * mbImageHeight);
+	std::vector<cl_short2> bwPredMem(mbImageWidth * mbImageHeight);
+    for( int i = 0; i < mbImageWidth * mbImageHeight; i++ )
+    {		
+		fwPredMem[ i ].s[ 0 ] = 0;
+		fwPredMem[ i ].s[ 1 ] = 0;		
+
+		bwPredMem[ i ].s[ 0 ] = 0;
+		bwPredMem[ i ].s[ 1 ] = 0;	
     }
 
-    err = clBuildProgram(
-            p(), 
-            1, 
-            &d,
-            "",
-            NULL,
-            NULL );
-
-    size_t  buildLogSize = 0;
-    clGetProgramBuildInfo(
-        p(),
-        d,
-        CL_PROGRAM_BUILD_LOG,
-        0,
-        NULL,
-        &buildLogSize );
-
-    cl_char*    buildLog = new cl_char[ buildLogSize ];
-    if( buildLog )
-    {
-        clGetProgramBuildInfo(
-            p(),
-            d,
-            CL_PROGRAM_BUILD_LOG,
-            buildLogSize,
-            buildLog,
-            NULL );
+    // Bootstrap video sequence reading
+    PlanarImage * currImage = CreatePlanarImage(width, height);
+
+	// The planes load straight from the mapped file when the capture allows it
+	PlanarImage sample = pCapture->ViewSample(0, currImage);
+	if (bidir)
+	{
+		refPlane0.Load(sample.Y, sample.PitchY);
+		sample = pCapture->ViewSample(1, currImage);
+	}
+	srcPlane.Load(sample.Y, sample.PitchY);
+
+    // Process all frames
+    double ioStat = 0;//file i/o
+    double meStat = 0;//motion estimation itself
+	int count = 0;
+
+    double overallStart  = time_stamp();
+
+	// Bidir: Frame 0 is the first forward reference, Frame 1 the first source, start with Frame 2.
+	// Fwd: Frame 0 is the first reference, start with Frame 1.
+    for (int i = bidir ? 2 : 1; i < numPics; i++, count++)
+    {	            
+		double ioStart = time_stamp();
+
+		// Load next picture
+        sample = pCapture->ViewSample(i, currImage);
+		if (bidir)
+		{
+			refPlane1.Load(sample.Y, sample.PitchY);
+		}
+		else
+		{
+			std::swap(refPlane0, srcPlane);
+			srcPlane.Load(sample.Y, sample.PitchY);
+		}
+
+        ioStat += (time_stamp() -ioStart);
+
+        double meStart = time_stamp();
+
+		// Half-pel planes are built once per frame: a backward reference
+		// becomes the source and then the forward reference, and keeps them.
+		if (!refPlane0.IsInterpolated())
+			refPlane0.Interpolate();
+		if (bidir && !refPlane1.IsInterpolated())
+			refPlane1.Interpolate();
+
+		// Results go straight to their place in the output vectors, no read back needed
+		const int frame = bidir ? i - 1 : i;
+		BMotionVector * pMVs = &MVs[frame * mvImageWidth * mvImageHeight];
+		cl_ushort * pSADs = &SADs[frame * mvImageWidth * mvImageHeight];
+		cl_uchar2 * pShapes = &Shapes[frame * mbImageWidth * mbImageHeight];
+		cl_uchar * pDirs = &Dirs[frame * mbImageWidth * mbImageHeight];
+
+		estimator.EstimateFrameBiDir(srcPlane, refPlane0, bidir ? &refPlane1 : NULL, &fwPredMem[0], &bwPredMem[0],
+		                             pMVs, pSADs, pShapes, pDirs);
 
-        std::cout << ">>> Build Log:\n";
-        std::cout << buildLog;
-        std::cout << ">>>End of Build Log\n";
+        meStat += (time_stamp() - meStart);
+
+		if (bidir)
+		{
+			std::swap(refPlane1, srcPlane);
+			std::swap(refPlane0, refPlane1);
+		}
     }
 
-	cl::Kernel kernel(p, "block_skip_check_bidir_intel");
+    double overallStat  = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
+    std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
+    std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/count << " ms\n";
+
+    ReleaseImage(currImage);
+}
+
+
+void ComputeCheckMotionVectorsBiDir( 
+	VmeSession & session, 
+	std::vector<BMotionVector> & searchBMVs, 
+	std::vector<cl_ushort> &skipSADs, 	
+	std::vector<cl_uchar>  &Dirs,
+    const CmdParserMV& cmd,
+	int skp_check_type)
+{
+    cl::Context & context = session.context;
+    cl::CommandQueue & queue = session.queue;
+    cl::Kernel & kernel = session.skipBiDirKernel;
 	
-    int numPics = pCapture->GetNumFrames();
+    int numPics = session.GetNumFrames();
     int width = cmd.width.getValue();
     int height = cmd.height.getValue();
     int mvImageWidth, mvImageHeight;
@@ -1129,10 +1143,6 @@ void ComputeCheckMotionVectorsBiDir(
 	ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight,  mbImageWidth, mbImageHeight);
 				
     // Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage0(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-	 cl::Image2D refImage1(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);    
 	cl::Buffer skipResidualBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(cl_ushort)); 
 
 	skipSADs.resize(numPics * mvImageWidth * mvImageHeight ); 
@@ -1141,24 +1151,12 @@ void ComputeCheckMotionVectorsBiDir(
 	unsigned skipBlockType = (skp_check_type == SKP_CHK_16) ? 0 : 1;
 
 	cl_uint2 *bidirMV = new cl_uint2[ mbImageWidth * mbImageHeight * numComponents];   //packed format
-		
-	cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
 
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-
-    pCapture->GetSample(0, currImage);
-    queue.enqueueWriteImage(refImage0, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-    
-	pCapture->GetSample(1, currImage);
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+	// The skip check inputs change every frame, the buffers are refilled rather than re-created
+	const size_t skipMVSize = mbImageWidth * mbImageHeight * numComponents * sizeof(cl_uint2);
+	const size_t dirSize = mbImageWidth * mbImageHeight * sizeof(cl_uchar);
+	cl::Buffer skipMVBuffer(session.buffers->acquire(VmeSession::SKIP_MV_SLOT, skipMVSize, CL_MEM_READ_ONLY));
+	cl::Buffer DirBuffer(session.buffers->acquire(VmeSession::SKIP_DIR_SLOT, dirSize, CL_MEM_READ_ONLY));
 
     // Process all frames
 	double ioTileStat = 0;
@@ -1171,8 +1169,8 @@ void ComputeCheckMotionVectorsBiDir(
 
     double overallStart  = time_stamp();
 
-	// Frame 0 is already in refImg0, Frame 1 is in srcImage, start with Frame 2
-   	// fw prediction uses refImg0 as reference, bw prediction uses refImg1 as reference
+	// The frames are uploaded again, the motion estimation kept only its last window; Frame i - 1 is checked
+	// with Frame i - 2 (refImg0) as fw reference and Frame i (refImg1) as bw reference
 	// Motion estimates done for Frame1 through FrameNumPics-2, Frame0, FrameNumPics-1 used only for reference
 
     int count = 0;
@@ -1189,23 +1187,20 @@ void ComputeCheckMotionVectorsBiDir(
 
 		cl_uchar* pDirs = (cl_uchar*) &Dirs[(i-1) * mbImageWidth * mbImageHeight];	
 
-		cl::Buffer skipMVBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-			mbImageWidth * mbImageHeight * numComponents * sizeof(cl_uint2), bidirMV, NULL);     	    	
-
-		cl::Buffer DirBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-		mbImageWidth * mbImageHeight * sizeof(cl_uchar), pDirs, NULL);
+		// The host copies stay untouched until the queue.finish() below
+		queue.enqueueWriteBuffer(skipMVBuffer, CL_FALSE, 0, skipMVSize, bidirMV);
+		queue.enqueueWriteBuffer(DirBuffer, CL_FALSE, 0, dirSize, pDirs);
 
         // Load next picture
 
 		double ioStart = time_stamp();
+		double uploadStart = session.uploadTime;
 
-        pCapture->GetSample(i, currImage);
-
-		double ioTileStart = time_stamp();
-		       
-        queue.enqueueWriteImage(refImage1, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+        const cl::Image2D & refImage0 = session.Frame(i - 2);
+        const cl::Image2D & srcImage = session.Frame(i - 1);
+        const cl::Image2D & refImage1 = session.Frame(i);
 
-		ioTileStat += (time_stamp() -ioTileStart);
+		ioTileStat += session.uploadTime - uploadStart;
 
         ioStat += (time_stamp() -ioStart);
 
@@ -1235,9 +1230,6 @@ void ComputeCheckMotionVectorsBiDir(
 		void * pSkipSADs = &skipSADs[(i-1) * mvImageWidth * mvImageHeight]; 
 		queue.enqueueReadBuffer(skipResidualBuffer,CL_TRUE,0,sizeof(cl_ushort) * mvImageWidth * mvImageHeight,pSkipSADs,0,0);		
 
-		std::swap(refImage1, srcImage);
-		std::swap(refImage0, refImage1);
-
         ioStat += (time_stamp() -ioStart);
     }
 
@@ -1248,93 +1240,21 @@ void ComputeCheckMotionVectorsBiDir(
 	std::cout << "Average frame tile I/O time per frame " << 1000*ioTileStat/count << " ms\n";
     std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
     std::cout << "Average Skip Check time per frame is " << 1000*meStat/count << " ms\n";
-   
-    ReleaseImage(currImage);
+    std::cout << "Device buffer allocations " << session.buffers->allocations << " (" << session.buffers->allocated_bytes / 1024 << " KB)\n";
 }
 
 void ComputeCheckMotionVectorsFwd( 
-	Capture * pCapture,
+	VmeSession & session,
 	std::vector<BMotionVector> & searchBMVs, 	
 	std::vector<cl_ushort> &skipSADs, 	
     const CmdParserMV& cmd,
 	int skp_check_type)
 {
-    // OpenCL initialization
-    OpenCLBasic init("Intel", "GPU");
-    //OpenCLBasic creates the platform/context and device for us, so all we need is to get an ownership (via incrementing ref counters with clRetainXXX)
-
-    cl::Context context = cl::Context(init.context); clRetainContext(init.context);
-    cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
-    cl::CommandQueue queue = cl::CommandQueue(init.queue);clRetainCommandQueue(init.queue);
-
-    std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
-    if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
-    {
-        printf("WARNING: The selected device doesn't officially support motion estimation or accelerator extensions!");
-    }
-
-    char* programSource = NULL;
-    
-    // Load the kernel source from the passed in file.
-    if( LoadSourceFromFile( 
-            "vme_ds_bidir.cl",
-            programSource ) )
-    {
-        printf("Error: Couldn't load kernel source from file.\n" );
-    }    
-	  
-    // Create a built-in VME kernel
-    cl_int err = 0;
-    const cl_device_id & d = device();    
-    cl::Program p(
-        clCreateProgramWithSource(
-            context(),
-            1,
-            ( const char** )&programSource,
-            NULL,
-            &err));
-
-    if (err != CL_SUCCESS)
-    {
-        throw cl::Error(err, "Failed creating vme program(s)");
-    }
-
-    err = clBuildProgram(
-            p(), 
-            1, 
-            &d,
-            "",
-            NULL,
-            NULL );
-
-    size_t  buildLogSize = 0;
-    clGetProgramBuildInfo(
-        p(),
-        d,
-        CL_PROGRAM_BUILD_LOG,
-        0,
-        NULL,
-        &buildLogSize );
-
-    cl_char*    buildLog = new cl_char[ buildLogSize ];
-    if( buildLog )
-    {
-        clGetProgramBuildInfo(
-            p(),
-            d,
-            CL_PROGRAM_BUILD_LOG,
-            buildLogSize,
-            buildLog,
-            NULL );
-
-        std::cout << ">>> Build Log:\n";
-        std::cout << buildLog;
-        std::cout << ">>>End of Build Log\n";
-    }
-
-	cl::Kernel kernel(p, "block_skip_check_fwd_intel");
+    cl::Context & context = session.context;
+    cl::CommandQueue & queue = session.queue;
+    cl::Kernel & kernel = session.skipFwdKernel;
 	
-    int numPics = pCapture->GetNumFrames();
+    int numPics = session.GetNumFrames();
     int width = cmd.width.getValue();
     int height = cmd.height.getValue();
     int mvImageWidth, mvImageHeight;
@@ -1343,9 +1263,6 @@ void ComputeCheckMotionVectorsFwd(
 	ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight,  mbImageWidth, mbImageHeight);
 				
     // Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);    
 	cl::Buffer skipResidualBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(cl_ushort)); 
 
     skipSADs.resize(numPics * mvImageWidth * mvImageHeight ); 
@@ -1354,23 +1271,11 @@ void ComputeCheckMotionVectorsFwd(
 	unsigned skipBlockType = (skp_check_type == SKP_CHK_16) ? 0 : 1;
 
 	cl_uint2 *bidirMV = new cl_uint2[ mbImageWidth * mbImageHeight * numComponents];   //packed format
-		
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
 
-    pCapture->GetSample(0, currImage);
-
-    cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-    // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-    
+	// The skip check input changes every frame, the buffer is refilled rather than re-created
+	const size_t skipMVSize = mbImageWidth * mbImageHeight * numComponents * sizeof(cl_uint2);
+	cl::Buffer skipMVBuffer(session.buffers->acquire(VmeSession::SKIP_MV_SLOT, skipMVSize, CL_MEM_READ_ONLY));
+
     // Process all frames
 	double ioTileStat = 0;
     double ioStat = 0; // File i/o
@@ -1382,7 +1287,7 @@ void ComputeCheckMotionVectorsFwd(
 	int count = 0;
 
     double overallStart  = time_stamp();
-    // First frame is already in srcImg, so we start with the second frame
+    // The first frame is only a reference, so we start with the second frame
 	for (int i = 1; i < numPics; i++, count++)
     {		 
 		unsigned offset = mvImageWidth * mvImageHeight;
@@ -1393,24 +1298,18 @@ void ComputeCheckMotionVectorsFwd(
 	 	        bidirMV[j*numComponents + l] =  searchBMVs[i*offset + j*16 + l*4];
 		}
 
-		cl::Buffer skipMVBuffer( 
-			context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-			mbImageWidth * mbImageHeight * numComponents * sizeof(cl_uint2), bidirMV, NULL);     
+		// The host copy stays untouched until the queue.finish() below
+		queue.enqueueWriteBuffer(skipMVBuffer, CL_FALSE, 0, skipMVSize, bidirMV);
 
         // Load next picture
 
 		double ioStart = time_stamp();
+		double uploadStart = session.uploadTime;
 
-        pCapture->GetSample(i, currImage);
-
-        std::swap(refImage, srcImage);
+        const cl::Image2D & refImage = session.Frame(i - 1);
+        const cl::Image2D & srcImage = session.Frame(i);
 
-		double ioTileStart = time_stamp();
-
-        // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-        queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-
-		ioTileStat += (time_stamp() -ioTileStart);
+		ioTileStat += session.uploadTime - uploadStart;
 
         ioStat += (time_stamp() -ioStart);
 
@@ -1447,10 +1346,117 @@ void ComputeCheckMotionVectorsFwd(
 	std::cout << "Average frame tile I/O time per frame " << 1000*ioTileStat/count << " ms\n";
     std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/count << " ms\n";
-   
+    std::cout << "Device buffer allocations " << session.buffers->allocations << " (" << session.buffers->allocated_bytes / 1024 << " KB)\n";
+}
+
+// Host counterpart of ComputeCheckMotionVectorsFwd (bidir = false) and
+// ComputeCheckMotionVectorsBiDir (bidir = true): the skip MVs are gathered the
+// same way and evaluated by the CPU skip checker, one MB row per call.
+void ComputeCheckMotionVectorsCPU( 
+	Capture * pCapture, 
+	std::vector<BMotionVector> & searchBMVs, 
+	std::vector<cl_ushort> &skipSADs, 	
+	std::vector<cl_uchar>  &Dirs,
+    const CmdParserMV& cmd,
+	int skp_check_type,
+	bool bidir)
+{
+    int numPics = pCapture->GetNumFrames();
+    int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
+
+    int mvImageWidth, mvImageHeight;
+	int mbImageWidth, mbImageHeight;
+
+	ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight,  mbImageWidth, mbImageHeight);
+
+	skipSADs.resize(numPics * mvImageWidth * mvImageHeight ); 
+
+	int numComponents = (skp_check_type == SKP_CHK_16) ? 1 : 4;
+	CPUVme::SkipChecker checker(width, height,
+		(skp_check_type == SKP_CHK_16) ? CPUVme::SKIP_BLOCK_16x16 : CPUVme::SKIP_BLOCK_8x8,
+		CPUVme::SAD_ADJUST_MODE_NONE, cmd.threads.getValue());
+
+	std::vector<cl_uint2> bidirMV(mbImageWidth * mbImageHeight * numComponents);   //packed format
+
+	// Host counterparts of refImage0 (forward), srcImage and refImage1 (backward)
+	CPUVme::Plane refPlane0(width, height);
+	CPUVme::Plane srcPlane(width, height);
+	CPUVme::Plane refPlane1(width, height);
+
+    // Bootstrap video sequence reading
+    PlanarImage * currImage = CreatePlanarImage(width, height);
+
+	// The planes load straight from the mapped file when the capture allows it
+	PlanarImage sample = pCapture->ViewSample(0, currImage);
+	if (bidir)
+	{
+		refPlane0.Load(sample.Y, sample.PitchY);
+		sample = pCapture->ViewSample(1, currImage);
+	}
+	srcPlane.Load(sample.Y, sample.PitchY);
+
+    // Process all frames
+    double ioStat = 0;//file i/o
+    double meStat = 0;//skip check itself
+	int count = 0;
+
+    double overallStart  = time_stamp();
+
+	for (int i = bidir ? 2 : 1; i < numPics; i++, count++)
+    {		 
+		const int frame = bidir ? i - 1 : i;
+		unsigned offset = mvImageWidth * mvImageHeight;
+		for( int j = 0; j < mbImageWidth * mbImageHeight; j++ )
+		{			
+			for( int l = 0; l < numComponents; l++ )
+	 	        bidirMV[j*numComponents + l] =  searchBMVs[frame*offset + j*16 + l*4];
+		}
+
+        // Load next picture
+		double ioStart = time_stamp();
+        sample = pCapture->ViewSample(i, currImage);
+		if (bidir)
+		{
+			refPlane1.Load(sample.Y, sample.PitchY);
+		}
+		else
+		{
+			std::swap(refPlane0, srcPlane);
+			srcPlane.Load(sample.Y, sample.PitchY);
+		}
+        ioStat += (time_stamp() -ioStart);
+
+        double meStart = time_stamp();
+
+		if (!refPlane0.IsInterpolated())
+			refPlane0.Interpolate();
+		if (bidir && !refPlane1.IsInterpolated())
+			refPlane1.Interpolate();
+
+		checker.CheckFrame(srcPlane, refPlane0, bidir ? &refPlane1 : NULL, &bidirMV[0],
+		                   bidir ? &Dirs[frame * mbImageWidth * mbImageHeight] : NULL,
+		                   &skipSADs[frame * mvImageWidth * mvImageHeight]);
+
+		meStat += (time_stamp() - meStart);
+
+		if (bidir)
+		{
+			std::swap(refPlane1, srcPlane);
+			std::swap(refPlane0, refPlane1);
+		}
+    }
+
+    double overallStat  = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
+    std::cout << "Average frame file I/O time per frame " << 1000*ioStat/count << " ms\n";
+    std::cout << "Average Skip Check time per frame is " << 1000*meStat/count << " ms\n";
+
     ReleaseImage(currImage);
 }
 
+
 void VerifySkipCheckSAD( 
 	Capture * pCapture, 
 	std::vector<cl_ushort> &searchSADs,
@@ -1797,7 +1803,7 @@ void OverlayMV(Capture * pCapture, int width,int height, std::vector<BMotionVect
         
 	ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
 				       
-	FrameWriter * pWriter = FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+	FrameWriter * pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
     PlanarImage * srcImage = CreatePlanarImage(width, height);
 		        
     unsigned int subBlockSize = ComputeSubBlockSize(CL_ME_MB_TYPE_4x4_INTEL);
@@ -1863,24 +1869,44 @@ int main( int argc, const char** argv )
 		std::vector<cl_uchar>  Dirs;
 
 
+		// One OpenCL session for all GPU stages, holding a window of uploaded frames
+		VmeSession * pSession = cmd.backend_cpu.isSet() ? NULL : new VmeSession(pCapture, width, height);
+
+		if (cmd.backend_cpu.isSet())
+		{
+			MotionEstimationCPU(pCapture, searchMVs, searchSADs, Shapes, Dirs, cmd, skp_check_type, BIDIR_PRED != 0);
+			IntraPredCPU(pCapture, searchMVs, Shapes, Dirs, cmd);  // Intramode prediction for Frame 0 only
+		}
+		else
+		{
 #if BIDIR_PRED
-		MotionEstimationBiDir(pCapture, searchMVs, searchSADs, Shapes, Dirs, cmd,skp_check_type);
+		MotionEstimationBiDir(*pSession, searchMVs, searchSADs, Shapes, Dirs, cmd,skp_check_type);
 #else
-	    MotionEstimationFwd(pCapture, searchMVs, searchSADs, Shapes,Dirs, cmd,skp_check_type);
+	    MotionEstimationFwd(*pSession, searchMVs, searchSADs, Shapes,Dirs, cmd,skp_check_type);
 #endif
 		
-		IntraPred(pCapture, searchMVs, Shapes, Dirs, cmd);  // Intramode prediction for Frame 0 only
+		IntraPred(*pSession, searchMVs, Shapes, Dirs, cmd);  // Intramode prediction for Frame 0 only
+		}
 
 		if(skp_check_type == SKP_CHK_8 || skp_check_type == SKP_CHK_16)  // Do skip check kernel only for partition sizes of 8x8 and 16x16
 		{
+			if (cmd.backend_cpu.isSet())
+			{
+				ComputeCheckMotionVectorsCPU(pCapture, searchMVs, skipSADs, Dirs, cmd, skp_check_type, BIDIR_PRED != 0);
+			}
+			else
+			{
 #if BIDIR_PRED		 
-            ComputeCheckMotionVectorsBiDir(pCapture, searchMVs, skipSADs,Dirs,cmd,skp_check_type);
+            ComputeCheckMotionVectorsBiDir(*pSession, searchMVs, skipSADs,Dirs,cmd,skp_check_type);
 #else
-	        ComputeCheckMotionVectorsFwd(pCapture, searchMVs, skipSADs,cmd,skp_check_type);
+	        ComputeCheckMotionVectorsFwd(*pSession, searchMVs, skipSADs,cmd,skp_check_type);
 #endif
+			}
 		    VerifySkipCheckSAD(pCapture,searchSADs, skipSADs,cmd,skp_check_type);		
 		}
 
+		delete pSession;
+
 		OverlayMV(pCapture,width,height, searchMVs,Shapes, Dirs,cmd);
 
 		Capture::Release(pCapture);
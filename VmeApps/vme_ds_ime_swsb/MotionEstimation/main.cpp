@@ -194,25 +194,25 @@ public:
         out_to_bmp(*this,       'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is off", true, "nobmp"),
         help(*this,             'h',"help","","Show this help text and exit."),
 #if USE_HD
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","BasketballDrive_1920x1080_30.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","BasketballDrive_1920x1080_30.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","BasketballDrive_1920x1080_30_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1920),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 1080),
         frames(*this,           30, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 30)
 #elif USE_SD_1280_720
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","goal_1280x720.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","goal_1280x720.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","goal_1280x720_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1280),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 720),
         frames(*this,           5, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 5)
 #elif USE_SD_720_576
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","iceage_720_576_491frames.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","iceage_720_576_491frames.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","iceage_720_576_491frames_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 720),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 576),
         frames(*this,           50, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 50)
 #else
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","boat_qcif_176x144.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","boat_qcif_176x144.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","boat_qcif_176x144_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 176),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 144),
@@ -227,6 +227,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -334,9 +347,8 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // Create a built-in VME kernel
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d,"-cl-std=CL2.0", NULL, NULL );
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "-cl-std=CL2.0", &err));
 
     if (err != CL_SUCCESS) {
         size_t  buildLogSize = 0;
@@ -405,6 +417,12 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
     queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
 
+    // The scoreboard is reset on the device every frame, so one buffer serves
+    // the whole sequence
+    OpenCLBufferPool buffers(init.context);
+    cl::Buffer scoreboardBuffer(buffers.acquire(0, mbImageWidth * mbImageHeight * sizeof(cl_int)));
+    void * pScoreboard = &Scoreboard[0];
+
     // First frame is already in srcImg, so we start with the second frame
     double time = 0;
     vector<double> tpf(numPics);
@@ -418,12 +436,6 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
         queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
 
-        void * pScoreboard = &Scoreboard[0];
-
-        cl::Buffer scoreboardBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-            mbImageWidth * mbImageHeight * sizeof(cl_int), pScoreboard, NULL);
-
         // Reset the Scoreboard buffer
         initialize.setArg(0, scoreboardBuffer);
         initialize.setArg(1, sizeof(int), &mbImageWidth);
@@ -466,6 +478,7 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         }
     }
     std::cout << "Total CL Time is " << time / (double)10e6 << " ms\n";
+    std::cout << "Device buffer allocations " << buffers.allocations << " (" << buffers.allocated_bytes / 1024 << " KB)\n";
     
     ReleaseImage(currImage);
 }
@@ -669,7 +682,7 @@ int main( int argc, const char** argv )
         ExtractMotionVectorsFullFrameWithOpenCL(pCapture, MVs, Residuals, Shapes, cmd);
 
         // Generate sequence with overlaid motion vectors
-        FrameWriter * pWriter = FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+        FrameWriter * pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
         PlanarImage * srcImage = CreatePlanarImage(width, height);
 
         int mvImageWidth, mvImageHeight;
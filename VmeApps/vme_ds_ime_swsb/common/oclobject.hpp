@@ -28,6 +28,7 @@
 #define _INTEL_OPENCL_SAMPLE_OCLOBJECT_HPP_
 
 #include <CL/cl.h>
+#include <CL/cl.hpp>
 #include <string>
 #include <vector>
 
@@ -71,6 +72,24 @@ cl_program createAndBuildProgram (
     const string& build_options
 );
 
+// Same as createAndBuildProgram for a single device, but goes through an
+// on-disk cache of program binaries. A cache entry is keyed by the device name,
+// device and driver versions, build options and a hash of the program text.
+// On a hit the program is created with clCreateProgramWithBinary; on a miss or
+// when the runtime rejects the stored binary, it is built from source and the
+// new binary is stored. The cache is opt-in: entries live in the directory
+// named by the OCL_PROGRAM_CACHE_DIR environment variable, and the program is
+// always built from source when it is unset or empty.
+// Unlike createAndBuildProgram it doesn't throw: the build status is returned
+// in errcode_ret and the program is kept, so the caller can query the build log.
+cl_program buildProgramWithCache (
+    cl_context context,
+    cl_device_id device,
+    const char* program_text,
+    const string& build_options,
+    cl_int* errcode_ret
+);
+
 // Helper structure to initialize and hold basic OpenCL objects.
 // Contains platform, device, context and queue.
 // Platfrom and device are selected by given attributes (see the constructor);
@@ -198,6 +217,52 @@ OpenCLDeviceAndHostMemory<T>::~OpenCLDeviceAndHostMemory ()
 }
 
 
+// Helper structure to keep the device buffers of a frame loop alive for
+// the whole sequence, instead of creating and releasing them every frame.
+// Buffers are addressed by a caller-defined slot index. A slot is allocated
+// on its first request and re-allocated only when a larger size is requested,
+// so a loop that asks for the sequence's maximum size allocates once and then
+// refills the buffers with clEnqueueWriteBuffer.
+// The pool keeps its own reference to every buffer, so a slot outlives the
+// cl::Buffer objects handed out for it.
+struct OpenCLBufferPool
+{
+    // Number of buffers created by the pool and their total size in bytes.
+    // A frame loop that allocates per frame shows up as allocations growing
+    // with the frame count.
+    size_t allocations;
+    size_t allocated_bytes;
+
+    OpenCLBufferPool (cl_context context);
+
+    ~OpenCLBufferPool ();
+
+    // Returns the buffer of the slot, at least size bytes large, already
+    // retained for the caller. The flags must not contain host pointer flags,
+    // the pool never creates a buffer over host memory.
+    cl::Buffer acquire (size_t slot, size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE);
+
+private:
+
+    struct Entry
+    {
+        cl_mem buffer;
+        size_t size;
+        cl_mem_flags flags;
+    };
+
+    // Replaces the buffer of the entry with a new one of the given size and flags.
+    void reallocate (Entry& entry, size_t size, cl_mem_flags flags);
+
+    cl_context context;
+    std::vector<Entry> entries;
+
+    // Disable copying and assignment to avoid incorrect resource deallocation.
+    OpenCLBufferPool (const OpenCLBufferPool&);
+    OpenCLBufferPool& operator= (const OpenCLBufferPool&);
+};
+
+
 // Parse textual representation of device type as cl_device_type enum.
 // Supported formats for textual representation:
 //   - CL_DEVICE_TYPE_ALL: "all", "ALL", "CL_DEVICE_TYPE_ALL" or empty string ""
@@ -217,25 +217,25 @@ public:
         out_to_bmp(*this,       'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is off", true, "nobmp"),
         help(*this,             'h',"help","","Show this help text and exit."),
 #if USE_HD_1920_1080
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","BasketballDrive_1920x1080_30.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","BasketballDrive_1920x1080_30.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","BasketballDrive_1920x1080_30_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1920),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 1080),
         frames(*this,           30, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 30)
 #elif USE_SD_1280_720
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","goal_1280x720.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","goal_1280x720.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","goal_1280x720_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1280),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 720),
         frames(*this,           50, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 5)
 #elif USE_SD_720_576
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","iceage_720_576_50.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","iceage_720_576_50.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","iceage_720_576_50_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 720),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 576),
         frames(*this,           50, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 50)
 #else
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","foreman_cif_352x288_100.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","foreman_cif_352x288_100.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","foreman_cif_352x288_100_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 352),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 288),
@@ -250,6 +250,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -311,6 +324,11 @@ void PerformPerMBVMEWithScoreboarding(
     cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
     cl::CommandQueue queue = cl::CommandQueue(init.queue);clRetainCommandQueue(init.queue);
 
+    // Buffers whose contents change every frame are allocated once per sequence
+    // and refilled, instead of being re-created in the frame loops
+    OpenCLBufferPool buffers(init.context);
+    enum { TIER1_PRED_SLOT, PRED_SLOT };
+
     std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
 
     if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
@@ -326,9 +344,8 @@ void PerformPerMBVMEWithScoreboarding(
 
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d,"-cl-std=CL2.0", NULL, NULL );
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "-cl-std=CL2.0", &err));
 
     if (err != CL_SUCCESS) {
         size_t  buildLogSize = 0;
@@ -424,10 +441,8 @@ void PerformPerMBVMEWithScoreboarding(
         time += tpf[i];
         queue.finish();
        
-        cl::Buffer predBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-            mvImageWidth * mvImageHeight * sizeof(MotionVector), 
-            &predMVs[0] + mvImageWidth * mvImageHeight * i, NULL);
+        // The tier 1 search only writes the predictors, there is nothing to upload
+        cl::Buffer predBuffer(buffers.acquire(TIER1_PRED_SLOT, mvImageWidth * mvImageHeight * sizeof(MotionVector)));
 
         tier1vme.setArg(0, src4xImage);
         tier1vme.setArg(1, ref4xImage);
@@ -492,10 +507,10 @@ void PerformPerMBVMEWithScoreboarding(
         kernel.setArg(argIndex++, srcImage);
         kernel.setArg(argIndex++, refImage[0]);
 
-        cl::Buffer predBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-            mbImageWidth * mbImageHeight * sizeof(MotionVector), 
-            &predMVs[0] + mbImageWidth * mbImageHeight * i, NULL);
+        cl::Buffer predBuffer(buffers.acquire(PRED_SLOT, mbImageWidth * mbImageHeight * sizeof(MotionVector)));
+        queue.enqueueWriteBuffer(
+            predBuffer, CL_FALSE, 0, mbImageWidth * mbImageHeight * sizeof(MotionVector), 
+            &predMVs[0] + mbImageWidth * mbImageHeight * i);
         kernel.setArg(argIndex++, predBuffer);
 
         kernel.setArg(argIndex++, mvBuffer);
@@ -522,6 +537,7 @@ void PerformPerMBVMEWithScoreboarding(
         std::cout << "CL Time for Frame " << i << " is " << tpf[i] / (double)10e6 << " ms\n";       
     }
     std::cout << "Total CL Time is " << time / (double)10e6 << " ms\n";
+    std::cout << "Device buffer allocations " << buffers.allocations << " (" << buffers.allocated_bytes / 1024 << " KB)\n";
     
     ReleaseImage(currImage);
 }
@@ -887,7 +903,7 @@ int main( int argc, const char** argv )
 
         // Generate sequence with overlaid motion vectors
         FrameWriter * pWriter = 
-            FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
+            FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
         PlanarImage * srcImage = CreatePlanarImage(width, height);
 
         int mvImageWidth, mvImageHeight;
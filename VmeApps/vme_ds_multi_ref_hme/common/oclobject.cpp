@@ -19,13 +19,26 @@
 // problem reports or change requests be submitted to it directly
 
 
+// Same cl.hpp configuration as the sample, the pool hands out cl::Buffer objects
+#define __CL_ENABLE_EXCEPTIONS
+
 #include <iostream>
 #include <vector>
 #include <cassert>
 #include <stdexcept>
 #include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
 #include <CL/cl.h>
 
+#ifdef __linux__
+#include <unistd.h>
+#elif defined(_WIN32) || defined(WIN32)
+#include <process.h>
+#endif
+
 #include "oclobject.hpp"
 #include "basic.hpp"
 
@@ -472,6 +485,241 @@ void readProgramFile (const string& program_file_name, vector<char>& program_tex
 }
 
 
+namespace
+{
+
+// Reads a string parameter of the device, empty string if the query fails.
+string deviceInfoString (cl_device_id device, cl_device_info param_name)
+{
+    size_t size = 0;
+    if(clGetDeviceInfo(device, param_name, 0, 0, &size) != CL_SUCCESS || size == 0)
+    {
+        return string();
+    }
+
+    vector<char> value(size);
+    if(clGetDeviceInfo(device, param_name, size, &value[0], 0) != CL_SUCCESS)
+    {
+        return string();
+    }
+
+    return string(&value[0]);
+}
+
+// 64-bit FNV-1a, good enough to tell program texts and cache keys apart.
+cl_ulong hashBytes (const char* data, size_t size)
+{
+    cl_ulong hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string hashToHex (cl_ulong hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    string hex(16, '0');
+    for(int i = 15; i >= 0; --i, hash >>= 4)
+    {
+        hex[i] = digits[hash & 0xF];
+    }
+    return hex;
+}
+
+// Everything the built binary depends on. The whole key is stored in the
+// cache file and compared on load, the file name only uses its hash.
+string programCacheKey (
+    cl_device_id device,
+    const char* program_text,
+    const string& build_options
+)
+{
+    return
+        "device: " + deviceInfoString(device, CL_DEVICE_NAME) + "\n"
+        "device version: " + deviceInfoString(device, CL_DEVICE_VERSION) + "\n"
+        "driver version: " + deviceInfoString(device, CL_DRIVER_VERSION) + "\n"
+        "build options: " + build_options + "\n"
+        "source: " + hashToHex(hashBytes(program_text, strlen(program_text))) + "\n";
+}
+
+// Returns the cache file for the key, empty string when the cache is disabled.
+// The cache is only used when OCL_PROGRAM_CACHE_DIR names a directory.
+string programCacheFile (const string& key)
+{
+    const char* dir = getenv("OCL_PROGRAM_CACHE_DIR");
+    string path = dir ? dir : "";
+    if(path.empty())
+    {
+        return path;
+    }
+
+    if(path[path.size() - 1] != '/' && path[path.size() - 1] != '\\')
+    {
+        path += '/';
+    }
+
+    return path + "ocl_program_" + hashToHex(hashBytes(key.data(), key.size())) + ".bin";
+}
+
+// Loads the binary stored for the key, false if there is no such entry.
+bool loadProgramBinary (
+    const string& file_name,
+    const string& key,
+    vector<unsigned char>& binary
+)
+{
+    using namespace std;
+
+    ifstream file(file_name.c_str(), ios_base::ate | ios_base::binary);
+    if(!file)
+    {
+        return false;
+    }
+
+    streamoff file_length = file.tellg();
+    if(file_length <= static_cast<streamoff>(key.size() + 1))
+    {
+        return false;
+    }
+
+    // The key and its terminating zero come first, the binary follows
+    vector<char> stored_key(key.size() + 1);
+    file.seekg(0, ios_base::beg);
+    file.read(&stored_key[0], stored_key.size());
+    if(!file || stored_key.back() != 0 || key.compare(0, key.size(), &stored_key[0], key.size()) != 0)
+    {
+        return false;
+    }
+
+    binary.resize(static_cast<size_t>(file_length) - stored_key.size());
+    file.read(reinterpret_cast<char*>(&binary[0]), binary.size());
+
+    return bool(file);
+}
+
+// Identifies the running process in temporary file names.
+unsigned long currentProcessId ()
+{
+#ifdef __linux__
+    return static_cast<unsigned long>(getpid());
+#elif defined(_WIN32) || defined(WIN32)
+    return static_cast<unsigned long>(_getpid());
+#else
+    return 0;
+#endif
+}
+
+// Stores the binary of a program built for a single device.
+// Writes a temporary file first, so that concurrent runs never see
+// a partially written entry.
+void storeProgramBinary (
+    const string& file_name,
+    const string& key,
+    cl_program program
+)
+{
+    using namespace std;
+
+    size_t binary_size = 0;
+    cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, 0);
+    if(err != CL_SUCCESS || binary_size == 0)
+    {
+        return;
+    }
+
+    vector<unsigned char> binary(binary_size);
+    unsigned char* binary_ptr = &binary[0];
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary_ptr), &binary_ptr, 0);
+    if(err != CL_SUCCESS)
+    {
+        return;
+    }
+
+    // The process id keeps runs sharing the cache directory from writing the same temporary file
+    string temp_name =
+        file_name + "." + to_str(currentProcessId()) + "." + to_str(time(0)) + "." + to_str(clock()) + ".tmp";
+    {
+        ofstream file(temp_name.c_str(), ios_base::binary | ios_base::trunc);
+        file.write(key.c_str(), key.size() + 1);
+        file.write(reinterpret_cast<const char*>(binary_ptr), binary_size);
+        if(!file)
+        {
+            cerr << "[ WARNING ] Unable to store program binary in " << inquotes(file_name) << "\n";
+            file.close();
+            remove(temp_name.c_str());
+            return;
+        }
+    }
+
+    remove(file_name.c_str());
+    if(rename(temp_name.c_str(), file_name.c_str()) != 0)
+    {
+        remove(temp_name.c_str());
+    }
+}
+
+}
+
+
+cl_program buildProgramWithCache (
+    cl_context context,
+    cl_device_id device,
+    const char* program_text,
+    const string& build_options,
+    cl_int* errcode_ret
+)
+{
+    string key = programCacheKey(device, program_text, build_options);
+    string file_name = programCacheFile(key);
+
+    vector<unsigned char> binary;
+    if(!file_name.empty() && loadProgramBinary(file_name, key, binary))
+    {
+        const unsigned char* binary_ptr = &binary[0];
+        size_t binary_size = binary.size();
+        cl_int binary_status = CL_SUCCESS;
+        cl_int err = CL_SUCCESS;
+
+        cl_program program = clCreateProgramWithBinary(
+            context, 1, &device, &binary_size, &binary_ptr, &binary_status, &err
+        );
+
+        if(err == CL_SUCCESS && binary_status == CL_SUCCESS)
+        {
+            err = clBuildProgram(program, 1, &device, build_options.c_str(), 0, 0);
+            if(err == CL_SUCCESS)
+            {
+                *errcode_ret = CL_SUCCESS;
+                return program;
+            }
+        }
+
+        // The runtime rejected the stored binary, rebuild it from source
+        if(program)
+        {
+            clReleaseProgram(program);
+        }
+    }
+
+    cl_program program = clCreateProgramWithSource(context, 1, &program_text, 0, errcode_ret);
+    if(*errcode_ret != CL_SUCCESS)
+    {
+        return program;
+    }
+
+    *errcode_ret = clBuildProgram(program, 1, &device, build_options.c_str(), 0, 0);
+    if(*errcode_ret == CL_SUCCESS && !file_name.empty())
+    {
+        storeProgramBinary(file_name, key, program);
+    }
+
+    return program;
+}
+
+
 cl_program createAndBuildProgram (
     const std::vector<char>& program_text_prepared,
     cl_context context,
@@ -483,11 +731,25 @@ cl_program createAndBuildProgram (
     // Create OpenCL program and build it
     const char* raw_text = &program_text_prepared[0];
     cl_int err;
-    // TODO Using prepared length and not terminating by 0 is better way?
-    cl_program program = clCreateProgramWithSource(context, 1, &raw_text, 0, &err);
-    SAMPLE_CHECK_ERRORS(err);
+    cl_program program = 0;
+
+    if(num_of_devices == 1)
+    {
+        // The binary cache only handles programs built for one device
+        program = buildProgramWithCache(context, devices[0], raw_text, build_options, &err);
+        if(!program)
+        {
+            SAMPLE_CHECK_ERRORS(err);
+        }
+    }
+    else
+    {
+        // TODO Using prepared length and not terminating by 0 is better way?
+        program = clCreateProgramWithSource(context, 1, &raw_text, 0, &err);
+        SAMPLE_CHECK_ERRORS(err);
 
-    err = clBuildProgram(program, (cl_uint)num_of_devices, devices, build_options.c_str(), 0, 0);
+        err = clBuildProgram(program, (cl_uint)num_of_devices, devices, build_options.c_str(), 0, 0);
+    }
 
     if(err == CL_BUILD_PROGRAM_FAILURE)
     {
@@ -602,6 +864,82 @@ OpenCLProgramOneKernel::~OpenCLProgramOneKernel ()
 }
 
 
+OpenCLBufferPool::OpenCLBufferPool (cl_context context) :
+    allocations(0),
+    allocated_bytes(0),
+    context(context)
+{
+    cl_int err = clRetainContext(context);
+    SAMPLE_CHECK_ERRORS(err);
+}
+
+
+OpenCLBufferPool::~OpenCLBufferPool ()
+{
+    try
+    {
+        for(size_t i = 0; i < entries.size(); ++i)
+        {
+            if(entries[i].buffer)
+            {
+                cl_int err = clReleaseMemObject(entries[i].buffer);
+                SAMPLE_CHECK_ERRORS(err);
+            }
+        }
+
+        cl_int err = clReleaseContext(context);
+        SAMPLE_CHECK_ERRORS(err);
+    }
+    catch(...)
+    {
+        destructorException();
+    }
+}
+
+
+cl::Buffer OpenCLBufferPool::acquire (size_t slot, size_t size, cl_mem_flags flags)
+{
+    assert(!(flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)));
+
+    if(slot >= entries.size())
+    {
+        Entry empty = { 0, 0, 0 };
+        entries.resize(slot + 1, empty);
+    }
+
+    Entry& entry = entries[slot];
+    if(!entry.buffer || entry.size < size || entry.flags != flags)
+    {
+        reallocate(entry, size, flags);
+    }
+
+    // cl::Buffer takes over the reference it is constructed from
+    cl_int err = clRetainMemObject(entry.buffer);
+    SAMPLE_CHECK_ERRORS(err);
+    return cl::Buffer(entry.buffer);
+}
+
+
+void OpenCLBufferPool::reallocate (Entry& entry, size_t size, cl_mem_flags flags)
+{
+    if(entry.buffer)
+    {
+        cl_int err = clReleaseMemObject(entry.buffer);
+        SAMPLE_CHECK_ERRORS(err);
+        entry.buffer = 0;
+    }
+
+    cl_int err = 0;
+    entry.buffer = clCreateBuffer(context, flags, size, NULL, &err);
+    SAMPLE_CHECK_ERRORS(err);
+    entry.size = size;
+    entry.flags = flags;
+
+    ++allocations;
+    allocated_bytes += size;
+}
+
+
 cl_device_type parseDeviceType (const string& device_type_name)
 {
     cl_device_type  device_type = 0;
@@ -54,7 +54,13 @@ typedef unsigned long long uint_fast64_t;
 #endif
 #endif
 
+#include <climits>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #include "utils.h"
 
 namespace YUVUtils
@@ -79,31 +85,132 @@ namespace YUVUtils
     class Capture
     {
     public:
-        static Capture * CreateFileCapture(const std::string & fn, int width, int height, int frames);
+        // Field order recorded in the input, unknown for raw files
+        enum FieldOrder
+        {
+            FIELD_ORDER_UNKNOWN,
+            FIELD_ORDER_PROGRESSIVE,
+            FIELD_ORDER_TOP_FIRST,
+            FIELD_ORDER_BOTTOM_FIRST,
+            FIELD_ORDER_MIXED
+        };
+
+        // Opens a raw YV12 file, or a YUV4MPEG2 (.y4m) file, whose header gives
+        // the frame size instead of width and height. "-" (stdin), a named pipe
+        // or a character device is read sequentially instead, see StreamCapture.
+        // Frames that left its window can't be read again, so only callers that
+        // go through the sequence once opt in with allowStream; the others get
+        // an exception before doing any work. Without a frame count a stream's
+        // length is only known at the end, such callers run until TryGetSample
+        // returns false.
+        static Capture * CreateFileCapture(const std::string & fn, int width, int height, int frames, bool allowStream = false);
+        // Frame size in the header of fn, for inputs that have one (.y4m).
+        // Returns false for raw files and streams, which need it given.
+        static bool ReadFileGeometry(const std::string & fn, int & width, int & height);
         static void Release(Capture * cap);
 
         virtual ~Capture() {}
         virtual void GetSample(int frameNum, PlanarImage * im) = 0;
 
+        // Reads frame frameNum like GetSample, but returns false instead of
+        // throwing past the end of the input, which is how the end of an
+        // unbounded stream is found.
+        virtual bool TryGetSample(int frameNum, PlanarImage * im)
+        {
+            if (frameNum >= m_numFrames)
+            {
+                return false;
+            }
+            GetSample(frameNum, im);
+            return true;
+        }
+
+        // Returns frame frameNum without copying it where the capture can: the
+        // planes then point into read-only memory of the capture, which stays
+        // valid until the capture is released. Otherwise, or when im has a padded
+        // pitch, the frame is read into im and *im is returned.
+        virtual PlanarImage ViewSample(int frameNum, PlanarImage * im) { GetSample(frameNum, im); return *im; }
+
         int GetWidth() const { return m_width; }
         int GetHeight() const { return m_height; }
+        FieldOrder GetFieldOrder() const { return m_fieldOrder; }
+        // kUnboundedFrames for a stream of unknown length
         int GetNumFrames() const { return m_numFrames; }
 
+        static const int kUnboundedFrames = INT_MAX;
+
     protected:
-        Capture() : m_width(0), m_height(0), m_numFrames(0) {};
+        Capture() : m_width(0), m_height(0), m_numFrames(0), m_fieldOrder(FIELD_ORDER_UNKNOWN) {};
 
         int m_width;
         int m_height;
         int m_numFrames;
+        FieldOrder m_fieldOrder;
 
     private:
         Capture(const Capture&);
     };
 
+    // Capture decorator reading the frames of another capture on a background
+    // thread, into a ring of ringSize images allocated up front. The reader
+    // stays up to ahead frames in front of the consumer and never overwrites a
+    // frame that is still acquired, so there is no allocation per frame.
+    // Frames are acquired and released in order; acquiring any other frame
+    // restarts the read-ahead there, which needs every frame released first.
+    class PrefetchCapture : public Capture
+    {
+    public:
+        // The source stays owned by the caller and has to outlive the prefetcher
+        PrefetchCapture(Capture * source, int ringSize = 4, int ahead = 3);
+        virtual ~PrefetchCapture();
+
+        // Blocks until frame frameNum is read and returns its image, which the
+        // caller may use (and draw on) until it releases the frame. Returns NULL
+        // past the end of a stream.
+        PlanarImage * Acquire(int frameNum);
+        void Release(int frameNum);
+
+        // Copies the frame out of the ring, through Acquire/Release
+        virtual void GetSample(int frameNum, PlanarImage * im);
+        virtual bool TryGetSample(int frameNum, PlanarImage * im);
+
+        // Seconds the consumer was blocked in Acquire, and seconds the reader
+        // thread spent reading frames from the source
+        double GetWaitTime() const;
+        double GetReadTime() const;
+
+    private:
+        void ReadLoop();
+
+        Capture * m_source;
+        std::vector<PlanarImage *> m_ring;
+        int m_ahead;
+        int m_next;             // next frame to acquire
+        int m_released;         // frames before this one are released
+        int m_read;             // next frame the reader fills
+        int m_end;              // frames in the source, known at the end of a stream
+        unsigned m_generation;  // bumped on a restart, drops the read in progress
+        bool m_stop;
+        std::exception_ptr m_error;     // thrown by the source on the reader thread
+        double m_waitTime;
+        double m_readTime;
+
+        mutable std::mutex m_mutex;
+        std::condition_variable m_readerCond;   // a slot or the ahead window opened up
+        std::condition_variable m_frameCond;    // a frame was read
+        std::thread m_reader;
+    };
+
     class FrameWriter
     {
     public:
+        // Keeps the appended frames in memory until WriteToFile, fine for short clips
         static FrameWriter * CreateFrameWriter(int width, int height, int frameNumHint = 0, bool bFormatBMPHint = false);
+        // Opens fn right away and writes the frames on a background thread as
+        // they are appended, queueDepth chunks of a few MB at most in memory.
+        // WriteToFile(fn) waits for the last frames and closes the file.
+        // Either writer writes YUV4MPEG2 to a file name ending in .y4m.
+        static FrameWriter * CreateStreamingFrameWriter(const std::string & fn, int width, int height, int queueDepth = 3);
         static void Release(FrameWriter * cap);
 
         virtual void AppendFrame(PlanarImage * im) = 0;
@@ -39,6 +39,8 @@
 #include "yuv_utils.h"
 #include "cmdparser.hpp"
 #include "oclobject.hpp"
+#include "cpu_vme.hpp"
+#include "result_sink.hpp"
 
 #ifdef __linux
 void fopen_s(FILE **f, const char *name, const char *mode) {
@@ -208,6 +210,21 @@ class CmdParserMV : public CmdParser
 public:
     CmdOption<bool>                 out_to_bmp;
     CmdOption<bool>                 help;
+    CmdOption<std::string>          backend;
+    CmdEnum<std::string>            backend_gpu;
+    CmdEnum<std::string>            backend_cpu;
+    CmdOption<int>                  early_exit;
+    CmdOption<std::string>          search;
+    CmdEnum<std::string>            search_exhaustive;
+    CmdEnum<std::string>            search_predictive;
+    CmdOption<int>                  search_stop;
+    CmdOption<std::string>          hme;
+    CmdEnum<std::string>            hme_gpu;
+    CmdEnum<std::string>            hme_cpu;
+    CmdOption<int>                  hme_levels;
+    CmdOption<int>                  threads;
+    CmdOption<std::string>          cost_table;
+    CmdOption<std::string>          results;
     CmdOption<std::string>          fileName;
     CmdOption<std::string>          overlayFileName;
     CmdOption<int>                  width;
@@ -218,26 +235,41 @@ public:
     CmdParser(argc, argv),
         out_to_bmp(*this,       'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is off", true, "nobmp"),
         help(*this,             'h',"help","","Show this help text and exit."),
+        backend(*this,          0,"backend","string","Motion search: VME with software scoreboarding on an Intel GPU or the host CPU (implies --hme cpu)","gpu"),
+        backend_gpu(backend,    "gpu"),
+        backend_cpu(backend,    "cpu"),
+        early_exit(*this,       0,"early_exit","<integer>","Distortion plus MV cost at which the cpu search skips the remaining reference frames of a MB -- 0 searches all of them",0),
+        search(*this,           0,"search","string","Integer search of the cpu backend: the whole window around every predictor, or the predictors refined by diamond steps","exhaustive"),
+        search_exhaustive(search, "exhaustive"),
+        search_predictive(search, "predictive"),
+        search_stop(*this,      0,"search_stop","<integer>","Distortion plus MV cost of a 16x16 match at which the predictive search of a MB stops -- higher is faster and less accurate, 0 never stops early",0),
+        hme(*this,              0,"hme","string","Predictor search: 4x downsampled VME on an Intel GPU or a hierarchical search on the host CPU","gpu"),
+        hme_gpu(hme,            "gpu"),
+        hme_cpu(hme,            "cpu"),
+        hme_levels(*this,       0,"hme_levels","<integer>","Number of 4:1 pyramid levels of the cpu predictor search, full resolution included -- 3 searches 16x, 4x and 1x",3),
+        threads(*this,          0,"threads","<integer>","Number of worker threads for the cpu searches -- 0 uses all hardware threads",0),
+        cost_table(*this,       0,"cost_table","string","Packed motion vector cost table of the cpu backend as its two 32-bit words s0,s1 -- by default an approximation of the kernel's high penalty table, the gpu backend of ime_mv_extract prints the device's tables",""),
+        results(*this,          0,"results","string","Comma-separated consumers of the per-frame results: overlay (output sequence), text (intra.txt, intra_dists.txt, inter_best_dists.txt and inter_dists.txt) or null","overlay,text"),
 #if USE_HD_1920_1080
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","BasketballDrive_1920x1080_30.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","BasketballDrive_1920x1080_30.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","BasketballDrive_1920x1080_30_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1920),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 1080),
         frames(*this,           30, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 30)
 #elif USE_SD_1280_720
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","wings_1280_720_100.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","wings_1280_720_100.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","wings_1280_720_100_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 1280),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 720),
         frames(*this,           50, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 50)
 #elif USE_SD_720_576
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","iceage_720_576_50.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","iceage_720_576_50.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","iceage_720_576_50_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 720),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 576),
         frames(*this,           50, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 50)
 #else
-        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv file format)","foreman_cif_352x288_100.yuv"),
+        fileName(*this,         0,"input", "string", "Input video sequence filename (.yuv or .y4m file format)","foreman_cif_352x288_100.yuv"),
         overlayFileName(*this,  0,"output","string", "Output video sequence with overlaid motion vectors filename ","foreman_cif_352x288_100_output.yuv"),
         width(*this,            0, "width", "<integer>", "Frame width for the input file", 352),
         height(*this,           0, "height","<integer>", "Frame height for the input file", 288),
@@ -252,6 +284,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -327,12 +372,63 @@ inline unsigned int ComputeSubBlockSize( cl_uint nMBType )
     }
 }
 
+// Host counterpart of downsample4x and tier1_block_motion_estimate_intel:
+// a coarse to fine search over pyramids of cmd.hme_levels 4:1 box filtered
+// levels (16x, 4x and 1x by default) gives one predictor per MB of every
+// frame, at the place block_motion_estimate_intel reads it from. A coarser
+// top level tracks faster motion: +/- 256 pixels with 3 levels.
+void ComputePredictorsCPU(Capture * pCapture, std::vector<MotionVector> & predMVs, const CmdParserMV& cmd)
+{
+    const int numPics = pCapture->GetNumFrames();
+
+    int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
+
+    int mvImageWidth, mvImageHeight;
+    int mbImageWidth, mbImageHeight;
+
+    ComputeNumMVs(
+        CL_ME_MB_TYPE_4x4_INTEL, width, height, 
+        mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
+
+    MotionVector zeroVector = { 0, 0 };
+    predMVs.resize(mbImageWidth * mbImageHeight * numPics, zeroVector);
+
+    CPUVme::HierarchicalDesc desc;
+    desc.numLevels = cmd.hme_levels.getValue();
+    CPUVme::HierarchicalEstimator estimator(width, height, desc, cmd.threads.getValue());
+
+    CPUVme::Pyramid srcPyramid(width, height, desc);
+    CPUVme::Pyramid refPyramid(width, height, desc);
+
+    PlanarImage * currImage = CreatePlanarImage(width, height);
+
+    pCapture->GetSample(0, currImage);
+    srcPyramid.Load(currImage->Y, currImage->PitchY);
+
+    double time = 0;
+
+    for (int i = 1; i < numPics; i++)
+    {
+        std::swap(refPyramid, srcPyramid);
+        pCapture->GetSample(i, currImage);
+
+        double start = time_stamp();
+        srcPyramid.Load(currImage->Y, currImage->PitchY);
+        estimator.EstimateFrame(srcPyramid, refPyramid, &predMVs[0] + mbImageWidth * mbImageHeight * i);
+        double tpf = time_stamp() - start;
+        time += tpf;
+
+        std::cout << "HME Time for Frame " << i << " is " << 1000 * tpf << " ms\n";
+    }
+
+    std::cout << "Total HME Time is " << 1000 * time << " ms\n";
+
+    ReleaseImage(currImage);
+}
+
 void PerformPerMBVMEWithScoreboarding( 
-    Capture * pCapture, 
-    std::vector<MotionVector> & MVs, std::vector<cl_ushort> & Residuals, std::vector<cl_ushort> & BestResiduals,
-    std::vector<cl_uchar2> & Shapes, std::vector<cl_uint> & ReferenceIds, 
-    std::vector<cl_uchar> & IntraShapes, std::vector<cl_ushort> & IntraResiduals, std::vector<cl_ulong> & IntraModes,
-    const CmdParserMV& cmd)
+    Capture * pCapture, ResultDispatcher & results, const CmdParserMV& cmd)
 {
     // OpenCL initialization
 
@@ -341,6 +437,11 @@ void PerformPerMBVMEWithScoreboarding(
     cl::Device device  = cl::Device(init.device);   clRetainDevice(init.device);
     cl::CommandQueue queue = cl::CommandQueue(init.queue);clRetainCommandQueue(init.queue);
 
+    // Buffers whose contents change every frame are allocated once per sequence
+    // and refilled, instead of being re-created in the frame loops
+    OpenCLBufferPool buffers(init.context);
+    enum { TIER1_PRED_SLOT, PRED_SLOT, SCOREBOARD_SLOT };
+
     std::string ext = device.getInfo< CL_DEVICE_EXTENSIONS >();
 
     if (string::npos == ext.find("cl_intel_device_side_avc_motion_estimation"))
@@ -356,9 +457,8 @@ void PerformPerMBVMEWithScoreboarding(
 
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d,"-cl-std=CL2.0", NULL, NULL );
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "-cl-std=CL2.0", &err));
 
     if (err != CL_SUCCESS) {
         size_t  buildLogSize = 0;
@@ -380,33 +480,8 @@ void PerformPerMBVMEWithScoreboarding(
     int mvImageWidth, mvImageHeight;
     int mbImageWidth, mbImageHeight;
 
-    ComputeNumMVs(
-        CL_ME_MB_TYPE_4x4_INTEL, DIV(width,4), DIV(height,4), 
-        mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
-
-    std::vector<MotionVector> predMVs;
-    MotionVector zeroVector = { 0, 0 };
-    predMVs.resize(mvImageWidth * mvImageHeight * numPics, zeroVector);
-
-    //--------- Full frame VME on 4x downsampled frame to get initial predictors --------
-
-    cl::Kernel downsample(p, "downsample4x");
-    cl::Kernel tier1vme(p, "tier1_block_motion_estimate_intel");
-    
-    // Set up OpenCL surfaces
-    
     cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
 
-    cl::Image2D inImage(
-        context, CL_MEM_READ_ONLY, imageFormat, 
-        width, height, 0, 0);
-    cl::Image2D src4xImage(
-        context, CL_MEM_READ_WRITE, imageFormat, 
-        DIV(width, 4), DIV(height, 4), 0, 0);
-    cl::Image2D ref4xImage(
-        context, CL_MEM_READ_WRITE, imageFormat, 
-        DIV(width, 4), DIV(height, 4), 0, 0);        
-
     // Bootstrap video sequence reading
     
     PlanarImage * currImage = CreatePlanarImage(width, height);   
@@ -418,68 +493,102 @@ void PerformPerMBVMEWithScoreboarding(
 
     double time = 0;
     vector<double> tpf(numPics);
-    cl::Event evt;
 
-    pCapture->GetSample(0, currImage);
-    queue.enqueueWriteImage(inImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+    std::vector<MotionVector> predMVs;
+
+    if (cmd.hme_cpu.isSet())
+    {
+        //--------- Hierarchical search on the host to get initial predictors --------
 
-    // Perform down sample on the first frame.
+        ComputePredictorsCPU(pCapture, predMVs, cmd);
+    }
+    else
+    {
+        //--------- Full frame VME on 4x downsampled frame to get initial predictors --------
 
-    downsample.setArg(0, inImage);
-    downsample.setArg(1, src4xImage);    
-    queue.enqueueNDRangeKernel(
-        downsample, cl::NullRange, 
-        cl::NDRange(PAD(DIV(width, 4), 16), DIV(height, 16)), cl::NDRange(16, 1, 1), 
-        NULL, &evt);
-    evt.wait(); 
-    tpf[0] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-    time += tpf[0];
-    queue.finish();
+        ComputeNumMVs(
+            CL_ME_MB_TYPE_4x4_INTEL, DIV(width,4), DIV(height,4), 
+            mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
 
-    // Perform down sample on the remaining frames and perform full frame VME.
+        MotionVector zeroVector = { 0, 0 };
+        predMVs.resize(mvImageWidth * mvImageHeight * numPics, zeroVector);
 
-    for (int i = 1; i < numPics; i++)
-    {
-        std::swap(ref4xImage, src4xImage);
-        pCapture->GetSample(i, currImage);
+        cl::Kernel downsample(p, "downsample4x");
+        cl::Kernel tier1vme(p, "tier1_block_motion_estimate_intel");
+
+        // Set up OpenCL surfaces
+
+        cl::Image2D inImage(
+            context, CL_MEM_READ_ONLY, imageFormat, 
+            width, height, 0, 0);
+        cl::Image2D src4xImage(
+            context, CL_MEM_READ_WRITE, imageFormat, 
+            DIV(width, 4), DIV(height, 4), 0, 0);
+        cl::Image2D ref4xImage(
+            context, CL_MEM_READ_WRITE, imageFormat, 
+            DIV(width, 4), DIV(height, 4), 0, 0);        
+
+        cl::Event evt;
+
+        pCapture->GetSample(0, currImage);
         queue.enqueueWriteImage(inImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+
+        // Perform down sample on the first frame.
+
         downsample.setArg(0, inImage);
-        downsample.setArg(1, src4xImage);
+        downsample.setArg(1, src4xImage);    
         queue.enqueueNDRangeKernel(
             downsample, cl::NullRange, 
             cl::NDRange(PAD(DIV(width, 4), 16), DIV(height, 16)), cl::NDRange(16, 1, 1), 
             NULL, &evt);
         evt.wait(); 
-        tpf[i] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-        time += tpf[i];
-        queue.finish();
-       
-        cl::Buffer predBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-            mvImageWidth * mvImageHeight * sizeof(MotionVector), 
-            &predMVs[0] + mvImageWidth * mvImageHeight * i, NULL);
-
-        tier1vme.setArg(0, src4xImage);
-        tier1vme.setArg(1, ref4xImage);
-        tier1vme.setArg(2, predBuffer);
-        cl::Event evt;
-        queue.enqueueNDRangeKernel(
-            tier1vme, cl::NullRange, 
-            cl::NDRange(PAD(DIV(width, 4), 16), mbImageHeight, 1), cl::NDRange(16, 1, 1), 
-            NULL, &evt);
-        evt.wait(); 
-        tpf[i] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-        time += tpf[i];
+        tpf[0] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+        time += tpf[0];
         queue.finish();
 
-        // Read back results (in a sync way)
-        void * pPredMVs = &predMVs[i * mvImageWidth * mvImageHeight];
-        queue.enqueueReadBuffer(predBuffer, CL_TRUE, 0, sizeof(MotionVector) * mvImageWidth * mvImageHeight, pPredMVs, 0, 0);
+        // Perform down sample on the remaining frames and perform full frame VME.
 
-        std::cout << "VME Down4x Time for Frame " << i << " is " << tpf[i] / (double)10e6 << " ms\n";
-    }
+        for (int i = 1; i < numPics; i++)
+        {
+            std::swap(ref4xImage, src4xImage);
+            pCapture->GetSample(i, currImage);
+            queue.enqueueWriteImage(inImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+            downsample.setArg(0, inImage);
+            downsample.setArg(1, src4xImage);
+            queue.enqueueNDRangeKernel(
+                downsample, cl::NullRange, 
+                cl::NDRange(PAD(DIV(width, 4), 16), DIV(height, 16)), cl::NDRange(16, 1, 1), 
+                NULL, &evt);
+            evt.wait(); 
+            tpf[i] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            time += tpf[i];
+            queue.finish();
+
+            // The tier 1 search only writes the predictors, there is nothing to upload
+            cl::Buffer predBuffer(buffers.acquire(TIER1_PRED_SLOT, mvImageWidth * mvImageHeight * sizeof(MotionVector)));
+
+            tier1vme.setArg(0, src4xImage);
+            tier1vme.setArg(1, ref4xImage);
+            tier1vme.setArg(2, predBuffer);
+            cl::Event evt;
+            queue.enqueueNDRangeKernel(
+                tier1vme, cl::NullRange, 
+                cl::NDRange(PAD(DIV(width, 4), 16), mbImageHeight, 1), cl::NDRange(16, 1, 1), 
+                NULL, &evt);
+            evt.wait(); 
+            tpf[i] += evt.getProfilingInfo<CL_PROFILING_COMMAND_END>() - evt.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            time += tpf[i];
+            queue.finish();
+
+            // Read back results (in a sync way)
+            void * pPredMVs = &predMVs[i * mvImageWidth * mvImageHeight];
+            queue.enqueueReadBuffer(predBuffer, CL_TRUE, 0, sizeof(MotionVector) * mvImageWidth * mvImageHeight, pPredMVs, 0, 0);
+
+            std::cout << "VME Down4x Time for Frame " << i << " is " << tpf[i] / (double)10e6 << " ms\n";
+        }
 
-    std::cout << "Total VME Down4x Time is " << time / (double)10e6 << " ms\n";
+        std::cout << "Total VME Down4x Time is " << time / (double)10e6 << " ms\n";
+    }
 
     //-------- VME using scoreboarding on the original frames using computed predictors ----------
 
@@ -492,16 +601,6 @@ void PerformPerMBVMEWithScoreboarding(
 
     std::vector<cl_int> Scoreboard;
     Scoreboard.resize(mbImageWidth * mbImageHeight);
-    
-    MVs.resize(numPics * mvImageWidth * mvImageHeight);
-    Residuals.resize(numPics * mvImageWidth * mvImageHeight, 0xFFFF);
-    BestResiduals.resize(numPics * mbImageWidth * mbImageHeight, 0xFFFF);
-    Shapes.resize(numPics * mbImageWidth * mbImageHeight);
-    ReferenceIds.resize(numPics * mbImageWidth * mbImageHeight, 0xFFFFFFFF);
-
-    IntraShapes.resize(numPics * mbImageWidth * mbImageHeight, 0xFF);
-    IntraResiduals.resize(numPics * mbImageWidth * mbImageHeight, 0xFFFF);
-    IntraModes.resize(numPics * mbImageWidth * mbImageHeight, 0xFFFFFFFFFFFFFFFF);
 
     // Set up OpenCL surfaces
     
@@ -592,9 +691,8 @@ void PerformPerMBVMEWithScoreboarding(
 
         void * pScoreboard = &Scoreboard[0];
 
-        cl::Buffer scoreboardBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-            mbImageWidth * mbImageHeight * sizeof(cl_int), pScoreboard, NULL);
+        // The scoreboard is reset on the device, there is nothing to upload
+        cl::Buffer scoreboardBuffer(buffers.acquire(SCOREBOARD_SLOT, mbImageWidth * mbImageHeight * sizeof(cl_int)));
 
         // Reset the Scoreboard buffer
         initialize.setArg(0, scoreboardBuffer);
@@ -633,10 +731,10 @@ void PerformPerMBVMEWithScoreboarding(
         // Convey the count of the available reference frames.
         kernel.setArg(argIndex++, num_avail_refs);
 
-        cl::Buffer predBuffer(
-            context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, 
-            mbImageWidth * mbImageHeight * sizeof(MotionVector), 
-            &predMVs[0] + mbImageWidth * mbImageHeight * i, NULL);
+        cl::Buffer predBuffer(buffers.acquire(PRED_SLOT, mbImageWidth * mbImageHeight * sizeof(MotionVector)));
+        queue.enqueueWriteBuffer(
+            predBuffer, CL_FALSE, 0, mbImageWidth * mbImageHeight * sizeof(MotionVector), 
+            &predMVs[0] + mbImageWidth * mbImageHeight * i);
         kernel.setArg(argIndex++, predBuffer);
 
         kernel.setArg(argIndex++, mvBuffer);
@@ -661,16 +759,17 @@ void PerformPerMBVMEWithScoreboarding(
         time += tpf[i];
         queue.finish();
         
-        // Read back results (in a sync way)
-        void * pMVs = &MVs[i * mvImageWidth * mvImageHeight];
-        void * pResiduals = &Residuals[i * mvImageWidth * mvImageHeight];
-        void * pBestResiduals = &BestResiduals[i * mbImageWidth * mbImageHeight];
-        void * pShapes = &Shapes[i * mbImageWidth * mbImageHeight];
-        void * pReferenceIds = &ReferenceIds[i * mbImageWidth * mbImageHeight];
-
-        void * pIntraShapes = &IntraShapes[i * mbImageWidth * mbImageHeight];
-        void * pIntraResiduals = &IntraResiduals[i * mbImageWidth * mbImageHeight];
-        void * pIntraModes = &IntraModes[i * mbImageWidth * mbImageHeight];
+        // Read back results (in a sync way) into the slot of the frame in the result window
+        MotionResults & slot = results.Begin(i);
+        void * pMVs = &slot.MVs[0];
+        void * pResiduals = &slot.Residuals[0];
+        void * pBestResiduals = &slot.BestResiduals[0];
+        void * pShapes = &slot.Shapes[0];
+        void * pReferenceIds = &slot.ReferenceIds[0];
+
+        void * pIntraShapes = &slot.IntraShapes[0];
+        void * pIntraResiduals = &slot.IntraResiduals[0];
+        void * pIntraModes = &slot.IntraModes[0];
 
         queue.enqueueReadBuffer(mvBuffer,CL_TRUE,0,sizeof(MotionVector) * mvImageWidth * mvImageHeight,pMVs,0,0);
         queue.enqueueReadBuffer(residualBuffer,CL_TRUE,0,sizeof(cl_ushort) * mvImageWidth * mvImageHeight,pResiduals,0,0);
@@ -707,12 +806,146 @@ void PerformPerMBVMEWithScoreboarding(
                 throw std::runtime_error("Error detected in software scorebaording");
             }
         }
+
+        // currImage is on the device already, the sinks may draw on it
+        results.Publish(i, currImage);
     }
+    results.Finish();
     std::cout << "Total CL Time is " << time / (double)10e6 << " ms\n";
+    std::cout << "Device buffer allocations " << buffers.allocations << " (" << buffers.allocated_bytes / 1024 << " KB)\n";
     
     ReleaseImage(currImage);
 }
 
+// Host counterpart of PerformPerMBVMEWithScoreboarding, with the same outputs:
+// every frame is searched in up to NUM_MAX_REFS previous frames, closest first,
+// around (0, 0), the hierarchical predictor, the vectors of the left, top
+// and top-left MBs and the co-located vector of the previous frame with the
+// high penalty cost table (--search predictive only tries these vectors and
+// refines the best one by diamond steps), and the reference giving
+// the cheapest partition is kept per partition (one reference per 8x8
+// quadrant). As with the kernel, MBs run in scoreboard order: each one starts
+// as soon as its three neighbors are done. The intra search does not cost the
+// predicted modes.
+void PerformPerMBVMECPU( 
+    Capture * pCapture, ResultDispatcher & results, const CmdParserMV& cmd)
+{
+    const int numPics = pCapture->GetNumFrames();
+
+    int width = cmd.width.getValue();
+    int height = cmd.height.getValue();
+
+    int mvImageWidth, mvImageHeight;
+    int mbImageWidth, mbImageHeight;
+
+    std::vector<MotionVector> predMVs;
+    ComputePredictorsCPU(pCapture, predMVs, cmd);
+
+    ComputeNumMVs(
+        CL_ME_MB_TYPE_4x4_INTEL, width, height, 
+        mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
+
+    CPUVme::SearchDesc desc;
+    desc.costTable = cmd.cost_table.getValue().empty()
+        ? CPUVme::GetCostTable(CPUVme::COST_PENALTY_HIGH)
+        : CPUVme::ParseCostTable(cmd.cost_table.getValue());
+    desc.earlyExitDistortion = cmd.early_exit.getValue();
+    desc.neighborPredictors = true;
+    if (cmd.search_predictive.isSet())
+    {
+        desc.searchMode = CPUVme::SEARCH_MODE_PREDICTIVE;
+        desc.predictiveStopDistortion = cmd.search_stop.getValue();
+    }
+    CPUVme::MotionEstimator estimator(width, height, desc, cmd.threads.getValue());
+    CPUVme::IntraEstimator intraEstimator(
+        width, height, CPUVme::kIntraPartitionMaskAll, CPUVme::SAD_ADJUST_MODE_NONE, cmd.threads.getValue());
+
+    std::vector<cl_char> modes(mbImageWidth * mbImageHeight * CPUVme::kIntraModesPerMB);
+
+    // The source plane and the interpolated reference planes, closest reference first
+    std::vector<CPUVme::Plane> planes;
+    planes.reserve(NUM_MAX_REFS + 1);
+    planes.push_back(CPUVme::Plane(width, height));
+    CPUVme::Plane * srcPlane = &planes[0];
+    std::vector<CPUVme::Plane *> refPlanes;
+
+    PlanarImage * currImage = CreatePlanarImage(width, height);
+
+    double time = 0;
+
+    for (int i = 0; i < numPics; i++)
+    {
+        pCapture->GetSample(i, currImage);
+
+        double start = time_stamp();
+        srcPlane->Load(currImage->Y, currImage->PitchY);
+
+        // The previous frame is still in the window, its vectors are predictors
+        MotionResults & slot = results.Begin(i);
+        slot.Clear();
+        estimator.EstimateFrameMultiRef(
+            *srcPlane, refPlanes.empty() ? NULL : &refPlanes[0], (int)refPlanes.size(), 
+            &predMVs[i * mbImageWidth * mbImageHeight], 
+            &slot.MVs[0], 
+            &slot.Residuals[0], 
+            &slot.BestResiduals[0], 
+            &slot.Shapes[0], 
+            &slot.ReferenceIds[0],
+            i > 0 ? &results.Window().Get(i - 1).MVs[0] : NULL);
+
+        intraEstimator.EstimateFrame(
+            *srcPlane, NULL, NULL, &modes[0], 
+            &slot.IntraResiduals[0], 
+            &slot.IntraShapes[0]);
+
+        // Pack the modes as the kernel does: one nibble per 4x4 block in the
+        // sub-block order, larger blocks replicate their mode over their 4x4 blocks
+        for (int mb = 0; mb < mbImageWidth * mbImageHeight; mb++)
+        {
+            const cl_char * mbModes = &modes[mb * CPUVme::kIntraModesPerMB];
+            cl_ulong packed = 0;
+            for (int b = 0; b < 16; b++)
+            {
+                cl_ulong mode;
+                switch (slot.IntraShapes[mb])
+                {
+                case CPUVme::INTRA_SHAPE_16x16: mode = mbModes[0]; break;
+                case CPUVme::INTRA_SHAPE_8x8:   mode = mbModes[1 + b / 4]; break;
+                default:                        mode = mbModes[5 + b]; break;
+                }
+                packed |= mode << (4 * b);
+            }
+            slot.IntraModes[mb] = packed;
+        }
+
+        // Reuse the plane of the farthest reference once NUM_MAX_REFS are held
+        srcPlane->Interpolate();
+        refPlanes.insert(refPlanes.begin(), srcPlane);
+        if ((int)refPlanes.size() > NUM_MAX_REFS)
+        {
+            srcPlane = refPlanes.back();
+            refPlanes.pop_back();
+        }
+        else
+        {
+            planes.push_back(CPUVme::Plane(width, height));
+            srcPlane = &planes.back();
+        }
+
+        double tpf = time_stamp() - start;
+        time += tpf;
+
+        std::cout << "CPU Time for Frame " << i << " is " << 1000 * tpf << " ms\n";
+
+        // srcPlane holds its own copy of the frame, so the sinks may draw on currImage
+        results.Publish(i, currImage);
+    }
+    results.Finish();
+    std::cout << "Total CPU Time is " << 1000 * time << " ms\n";
+
+    ReleaseImage(currImage);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Overlay routines
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -841,22 +1074,18 @@ cl_short4 GetColor(cl_uchar4& pReferenceIds, cl_uint part)
     return color;
 }
 
-void OverlayVectors(unsigned int subBlockSize, std::vector<MotionVector>& MVs,
-                    std::vector<cl_uchar2>& InterShapes, std::vector<cl_uchar>& IntraShapes,
-                    std::vector<cl_uint>& ReferenceIds, 
-                    std::vector<cl_ushort>& InterResiduals, std::vector<cl_ushort>& IntraResiduals,
-                    PlanarImage* srcImage,
-                    int frame, int width, int height) {
+void OverlayVectors(unsigned int subBlockSize, const MotionResults& results,
+                    PlanarImage* srcImage, int width, int height) {
   int mvImageWidth, mvImageHeight;
   int mbImageWidth, mbImageHeight;
   ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight,
                 mbImageWidth, mbImageHeight);
-  MotionVector* pMV = &MVs[frame * mvImageWidth * mvImageHeight];
-  cl_uchar2* pInterShapes = &InterShapes[frame * mbImageWidth * mbImageHeight];
-  cl_uchar* pIntraShapes = &IntraShapes[frame * mbImageWidth * mbImageHeight];
-  cl_uchar4* pReferenceIds = ( cl_uchar4* ) &ReferenceIds[frame * mbImageWidth * mbImageHeight];
-  cl_ushort* pInterResiduals = &InterResiduals[frame * mbImageWidth * mbImageHeight];
-  cl_ushort* pIntraResiduals = &IntraResiduals[frame * mbImageWidth * mbImageHeight];
+  const MotionVector* pMV = &results.MVs[0];
+  const cl_uchar2* pInterShapes = &results.Shapes[0];
+  const cl_uchar* pIntraShapes = &results.IntraShapes[0];
+  cl_uchar4* pReferenceIds = ( cl_uchar4* ) &results.ReferenceIds[0];
+  const cl_ushort* pInterResiduals = &results.BestResiduals[0];
+  const cl_ushort* pIntraResiduals = &results.IntraResiduals[0];
 
 #define OFF(P) (P + 2) >> 2
   for (int i = 0; i < mbImageHeight; i++) {
@@ -1041,17 +1270,14 @@ void OverlayVectors(unsigned int subBlockSize, std::vector<MotionVector>& MVs,
 }
 
 
-void PrintIntraModes( std::vector<cl_ulong>& intraModes, std::vector<cl_uchar>& intraShapes, int width, int height )
+void PrintIntraModes( std::ofstream& file, const MotionResults& results, unsigned pic, int width )
 {
-	std::ofstream file;
-    file.open("intra.txt");
-    unsigned numMBs = DIV(width, 16) * DIV(height, 16);
+    const std::vector<cl_ulong>& intraModes = results.IntraModes;
+    const std::vector<cl_uchar>& intraShapes = results.IntraShapes;
     for (unsigned i = 0; i < intraModes.size(); i++)
     {
-        unsigned pic = i / numMBs;
-        unsigned mb = i % numMBs;
-        unsigned mb_x = mb % DIV(width, 16);
-        unsigned mb_y = mb / DIV(width, 16);
+        unsigned mb_x = i % DIV(width, 16);
+        unsigned mb_y = i / DIV(width, 16);
         
         file << "pic=" << pic << " mb=(" << mb_x << "," << mb_y << "): ";
 
@@ -1079,38 +1305,26 @@ void PrintIntraModes( std::vector<cl_ulong>& intraModes, std::vector<cl_uchar>&
 
         file << std::endl;
     }
-    file.close();
 }
 
-void PrintIntraDists( std::vector<cl_ushort>& intraDists, int width, int height )
+void PrintIntraDists( std::ofstream& file, const std::vector<cl_ushort>& intraDists, unsigned pic, int width )
 {
-	std::ofstream file;
-    file.open("intra_dists.txt");
-    unsigned numMBs = DIV(width, 16) * DIV(height, 16);
     for (unsigned i = 0; i < intraDists.size(); i++)
     {
-        unsigned pic = i / numMBs;
-        unsigned mb = i % numMBs;
-        unsigned mb_x = mb % DIV(width, 16);
-        unsigned mb_y = mb / DIV(width, 16);
+        unsigned mb_x = i % DIV(width, 16);
+        unsigned mb_y = i / DIV(width, 16);
         file << "pic=" << pic << " mb=(" << mb_x << "," << mb_y << "): ";
         file << unsigned(intraDists[i]);
         file << std::endl;
     }
-    file.close();
 }
 
-void PrintInterDists( std::vector<cl_ushort>& interDists, int width, int height )
+void PrintInterDists( std::ofstream& file, const std::vector<cl_ushort>& interDists, unsigned pic, int width )
 {
-	std::ofstream file;
-    file.open("inter_dists.txt");
-    unsigned numMBs = DIV(width, 16) * DIV(height, 16);
     for (unsigned i = 0; i < interDists.size() / 16; i++)
     {
-        unsigned pic = i / numMBs;
-        unsigned mb = i % numMBs;
-        unsigned mb_x = mb % DIV(width, 16);
-        unsigned mb_y = mb / DIV(width, 16);
+        unsigned mb_x = i % DIV(width, 16);
+        unsigned mb_y = i / DIV(width, 16);
         
         file << "pic=" << pic << " mb=(" << mb_x << "," << mb_y << "): ";
 
@@ -1121,27 +1335,81 @@ void PrintInterDists( std::vector<cl_ushort>& interDists, int width, int height
 
         file << std::endl;
     }
-    file.close();
 }
 
-void PrintInterBestDists( std::vector<cl_ushort>& interDists, int width, int height )
+void PrintInterBestDists( std::ofstream& file, const std::vector<cl_ushort>& interDists, unsigned pic, int width )
 {
-	std::ofstream file;
-    file.open("inter_best_dists.txt");
-    unsigned numMBs = DIV(width, 16) * DIV(height, 16);
     for (unsigned i = 0; i < interDists.size(); i++)
     {
-        unsigned pic = i / numMBs;
-        unsigned mb = i % numMBs;
-        unsigned mb_x = mb % DIV(width, 16);
-        unsigned mb_y = mb / DIV(width, 16);
+        unsigned mb_x = i % DIV(width, 16);
+        unsigned mb_y = i / DIV(width, 16);
         file << "pic=" << pic << " mb=(" << mb_x << "," << mb_y << "): ";
         file << unsigned(interDists[i]);
         file << std::endl;
     }
-    file.close();
 }
 
+// Appends the intra modes and the intra, best inter and inter distortions of
+// every frame to intra.txt, intra_dists.txt, inter_best_dists.txt and inter_dists.txt
+class TextSink : public ResultSink
+{
+public:
+    TextSink(int width) : m_width(width)
+    {
+        m_intraModes.open("intra.txt");
+        m_intraDists.open("intra_dists.txt");
+        m_interBestDists.open("inter_best_dists.txt");
+        m_interDists.open("inter_dists.txt");
+    }
+
+    virtual void Consume(const ResultWindow & window, int i, PlanarImage *)
+    {
+        const MotionResults & results = window.Get(i);
+        PrintIntraModes( m_intraModes, results, i, m_width );
+        PrintIntraDists( m_intraDists, results.IntraResiduals, i, m_width );
+        PrintInterBestDists( m_interBestDists, results.BestResiduals, i, m_width );
+        PrintInterDists( m_interDists, results.Residuals, i, m_width );
+    }
+
+    virtual void Finish()
+    {
+        m_intraModes.close();
+        m_intraDists.close();
+        m_interBestDists.close();
+        m_interDists.close();
+    }
+
+private:
+    int m_width;
+    std::ofstream m_intraModes;
+    std::ofstream m_intraDists;
+    std::ofstream m_interBestDists;
+    std::ofstream m_interDists;
+};
+
+// Draws the vectors, partitions and intra blocks on the frame and appends it to the output sequence
+class OverlaySink : public ResultSink
+{
+public:
+    OverlaySink(FrameWriter * pWriter, int width, int height) :
+        m_pWriter(pWriter), m_width(width), m_height(height),
+        m_subBlockSize(ComputeSubBlockSize(CL_ME_MB_TYPE_4x4_INTEL))
+    {
+    }
+
+    virtual void Consume(const ResultWindow & window, int i, PlanarImage * image)
+    {
+        OverlayVectors(m_subBlockSize, window.Get(i), image, m_width, m_height);
+        m_pWriter->AppendFrame(image);
+    }
+
+private:
+    FrameWriter * m_pWriter;
+    int m_width;
+    int m_height;
+    unsigned int m_subBlockSize;
+};
+
 int main( int argc, const char** argv )
 {
     try
@@ -1165,58 +1433,64 @@ int main( int argc, const char** argv )
             throw std::runtime_error("Failed opening video input sequence...");
         }
 
-        // Process sequence
-        std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
-        
-        std::vector<MotionVector> MVs;
-        std::vector<cl_ushort> Residuals;
-        std::vector<cl_ushort> BestResiduals;
-        std::vector<cl_uchar2> Shapes;
-        std::vector<cl_uint> ReferenceIds;
-
-        std::vector<cl_uchar> IntraShapes;
-        std::vector<cl_ushort> IntraResiduals; 
-        std::vector<cl_ulong> IntraModes;        
-
-        PerformPerMBVMEWithScoreboarding(
-            pCapture, MVs, Residuals, BestResiduals, Shapes, ReferenceIds, 
-            IntraShapes, IntraResiduals, IntraModes,
-            cmd);
-
-        PrintIntraModes( IntraModes, IntraShapes, width, height );
-		PrintIntraDists( IntraResiduals, width, height );
-        PrintInterBestDists( BestResiduals, width, height );
-        PrintInterDists( Residuals, width, height );
-
-        // Generate sequence with overlaid motion vectors
-        FrameWriter * pWriter = 
-            FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
-        PlanarImage * srcImage = CreatePlanarImage(width, height);
-
         int mvImageWidth, mvImageHeight;
         int mbImageWidth, mbImageHeight;
         ComputeNumMVs(CL_ME_MB_TYPE_4x4_INTEL, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);       
 
-        unsigned int subBlockSize = ComputeSubBlockSize(CL_ME_MB_TYPE_4x4_INTEL);
-        for (int k = 0; k < pCapture->GetNumFrames(); k++)
+        // Consumers of the per-frame results, in the order they see a frame
+        FrameWriter * pWriter = NULL;
+        std::vector<ResultSink *> sinks;
+        std::stringstream names(cmd.results.getValue());
+        std::string name;
+        while (std::getline(names, name, ','))
         {
-            pCapture->GetSample(k, srcImage);
+            if (name == "overlay")
             {
-                OverlayVectors(
-                    subBlockSize, MVs, 
-                    Shapes, IntraShapes, 
-                    ReferenceIds, 
-                    BestResiduals, IntraResiduals,
-                    srcImage, k, width, height);
+                // Generate sequence with overlaid motion vectors
+                pWriter = 
+                    FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
+                sinks.push_back(new OverlaySink(pWriter, width, height));
+            }
+            else if (name == "text")
+            {
+                sinks.push_back(new TextSink(width));
+            }
+            else if (name == "null")
+            {
+                sinks.push_back(new NullSink());
+            }
+            else
+            {
+                throw std::runtime_error("Unknown result consumer " + name);
             }
-            pWriter->AppendFrame(srcImage);
         }
-        std::cout << "Writing " << pCapture->GetNumFrames() << " frames to " << cmd.overlayFileName.getValue() << "..." << std::endl;
-        pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
 
-        FrameWriter::Release(pWriter);
+        // Process sequence, only the frames the backend and the sinks still need are kept
+        std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
+
+        if (cmd.backend_cpu.isSet())
+        {
+            // The cpu search reads the vectors of the previous frame
+            ResultDispatcher results(sinks, mvImageWidth * mvImageHeight, mbImageWidth * mbImageHeight, 2);
+            PerformPerMBVMECPU(pCapture, results, cmd);
+        }
+        else
+        {
+            ResultDispatcher results(sinks, mvImageWidth * mvImageHeight, mbImageWidth * mbImageHeight, 1);
+            PerformPerMBVMEWithScoreboarding(pCapture, results, cmd);
+        }
+
+        if (pWriter)
+        {
+            std::cout << "Writing " << pCapture->GetNumFrames() << " frames to " << cmd.overlayFileName.getValue() << "..." << std::endl;
+            pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
+            FrameWriter::Release(pWriter);
+        }
+        for (size_t s = 0; s < sinks.size(); s++)
+        {
+            delete sinks[s];
+        }
         Capture::Release(pCapture);
-        ReleaseImage(srcImage);
     }
     catch (cl::Error & err)
     {
@@ -0,0 +1,2734 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+#include "cpu_vme.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include <smmintrin.h>
+#include <immintrin.h>
+
+#ifdef __GNUC__
+#define CPU_VME_TARGET_AVX2 __attribute__((target("avx2")))
+#define CPU_VME_ALIGN(n) __attribute__((aligned(n)))
+#else
+#define CPU_VME_TARGET_AVX2
+#define CPU_VME_ALIGN(n) __declspec(align(n))
+#endif
+
+namespace CPUVme
+{
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // SIMD kernels
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Computes 16x16 SADs of one source MB against count horizontally consecutive
+    // reference positions starting at ref.
+    typedef void (*SadRowFn)(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out);
+
+    static void SadRow16x16_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out)
+    {
+        __m128i s[16];
+        for (int y = 0; y < 16; ++y)
+        {
+            s[y] = _mm_load_si128((const __m128i *)(src + y * srcPitch));
+        }
+
+        for (int x = 0; x < count; ++x)
+        {
+            const uint8_t * r = ref + x;
+            __m128i acc = _mm_setzero_si128();
+            for (int y = 0; y < 16; ++y)
+            {
+                acc = _mm_add_epi32(acc, _mm_sad_epu8(s[y], _mm_loadu_si128((const __m128i *)(r + y * refPitch))));
+            }
+            out[x] = _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+        }
+    }
+
+    // Two candidate positions per iteration: position x in the low lane,
+    // position x + 1 in the high lane, against the source row broadcast to both.
+    CPU_VME_TARGET_AVX2
+    static void SadRow16x16_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, int count, uint32_t * out)
+    {
+        int x = 0;
+        for (; x + 1 < count; x += 2)
+        {
+            const uint8_t * r = ref + x;
+            __m256i acc = _mm256_setzero_si256();
+            for (int y = 0; y < 16; ++y)
+            {
+                __m256i s = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(src + y * srcPitch)));
+                __m256i rr = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(r + y * refPitch))),
+                    _mm_loadu_si128((const __m128i *)(r + y * refPitch + 1)), 1);
+                acc = _mm256_add_epi32(acc, _mm256_sad_epu8(s, rr));
+            }
+            out[x]     = _mm256_extract_epi32(acc, 0) + _mm256_extract_epi32(acc, 2);
+            out[x + 1] = _mm256_extract_epi32(acc, 4) + _mm256_extract_epi32(acc, 6);
+        }
+        if (x < count)
+        {
+            SadRow16x16_SSE41(src, srcPitch, ref + x, refPitch, 1, out + x);
+        }
+    }
+
+    static bool HasAVX2()
+    {
+#ifdef __GNUC__
+        return __builtin_cpu_supports("avx2") != 0;
+#else
+        return false;
+#endif
+    }
+
+    static SadRowFn SelectSadRow()
+    {
+        return HasAVX2() ? SadRow16x16_AVX2 : SadRow16x16_SSE41;
+    }
+
+    // 2:1 box filter of 16 output samples, (a + b + c + d + 2) >> 2, from 32
+    // samples of two consecutive rows. pmaddubsw adds the horizontal pairs.
+    static inline __m128i BoxFilter2x2_U8(const uint8_t * pRow0, const uint8_t * pRow1)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        const __m128i two = _mm_set1_epi16(2);
+        __m128i lo = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)pRow0), ones),
+                                   _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)pRow1), ones));
+        __m128i hi = _mm_add_epi16(_mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)(pRow0 + 16)), ones),
+                                   _mm_maddubs_epi16(_mm_loadu_si128((const __m128i *)(pRow1 + 16)), ones));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        return _mm_packus_epi16(lo, hi);
+    }
+
+    // H.264 6-tap filter (1, -5, 20, 20, -5, 1) on eight 16 bit lanes, unscaled.
+    static inline __m128i Tap6_16(__m128i a, __m128i b, __m128i c, __m128i d, __m128i e, __m128i f)
+    {
+        const __m128i sum05 = _mm_add_epi16(a, f);
+        const __m128i sum14 = _mm_add_epi16(b, e);
+        const __m128i sum23 = _mm_add_epi16(c, d);
+        return _mm_add_epi16(_mm_sub_epi16(sum05, _mm_mullo_epi16(sum14, _mm_set1_epi16(5))),
+                             _mm_mullo_epi16(sum23, _mm_set1_epi16(20)));
+    }
+
+    // Filters 16 consecutive pixels whose six taps start at p[0], p[step], ...
+    // Returns the unscaled sums in lo (pixels 0..7) and hi (pixels 8..15).
+    static inline void Tap6_U8(const uint8_t * p, int step, __m128i & lo, __m128i & hi)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        __m128i v[6];
+        for (int i = 0; i < 6; ++i)
+        {
+            v[i] = _mm_loadu_si128((const __m128i *)(p + i * step));
+        }
+        lo = Tap6_16(_mm_unpacklo_epi8(v[0], zero), _mm_unpacklo_epi8(v[1], zero), _mm_unpacklo_epi8(v[2], zero),
+                     _mm_unpacklo_epi8(v[3], zero), _mm_unpacklo_epi8(v[4], zero), _mm_unpacklo_epi8(v[5], zero));
+        hi = Tap6_16(_mm_unpackhi_epi8(v[0], zero), _mm_unpackhi_epi8(v[1], zero), _mm_unpackhi_epi8(v[2], zero),
+                     _mm_unpackhi_epi8(v[3], zero), _mm_unpackhi_epi8(v[4], zero), _mm_unpackhi_epi8(v[5], zero));
+    }
+
+    // (sum + 16) >> 5, clipped to [0, 255].
+    static inline __m128i Round5_U8(__m128i lo, __m128i hi)
+    {
+        const __m128i bias = _mm_set1_epi16(16);
+        return _mm_packus_epi16(_mm_srai_epi16(_mm_add_epi16(lo, bias), 5),
+                                _mm_srai_epi16(_mm_add_epi16(hi, bias), 5));
+    }
+
+    // Second (vertical) filter pass of the center sample over unscaled
+    // horizontal sums: (sum + 512) >> 10 in 32 bit, clipped to [0, 255].
+    static inline __m128i Tap6Center_16(const __m128i * r)
+    {
+        const __m128i k01 = _mm_set_epi16(-5, 1, -5, 1, -5, 1, -5, 1);
+        const __m128i k23 = _mm_set1_epi16(20);
+        const __m128i k45 = _mm_set_epi16(1, -5, 1, -5, 1, -5, 1, -5);
+        const __m128i bias = _mm_set1_epi32(512);
+
+        __m128i lo = _mm_add_epi32(_mm_add_epi32(
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[0], r[1]), k01),
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[2], r[3]), k23)),
+            _mm_madd_epi16(_mm_unpacklo_epi16(r[4], r[5]), k45));
+        __m128i hi = _mm_add_epi32(_mm_add_epi32(
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[0], r[1]), k01),
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[2], r[3]), k23)),
+            _mm_madd_epi16(_mm_unpackhi_epi16(r[4], r[5]), k45));
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, bias), 10);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, bias), 10);
+        return _mm_packs_epi32(lo, hi);
+    }
+
+    template <int W> static inline __m128i LoadBlockRow(const uint8_t * p);
+
+    template <> inline __m128i LoadBlockRow<16>(const uint8_t * p)
+    {
+        return _mm_loadu_si128((const __m128i *)p);
+    }
+
+    template <> inline __m128i LoadBlockRow<8>(const uint8_t * p)
+    {
+        return _mm_loadl_epi64((const __m128i *)p);
+    }
+
+    template <> inline __m128i LoadBlockRow<4>(const uint8_t * p)
+    {
+        int32_t v;
+        memcpy(&v, p, sizeof(v));
+        return _mm_cvtsi32_si128(v);
+    }
+
+    // SAD of a W x h source block against the prediction p1, or the rounded
+    // average of p1 and p2 when p2 is set (quarter-pel samples).
+    template <int W>
+    static uint32_t PredictionSad(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch, int h)
+    {
+        __m128i acc = _mm_setzero_si128();
+        for (int y = 0; y < h; ++y)
+        {
+            __m128i pred = LoadBlockRow<W>(p1 + y * refPitch);
+            if (p2)
+            {
+                pred = _mm_avg_epu8(pred, LoadBlockRow<W>(p2 + y * refPitch));
+            }
+            acc = _mm_add_epi32(acc, _mm_sad_epu8(LoadBlockRow<W>(src + y * srcPitch), pred));
+        }
+        return _mm_cvtsi128_si32(acc) + _mm_extract_epi32(acc, 2);
+    }
+
+    // Sums the absolute 4x4 Hadamard coefficients of two side by side 4x4
+    // difference blocks, one row of both per register (16 bit lanes).
+    static inline __m128i Hadamard4x4Pair(__m128i d0, __m128i d1, __m128i d2, __m128i d3)
+    {
+        const __m128i a0 = _mm_add_epi16(d0, d1), a1 = _mm_sub_epi16(d0, d1);
+        const __m128i a2 = _mm_add_epi16(d2, d3), a3 = _mm_sub_epi16(d2, d3);
+        const __m128i rows[4] = { _mm_add_epi16(a0, a2), _mm_add_epi16(a1, a3),
+                                  _mm_sub_epi16(a0, a2), _mm_sub_epi16(a1, a3) };
+
+        __m128i acc = _mm_setzero_si128();
+        for (int i = 0; i < 4; ++i)
+        {
+            // Horizontal butterflies inside each group of 4 lanes. Differences
+            // come out negated, which the absolute value makes irrelevant.
+            __m128i v = rows[i];
+            __m128i sw = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_blend_epi16(_mm_add_epi16(v, sw), _mm_sub_epi16(sw, v), 0xAA);
+            sw = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(1, 0, 3, 2)), _MM_SHUFFLE(1, 0, 3, 2));
+            v = _mm_blend_epi16(_mm_add_epi16(v, sw), _mm_sub_epi16(sw, v), 0xCC);
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_abs_epi16(v), _mm_set1_epi16(1)));
+        }
+        return acc;
+    }
+
+    // SATD (sum of absolute 4x4 Hadamard transformed differences, halved) of a
+    // W x h source block against the same prediction as PredictionSad().
+    template <int W>
+    static uint32_t PredictionSatd(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch, int h)
+    {
+        static const int kChunk = W < 8 ? W : 8;
+        const __m128i zero = _mm_setzero_si128();
+        __m128i acc = zero;
+        for (int y = 0; y < h; y += 4)
+        {
+            for (int x = 0; x < W; x += kChunk)
+            {
+                __m128i d[4];
+                for (int r = 0; r < 4; ++r)
+                {
+                    const int offset = (y + r) * refPitch + x;
+                    __m128i pred = LoadBlockRow<kChunk>(p1 + offset);
+                    if (p2)
+                    {
+                        pred = _mm_avg_epu8(pred, LoadBlockRow<kChunk>(p2 + offset));
+                    }
+                    d[r] = _mm_sub_epi16(_mm_unpacklo_epi8(LoadBlockRow<kChunk>(src + (y + r) * srcPitch + x), zero),
+                                         _mm_unpacklo_epi8(pred, zero));
+                }
+                acc = _mm_add_epi32(acc, Hadamard4x4Pair(d[0], d[1], d[2], d[3]));
+            }
+        }
+        acc = _mm_hadd_epi32(acc, acc);
+        acc = _mm_hadd_epi32(acc, acc);
+        return ((uint32_t)_mm_cvtsi128_si32(acc) + 1) >> 1;
+    }
+
+    // Half-pel planes averaged to form each quarter-pel phase, indexed by
+    // (qy & 3) * 4 + (qx & 3); see Plane::SubpelPtr() for the plane numbering.
+    static const int kQpelPlane0[16] = { 0, 1, 1, 1, 0, 1, 1, 1, 2, 3, 3, 3, 0, 1, 1, 1 };
+    static const int kQpelPlane1[16] = { 0, 0, 1, 0, 2, 2, 3, 2, 2, 2, 3, 2, 2, 2, 3, 2 };
+
+    // SAD, or SATD when haar is set, of a w x h source block against the
+    // prediction p1, or the rounded average of p1 and p2 when p2 is set.
+    static uint32_t BlockDistortion(const uint8_t * src, int srcPitch, const uint8_t * p1, const uint8_t * p2, int refPitch,
+                                    int w, int h, bool haar)
+    {
+        if (haar)
+        {
+            switch (w)
+            {
+            case 16: return PredictionSatd<16>(src, srcPitch, p1, p2, refPitch, h);
+            case 8:  return PredictionSatd<8>(src, srcPitch, p1, p2, refPitch, h);
+            default: return PredictionSatd<4>(src, srcPitch, p1, p2, refPitch, h);
+            }
+        }
+        switch (w)
+        {
+        case 16: return PredictionSad<16>(src, srcPitch, p1, p2, refPitch, h);
+        case 8:  return PredictionSad<8>(src, srcPitch, p1, p2, refPitch, h);
+        default: return PredictionSad<4>(src, srcPitch, p1, p2, refPitch, h);
+        }
+    }
+
+    // Full/half-pel samples forming the prediction at the absolute QPEL
+    // position (qx, qy): p1, averaged with p2 unless p2 is NULL.
+    static inline void SubpelSamples(const Plane & ref, int qx, int qy, const uint8_t * & p1, const uint8_t * & p2)
+    {
+        const int phase = ((qy & 3) << 2) + (qx & 3);
+        const int x = qx >> 2;
+        const int y = qy >> 2;
+        p1 = ref.SubpelPtr(kQpelPlane0[phase], x, y + ((qy & 3) == 3));
+        p2 = (phase & 5) ? ref.SubpelPtr(kQpelPlane1[phase], x + ((qx & 3) == 3), y) : NULL;
+    }
+
+    // SAD, or SATD when haar is set, of the w x h source block against the
+    // reference at the absolute QPEL position (qx, qy) of its top left sample.
+    static uint32_t SubpelDistortion(const Plane & ref, const uint8_t * src, int srcPitch, int qx, int qy, int w, int h, bool haar)
+    {
+        const uint8_t * p1;
+        const uint8_t * p2;
+        SubpelSamples(ref, qx, qy, p1, p2);
+        return BlockDistortion(src, srcPitch, p1, p2, ref.GetPitch(), w, h, haar);
+    }
+
+    // One refinement step: the 8 neighbours of mv at distance step (QPEL units)
+    // are tried and the cheapest (distortion + MV cost) replaces mv. Ties keep
+    // the current vector.
+    static void RefineStep(const Plane & ref, const uint8_t * src, int srcPitch, int x, int y, int w, int h,
+                           bool haar, const CostModel & costModel, cl_short2 costCenter,
+                           int step, cl_short2 & mv, uint32_t & dist)
+    {
+        const int centerX = mv.s[0];
+        const int centerY = mv.s[1];
+        uint32_t bestCost = dist + costModel.Cost(centerX - costCenter.s[0], centerY - costCenter.s[1]);
+        for (int dy = -step; dy <= step; dy += step)
+        {
+            for (int dx = -step; dx <= step; dx += step)
+            {
+                if (dx == 0 && dy == 0)
+                {
+                    continue;
+                }
+                const uint32_t d = SubpelDistortion(ref, src, srcPitch, x * 4 + centerX + dx, y * 4 + centerY + dy, w, h, haar);
+                const uint32_t cost = d + costModel.Cost(centerX + dx - costCenter.s[0], centerY + dy - costCenter.s[1]);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    dist = d;
+                    mv.s[0] = (cl_short)(centerX + dx);
+                    mv.s[1] = (cl_short)(centerY + dy);
+                }
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // Variable block size search
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // The 41 H.264 inter partitions of a MB, grouped by size in the bit order
+    // of the partition mask: 16x16, 16x8 (2), 8x16 (2), 8x8 (4), 8x4 (8),
+    // 4x8 (8), 4x4 (16). Sub-partitions follow their 8x8 quadrant.
+    enum
+    {
+        PART_16x16 = 0,
+        PART_16x8 = 1,
+        PART_8x16 = 3,
+        PART_8x8 = 5,
+        PART_8x4 = 9,
+        PART_4x8 = 17,
+        PART_4x4 = 25,
+        NUM_PARTITIONS = 41
+    };
+
+    static const int kPartitionFirst[7] = { PART_16x16, PART_16x8, PART_8x16, PART_8x8, PART_8x4, PART_4x8, PART_4x4 };
+    static const int kPartitionCount[7] = { 1, 2, 2, 4, 8, 8, 16 };
+
+    // Pixel rectangle of partition p inside the MB
+    static void GetPartitionRect(int p, int & x, int & y, int & w, int & h)
+    {
+        if (p >= PART_4x4)
+        {
+            const int q = (p - PART_4x4) >> 2, s = (p - PART_4x4) & 3;
+            x = (q & 1) * 8 + (s & 1) * 4; y = (q >> 1) * 8 + (s >> 1) * 4; w = 4; h = 4;
+        }
+        else if (p >= PART_4x8)
+        {
+            const int q = (p - PART_4x8) >> 1, n = (p - PART_4x8) & 1;
+            x = (q & 1) * 8 + n * 4; y = (q >> 1) * 8; w = 4; h = 8;
+        }
+        else if (p >= PART_8x4)
+        {
+            const int q = (p - PART_8x4) >> 1, n = (p - PART_8x4) & 1;
+            x = (q & 1) * 8; y = (q >> 1) * 8 + n * 4; w = 8; h = 4;
+        }
+        else if (p >= PART_8x8)
+        {
+            const int q = p - PART_8x8;
+            x = (q & 1) * 8; y = (q >> 1) * 8; w = 8; h = 8;
+        }
+        else if (p >= PART_8x16)
+        {
+            x = (p - PART_8x16) * 8; y = 0; w = 8; h = 16;
+        }
+        else if (p >= PART_16x8)
+        {
+            x = 0; y = (p - PART_16x8) * 8; w = 16; h = 8;
+        }
+        else
+        {
+            x = 0; y = 0; w = 16; h = 16;
+        }
+    }
+
+    // Per lane (= per candidate column) best distortion of every partition,
+    // with the L1 vector length used to break ties and the packed
+    // window position ((dy index << 8) | dx index) of the winner.
+    struct PartitionTracker
+    {
+        __m128i sad[NUM_PARTITIONS];
+        __m128i length[NUM_PARTITIONS];
+        __m128i pos[NUM_PARTITIONS];
+
+        void Reset()
+        {
+            for (int p = 0; p < NUM_PARTITIONS; ++p)
+            {
+                sad[p] = _mm_set1_epi16(-1);
+                length[p] = _mm_set1_epi16(0x7FFF);
+                pos[p] = _mm_setzero_si128();
+            }
+        }
+    };
+
+    // Best integer vector (QPEL units), its distortion and its MV cost, for
+    // every partition
+    struct PartitionResults
+    {
+        uint32_t dist[NUM_PARTITIONS];
+        uint32_t cost[NUM_PARTITIONS];
+        cl_short2 mv[NUM_PARTITIONS];
+    };
+
+    static inline void Track(PartitionTracker & t, int p, __m128i sad, __m128i pos, __m128i length)
+    {
+        // Unsigned 16 bit compare: sad < best, or sad == best with a shorter vector
+        const __m128i eq = _mm_cmpeq_epi16(sad, t.sad[p]);
+        const __m128i le = _mm_cmpeq_epi16(_mm_min_epu16(sad, t.sad[p]), sad);
+        const __m128i take = _mm_or_si128(_mm_andnot_si128(eq, le),
+                                          _mm_and_si128(eq, _mm_cmpgt_epi16(t.length[p], length)));
+        t.sad[p] = _mm_min_epu16(sad, t.sad[p]);
+        t.length[p] = _mm_blendv_epi8(t.length[p], length, take);
+        t.pos[p] = _mm_blendv_epi8(t.pos[p], pos, take);
+    }
+
+    // Sums the 4x4 SADs (raster order) of 8 candidates into every enabled
+    // partition, adds the MV cost of the candidates and tracks the winners.
+    // 16 bit lanes are enough: a 16x16 SAD is at most 65280, and the cost is
+    // added with saturation.
+    static inline void UpdatePartitions(const __m128i * sad4x4, __m128i pos, __m128i length, const __m128i * cost,
+                                        unsigned enabled, PartitionTracker & t)
+    {
+        __m128i part[NUM_PARTITIONS];
+        for (int q = 0; q < 4; ++q)
+        {
+            const int b = (q >> 1) * 8 + (q & 1) * 2;
+            const __m128i s0 = sad4x4[b], s1 = sad4x4[b + 1], s2 = sad4x4[b + 4], s3 = sad4x4[b + 5];
+            part[PART_4x4 + 4 * q + 0] = s0;
+            part[PART_4x4 + 4 * q + 1] = s1;
+            part[PART_4x4 + 4 * q + 2] = s2;
+            part[PART_4x4 + 4 * q + 3] = s3;
+            part[PART_8x4 + 2 * q + 0] = _mm_add_epi16(s0, s1);
+            part[PART_8x4 + 2 * q + 1] = _mm_add_epi16(s2, s3);
+            part[PART_4x8 + 2 * q + 0] = _mm_add_epi16(s0, s2);
+            part[PART_4x8 + 2 * q + 1] = _mm_add_epi16(s1, s3);
+            part[PART_8x8 + q] = _mm_add_epi16(part[PART_8x4 + 2 * q], part[PART_8x4 + 2 * q + 1]);
+        }
+        part[PART_16x8 + 0] = _mm_add_epi16(part[PART_8x8 + 0], part[PART_8x8 + 1]);
+        part[PART_16x8 + 1] = _mm_add_epi16(part[PART_8x8 + 2], part[PART_8x8 + 3]);
+        part[PART_8x16 + 0] = _mm_add_epi16(part[PART_8x8 + 0], part[PART_8x8 + 2]);
+        part[PART_8x16 + 1] = _mm_add_epi16(part[PART_8x8 + 1], part[PART_8x8 + 3]);
+        part[PART_16x16] = _mm_add_epi16(part[PART_16x8 + 0], part[PART_16x8 + 1]);
+
+        for (int size = 0; size < 7; ++size)
+        {
+            if (enabled & (1 << size))
+            {
+                for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                {
+                    Track(t, p, cost ? _mm_adds_epu16(part[p], *cost) : part[p], pos, length);
+                }
+            }
+        }
+    }
+
+    // MV costs of the search window, one entry per column (padded to a whole
+    // number of 16 lane groups) and per row. NULL x means no cost.
+    struct WindowCosts
+    {
+        const uint16_t * x;
+        const uint16_t * y;
+    };
+
+    // Candidate positions, vector lengths and MV costs of 8 window columns starting at dx
+    static inline void CandidateLanes(int dx, int dy, int centerX, int centerY, const WindowCosts & costs,
+                                      __m128i & pos, __m128i & length, __m128i & cost)
+    {
+        const __m128i lane = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const int mvX = centerX - kSearchRadiusX + dx;
+        const int mvY = centerY - kSearchRadiusY + dy;
+        pos = _mm_add_epi16(_mm_set1_epi16((short)((dy << 8) | dx)), lane);
+        length = _mm_add_epi16(_mm_abs_epi16(_mm_add_epi16(_mm_set1_epi16((short)mvX), lane)),
+                               _mm_set1_epi16((short)abs(mvY)));
+        if (costs.x)
+        {
+            cost = _mm_adds_epu16(_mm_loadu_si128((const __m128i *)(costs.x + dx)), _mm_set1_epi16((short)costs.y[dy]));
+        }
+    }
+
+    // 4x4 SADs of the MB against 8 horizontally consecutive positions starting
+    // at ref: lane i of sad4x4[by * 4 + bx] is block (bx, by) at position i.
+    // mpsadbw matches one 4 byte source group against 8 sliding windows.
+    static inline void Sad4x4Grid_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, __m128i * sad4x4)
+    {
+        for (int by = 0; by < 4; ++by)
+        {
+            __m128i acc0 = _mm_setzero_si128(), acc1 = acc0, acc2 = acc0, acc3 = acc0;
+            for (int r = 0; r < 4; ++r)
+            {
+                const int y = by * 4 + r;
+                const __m128i s = _mm_load_si128((const __m128i *)(src + y * srcPitch));
+                const __m128i a0 = _mm_loadu_si128((const __m128i *)(ref + y * refPitch));
+                const __m128i a8 = _mm_loadu_si128((const __m128i *)(ref + y * refPitch + 8));
+                acc0 = _mm_add_epi16(acc0, _mm_mpsadbw_epu8(a0, s, 0));
+                acc1 = _mm_add_epi16(acc1, _mm_mpsadbw_epu8(a0, s, 5));
+                acc2 = _mm_add_epi16(acc2, _mm_mpsadbw_epu8(a8, s, 2));
+                acc3 = _mm_add_epi16(acc3, _mm_mpsadbw_epu8(a8, s, 7));
+            }
+            sad4x4[by * 4 + 0] = acc0;
+            sad4x4[by * 4 + 1] = acc1;
+            sad4x4[by * 4 + 2] = acc2;
+            sad4x4[by * 4 + 3] = acc3;
+        }
+    }
+
+    // Same as above for 16 positions: positions 0..7 in lo, 8..15 in hi.
+    CPU_VME_TARGET_AVX2
+    static inline void Sad4x4Grid_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, __m128i * lo, __m128i * hi)
+    {
+        for (int by = 0; by < 4; ++by)
+        {
+            __m256i acc[4];
+            for (int k = 0; k < 4; ++k)
+            {
+                acc[k] = _mm256_setzero_si256();
+            }
+            for (int r = 0; r < 4; ++r)
+            {
+                const int y = by * 4 + r;
+                const __m256i s = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)(src + y * srcPitch)));
+                const __m256i v = _mm256_loadu_si256((const __m256i *)(ref + y * refPitch));
+                const __m256i a0 = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(2, 1, 1, 0));    // bytes 0..15 | 8..23
+                const __m256i a8 = _mm256_permute4x64_epi64(v, _MM_SHUFFLE(3, 2, 2, 1));    // bytes 8..23 | 16..31
+                acc[0] = _mm256_add_epi16(acc[0], _mm256_mpsadbw_epu8(a0, s, 0 | (0 << 3)));
+                acc[1] = _mm256_add_epi16(acc[1], _mm256_mpsadbw_epu8(a0, s, 5 | (5 << 3)));
+                acc[2] = _mm256_add_epi16(acc[2], _mm256_mpsadbw_epu8(a8, s, 2 | (2 << 3)));
+                acc[3] = _mm256_add_epi16(acc[3], _mm256_mpsadbw_epu8(a8, s, 7 | (7 << 3)));
+            }
+            for (int k = 0; k < 4; ++k)
+            {
+                lo[by * 4 + k] = _mm256_castsi256_si128(acc[k]);
+                hi[by * 4 + k] = _mm256_extracti128_si256(acc[k], 1);
+            }
+        }
+    }
+
+    // Searches the whole window for every enabled partition at once.
+    // ref points at the top left candidate of the window.
+    typedef void (*PartitionSearchFn)(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                      int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                      PartitionTracker & t);
+
+    // The 33 window columns as groups of 8 (16); the last group overlaps the
+    // previous one, which is harmless since re-tracking a candidate is a no-op.
+    static const int kGroupStarts8[] = { 0, 8, 16, 24, 2 * kSearchRadiusX + 1 - 8 };
+    static const int kGroupStarts16[] = { 0, 16, 2 * kSearchRadiusX + 1 - 16 };
+
+    static void SearchPartitions_SSE41(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                       int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                       PartitionTracker & t)
+    {
+        __m128i sad4x4[16];
+        for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+        {
+            for (size_t g = 0; g < sizeof(kGroupStarts8) / sizeof(kGroupStarts8[0]); ++g)
+            {
+                const int dx = kGroupStarts8[g];
+                __m128i pos, length, cost;
+                CandidateLanes(dx, dy, centerX, centerY, costs, pos, length, cost);
+                Sad4x4Grid_SSE41(src, srcPitch, ref + dy * refPitch + dx, refPitch, sad4x4);
+                UpdatePartitions(sad4x4, pos, length, costs.x ? &cost : NULL, enabled, t);
+            }
+        }
+    }
+
+    CPU_VME_TARGET_AVX2
+    static void SearchPartitions_AVX2(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch,
+                                      int centerX, int centerY, const WindowCosts & costs, unsigned enabled,
+                                      PartitionTracker & t)
+    {
+        __m128i lo[16], hi[16];
+        for (int dy = 0; dy <= 2 * kSearchRadiusY; ++dy)
+        {
+            for (size_t g = 0; g < sizeof(kGroupStarts16) / sizeof(kGroupStarts16[0]); ++g)
+            {
+                const int dx = kGroupStarts16[g];
+                __m128i pos, length, cost;
+                Sad4x4Grid_AVX2(src, srcPitch, ref + dy * refPitch + dx, refPitch, lo, hi);
+                CandidateLanes(dx, dy, centerX, centerY, costs, pos, length, cost);
+                UpdatePartitions(lo, pos, length, costs.x ? &cost : NULL, enabled, t);
+                CandidateLanes(dx + 8, dy, centerX, centerY, costs, pos, length, cost);
+                UpdatePartitions(hi, pos, length, costs.x ? &cost : NULL, enabled, t);
+            }
+        }
+    }
+
+    static PartitionSearchFn SelectPartitionSearch()
+    {
+        return HasAVX2() ? SearchPartitions_AVX2 : SearchPartitions_SSE41;
+    }
+
+    // Folds the 8 lanes of partition p into its best vector. dist receives
+    // the tracked value, which includes the MV cost.
+    static void ReduceTracker(const PartitionTracker & t, int p, int centerX, int centerY, PartitionResults & r)
+    {
+        uint16_t sad[8], length[8], pos[8];
+        _mm_storeu_si128((__m128i *)sad, t.sad[p]);
+        _mm_storeu_si128((__m128i *)length, t.length[p]);
+        _mm_storeu_si128((__m128i *)pos, t.pos[p]);
+
+        int best = 0;
+        for (int i = 1; i < 8; ++i)
+        {
+            if (sad[i] < sad[best] || (sad[i] == sad[best] && length[i] < length[best]))
+            {
+                best = i;
+            }
+        }
+        r.dist[p] = sad[best];
+        r.mv[p].s[0] = (cl_short)((centerX - kSearchRadiusX + (pos[best] & 0xFF)) * 4);
+        r.mv[p].s[1] = (cl_short)((centerY - kSearchRadiusY + (pos[best] >> 8)) * 4);
+    }
+
+    static inline uint32_t Total(const PartitionResults & r, int p)
+    {
+        return r.dist[p] + r.cost[p];
+    }
+
+    // Chooses the cheapest enabled partitioning (distortion plus MV cost of
+    // every partition, so more vectors cost more); ties go to the larger
+    // partitions. Fills the partitions of the chosen shape into parts, and
+    // its cost into totalCost when set.
+    static int DecideShape(const PartitionResults & r, unsigned enabled, cl_uchar2 & shape, int * parts,
+                           uint32_t * totalCost = NULL)
+    {
+        if (enabled == 1)
+        {
+            // 16x16 only, the other partitions were not searched
+            shape.s[0] = 0;     // CL_AVC_ME_MAJOR_16x16_INTEL
+            shape.s[1] = 0;
+            parts[0] = PART_16x16;
+            if (totalCost)
+            {
+                *totalCost = Total(r, PART_16x16);
+            }
+            return 1;
+        }
+
+        // Best sub-shape of every 8x8 quadrant (minor shape codes 0..3 are
+        // 8x8, 8x4, 4x8 and 4x4, the same order as enable bits 3..6)
+        uint32_t quadCost[4];
+        int quadMinor[4];
+        uint32_t cost8x8 = 0;
+        for (int q = 0; q < 4; ++q)
+        {
+            const uint32_t costs[4] = {
+                Total(r, PART_8x8 + q),
+                Total(r, PART_8x4 + 2 * q) + Total(r, PART_8x4 + 2 * q + 1),
+                Total(r, PART_4x8 + 2 * q) + Total(r, PART_4x8 + 2 * q + 1),
+                Total(r, PART_4x4 + 4 * q) + Total(r, PART_4x4 + 4 * q + 1) + Total(r, PART_4x4 + 4 * q + 2) + Total(r, PART_4x4 + 4 * q + 3) };
+            quadCost[q] = 0xFFFFFFFF;
+            quadMinor[q] = 0;
+            for (int m = 0; m < 4; ++m)
+            {
+                if ((enabled & (8 << m)) && costs[m] < quadCost[q])
+                {
+                    quadCost[q] = costs[m];
+                    quadMinor[q] = m;
+                }
+            }
+            cost8x8 += quadCost[q];
+        }
+
+        const uint32_t majorCosts[4] = {
+            Total(r, PART_16x16),
+            Total(r, PART_16x8) + Total(r, PART_16x8 + 1),
+            Total(r, PART_8x16) + Total(r, PART_8x16 + 1),
+            cost8x8 };
+        const unsigned majorEnabled = (enabled & 7) | ((enabled & 0x78) ? 8 : 0);
+        int major = 0;
+        uint32_t bestCost = 0xFFFFFFFF;
+        for (int m = 0; m < 4; ++m)
+        {
+            if ((majorEnabled & (1 << m)) && majorCosts[m] < bestCost)
+            {
+                bestCost = majorCosts[m];
+                major = m;
+            }
+        }
+
+        int count = 0;
+        cl_uchar minor = 0;
+        if (major < 3)
+        {
+            const int size = major;  // major shape codes match enable bits 0..2
+            for (int i = 0; i < kPartitionCount[size]; ++i)
+            {
+                parts[count++] = kPartitionFirst[size] + i;
+            }
+        }
+        else
+        {
+            for (int q = 0; q < 4; ++q)
+            {
+                const int size = 3 + quadMinor[q];
+                const int n = kPartitionCount[size] / 4;
+                for (int i = 0; i < n; ++i)
+                {
+                    parts[count++] = kPartitionFirst[size] + q * n + i;
+                }
+                minor |= (cl_uchar)(quadMinor[q] << (2 * q));
+            }
+        }
+        shape.s[0] = (cl_uchar)major;
+        shape.s[1] = minor;
+        if (totalCost)
+        {
+            *totalCost = bestCost;
+        }
+        return count;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // MV cost
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Distances (in cost precision units) of the 8 packed table entries
+    static const int kCostTableDistances[8] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+    cl_uint2 GetCostTable(CostPenalty penalty)
+    {
+        // Made up, see CostPenalty: roughly log2 of the distance, doubling
+        // from one penalty level to the next.
+        // Decoded: low 0 2 4 6 10 16 24 32, normal 0 4 8 12 20 32 48 64,
+        // high 0 8 16 24 40 64 96 128.
+        static const cl_uint kTables[4][2] = {
+            { 0x00000000, 0x00000000 },
+            { 0x06040200, 0x281C180A },
+            { 0x0C080400, 0x382C2825 },
+            { 0x1C180800, 0x483C382A },
+        };
+        cl_uint2 table;
+        table.s[0] = kTables[penalty][0];
+        table.s[1] = kTables[penalty][1];
+        return table;
+    }
+
+    cl_uint2 ParseCostTable(const std::string & text)
+    {
+        cl_uint2 table;
+        const char * p = text.c_str();
+        for (int i = 0; i < 2; ++i)
+        {
+            char * end = NULL;
+            const unsigned long long word = strtoull(p, &end, 0);
+            if (end == p || *p == '-' || *end != (i == 0 ? ',' : '\0') || word > 0xFFFFFFFFull)
+            {
+                throw std::runtime_error("CPUVme::ParseCostTable: expected the two words of a packed cost table as s0,s1, got \"" + text + "\".");
+            }
+            table.s[i] = (cl_uint)word;
+            p = end + 1;
+        }
+        return table;
+    }
+
+    CostModel::CostModel(cl_uint2 packedTable, CostPrecision precision)
+        : m_shift((int)precision), m_zero(true)
+    {
+        int costs[8];
+        for (int i = 0; i < 8; ++i)
+        {
+            const cl_uint packed = (packedTable.s[i / 4] >> (8 * (i % 4))) & 0xFF;
+            costs[i] = (packed & 0xF) << (packed >> 4);
+            m_zero = m_zero && costs[i] == 0;
+        }
+
+        int entry = 0;
+        for (int d = 0; d < kLutSize; ++d)
+        {
+            while (entry < 7 && d >= kCostTableDistances[entry + 1])
+            {
+                ++entry;
+            }
+            int cost = costs[entry];
+            if (entry < 7)
+            {
+                const int span = kCostTableDistances[entry + 1] - kCostTableDistances[entry];
+                cost += (costs[entry + 1] - costs[entry]) * (d - kCostTableDistances[entry]) / span;
+            }
+            m_lut[d] = (uint16_t)std::min(std::max(cost, 0), 0xFFFF);
+        }
+    }
+
+    void CostModel::FillIntegerCosts(int base, int count, uint16_t * out) const
+    {
+        for (int i = 0; i < count; ++i)
+        {
+            out[i] = m_lut[Index(4 * i - base)];
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // Plane
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    Plane::Plane(int width, int height)
+        : m_origin(NULL), m_width(width), m_height(height)
+    {
+        if (width <= 0 || height <= 0)
+        {
+            throw std::runtime_error("CPUVme::Plane: invalid dimensions.");
+        }
+
+        m_paddedWidth = (width + 15) & ~15;
+        m_paddedHeight = (height + 15) & ~15;
+        // 16 bytes of slack so the last vector of a filtered row stays in its row
+        m_pitch = (m_paddedWidth + 2 * kPlaneBorder + 16 + 63) & ~63;
+
+        // One extra row and the alignment slack keep the vector loads of the
+        // right-most candidates inside the allocation.
+        const size_t rows = m_paddedHeight + 2 * kPlaneBorder + 1;
+        m_storage.resize(rows * m_pitch + 64);
+        m_origin = AlignedOrigin(m_storage);
+
+        for (int i = 0; i < 3; ++i)
+        {
+            m_subpelOrigin[i] = NULL;
+        }
+        m_interpolated = false;
+    }
+
+    uint8_t * Plane::AlignedOrigin(std::vector<uint8_t> & storage) const
+    {
+        uintptr_t base = (uintptr_t)&storage[0];
+        uintptr_t aligned = (base + 63) & ~(uintptr_t)63;
+        return (uint8_t *)aligned + kPlaneBorder * m_pitch + kPlaneBorder;
+    }
+
+    void Plane::Load(const uint8_t * pSrc, int pitch)
+    {
+        for (int y = 0; y < m_height; ++y)
+        {
+            memcpy(Row(y), pSrc + y * pitch, m_width);
+        }
+
+        ExtendBorder();
+    }
+
+    void Plane::Decimate2x(const Plane & src)
+    {
+        if (m_width != (src.m_width + 1) / 2 || m_height != (src.m_height + 1) / 2)
+        {
+            throw std::runtime_error("CPUVme::Plane: decimated plane size mismatch.");
+        }
+
+        // Whole vectors up to the padded width: the source samples past its
+        // width (and its last odd row) are the replicated edge, as with
+        // clamp-to-edge sampling, and the border rebuild then overwrites
+        // everything past m_width anyway.
+        for (int y = 0; y < m_height; ++y)
+        {
+            const uint8_t * pRow0 = src.Ptr(0, 2 * y);
+            const uint8_t * pRow1 = src.Ptr(0, 2 * y + 1);
+            uint8_t * pDst = Row(y);
+            for (int x = 0; x < m_paddedWidth; x += 16)
+            {
+                _mm_store_si128((__m128i *)(pDst + x), BoxFilter2x2_U8(pRow0 + 2 * x, pRow1 + 2 * x));
+            }
+        }
+
+        ExtendBorder();
+    }
+
+    void Plane::ExtendBorder()
+    {
+        for (int y = 0; y < m_height; ++y)
+        {
+            uint8_t * pDst = Row(y);
+            memset(pDst - kPlaneBorder, pDst[0], kPlaneBorder);
+            memset(pDst + m_width, pDst[m_width - 1], m_paddedWidth - m_width + kPlaneBorder);
+        }
+
+        const size_t rowBytes = m_paddedWidth + 2 * kPlaneBorder;
+        for (int y = -kPlaneBorder; y < 0; ++y)
+        {
+            memcpy(Row(y) - kPlaneBorder, Row(0) - kPlaneBorder, rowBytes);
+        }
+        for (int y = m_height; y < m_paddedHeight + kPlaneBorder; ++y)
+        {
+            memcpy(Row(y) - kPlaneBorder, Row(m_height - 1) - kPlaneBorder, rowBytes);
+        }
+
+        m_interpolated = false;
+    }
+
+    void Plane::Interpolate()
+    {
+        if (m_subpelStorage[0].empty())
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                m_subpelStorage[i].resize(m_storage.size());
+                m_subpelOrigin[i] = AlignedOrigin(m_subpelStorage[i]);
+            }
+        }
+
+        // Every sample whose 6 taps fall inside the border; candidates are
+        // kept kInterpolationMargin pixels away from its edge, so that is all
+        // the refinement can reach.
+        const int first = -kPlaneBorder + 2;
+        const int lastX = m_paddedWidth + kPlaneBorder - 3;
+        const int lastY = m_paddedHeight + kPlaneBorder - 3;
+        const int numVectors = (lastX - first + 15) / 16;
+
+        // Unscaled horizontal sums of the 6 rows feeding the center samples
+        std::vector<int16_t> ring(6 * 16 * numVectors);
+
+        for (int y = first - 2; y < lastY + 3; ++y)
+        {
+            int16_t * sums = &ring[((y - first + 2) % 6) * 16 * numVectors];
+            const uint8_t * pRow = Ptr(first, y);
+            uint8_t * pH = m_subpelOrigin[0] + y * m_pitch + first;
+            for (int v = 0; v < numVectors; ++v)
+            {
+                __m128i lo, hi;
+                Tap6_U8(pRow + v * 16 - 2, 1, lo, hi);
+                _mm_storeu_si128((__m128i *)(sums + v * 16), lo);
+                _mm_storeu_si128((__m128i *)(sums + v * 16 + 8), hi);
+                if (y >= first && y < lastY)
+                {
+                    _mm_storeu_si128((__m128i *)(pH + v * 16), Round5_U8(lo, hi));
+                }
+            }
+
+            // Row y is the last tap of the center row y - 3
+            const int cy = y - 3;
+            if (cy < first)
+            {
+                continue;
+            }
+            const uint8_t * pCol = Ptr(first, cy - 2);
+            uint8_t * pV = m_subpelOrigin[1] + cy * m_pitch + first;
+            uint8_t * pC = m_subpelOrigin[2] + cy * m_pitch + first;
+            for (int v = 0; v < numVectors; ++v)
+            {
+                __m128i lo, hi;
+                Tap6_U8(pCol + v * 16, m_pitch, lo, hi);
+                _mm_storeu_si128((__m128i *)(pV + v * 16), Round5_U8(lo, hi));
+
+                __m128i rowsLo[6], rowsHi[6];
+                for (int i = 0; i < 6; ++i)
+                {
+                    const int16_t * tap = &ring[((cy - first + i) % 6) * 16 * numVectors] + v * 16;
+                    rowsLo[i] = _mm_loadu_si128((const __m128i *)tap);
+                    rowsHi[i] = _mm_loadu_si128((const __m128i *)(tap + 8));
+                }
+                _mm_storeu_si128((__m128i *)(pC + v * 16),
+                                 _mm_packus_epi16(Tap6Center_16(rowsLo), Tap6Center_16(rowsHi)));
+            }
+        }
+
+        m_interpolated = true;
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // MotionEstimator
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Search center of one MB as the kernels compute it: integer part of the
+    // QPEL predictor, vertical component forced even. The center is clamped
+    // so that the whole window (plus the interpolation margin) stays inside
+    // the replicated border.
+    static void SearchCenter(const cl_short2 * predMVs, int mbIndex, int x0, int y0, int paddedWidth, int paddedHeight,
+                             int & centerX, int & centerY)
+    {
+        const int marginX = kPlaneBorder - kSearchRadiusX - kInterpolationMargin;
+        const int marginY = kPlaneBorder - kSearchRadiusY - kInterpolationMargin;
+
+        centerX = 0;
+        centerY = 0;
+        if (predMVs)
+        {
+            centerX = predMVs[mbIndex].s[0] / 4;
+            centerY = (predMVs[mbIndex].s[1] / 4) & ~1;
+        }
+        centerX = std::min(std::max(centerX, -marginX - x0), paddedWidth - 16 + marginX - x0);
+        centerY = std::min(std::max(centerY, -marginY - y0), paddedHeight - 16 + marginY - y0);
+    }
+
+    // Integer search of the MB at (x0, y0) in one reference: fills the vector,
+    // the distortion and the MV cost of every enabled partition.
+    static void SearchInteger(const Plane & src, const Plane & ref, int x0, int y0, int centerX, int centerY,
+                              cl_short2 costCenter, const CostModel & costModel, unsigned enabled, bool haar,
+                              PartitionTracker & tracker, PartitionResults & results)
+    {
+        static const SadRowFn sadRow = SelectSadRow();
+        static const PartitionSearchFn searchPartitions = SelectPartitionSearch();
+        const int numCandidatesX = 2 * kSearchRadiusX + 1;
+
+        uint32_t rowSads[2 * kSearchRadiusX + 2];
+        uint16_t costX[48];
+        uint16_t costY[2 * kSearchRadiusY + 1];
+        WindowCosts windowCosts = { NULL, costY };
+
+        const uint8_t * pSrc = src.Ptr(x0, y0);
+        const uint8_t * pWindow = ref.Ptr(x0 + centerX - kSearchRadiusX, y0 + centerY - kSearchRadiusY);
+
+        // MV costs of the window columns and rows, looked up once per MB
+        // and added to the distortions inside the search loops
+        if (!costModel.IsZero())
+        {
+            costModel.FillIntegerCosts(costCenter.s[0] - (centerX - kSearchRadiusX) * 4, 48, costX);
+            costModel.FillIntegerCosts(costCenter.s[1] - (centerY - kSearchRadiusY) * 4, 2 * kSearchRadiusY + 1, costY);
+            windowCosts.x = costX;
+        }
+
+        if (enabled == 1)
+        {
+            // 16x16 only: whole-MB SADs are cheaper than the 4x4 grid
+            uint32_t bestSad = 0xFFFFFFFF;
+            int bestX = 0;
+            int bestY = 0;
+            for (int dy = -kSearchRadiusY; dy <= kSearchRadiusY; ++dy)
+            {
+                const int mvY = centerY + dy;
+                sadRow(pSrc, src.GetPitch(), pWindow + (dy + kSearchRadiusY) * ref.GetPitch(), ref.GetPitch(),
+                       numCandidatesX, rowSads);
+                if (windowCosts.x)
+                {
+                    for (int i = 0; i < numCandidatesX; ++i)
+                    {
+                        rowSads[i] += costX[i] + costY[dy + kSearchRadiusY];
+                    }
+                }
+
+                for (int i = 0; i < numCandidatesX; ++i)
+                {
+                    const int mvX = centerX - kSearchRadiusX + i;
+                    // On ties prefer the shorter vector, so flat areas stay still.
+                    if (rowSads[i] < bestSad ||
+                        (rowSads[i] == bestSad && abs(mvX) + abs(mvY) < abs(bestX) + abs(bestY)))
+                    {
+                        bestSad = rowSads[i];
+                        bestX = mvX;
+                        bestY = mvY;
+                    }
+                }
+            }
+            results.dist[PART_16x16] = bestSad;
+            results.mv[PART_16x16].s[0] = (cl_short)(bestX * 4);
+            results.mv[PART_16x16].s[1] = (cl_short)(bestY * 4);
+        }
+        else
+        {
+            // One 4x4 SAD grid per candidate feeds all 41 partitions
+            tracker.Reset();
+            searchPartitions(pSrc, src.GetPitch(), pWindow, ref.GetPitch(), centerX, centerY, windowCosts, enabled, tracker);
+            for (int size = 0; size < 7; ++size)
+            {
+                if (enabled & (1 << size))
+                {
+                    for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                    {
+                        ReduceTracker(tracker, p, centerX, centerY, results);
+                    }
+                }
+            }
+        }
+
+        // Split the tracked values into distortion and MV cost. The
+        // integer scan ranks candidates by SAD; with Haar adjustment the
+        // winners are re-measured in SATD before the shape decision, so
+        // only the partitions actually compared pay for the transform.
+        for (int size = 0; size < 7; ++size)
+        {
+            if (!(enabled & (1 << size)))
+            {
+                continue;
+            }
+            for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+            {
+                results.cost[p] = costModel.Cost(results.mv[p].s[0] - costCenter.s[0], results.mv[p].s[1] - costCenter.s[1]);
+                if (haar || results.dist[p] >= 0xFFFF)
+                {
+                    // Saturated 16 bit sums are measured again as well
+                    int px, py, pw, ph;
+                    GetPartitionRect(p, px, py, pw, ph);
+                    results.dist[p] = SubpelDistortion(ref, src.Ptr(x0 + px, y0 + py), src.GetPitch(),
+                        (x0 + px) * 4 + results.mv[p].s[0], (y0 + py) * 4 + results.mv[p].s[1], pw, ph, haar);
+                }
+                else
+                {
+                    results.dist[p] -= results.cost[p];
+                }
+            }
+        }
+    }
+
+    // SADs of the 16 4x4 blocks (raster order) of the MB at src against the
+    // single position ref.
+    static inline void Sad4x4Blocks(const uint8_t * src, int srcPitch, const uint8_t * ref, int refPitch, uint32_t * sad)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+        for (int by = 0; by < 4; ++by)
+        {
+            __m128i lo = zero;
+            __m128i hi = zero;
+            for (int r = 4 * by; r < 4 * by + 4; ++r)
+            {
+                const __m128i s = _mm_loadu_si128((const __m128i *)(src + r * srcPitch));
+                const __m128i p = _mm_loadu_si128((const __m128i *)(ref + r * refPitch));
+                const __m128i d = _mm_or_si128(_mm_subs_epu8(s, p), _mm_subs_epu8(p, s));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(d, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(d, zero));
+            }
+            // Column pairs, then groups of four columns
+            _mm_storeu_si128((__m128i *)(sad + 4 * by), _mm_hadd_epi32(_mm_madd_epi16(lo, ones), _mm_madd_epi16(hi, ones)));
+        }
+    }
+
+    // Upper bound of the positions the predictive search evaluates per MB and
+    // reference. The exhaustive window has 33 x 25 = 825 of them.
+    static const int kMaxPredictivePositions = 128;
+
+    // Predictive integer search of the MB at (x0, y0) in one reference: the
+    // QPEL candidates (rounded to integer pel) are evaluated, then a large
+    // diamond (8 positions, radius 2) and a small diamond (4 positions,
+    // radius 1) move the cheapest whole-MB match until it stays put. Every
+    // enabled partition keeps its best position among all evaluated ones.
+    // Stops early once the whole-MB match costs at most stopCost (0: never).
+    // Fills the same results as SearchInteger.
+    static void SearchPredictive(const Plane & src, const Plane & ref, int x0, int y0, int paddedWidth, int paddedHeight,
+                                 const cl_short2 * candidates, int numCandidates, cl_short2 costCenter,
+                                 const CostModel & costModel, unsigned enabled, bool haar, uint32_t stopCost,
+                                 PartitionResults & results)
+    {
+        static const int kLargeDiamond[8][2] = { { 0, -2 }, { -1, -1 }, { 1, -1 }, { -2, 0 }, { 2, 0 }, { -1, 1 }, { 1, 1 }, { 0, 2 } };
+        static const int kSmallDiamond[4][2] = { { 0, -1 }, { -1, 0 }, { 1, 0 }, { 0, 1 } };
+
+        // Same reach as the exhaustive search around a clamped center
+        const int reach = kPlaneBorder - kInterpolationMargin;
+        const int minX = -reach - x0, maxX = paddedWidth - 16 + reach - x0;
+        const int minY = -reach - y0, maxY = paddedHeight - 16 + reach - y0;
+
+        const uint8_t * pSrc = src.Ptr(x0, y0);
+        uint32_t bestTotal[NUM_PARTITIONS];
+        int bestLength[NUM_PARTITIONS];
+        for (int p = 0; p < NUM_PARTITIONS; ++p)
+        {
+            bestTotal[p] = 0xFFFFFFFF;
+            bestLength[p] = 0x7FFFFFFF;
+        }
+
+        int visited[kMaxPredictivePositions];
+        int numVisited = 0;
+        uint32_t centerCost = 0xFFFFFFFF;
+        int centerX = 0;
+        int centerY = 0;
+
+        // Evaluates (mvX, mvY) unless it was already, and tells whether it
+        // became the cheapest whole-MB match
+        auto evaluate = [&](int mvX, int mvY) -> bool {
+            mvX = std::min(std::max(mvX, minX), maxX);
+            mvY = std::min(std::max(mvY, minY), maxY);
+            const int key = (mvY << 16) + mvX;
+            if (numVisited == kMaxPredictivePositions || std::find(visited, visited + numVisited, key) != visited + numVisited)
+            {
+                return false;
+            }
+            visited[numVisited++] = key;
+
+            uint32_t sad4x4[16];
+            Sad4x4Blocks(pSrc, src.GetPitch(), ref.Ptr(x0 + mvX, y0 + mvY), ref.GetPitch(), sad4x4);
+
+            uint32_t part[NUM_PARTITIONS];
+            for (int q = 0; q < 4; ++q)
+            {
+                const int b = (q >> 1) * 8 + (q & 1) * 2;
+                const uint32_t s0 = sad4x4[b], s1 = sad4x4[b + 1], s2 = sad4x4[b + 4], s3 = sad4x4[b + 5];
+                part[PART_4x4 + 4 * q + 0] = s0;
+                part[PART_4x4 + 4 * q + 1] = s1;
+                part[PART_4x4 + 4 * q + 2] = s2;
+                part[PART_4x4 + 4 * q + 3] = s3;
+                part[PART_8x4 + 2 * q + 0] = s0 + s1;
+                part[PART_8x4 + 2 * q + 1] = s2 + s3;
+                part[PART_4x8 + 2 * q + 0] = s0 + s2;
+                part[PART_4x8 + 2 * q + 1] = s1 + s3;
+                part[PART_8x8 + q] = s0 + s1 + s2 + s3;
+            }
+            part[PART_16x8 + 0] = part[PART_8x8 + 0] + part[PART_8x8 + 1];
+            part[PART_16x8 + 1] = part[PART_8x8 + 2] + part[PART_8x8 + 3];
+            part[PART_8x16 + 0] = part[PART_8x8 + 0] + part[PART_8x8 + 2];
+            part[PART_8x16 + 1] = part[PART_8x8 + 1] + part[PART_8x8 + 3];
+            part[PART_16x16] = part[PART_16x8 + 0] + part[PART_16x8 + 1];
+
+            const uint32_t cost = costModel.Cost(mvX * 4 - costCenter.s[0], mvY * 4 - costCenter.s[1]);
+            const int length = abs(mvX) + abs(mvY);
+            for (int size = 0; size < 7; ++size)
+            {
+                if (!(enabled & (1 << size)))
+                {
+                    continue;
+                }
+                for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                {
+                    // On ties prefer the shorter vector, as the exhaustive search does
+                    const uint32_t total = part[p] + cost;
+                    if (total < bestTotal[p] || (total == bestTotal[p] && length < bestLength[p]))
+                    {
+                        bestTotal[p] = total;
+                        bestLength[p] = length;
+                        results.dist[p] = part[p];
+                        results.cost[p] = cost;
+                        results.mv[p].s[0] = (cl_short)(mvX * 4);
+                        results.mv[p].s[1] = (cl_short)(mvY * 4);
+                    }
+                }
+            }
+
+            if (part[PART_16x16] + cost < centerCost)
+            {
+                centerCost = part[PART_16x16] + cost;
+                centerX = mvX;
+                centerY = mvY;
+                return true;
+            }
+            return false;
+        };
+
+        for (int i = 0; i < numCandidates; ++i)
+        {
+            evaluate((candidates[i].s[0] + 2) >> 2, (candidates[i].s[1] + 2) >> 2);
+        }
+
+        // Large diamond while the center moves, then small diamond
+        for (int pattern = 0; pattern < 2; ++pattern)
+        {
+            const int (*offsets)[2] = pattern ? kSmallDiamond : kLargeDiamond;
+            const int numOffsets = pattern ? 4 : 8;
+            bool moved = true;
+            while (moved && centerCost > stopCost && numVisited < kMaxPredictivePositions)
+            {
+                moved = false;
+                const int x = centerX;
+                const int y = centerY;
+                for (int i = 0; i < numOffsets; ++i)
+                {
+                    moved |= evaluate(x + offsets[i][0], y + offsets[i][1]);
+                }
+            }
+        }
+
+        // Winners are re-measured in SATD with Haar adjustment
+        if (haar)
+        {
+            for (int size = 0; size < 7; ++size)
+            {
+                if (!(enabled & (1 << size)))
+                {
+                    continue;
+                }
+                for (int p = kPartitionFirst[size]; p < kPartitionFirst[size] + kPartitionCount[size]; ++p)
+                {
+                    int px, py, pw, ph;
+                    GetPartitionRect(p, px, py, pw, ph);
+                    results.dist[p] = SubpelDistortion(ref, src.Ptr(x0 + px, y0 + py), src.GetPitch(),
+                        (x0 + px) * 4 + results.mv[p].s[0], (y0 + py) * 4 + results.mv[p].s[1], pw, ph, haar);
+                }
+            }
+        }
+    }
+
+    // Fractional refinement of one partition, as the FME stage does:
+    // half-pel neighbours first, then quarter-pel.
+    static void RefinePartition(const Plane & ref, const Plane & src, int x, int y, int w, int h, SubPixelMode mode, bool haar,
+                                const CostModel & costModel, cl_short2 costCenter, cl_short2 & mv, uint32_t & dist)
+    {
+        if (mode != SUBPIXEL_MODE_INTEGER)
+        {
+            RefineStep(ref, src.Ptr(x, y), src.GetPitch(), x, y, w, h, haar, costModel, costCenter, 2, mv, dist);
+        }
+        if (mode == SUBPIXEL_MODE_QPEL)
+        {
+            RefineStep(ref, src.Ptr(x, y), src.GetPitch(), x, y, w, h, haar, costModel, costCenter, 1, mv, dist);
+        }
+    }
+
+    // Index of entry (bx, by) of the 4x4 grid of a MB in VME sub-block order
+    static inline int SubBlockIndex(int bx, int by)
+    {
+        return ((by >> 1) * 2 + (bx >> 1)) * 4 + (by & 1) * 2 + (bx & 1);
+    }
+
+    // Number of worker threads for numRows MB rows; 0 selects the number of
+    // hardware threads.
+    static int WorkerThreads(int numThreads, int numRows)
+    {
+        if (numThreads <= 0)
+        {
+            numThreads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        return std::min(numThreads, numRows);
+    }
+
+    // Runs rows(firstRow, lastRow) over contiguous ranges of numRows MB rows
+    // on numThreads worker threads.
+    template <typename RowsFn>
+    static void ForEachRowRange(int numRows, int numThreads, RowsFn rows)
+    {
+        if (numThreads == 1)
+        {
+            rows(0, numRows);
+            return;
+        }
+
+        // MB rows are independent, so hand out contiguous row ranges.
+        std::vector<std::thread> workers;
+        const int rowsPerThread = (numRows + numThreads - 1) / numThreads;
+        for (int first = 0; first < numRows; first += rowsPerThread)
+        {
+            workers.push_back(std::thread(rows, first, std::min(first + rowsPerThread, numRows)));
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].join();
+        }
+    }
+
+    // Dependency bits of the software scoreboard of vme_multi_ref_swsb.cl:
+    // a MB may start once its top, top-left and left neighbors are done.
+    static const int kTopDep = 1 << 0;
+    static const int kTopLeftDep = 1 << 1;
+    static const int kLeftDep = 1 << 2;
+    static const int kAllDeps = kTopDep | kTopLeftDep | kLeftDep;
+
+    // Runs mb(mbX, mbY) for every MB of a mbWidth x mbHeight frame on
+    // numThreads worker threads, each MB after its top, top-left and left
+    // neighbors. The scoreboard is the one of initialize_scoreboard and
+    // signal_scoreboard, but nobody polls it: the atomic fetch_or that sets
+    // the last bit of a MB tells the signaling worker that the MB is ready.
+    // That worker goes on with the first MB it made ready (the right
+    // neighbor whenever it can) and hands the others over to the idle
+    // workers, which sleep until there is work.
+    template <typename MBFn>
+    static void ForEachMBWavefront(int mbWidth, int mbHeight, int numThreads, MBFn mb)
+    {
+        const int numMBs = mbWidth * mbHeight;
+        if (numThreads == 1)
+        {
+            // Raster order satisfies every dependency
+            for (int i = 0; i < numMBs; ++i)
+            {
+                mb(i % mbWidth, i / mbWidth);
+            }
+            return;
+        }
+
+        std::unique_ptr<std::atomic<int>[]> scoreboard(new std::atomic<int>[numMBs]);
+        for (int i = 0; i < numMBs; ++i)
+        {
+            const int x = i % mbWidth;
+            const int y = i / mbWidth;
+            int deps = 0;
+            if (y == 0) deps |= kTopDep;
+            if (x == 0) deps |= kLeftDep;
+            if (x == 0 || y == 0) deps |= kTopLeftDep;
+            scoreboard[i].store(deps, std::memory_order_relaxed);
+        }
+
+        std::atomic<int> numDone(0);
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<int> ready(1, 0);
+        bool finished = false;
+
+        auto worker = [&]() {
+            int next = -1;
+            for (;;)
+            {
+                if (next < 0)
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    wake.wait(guard, [&]() { return !ready.empty() || finished; });
+                    if (ready.empty())
+                    {
+                        return;
+                    }
+                    next = ready.front();
+                    ready.pop_front();
+                }
+
+                const int x = next % mbWidth;
+                const int y = next / mbWidth;
+                mb(x, y);
+
+                // signal_scoreboard. The acq_rel ordering publishes the results
+                // of every signaling MB to the worker that runs the dependent MB.
+                const int dependents[3] = {
+                    x + 1 < mbWidth ? next + 1 : -1,
+                    y + 1 < mbHeight ? next + mbWidth : -1,
+                    x + 1 < mbWidth && y + 1 < mbHeight ? next + mbWidth + 1 : -1
+                };
+                static const int deps[3] = { kLeftDep, kTopDep, kTopLeftDep };
+                int made[3];
+                int numMade = 0;
+                for (int d = 0; d < 3; ++d)
+                {
+                    if (dependents[d] >= 0 &&
+                        (scoreboard[dependents[d]].fetch_or(deps[d], std::memory_order_acq_rel) | deps[d]) == kAllDeps)
+                    {
+                        made[numMade++] = dependents[d];
+                    }
+                }
+
+                next = numMade ? made[0] : -1;
+                const bool last = numDone.fetch_add(1) + 1 == numMBs;
+                if (numMade > 1 || last)
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    for (int i = 1; i < numMade; ++i)
+                    {
+                        ready.push_back(made[i]);
+                    }
+                    finished = last;
+                }
+                if (last)
+                {
+                    wake.notify_all();
+                }
+                else
+                {
+                    for (int i = 1; i < numMade; ++i)
+                    {
+                        wake.notify_one();
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < numThreads; ++t)
+        {
+            workers.push_back(std::thread(worker));
+        }
+        for (size_t i = 0; i < workers.size(); ++i)
+        {
+            workers[i].join();
+        }
+    }
+
+    MotionEstimator::MotionEstimator(int width, int height, const SearchDesc & desc, int numThreads)
+        : m_desc(desc), m_costModel(desc.costTable, desc.costPrecision),
+          m_width(width), m_height(height), m_numThreads(numThreads)
+    {
+        m_mbWidth = (width + 15) / 16;
+        m_mbHeight = (height + 15) / 16;
+
+        if ((m_desc.partitionMask & 0x7F) == 0x7F)
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: the partition mask disables every shape.");
+        }
+
+        m_numThreads = WorkerThreads(m_numThreads, m_mbHeight);
+    }
+
+    void MotionEstimator::CheckPlane(const Plane & plane, bool reference) const
+    {
+        if (plane.GetWidth() != m_width || plane.GetHeight() != m_height)
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: plane size mismatch.");
+        }
+        if (reference && m_desc.subPixelMode != SUBPIXEL_MODE_INTEGER && !plane.IsInterpolated())
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: sub-pel search needs an interpolated reference.");
+        }
+    }
+
+    void MotionEstimator::EstimateFrameMultiRef(
+        const Plane & src,
+        const Plane * const * refs,
+        int numRefs,
+        const cl_short2 * predMVs,
+        cl_short2 * mvs,
+        cl_ushort * residuals,
+        cl_ushort * bestResiduals,
+        cl_uchar2 * shapes,
+        cl_uint * referenceIds,
+        const cl_short2 * colocatedMVs) const
+    {
+        if (numRefs < 0 || numRefs > kMaxReferences)
+        {
+            throw std::runtime_error("CPUVme::MotionEstimator: invalid number of references.");
+        }
+        CheckPlane(src, false);
+        for (int r = 0; r < numRefs; ++r)
+        {
+            CheckPlane(*refs[r], true);
+        }
+        if (numRefs == 0)
+        {
+            return;
+        }
+
+        auto mb = [&](int mbX, int mbY) {
+            EstimateMBMultiRef(mbX, mbY, src, refs, numRefs, predMVs, mvs, residuals, bestResiduals, shapes, referenceIds,
+                               colocatedMVs);
+        };
+        if (m_desc.neighborPredictors)
+        {
+            ForEachMBWavefront(m_mbWidth, m_mbHeight, m_numThreads, mb);
+        }
+        else
+        {
+            ForEachRowRange(m_mbHeight, m_numThreads, [&](int firstRow, int lastRow) {
+                for (int mbY = firstRow; mbY < lastRow; ++mbY)
+                {
+                    for (int mbX = 0; mbX < m_mbWidth; ++mbX)
+                    {
+                        mb(mbX, mbY);
+                    }
+                }
+            });
+        }
+    }
+
+    // Best-so-far results of every partition across search windows and
+    // references, the counterpart of the IME streamin/streamout records.
+    struct MultiRefResults
+    {
+        PartitionResults results;
+        int ref[NUM_PARTITIONS];
+
+        void Reset()
+        {
+            for (int p = 0; p < NUM_PARTITIONS; ++p)
+            {
+                // Low enough that the 16 partitions of a shape cannot overflow
+                results.dist[p] = 0x0FFFFFFF;
+                results.cost[p] = 0;
+                results.mv[p].s[0] = 0;
+                results.mv[p].s[1] = 0;
+                ref[p] = 0;
+            }
+        }
+    };
+
+    // Keeps the cheaper of r, searched in reference refId, and m for every
+    // enabled partition; ties keep m, so closer references and earlier
+    // windows win. The sub-8x8 partitions of a quadrant must share one
+    // reference, so they are taken over together, per minor shape.
+    static void MergeResults(const PartitionResults & r, unsigned enabled, int refId, MultiRefResults & m)
+    {
+        for (int size = 0; size < 7; ++size)
+        {
+            if (!(enabled & (1 << size)))
+            {
+                continue;
+            }
+
+            const int groupSize = size <= 3 ? 1 : kPartitionCount[size] / 4;
+            for (int first = kPartitionFirst[size]; first < kPartitionFirst[size] + kPartitionCount[size]; first += groupSize)
+            {
+                uint32_t total = 0;
+                uint32_t bestTotal = 0;
+                for (int p = first; p < first + groupSize; ++p)
+                {
+                    total += Total(r, p);
+                    bestTotal += Total(m.results, p);
+                }
+                if (total < bestTotal)
+                {
+                    for (int p = first; p < first + groupSize; ++p)
+                    {
+                        m.results.dist[p] = r.dist[p];
+                        m.results.cost[p] = r.cost[p];
+                        m.results.mv[p] = r.mv[p];
+                        m.ref[p] = refId;
+                    }
+                }
+            }
+        }
+    }
+
+    void MotionEstimator::EstimateMBMultiRef(
+        int mbX,
+        int mbY,
+        const Plane & src,
+        const Plane * const * refs,
+        int numRefs,
+        const cl_short2 * predMVs,
+        cl_short2 * mvs,
+        cl_ushort * residuals,
+        cl_ushort * bestResiduals,
+        cl_uchar2 * shapes,
+        cl_uint * referenceIds,
+        const cl_short2 * colocatedMVs) const
+    {
+        const unsigned enabled = ~m_desc.partitionMask & 0x7F;
+        const bool haar = m_desc.sadAdjustMode == SAD_ADJUST_MODE_HAAR;
+        const cl_short2 costCenter = { { 0, 0 } };
+
+        PartitionTracker tracker;
+        PartitionResults results;
+        MultiRefResults best;
+        int parts[16];
+
+        const int mbIndex = mbX + mbY * m_mbWidth;
+        const int x0 = mbX * 16;
+        const int y0 = mbY * 16;
+
+        // The (0, 0) window, then the windows of the predictor, of the left,
+        // top and top-left MBs' first sub-block vectors (the predictors of the
+        // kernel) and of the co-located vector, each unless an earlier window
+        // is the same one. The predictive search starts from the same vectors.
+        cl_short2 candidates[6];
+        int numCandidates = 0;
+        candidates[numCandidates].s[0] = 0;
+        candidates[numCandidates++].s[1] = 0;
+        if (predMVs)
+        {
+            candidates[numCandidates++] = predMVs[mbIndex];
+        }
+        if (m_desc.neighborPredictors)
+        {
+            if (mbX > 0)
+            {
+                candidates[numCandidates++] = mvs[(mbIndex - 1) * 16];
+            }
+            if (mbY > 0)
+            {
+                candidates[numCandidates++] = mvs[(mbIndex - m_mbWidth) * 16];
+            }
+            if (mbX > 0 && mbY > 0)
+            {
+                candidates[numCandidates++] = mvs[(mbIndex - m_mbWidth - 1) * 16];
+            }
+        }
+        if (colocatedMVs)
+        {
+            candidates[numCandidates++] = colocatedMVs[mbIndex * 16];
+        }
+
+        int centers[6][2];
+        int numCenters = 0;
+        for (int i = 0; i < numCandidates; ++i)
+        {
+            int & centerX = centers[numCenters][0];
+            int & centerY = centers[numCenters][1];
+            SearchCenter(&candidates[i], 0, x0, y0, m_mbWidth * 16, m_mbHeight * 16, centerX, centerY);
+            int c = 0;
+            while (c < numCenters && (centers[c][0] != centerX || centers[c][1] != centerY))
+            {
+                ++c;
+            }
+            if (c == numCenters)
+            {
+                ++numCenters;
+            }
+        }
+
+        best.Reset();
+        cl_uchar2 shape;
+        for (int r = 0; r < numRefs; ++r)
+        {
+            if (m_desc.searchMode == SEARCH_MODE_PREDICTIVE)
+            {
+                SearchPredictive(src, *refs[r], x0, y0, m_mbWidth * 16, m_mbHeight * 16, candidates, numCandidates, costCenter,
+                                 m_costModel, enabled, haar, m_desc.predictiveStopDistortion, results);
+                MergeResults(results, enabled, r, best);
+            }
+            else
+            {
+                for (int c = 0; c < numCenters; ++c)
+                {
+                    SearchInteger(src, *refs[r], x0, y0, centers[c][0], centers[c][1], costCenter, m_costModel, enabled, haar,
+                                  tracker, results);
+                    MergeResults(results, enabled, r, best);
+                }
+            }
+
+            if (m_desc.earlyExitDistortion)
+            {
+                uint32_t cost;
+                DecideShape(best.results, enabled, shape, parts, &cost);
+                if (cost <= m_desc.earlyExitDistortion)
+                {
+                    break;
+                }
+            }
+        }
+
+        const int numParts = DecideShape(best.results, enabled, shape, parts);
+
+        cl_uint refIds = 0;
+        uint32_t shapeDist = 0;
+        for (int i = 0; i < numParts; ++i)
+        {
+            const int p = parts[i];
+            int px, py, pw, ph;
+            GetPartitionRect(p, px, py, pw, ph);
+            RefinePartition(*refs[best.ref[p]], src, x0 + px, y0 + py, pw, ph, m_desc.subPixelMode, haar, m_costModel,
+                            costCenter, best.results.mv[p], best.results.dist[p]);
+            shapeDist += best.results.dist[p];
+
+            const cl_ushort dist = (cl_ushort)std::min(best.results.dist[p], 0xFFFFu);
+            for (int by = py / 4; by < (py + ph) / 4; ++by)
+            {
+                for (int bx = px / 4; bx < (px + pw) / 4; ++bx)
+                {
+                    const int b = mbIndex * 16 + SubBlockIndex(bx, by);
+                    mvs[b] = best.results.mv[p];
+                    if (residuals)
+                    {
+                        residuals[b] = dist;
+                    }
+                }
+            }
+            for (int q = 0; q < 4; ++q)
+            {
+                if ((q & 1) * 8 >= px && (q & 1) * 8 < px + pw && (q >> 1) * 8 >= py && (q >> 1) * 8 < py + ph)
+                {
+                    refIds |= (cl_uint)best.ref[p] << (8 * q);
+                }
+            }
+        }
+
+        shapes[mbIndex] = shape;
+        if (bestResiduals)
+        {
+            bestResiduals[mbIndex] = (cl_ushort)std::min(shapeDist, 0xFFFFu);
+        }
+        if (referenceIds)
+        {
+            referenceIds[mbIndex] = refIds;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // IntraEstimator
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Luma predictor modes, same values as CL_AVC_ME_LUMA_PREDICTOR_MODE_*_INTEL.
+    enum LumaMode
+    {
+        LUMA_MODE_VERTICAL,
+        LUMA_MODE_HORIZONTAL,
+        LUMA_MODE_DC,
+        LUMA_MODE_DIAGONAL_DOWN_LEFT,
+        LUMA_MODE_DIAGONAL_DOWN_RIGHT,
+        LUMA_MODE_VERTICAL_RIGHT,
+        LUMA_MODE_HORIZONTAL_DOWN,
+        LUMA_MODE_VERTICAL_LEFT,
+        LUMA_MODE_HORIZONTAL_UP,
+        LUMA_MODE_PLANE = 3,        // 16x16 blocks only
+        NUM_BLOCK_MODES = 9
+    };
+
+    // Chroma predictor modes, same values as CL_AVC_ME_CHROMA_PREDICTOR_MODE_*_INTEL.
+    enum ChromaMode
+    {
+        CHROMA_MODE_DC,
+        CHROMA_MODE_HORIZONTAL,
+        CHROMA_MODE_VERTICAL,
+        CHROMA_MODE_PLANE
+    };
+
+    // Neighbor availability, the counterpart of CLK_AVC_ME_INTRA_NEIGHBOR_*_MASK_ENABLE_INTEL.
+    enum Neighbor
+    {
+        NEIGHBOR_LEFT        = 1,
+        NEIGHBOR_UPPER       = 2,
+        NEIGHBOR_UPPER_LEFT  = 4,
+        NEIGHBOR_UPPER_RIGHT = 8
+    };
+
+    // Neighbors each 4x4/8x8 mode needs (a missing upper-right row is replaced
+    // by the last upper sample, as H.264 does).
+    static const int kBlockModeNeighbors[NUM_BLOCK_MODES] = {
+        NEIGHBOR_UPPER,
+        NEIGHBOR_LEFT,
+        0,
+        NEIGHBOR_UPPER,
+        NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT,
+        NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT,
+        NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT,
+        NEIGHBOR_UPPER,
+        NEIGHBOR_LEFT };
+
+    // (a + 2 * b + c + 2) >> 2 per byte, exact: the floor of the average of
+    // a and c, averaged (rounding up) with b.
+    static inline __m128i Average3(__m128i a, __m128i b, __m128i c)
+    {
+        const __m128i ac = _mm_sub_epi8(_mm_avg_epu8(a, c), _mm_and_si128(_mm_xor_si128(a, c), _mm_set1_epi8(1)));
+        return _mm_avg_epu8(ac, b);
+    }
+
+    // Sample sources of the directional N x N predictors, in three slots:
+    //  - EDGE: the neighbors on one line, e[k] for k in [0, 3N]: the left
+    //    column bottom to top (e[N - 1 - y] = p[-1, y]), the upper-left
+    //    corner (e[N] = p[-1, -1]), the upper and upper-right rows
+    //    (e[N + 1 + x] = p[x, -1]),
+    //  - AVERAGE2: (e[k] + e[k + 1] + 1) >> 1,
+    //  - AVERAGE3: (e[k - 1] + 2 * e[k] + e[k + 1] + 2) >> 2, the line ends
+    //    repeated (e[-1] = e[0], e[3N + 1] = e[3N]).
+    // Every predictor sample of the H.264 equations (8.3.1.2, 8.3.2.2) is one
+    // of these, so a predictor is a byte shuffle of the slots.
+    enum EdgeSlot
+    {
+        SLOT_EDGE,
+        SLOT_AVERAGE2,
+        SLOT_AVERAGE3,
+        NUM_SLOTS
+    };
+
+    // Slot and index of sample (x, y) of the n x n predictor of a luma mode.
+    static void PredictorSample(int mode, int n, int x, int y, int & slot, int & k)
+    {
+        switch (mode)
+        {
+        case LUMA_MODE_VERTICAL:
+            slot = SLOT_EDGE; k = n + 1 + x;
+            break;
+        case LUMA_MODE_HORIZONTAL:
+            slot = SLOT_EDGE; k = n - 1 - y;
+            break;
+        case LUMA_MODE_DIAGONAL_DOWN_LEFT:
+            slot = SLOT_AVERAGE3; k = n + 2 + x + y;
+            break;
+        case LUMA_MODE_DIAGONAL_DOWN_RIGHT:
+            slot = SLOT_AVERAGE3; k = n + x - y;
+            break;
+        case LUMA_MODE_VERTICAL_RIGHT:
+        {
+            const int z = 2 * x - y;
+            if (z >= 0)
+            {
+                slot = (z & 1) ? SLOT_AVERAGE3 : SLOT_AVERAGE2; k = n + x - (y >> 1);
+            }
+            else
+            {
+                slot = SLOT_AVERAGE3; k = z == -1 ? n : n + 1 + 2 * x - y;
+            }
+            break;
+        }
+        case LUMA_MODE_HORIZONTAL_DOWN:
+        {
+            const int z = 2 * y - x;
+            if (z >= 0)
+            {
+                slot = (z & 1) ? SLOT_AVERAGE3 : SLOT_AVERAGE2; k = n - 1 - y + (x >> 1) + (z & 1);
+            }
+            else
+            {
+                slot = SLOT_AVERAGE3; k = z == -1 ? n : n - 1 + x - 2 * y;
+            }
+            break;
+        }
+        case LUMA_MODE_VERTICAL_LEFT:
+            slot = (y & 1) ? SLOT_AVERAGE3 : SLOT_AVERAGE2; k = n + 1 + x + (y >> 1) + (y & 1);
+            break;
+        case LUMA_MODE_HORIZONTAL_UP:
+        {
+            const int z = x + 2 * y;
+            if (z > 2 * n - 3)
+            {
+                slot = SLOT_EDGE; k = 0;
+            }
+            else if (z == 2 * n - 3)
+            {
+                slot = SLOT_AVERAGE3; k = 0;
+            }
+            else
+            {
+                slot = (z & 1) ? SLOT_AVERAGE3 : SLOT_AVERAGE2; k = n - 2 - y - (x >> 1);
+            }
+            break;
+        }
+        default:
+            slot = SLOT_EDGE; k = 0;
+            break;
+        }
+    }
+
+    // pshufb controls generating the N x N predictors from the slots: per mode
+    // (DC has none), per 16 sample chunk of the predictor (raster order) and
+    // per 16 byte register of the slots. Built once at start-up.
+    template <int N>
+    struct PredictorTables
+    {
+        static const int kSlotSize = N == 4 ? 16 : 32;
+        static const int kRegisters = NUM_SLOTS * kSlotSize / 16;
+        static const int kChunks = N * N / 16;
+
+        PredictorTables();
+
+        __m128i control[NUM_BLOCK_MODES][kChunks][kRegisters];
+    };
+
+    template <int N>
+    PredictorTables<N>::PredictorTables()
+    {
+        for (int mode = 0; mode < NUM_BLOCK_MODES; ++mode)
+        {
+            CPU_VME_ALIGN(16) uint8_t bytes[kChunks][kRegisters][16];
+            memset(bytes, 0x80, sizeof(bytes));
+            if (mode != LUMA_MODE_DC)
+            {
+                for (int y = 0; y < N; ++y)
+                {
+                    for (int x = 0; x < N; ++x)
+                    {
+                        int slot, k;
+                        PredictorSample(mode, N, x, y, slot, k);
+                        const int source = slot * kSlotSize + k;
+                        const int i = y * N + x;
+                        bytes[i / 16][source / 16][i % 16] = (uint8_t)(source % 16);
+                    }
+                }
+            }
+            for (int c = 0; c < kChunks; ++c)
+            {
+                for (int r = 0; r < kRegisters; ++r)
+                {
+                    control[mode][c][r] = _mm_load_si128((const __m128i *)bytes[c][r]);
+                }
+            }
+        }
+    }
+
+    static const PredictorTables<4> s_predictorTables4x4;
+    static const PredictorTables<8> s_predictorTables8x8;
+
+    template <int N> static inline const PredictorTables<N> & GetPredictorTables();
+    template <> inline const PredictorTables<4> & GetPredictorTables<4>() { return s_predictorTables4x4; }
+    template <> inline const PredictorTables<8> & GetPredictorTables<8>() { return s_predictorTables8x8; }
+
+    // Fills the AVERAGE2 and AVERAGE3 slots from the edge line e[0..3N] held
+    // in line[1..3N + 1]; line[0] and line[3N + 2] get the repeated ends.
+    template <int N>
+    static void BuildSlots(uint8_t * line, uint8_t * slots)
+    {
+        static const int kSlotSize = PredictorTables<N>::kSlotSize;
+        line[0] = line[1];
+        line[3 * N + 2] = line[3 * N + 1];
+        for (int k = 0; k < 3 * N + 1; k += 16)
+        {
+            const __m128i a = _mm_loadu_si128((const __m128i *)(line + k));
+            const __m128i b = _mm_loadu_si128((const __m128i *)(line + k + 1));
+            const __m128i c = _mm_loadu_si128((const __m128i *)(line + k + 2));
+            _mm_store_si128((__m128i *)(slots + SLOT_EDGE * kSlotSize + k), b);
+            _mm_store_si128((__m128i *)(slots + SLOT_AVERAGE2 * kSlotSize + k), _mm_avg_epu8(b, c));
+            _mm_store_si128((__m128i *)(slots + SLOT_AVERAGE3 * kSlotSize + k), Average3(a, b, c));
+        }
+    }
+
+    // N x N predictor (pitch N) of a directional, vertical or horizontal mode.
+    template <int N>
+    static void ShufflePrediction(const PredictorTables<N> & tables, const uint8_t * slots, int mode, uint8_t * pred)
+    {
+        static const int kRegisters = PredictorTables<N>::kRegisters;
+        __m128i sources[kRegisters];
+        for (int r = 0; r < kRegisters; ++r)
+        {
+            sources[r] = _mm_load_si128((const __m128i *)(slots + r * 16));
+        }
+        for (int c = 0; c < PredictorTables<N>::kChunks; ++c)
+        {
+            __m128i samples = _mm_setzero_si128();
+            for (int r = 0; r < kRegisters; ++r)
+            {
+                samples = _mm_or_si128(samples, _mm_shuffle_epi8(sources[r], tables.control[mode][c][r]));
+            }
+            _mm_store_si128((__m128i *)(pred + c * 16), samples);
+        }
+    }
+
+    // Mean of the available neighbors, 128 without any (8.3.1.2.3, 8.3.2.2.4, 8.3.3.3).
+    static inline int DcValue(int sumLeft, int sumUpper, int n, int log2n, int neighbors)
+    {
+        const bool left = (neighbors & NEIGHBOR_LEFT) != 0;
+        const bool upper = (neighbors & NEIGHBOR_UPPER) != 0;
+        if (left && upper)
+        {
+            return (sumLeft + sumUpper + n) >> (log2n + 1);
+        }
+        if (left || upper)
+        {
+            return ((left ? sumLeft : sumUpper) + n / 2) >> log2n;
+        }
+        return 128;
+    }
+
+    // Plane predictor (pitch size) of 8.3.3.4 and 8.3.4.4: pred[x, y] =
+    // Clip1((a + b * (x - c) + c * (y - c) + 16) >> 5) with c = size / 2 - 1.
+    // All intermediate values fit in 16 bits for 8 and 16 sample blocks.
+    static void PlanePrediction(const uint8_t * upper, const uint8_t * left, int corner, int size, int scale, int shift,
+                                uint8_t * pred)
+    {
+        const int half = size / 2;
+        int h = 0, v = 0;
+        for (int i = 0; i < half; ++i)
+        {
+            const int before = half - 2 - i;
+            h += (i + 1) * (upper[half + i] - (before < 0 ? corner : upper[before]));
+            v += (i + 1) * (left[half + i] - (before < 0 ? corner : left[before]));
+        }
+        const int a = 16 * (left[size - 1] + upper[size - 1]);
+        const int b = (scale * h + (1 << (shift - 1))) >> shift;
+        const int c = (scale * v + (1 << (shift - 1))) >> shift;
+
+        const __m128i ramp = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i lo = _mm_add_epi16(_mm_set1_epi16((short)(a + 16 - (half - 1) * (b + c))),
+                                         _mm_mullo_epi16(ramp, _mm_set1_epi16((short)b)));
+        const __m128i hi = _mm_add_epi16(lo, _mm_set1_epi16((short)(8 * b)));
+        const __m128i step = _mm_set1_epi16((short)c);
+        __m128i rowLo = lo, rowHi = hi;
+        for (int y = 0; y < size; ++y)
+        {
+            const __m128i row = _mm_packus_epi16(_mm_srai_epi16(rowLo, 5), _mm_srai_epi16(rowHi, 5));
+            if (size == 16)
+            {
+                _mm_store_si128((__m128i *)(pred + y * size), row);
+            }
+            else
+            {
+                _mm_storel_epi64((__m128i *)(pred + y * size), row);
+            }
+            rowLo = _mm_add_epi16(rowLo, step);
+            rowHi = _mm_add_epi16(rowHi, step);
+        }
+    }
+
+    // Copy of the source MB and its neighbors: rows -1 to 15, columns -1 to
+    // 23 (upper-right MB included) around the MB origin.
+    static const int kIntraWindowPitch = 32;
+
+    struct IntraWindow
+    {
+        const uint8_t * At(int x, int y) const { return samples + (y + 1) * kIntraWindowPitch + x + 1; }
+
+        CPU_VME_ALIGN(16) uint8_t samples[17 * kIntraWindowPitch];
+    };
+
+    static void LoadIntraWindow(const Plane & src, int x0, int y0, IntraWindow & w)
+    {
+        for (int y = 0; y < 17; ++y)
+        {
+            const uint8_t * p = src.Ptr(x0 - 1, y0 - 1 + y);
+            _mm_store_si128((__m128i *)(w.samples + y * kIntraWindowPitch), _mm_loadu_si128((const __m128i *)p));
+            _mm_store_si128((__m128i *)(w.samples + y * kIntraWindowPitch + 16), _mm_loadu_si128((const __m128i *)(p + 16)));
+        }
+    }
+
+    // Best mode of the N x N luma block at (x, y) of the MB, and its distortion.
+    template <int N>
+    static uint32_t SearchBlockModes(const IntraWindow & w, int x, int y, int neighbors, bool haar, cl_char & bestMode)
+    {
+        static const int kSlotSize = PredictorTables<N>::kSlotSize;
+        const PredictorTables<N> & tables = GetPredictorTables<N>();
+
+        // Edge line: left column bottom to top, corner, upper and upper-right rows
+        CPU_VME_ALIGN(16) uint8_t line[48] = { 0 };
+        for (int j = 0; j < N; ++j)
+        {
+            line[1 + N - 1 - j] = w.At(x - 1, y + j)[0];
+        }
+        memcpy(line + 1 + N, w.At(x - 1, y - 1), N + 1);
+        if (neighbors & NEIGHBOR_UPPER_RIGHT)
+        {
+            memcpy(line + 2 + 2 * N, w.At(x + N, y - 1), N);
+        }
+        else
+        {
+            memset(line + 2 + 2 * N, line[1 + 2 * N], N);
+        }
+
+        CPU_VME_ALIGN(16) uint8_t slots[NUM_SLOTS * kSlotSize];
+        if (N == 8)
+        {
+            // 8x8 blocks predict from the [1, 2, 1] filtered neighbors (8.3.2.2.1).
+            BuildSlots<N>(line, slots);
+            const uint8_t * e = line + 1;
+            uint8_t * filtered = slots + SLOT_AVERAGE3 * kSlotSize;
+            if (!(neighbors & NEIGHBOR_UPPER_LEFT))
+            {
+                filtered[N + 1] = (uint8_t)((3 * e[N + 1] + e[N + 2] + 2) >> 2);
+                filtered[N - 1] = (uint8_t)((3 * e[N - 1] + e[N - 2] + 2) >> 2);
+            }
+            else if (!(neighbors & NEIGHBOR_LEFT))
+            {
+                filtered[N] = (uint8_t)((3 * e[N] + e[N + 1] + 2) >> 2);
+            }
+            else if (!(neighbors & NEIGHBOR_UPPER))
+            {
+                filtered[N] = (uint8_t)((3 * e[N] + e[N - 1] + 2) >> 2);
+            }
+            memcpy(line + 1, filtered, 3 * N + 1);
+        }
+        BuildSlots<N>(line, slots);
+
+        const uint8_t * src = w.At(x, y);
+        CPU_VME_ALIGN(16) uint8_t pred[N * N];
+        uint32_t best = 0xFFFFFFFF;
+        for (int mode = 0; mode < NUM_BLOCK_MODES; ++mode)
+        {
+            if ((kBlockModeNeighbors[mode] & neighbors) != kBlockModeNeighbors[mode])
+            {
+                continue;
+            }
+            if (mode == LUMA_MODE_DC)
+            {
+                int sumLeft = 0, sumUpper = 0;
+                for (int i = 0; i < N; ++i)
+                {
+                    sumLeft += line[1 + i];
+                    sumUpper += line[2 + N + i];
+                }
+                memset(pred, DcValue(sumLeft, sumUpper, N, N == 4 ? 2 : 3, neighbors), N * N);
+            }
+            else
+            {
+                ShufflePrediction<N>(tables, slots, mode, pred);
+            }
+            const uint32_t dist = BlockDistortion(src, kIntraWindowPitch, pred, NULL, N, N, N, haar);
+            if (dist < best)
+            {
+                best = dist;
+                bestMode = (cl_char)mode;
+            }
+        }
+        return best;
+    }
+
+    // Best 16x16 mode of the MB, and its distortion.
+    static uint32_t Search16x16Modes(const IntraWindow & w, int neighbors, bool haar, cl_char & bestMode)
+    {
+        CPU_VME_ALIGN(16) uint8_t left[16];
+        for (int y = 0; y < 16; ++y)
+        {
+            left[y] = w.At(-1, y)[0];
+        }
+        const uint8_t * upper = w.At(0, -1);
+        const __m128i upperRow = _mm_loadu_si128((const __m128i *)upper);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i leftSum = _mm_sad_epu8(_mm_load_si128((const __m128i *)left), zero);
+        const __m128i upperSum = _mm_sad_epu8(upperRow, zero);
+
+        CPU_VME_ALIGN(16) uint8_t pred[256];
+        uint32_t best = 0xFFFFFFFF;
+        for (int mode = 0; mode < 4; ++mode)
+        {
+            switch (mode)
+            {
+            case LUMA_MODE_VERTICAL:
+                if (!(neighbors & NEIGHBOR_UPPER))
+                {
+                    continue;
+                }
+                for (int y = 0; y < 16; ++y)
+                {
+                    _mm_store_si128((__m128i *)(pred + y * 16), upperRow);
+                }
+                break;
+            case LUMA_MODE_HORIZONTAL:
+                if (!(neighbors & NEIGHBOR_LEFT))
+                {
+                    continue;
+                }
+                for (int y = 0; y < 16; ++y)
+                {
+                    _mm_store_si128((__m128i *)(pred + y * 16), _mm_set1_epi8((char)left[y]));
+                }
+                break;
+            case LUMA_MODE_DC:
+                memset(pred, DcValue(_mm_cvtsi128_si32(leftSum) + _mm_extract_epi32(leftSum, 2),
+                                     _mm_cvtsi128_si32(upperSum) + _mm_extract_epi32(upperSum, 2), 16, 4, neighbors), 256);
+                break;
+            default:
+                if ((neighbors & (NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT)) != (NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT))
+                {
+                    continue;
+                }
+                PlanePrediction(upper, left, upper[-1], 16, 5, 6, pred);
+                break;
+            }
+            const uint32_t dist = BlockDistortion(w.At(0, 0), kIntraWindowPitch, pred, NULL, 16, 16, 16, haar);
+            if (dist < best)
+            {
+                best = dist;
+                bestMode = (cl_char)mode;
+            }
+        }
+        return best;
+    }
+
+    // Chroma predictor (pitch 8) of one component of the MB.
+    static void ChromaPrediction(int mode, const uint8_t * upper, const uint8_t * left, int corner, int neighbors, uint8_t * pred)
+    {
+        switch (mode)
+        {
+        case CHROMA_MODE_DC:
+            // One DC per 4x4 block (8.3.4.1 - 8.3.4.3): the upper-right block
+            // prefers the upper neighbors, the lower-left one the left ones.
+            for (int by = 0; by < 2; ++by)
+            {
+                for (int bx = 0; bx < 2; ++bx)
+                {
+                    int sumLeft = 0, sumUpper = 0;
+                    for (int i = 0; i < 4; ++i)
+                    {
+                        sumLeft += left[by * 4 + i];
+                        sumUpper += upper[bx * 4 + i];
+                    }
+                    int value;
+                    if (bx == by)
+                    {
+                        value = DcValue(sumLeft, sumUpper, 4, 2, neighbors);
+                    }
+                    else
+                    {
+                        const int preferred = bx ? NEIGHBOR_UPPER : NEIGHBOR_LEFT;
+                        value = DcValue(sumLeft, sumUpper, 4, 2, (neighbors & preferred) ? preferred : neighbors);
+                    }
+                    for (int y = 0; y < 4; ++y)
+                    {
+                        memset(pred + (by * 4 + y) * 8 + bx * 4, value, 4);
+                    }
+                }
+            }
+            break;
+        case CHROMA_MODE_HORIZONTAL:
+            for (int y = 0; y < 8; ++y)
+            {
+                memset(pred + y * 8, left[y], 8);
+            }
+            break;
+        case CHROMA_MODE_VERTICAL:
+            for (int y = 0; y < 8; ++y)
+            {
+                memcpy(pred + y * 8, upper, 8);
+            }
+            break;
+        default:
+            PlanePrediction(upper, left, corner, 8, 34, 6, pred);
+            break;
+        }
+    }
+
+    // Best chroma mode of the MB (both components predicted with the same mode),
+    // and its distortion: the sum of both components' distortions.
+    static uint32_t SearchChromaModes(const Plane & srcU, const Plane & srcV, int x0, int y0, int neighbors, bool haar,
+                                      cl_char & bestMode)
+    {
+        const Plane * planes[2] = { &srcU, &srcV };
+        uint8_t upper[2][8], left[2][8];
+        int corner[2];
+        for (int c = 0; c < 2; ++c)
+        {
+            memcpy(upper[c], planes[c]->Ptr(x0, y0 - 1), 8);
+            for (int y = 0; y < 8; ++y)
+            {
+                left[c][y] = planes[c]->Ptr(x0 - 1, y0 + y)[0];
+            }
+            corner[c] = planes[c]->Ptr(x0 - 1, y0 - 1)[0];
+        }
+
+        static const int kNeeds[4] = { 0, NEIGHBOR_LEFT, NEIGHBOR_UPPER, NEIGHBOR_LEFT | NEIGHBOR_UPPER | NEIGHBOR_UPPER_LEFT };
+        CPU_VME_ALIGN(16) uint8_t pred[64];
+        uint32_t best = 0xFFFFFFFF;
+        for (int mode = 0; mode < 4; ++mode)
+        {
+            if ((kNeeds[mode] & neighbors) != kNeeds[mode])
+            {
+                continue;
+            }
+            uint32_t dist = 0;
+            for (int c = 0; c < 2; ++c)
+            {
+                ChromaPrediction(mode, upper[c], left[c], corner[c], neighbors, pred);
+                dist += BlockDistortion(planes[c]->Ptr(x0, y0), planes[c]->GetPitch(), pred, NULL, 8, 8, 8, haar);
+            }
+            if (dist < best)
+            {
+                best = dist;
+                bestMode = (cl_char)mode;
+            }
+        }
+        return best;
+    }
+
+    // Neighbors of the 4x4 (n = 1) or 8x8 (n = 2) block (bx, by), in block
+    // units, given those of the MB. Blocks inside the MB are available when they
+    // precede the block in VME sub-block order.
+    static int BlockNeighbors(int bx, int by, int n, int mbNeighbors)
+    {
+        const int last = 4 / n - 1;
+        int neighbors = 0;
+        if (bx > 0 || (mbNeighbors & NEIGHBOR_LEFT))
+        {
+            neighbors |= NEIGHBOR_LEFT;
+        }
+        if (by > 0 || (mbNeighbors & NEIGHBOR_UPPER))
+        {
+            neighbors |= NEIGHBOR_UPPER;
+        }
+        if (bx > 0 && by > 0)
+        {
+            neighbors |= NEIGHBOR_UPPER_LEFT;
+        }
+        else if ((bx > 0 ? NEIGHBOR_UPPER : by > 0 ? NEIGHBOR_LEFT : NEIGHBOR_UPPER_LEFT) & mbNeighbors)
+        {
+            neighbors |= NEIGHBOR_UPPER_LEFT;
+        }
+        if (by == 0)
+        {
+            if ((bx < last ? NEIGHBOR_UPPER : NEIGHBOR_UPPER_RIGHT) & mbNeighbors)
+            {
+                neighbors |= NEIGHBOR_UPPER_RIGHT;
+            }
+        }
+        else if (bx < last && SubBlockIndex((bx + 1) * n, (by - 1) * n) < SubBlockIndex(bx * n, by * n))
+        {
+            neighbors |= NEIGHBOR_UPPER_RIGHT;
+        }
+        return neighbors;
+    }
+
+    IntraEstimator::IntraEstimator(int width, int height, cl_uchar partitionMask, SadAdjustMode sadAdjustMode, int numThreads)
+        : m_partitionMask(partitionMask), m_sadAdjustMode(sadAdjustMode),
+          m_width(width), m_height(height), m_numThreads(numThreads)
+    {
+        m_mbWidth = (width + 15) / 16;
+        m_mbHeight = (height + 15) / 16;
+
+        if ((m_partitionMask & 0x7) == 0x7)
+        {
+            throw std::runtime_error("CPUVme::IntraEstimator: the partition mask disables every block size.");
+        }
+
+        m_numThreads = WorkerThreads(m_numThreads, m_mbHeight);
+    }
+
+    void IntraEstimator::EstimateFrame(
+        const Plane & src,
+        const Plane * srcU,
+        const Plane * srcV,
+        cl_char * modes,
+        cl_ushort * residuals,
+        cl_uchar * shapes,
+        cl_ushort * blockResiduals) const
+    {
+        if (src.GetWidth() != m_width || src.GetHeight() != m_height)
+        {
+            throw std::runtime_error("CPUVme::IntraEstimator: plane size mismatch.");
+        }
+        if ((srcU == NULL) != (srcV == NULL))
+        {
+            throw std::runtime_error("CPUVme::IntraEstimator: both chroma planes are needed.");
+        }
+        for (int c = 0; srcU && c < 2; ++c)
+        {
+            const Plane * plane = c ? srcV : srcU;
+            if (plane->GetWidth() != (m_width + 1) / 2 || plane->GetHeight() != (m_height + 1) / 2)
+            {
+                throw std::runtime_error("CPUVme::IntraEstimator: chroma plane size mismatch.");
+            }
+        }
+
+        ForEachRowRange(m_mbHeight, m_numThreads, [&](int firstRow, int lastRow) {
+            EstimateRows(firstRow, lastRow, src, srcU, srcV, modes, residuals, shapes, blockResiduals);
+        });
+    }
+
+    void IntraEstimator::EstimateRows(
+        int firstRow,
+        int lastRow,
+        const Plane & src,
+        const Plane * srcU,
+        const Plane * srcV,
+        cl_char * modes,
+        cl_ushort * residuals,
+        cl_uchar * shapes,
+        cl_ushort * blockResiduals) const
+    {
+        const bool haar = m_sadAdjustMode == SAD_ADJUST_MODE_HAAR;
+        IntraWindow window;
+
+        for (int mbY = firstRow; mbY < lastRow; ++mbY)
+        {
+            for (int mbX = 0; mbX < m_mbWidth; ++mbX)
+            {
+                const int mbIndex = mbY * m_mbWidth + mbX;
+                cl_char * mbModes = modes + mbIndex * kIntraModesPerMB;
+
+                // Same neighbor availability as block_intrapred_intel
+                int neighbors = 0;
+                if (mbX > 0)
+                {
+                    neighbors |= NEIGHBOR_LEFT;
+                }
+                if (mbY > 0)
+                {
+                    neighbors |= NEIGHBOR_UPPER;
+                    if (mbX > 0)
+                    {
+                        neighbors |= NEIGHBOR_UPPER_LEFT;
+                    }
+                    if (mbX < m_mbWidth - 1)
+                    {
+                        neighbors |= NEIGHBOR_UPPER_RIGHT;
+                    }
+                }
+
+                LoadIntraWindow(src, mbX * 16, mbY * 16, window);
+
+                uint32_t dists[3] = { 0, 0, 0 };
+                int bestShape = -1;
+                for (int shape = INTRA_SHAPE_16x16; shape <= INTRA_SHAPE_4x4; ++shape)
+                {
+                    if (m_partitionMask & (1 << shape))
+                    {
+                        continue;
+                    }
+                    if (shape == INTRA_SHAPE_16x16)
+                    {
+                        dists[shape] = Search16x16Modes(window, neighbors, haar, mbModes[0]);
+                    }
+                    else if (shape == INTRA_SHAPE_8x8)
+                    {
+                        for (int q = 0; q < 4; ++q)
+                        {
+                            const int bx = q & 1, by = q >> 1;
+                            dists[shape] += SearchBlockModes<8>(window, bx * 8, by * 8,
+                                BlockNeighbors(bx, by, 2, neighbors), haar, mbModes[1 + q]);
+                        }
+                    }
+                    else
+                    {
+                        for (int by = 0; by < 4; ++by)
+                        {
+                            for (int bx = 0; bx < 4; ++bx)
+                            {
+                                dists[shape] += SearchBlockModes<4>(window, bx * 4, by * 4,
+                                    BlockNeighbors(bx, by, 1, neighbors), haar, mbModes[5 + SubBlockIndex(bx, by)]);
+                            }
+                        }
+                    }
+                    // Ties keep the larger block size
+                    if (bestShape < 0 || dists[shape] < dists[bestShape])
+                    {
+                        bestShape = shape;
+                    }
+                }
+
+                uint32_t chromaDist = 0;
+                if (srcU)
+                {
+                    chromaDist = SearchChromaModes(*srcU, *srcV, mbX * 8, mbY * 8, neighbors, haar, mbModes[kIntraModesPerMB - 1]);
+                }
+
+                shapes[mbIndex] = (cl_uchar)bestShape;
+                residuals[mbIndex] = (cl_ushort)std::min(dists[bestShape], 0xFFFFu);
+                if (blockResiduals)
+                {
+                    cl_ushort * r = blockResiduals + mbIndex * kIntraResidualsPerMB;
+                    for (int shape = 0; shape < 3; ++shape)
+                    {
+                        r[shape] = (cl_ushort)std::min(dists[shape], 0xFFFFu);
+                    }
+                    r[3] = (cl_ushort)std::min(chromaDist, 0xFFFFu);
+                }
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // Pyramid
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    static void CheckHierarchicalDesc(const HierarchicalDesc & desc)
+    {
+        if (desc.numLevels < 1 || desc.numLevels > kMaxHierarchyLevels)
+        {
+            throw std::runtime_error("CPUVme::HierarchicalDesc: invalid number of levels.");
+        }
+        if (desc.levelScale != 2 && desc.levelScale != 4)
+        {
+            throw std::runtime_error("CPUVme::HierarchicalDesc: the level scale must be 2 or 4.");
+        }
+        if (desc.refineRadius < 0 || desc.refineRadius > kSearchRadiusY)
+        {
+            throw std::runtime_error("CPUVme::HierarchicalDesc: invalid refinement radius.");
+        }
+    }
+
+    Pyramid::Pyramid(int width, int height, const HierarchicalDesc & desc)
+        : m_levelScale(desc.levelScale)
+    {
+        CheckHierarchicalDesc(desc);
+
+        m_levels.reserve(desc.numLevels);
+        m_halfLevels.reserve(desc.numLevels);
+        m_levels.push_back(Plane(width, height));
+        for (int level = 1; level < desc.numLevels; ++level)
+        {
+            width = (width + 1) / 2;
+            height = (height + 1) / 2;
+            if (m_levelScale == 4)
+            {
+                m_halfLevels.push_back(Plane(width, height));
+                width = (width + 1) / 2;
+                height = (height + 1) / 2;
+            }
+            m_levels.push_back(Plane(width, height));
+        }
+    }
+
+    void Pyramid::Load(const uint8_t * pSrc, int pitch)
+    {
+        m_levels[0].Load(pSrc, pitch);
+        for (size_t level = 1; level < m_levels.size(); ++level)
+        {
+            if (m_levelScale == 4)
+            {
+                m_halfLevels[level - 1].Decimate2x(m_levels[level - 1]);
+                m_levels[level].Decimate2x(m_halfLevels[level - 1]);
+            }
+            else
+            {
+                m_levels[level].Decimate2x(m_levels[level - 1]);
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    // HierarchicalEstimator
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // Clamps one component of a search center so that every candidate of a
+    // +/- radius window around it stays inside the replicated border.
+    static inline int ClampCenter(int center, int origin, int paddedSize, int radius)
+    {
+        const int margin = kPlaneBorder - radius;
+        return std::min(std::max(center, -margin - origin), paddedSize - 16 + margin - origin);
+    }
+
+    // Best 16x16 SAD match of the MB at (x0, y0) over the integer positions
+    // [-radiusX, radiusX] x [-radiusY, radiusY] around (centerX, centerY).
+    // Ties go to the shorter vector. mv is in pixels of the plane.
+    static void SearchWindow16x16(const Plane & src, const Plane & ref, int x0, int y0, int centerX, int centerY,
+                                  int radiusX, int radiusY, cl_short2 & mv, uint32_t & sad)
+    {
+        static const SadRowFn sadRow = SelectSadRow();
+        uint32_t rowSads[2 * kSearchRadiusX + 2];
+
+        const uint8_t * pSrc = src.Ptr(x0, y0);
+        for (int dy = centerY - radiusY; dy <= centerY + radiusY; ++dy)
+        {
+            sadRow(pSrc, src.GetPitch(), ref.Ptr(x0 + centerX - radiusX, y0 + dy), ref.GetPitch(), 2 * radiusX + 1, rowSads);
+            for (int i = 0; i <= 2 * radiusX; ++i)
+            {
+                const int dx = centerX - radiusX + i;
+                const int length = std::abs(dx) + std::abs(dy);
+                if (rowSads[i] < sad || (rowSads[i] == sad && length < std::abs(mv.s[0]) + std::abs(mv.s[1])))
+                {
+                    sad = rowSads[i];
+                    mv.s[0] = (cl_short)dx;
+                    mv.s[1] = (cl_short)dy;
+                }
+            }
+        }
+    }
+
+    HierarchicalEstimator::HierarchicalEstimator(int width, int height, const HierarchicalDesc & desc, int numThreads)
+        : m_desc(desc), m_width(width), m_height(height), m_numThreads(numThreads)
+    {
+        CheckHierarchicalDesc(m_desc);
+
+        for (int level = 0; level < m_desc.numLevels; ++level)
+        {
+            m_mbWidth[level] = (width + 15) / 16;
+            m_mbHeight[level] = (height + 15) / 16;
+            for (int i = 1; i < m_desc.levelScale; i *= 2)
+            {
+                width = (width + 1) / 2;
+                height = (height + 1) / 2;
+            }
+        }
+    }
+
+    void HierarchicalEstimator::CheckPyramid(const Pyramid & pyramid) const
+    {
+        if (pyramid.GetNumLevels() != m_desc.numLevels || pyramid.GetLevelScale() != m_desc.levelScale ||
+            pyramid.GetLevel(0).GetWidth() != m_width || pyramid.GetLevel(0).GetHeight() != m_height)
+        {
+            throw std::runtime_error("CPUVme::HierarchicalEstimator: pyramid mismatch.");
+        }
+    }
+
+    void HierarchicalEstimator::EstimateFrame(const Pyramid & src, const Pyramid & ref, cl_short2 * predMVs) const
+    {
+        CheckPyramid(src);
+        CheckPyramid(ref);
+
+        // Vectors of the level being searched and of its parent level, in
+        // pixels of their own level
+        std::vector<cl_short2> mvs;
+        std::vector<cl_short2> parentMVs;
+
+        for (int level = m_desc.numLevels - 1; level >= 0; --level)
+        {
+            mvs.resize(m_mbWidth[level] * m_mbHeight[level]);
+            const cl_short2 * pParentMVs = parentMVs.empty() ? NULL : &parentMVs[0];
+
+            ForEachRowRange(m_mbHeight[level], WorkerThreads(m_numThreads, m_mbHeight[level]), [&](int firstRow, int lastRow) {
+                EstimateRows(level, firstRow, lastRow, src.GetLevel(level), ref.GetLevel(level), pParentMVs, &mvs[0]);
+            });
+
+            mvs.swap(parentMVs);
+        }
+
+        for (size_t i = 0; i < parentMVs.size(); ++i)
+        {
+            predMVs[i].s[0] = (cl_short)(parentMVs[i].s[0] * 4);
+            predMVs[i].s[1] = (cl_short)(parentMVs[i].s[1] * 4);
+        }
+    }
+
+    void HierarchicalEstimator::EstimateRows(
+        int level,
+        int firstRow,
+        int lastRow,
+        const Plane & src,
+        const Plane & ref,
+        const cl_short2 * parentMVs,
+        cl_short2 * mvs) const
+    {
+        const int scale = m_desc.levelScale;
+        const int radius = m_desc.refineRadius;
+        const int paddedWidth = m_mbWidth[level] * 16;
+        const int paddedHeight = m_mbHeight[level] * 16;
+
+        for (int mbY = firstRow; mbY < lastRow; ++mbY)
+        {
+            for (int mbX = 0; mbX < m_mbWidth[level]; ++mbX)
+            {
+                const int x0 = mbX * 16;
+                const int y0 = mbY * 16;
+                cl_short2 mv = { { 0, 0 } };
+                uint32_t sad = 0xFFFFFFFF;
+
+                if (!parentMVs)
+                {
+                    const int centerX = ClampCenter(0, x0, paddedWidth, kSearchRadiusX);
+                    const int centerY = ClampCenter(0, y0, paddedHeight, kSearchRadiusY);
+                    SearchWindow16x16(src, ref, x0, y0, centerX, centerY, kSearchRadiusX, kSearchRadiusY, mv, sad);
+                    mvs[mbX + mbY * m_mbWidth[level]] = mv;
+                    continue;
+                }
+
+                // The parent block, its horizontal and vertical neighbours on
+                // the side of this MB, and (0, 0). Every block of the parent
+                // level is scale x scale MBs of this one.
+                const int parentWidth = m_mbWidth[level + 1];
+                const int parentHeight = m_mbHeight[level + 1];
+                const int px = mbX / scale;
+                const int py = mbY / scale;
+                const int nx = std::min(std::max(px + (mbX % scale < scale / 2 ? -1 : 1), 0), parentWidth - 1);
+                const int ny = std::min(std::max(py + (mbY % scale < scale / 2 ? -1 : 1), 0), parentHeight - 1);
+                const int parents[3] = { px + py * parentWidth, nx + py * parentWidth, px + ny * parentWidth };
+
+                int candidates[4][2];
+                for (int i = 0; i < 3; ++i)
+                {
+                    candidates[i][0] = ClampCenter(parentMVs[parents[i]].s[0] * scale, x0, paddedWidth, radius);
+                    candidates[i][1] = ClampCenter(parentMVs[parents[i]].s[1] * scale, y0, paddedHeight, radius);
+                }
+                candidates[3][0] = ClampCenter(0, x0, paddedWidth, radius);
+                candidates[3][1] = ClampCenter(0, y0, paddedHeight, radius);
+
+                // Each distinct candidate is refined: at a flat or half-pel
+                // aligned parent position the unrefined candidates say little.
+                for (int i = 0; i < 4; ++i)
+                {
+                    bool seen = false;
+                    for (int j = 0; j < i; ++j)
+                    {
+                        seen |= candidates[j][0] == candidates[i][0] && candidates[j][1] == candidates[i][1];
+                    }
+                    if (!seen)
+                    {
+                        SearchWindow16x16(src, ref, x0, y0, candidates[i][0], candidates[i][1], radius, radius, mv, sad);
+                    }
+                }
+                mvs[mbX + mbY * m_mbWidth[level]] = mv;
+            }
+        }
+    }
+
+} // namespace CPUVme
@@ -0,0 +1,475 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// This file contains a host (CPU) implementation of the motion search
+// performed by vme_multi_ref_swsb.cl: the multi-reference integer search
+// followed by the optional half/quarter-pel refinement, the intra mode search,
+// and the hierarchical search producing the predictors of the full resolution
+// search (downsample4x and tier1_block_motion_estimate_intel).
+// It produces the motion vector, residual, shape, reference id and intra mode
+// buffers in exactly the same layout as the kernels, so the code consuming
+// those buffers does not need to know which backend produced them.
+
+
+#ifndef _CPU_VME_HPP_
+#define _CPU_VME_HPP_
+
+#include <CL/cl.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace CPUVme
+{
+    // Search window of CL_ME_SEARCH_PATH_RADIUS_16_12_INTEL:
+    // candidates are [-16, 16] x [-12, 12] pixels around the search center.
+    static const int kSearchRadiusX = 16;
+    static const int kSearchRadiusY = 12;
+
+    // Size of the replicated border around every plane. Search centers are
+    // clamped so that no candidate (and no interpolation tap) leaves it.
+    static const int kPlaneBorder = 64;
+
+    // Distance kept between any integer candidate and the edge of the border,
+    // so that sub-pel refinement (one more pixel) and the 6-tap filter taps
+    // only ever read computed samples.
+    static const int kInterpolationMargin = 6;
+
+    // Number of references of the multi-reference search, NUM_MAX_REFS of
+    // the scoreboarded sample: reference ids are 4 bit values.
+    static const int kMaxReferences = 16;
+
+    // Motion vector precision, the CPU counterpart of CL_ME_SUBPIXEL_MODE_*_INTEL.
+    enum SubPixelMode
+    {
+        SUBPIXEL_MODE_INTEGER,
+        SUBPIXEL_MODE_HPEL,
+        SUBPIXEL_MODE_QPEL
+    };
+
+    // Distortion metric, the CPU counterpart of CL_ME_SAD_ADJUST_MODE_*_INTEL.
+    // HAAR reports SATD: the halved sum of absolute 4x4 Hadamard coefficients.
+    enum SadAdjustMode
+    {
+        SAD_ADJUST_MODE_NONE,
+        SAD_ADJUST_MODE_HAAR
+    };
+
+    // Integer search strategy. EXHAUSTIVE scans the whole search window around
+    // every search center, as CLK_AVC_ME_SEARCH_WINDOW_EXHAUSTIVE_INTEL does.
+    // PREDICTIVE only tries the predictor candidates (zero vector, search
+    // predictors, neighbor and co-located vectors), then moves the best one
+    // with a large and then a small diamond pattern until no neighbor is
+    // cheaper.
+    enum SearchMode
+    {
+        SEARCH_MODE_EXHAUSTIVE,
+        SEARCH_MODE_PREDICTIVE
+    };
+
+    // MV cost precision, same values as CL_AVC_ME_COST_PRECISION_*_INTEL:
+    // the unit in which the distance to the cost center is measured.
+    enum CostPrecision
+    {
+        COST_PRECISION_QPEL,
+        COST_PRECISION_HPEL,
+        COST_PRECISION_PEL,
+        COST_PRECISION_DPEL
+    };
+
+    // Cost tables of increasing strength for the CPU search. The driver's
+    // tables (intel_sub_group_avc_mce_get_default_*_penalty_cost_table())
+    // are not documented and these are not copies of them, only tables in
+    // the same layout that grow with the distance. To get the MV costs of
+    // the kernels exactly, pass the device's table (ParseCostTable).
+    enum CostPenalty
+    {
+        COST_PENALTY_NONE,
+        COST_PENALTY_LOW,
+        COST_PENALTY_NORMAL,
+        COST_PENALTY_HIGH
+    };
+
+    // Packed cost table in the layout of the kernels' uint2: 8 bytes, byte i
+    // (little endian, s[0] first) holding the cost of a distance of
+    // 0, 1, 2, 4, 8, 16, 32, 64 units in U4U4 format (value = (b & 0xF) << (b >> 4)).
+    cl_uint2 GetCostTable(CostPenalty penalty);
+
+    // Packed table given as its two 32-bit words "s0,s1" (decimal or 0x hex),
+    // e.g. what ime_mv_extract --print_cost_tables reads back from the device.
+    // Throws std::runtime_error for anything else.
+    cl_uint2 ParseCostTable(const std::string & text);
+
+    // MV cost of a vector: table cost of |dx| plus table cost of |dy|, where
+    // (dx, dy) is the distance to the cost center in cost precision units.
+    // Distances between two table entries are interpolated linearly,
+    // distances beyond 64 units cost the last entry.
+    class CostModel
+    {
+    public:
+        CostModel(cl_uint2 packedTable, CostPrecision precision);
+
+        // (dx, dy) in QPEL units
+        uint32_t Cost(int dx, int dy) const { return m_lut[Index(dx)] + m_lut[Index(dy)]; }
+
+        // Cost of every QPEL distance 4 * i - base for i in [0, count)
+        void FillIntegerCosts(int base, int count, uint16_t * out) const;
+
+        bool IsZero() const { return m_zero; }
+
+    private:
+        static const int kLutSize = 65;
+
+        int Index(int d) const
+        {
+            d = (d < 0 ? -d : d) >> m_shift;
+            return d < kLutSize ? d : kLutSize - 1;
+        }
+
+        uint16_t m_lut[kLutSize];
+        int m_shift;
+        bool m_zero;
+    };
+
+    // Partition masks, same values as CL_AVC_ME_PARTITION_MASK_*_INTEL: a set
+    // bit disables a partition size, masks are combined with '&'.
+    static const cl_uchar kPartitionMaskAll   = 0x00;
+    static const cl_uchar kPartitionMask16x16 = 0x7E;
+    static const cl_uchar kPartitionMask16x8  = 0x7D;
+    static const cl_uchar kPartitionMask8x16  = 0x7B;
+    static const cl_uchar kPartitionMask8x8   = 0x77;
+    static const cl_uchar kPartitionMask8x4   = 0x6F;
+    static const cl_uchar kPartitionMask4x8   = 0x5F;
+    static const cl_uchar kPartitionMask4x4   = 0x3F;
+
+    // Search parameters, the CPU counterpart of cl_motion_estimation_desc_intel.
+    struct SearchDesc
+    {
+        SearchDesc()
+            : subPixelMode(SUBPIXEL_MODE_QPEL), sadAdjustMode(SAD_ADJUST_MODE_NONE), partitionMask(kPartitionMaskAll),
+              costTable(GetCostTable(COST_PENALTY_NORMAL)), costPrecision(COST_PRECISION_QPEL),
+              earlyExitDistortion(0), neighborPredictors(false),
+              searchMode(SEARCH_MODE_EXHAUSTIVE), predictiveStopDistortion(0) {}
+
+        SubPixelMode subPixelMode;
+        SadAdjustMode sadAdjustMode;
+        cl_uchar partitionMask;
+        cl_uint2 costTable;
+        CostPrecision costPrecision;
+        // Multi-reference search only: the remaining references of a MB are
+        // skipped once its best shape costs (distortion plus MV cost) at most
+        // this much. 0 searches every reference.
+        cl_uint earlyExitDistortion;
+        // Multi-reference search only: also search around the vectors already
+        // chosen for the left, top and top-left MBs, as the scoreboarded kernel
+        // does. MBs are then scheduled in dependency order instead of by rows.
+        bool neighborPredictors;
+        SearchMode searchMode;
+        // Predictive search only: the search of a MB in a reference stops as
+        // soon as its best 16x16 match costs (distortion plus MV cost) at most
+        // this much. Higher values evaluate fewer positions for less accurate
+        // vectors; 0 always runs the diamond search to its end.
+        cl_uint predictiveStopDistortion;
+    };
+
+    // Luma plane padded to a whole number of macroblocks and surrounded by a
+    // replicated border. This is the CPU counterpart of a CL_R/CL_UNORM_INT8
+    // image sampled with clamp-to-edge addressing.
+    class Plane
+    {
+    public:
+        Plane(int width, int height);
+
+        // Copies a width x height luma plane and rebuilds the border.
+        // Invalidates the sub-pel planes.
+        void Load(const uint8_t * pSrc, int pitch);
+
+        // Builds the H.264 half-pel planes (6-tap filter) of the loaded picture.
+        // Called once per reference frame; quarter-pel samples are then
+        // averages of two full/half-pel samples and need no further filtering.
+        void Interpolate();
+        bool IsInterpolated() const { return m_interpolated; }
+
+        // Fills the plane with src decimated 2:1 in both directions by a box
+        // filter, (a + b + c + d + 2) >> 2 over every 2x2 block, which is one
+        // of the two stages of downsample4x. The plane must be
+        // (src width + 1) / 2 x (src height + 1) / 2. Invalidates the sub-pel planes.
+        void Decimate2x(const Plane & src);
+
+        // (x, y) may point into the border, down to -kPlaneBorder.
+        const uint8_t * Ptr(int x, int y) const { return m_origin + y * m_pitch + x; }
+
+        // Sample planes by half-pel phase: 0 - full-pel, 1 - (x + 1/2, y),
+        // 2 - (x, y + 1/2), 3 - (x + 1/2, y + 1/2). Same pitch as Ptr().
+        const uint8_t * SubpelPtr(int phase, int x, int y) const
+        {
+            return (phase ? m_subpelOrigin[phase - 1] : m_origin) + y * m_pitch + x;
+        }
+
+        int GetWidth() const { return m_width; }
+        int GetHeight() const { return m_height; }
+        int GetPitch() const { return m_pitch; }
+
+    private:
+        uint8_t * Row(int y) { return m_origin + y * m_pitch; }
+        uint8_t * AlignedOrigin(std::vector<uint8_t> & storage) const;
+        void ExtendBorder();
+
+        std::vector<uint8_t> m_storage;
+        uint8_t * m_origin;
+        std::vector<uint8_t> m_subpelStorage[3];
+        uint8_t * m_subpelOrigin[3];
+        bool m_interpolated;
+        int m_width;
+        int m_height;
+        int m_paddedWidth;
+        int m_paddedHeight;
+        int m_pitch;
+    };
+
+    // Integer-pel block matching on the CPU (SSE4.1, with an AVX2 path
+    // selected at run time), exhaustive or predictive as selected by the
+    // search descriptor. The 4x4 SADs of every candidate are summed
+    // into all enabled partitions, so the whole major/minor shape decision
+    // costs one search; the chosen partitions are then refined to half or
+    // quarter pel as selected by the search descriptor. MB rows (MBs in
+    // scoreboard order, with neighbor predictors) are distributed over
+    // numThreads worker threads; 0 selects the number of hardware threads.
+    class MotionEstimator
+    {
+    public:
+        MotionEstimator(int width, int height, const SearchDesc & desc, int numThreads = 0);
+
+        // Same contract as block_motion_estimate_intel in vme_multi_ref_swsb.cl:
+        //  - refs holds numRefs (0 to kMaxReferences) references, closest
+        //    first: the index is the reference id,
+        //  - every reference is searched around (0, 0) and around the QPEL
+        //    predictor of the MB in predMVs (may be NULL), cost center (0, 0),
+        //  - with neighborPredictors set, also around the first sub-block
+        //    vector of the left, top and top-left MBs; a MB starts once those
+        //    three are done (the TOP/LEFT/TOP_LEFT scoreboard dependencies),
+        //  - colocatedMVs (may be NULL) holds the mvs of the previous frame,
+        //    whose first sub-block vector of the co-located MB is one more
+        //    predictor,
+        //  - mvs and residuals hold 16 entries per MB in VME sub-block order,
+        //  - bestResiduals receives the distortion of the chosen shape, one per MB,
+        //  - referenceIds receives one byte per 8x8 quadrant (quadrant q in
+        //    bits 8q + 7 : 8q), the low nibble holding the reference id.
+        // As the IME streamin/streamout chain, each partition keeps its best
+        // result across windows and references; the sub-8x8 partitions of a
+        // quadrant share their reference, as H.264 requires. With no reference
+        // (the first frame) nothing is written. The output does not depend on
+        // the number of threads.
+        void EstimateFrameMultiRef(
+            const Plane & src,
+            const Plane * const * refs,
+            int numRefs,
+            const cl_short2 * predMVs,
+            cl_short2 * mvs,
+            cl_ushort * residuals,
+            cl_ushort * bestResiduals,
+            cl_uchar2 * shapes,
+            cl_uint * referenceIds,
+            const cl_short2 * colocatedMVs = NULL) const;
+
+        int GetMBWidth() const { return m_mbWidth; }
+        int GetMBHeight() const { return m_mbHeight; }
+
+    private:
+        void CheckPlane(const Plane & plane, bool reference) const;
+
+        void EstimateMBMultiRef(
+            int mbX,
+            int mbY,
+            const Plane & src,
+            const Plane * const * refs,
+            int numRefs,
+            const cl_short2 * predMVs,
+            cl_short2 * mvs,
+            cl_ushort * residuals,
+            cl_ushort * bestResiduals,
+            cl_uchar2 * shapes,
+            cl_uint * referenceIds,
+            const cl_short2 * colocatedMVs) const;
+
+        SearchDesc m_desc;
+        CostModel m_costModel;
+        int m_width;
+        int m_height;
+        int m_mbWidth;
+        int m_mbHeight;
+        int m_numThreads;
+    };
+
+    // Intra partition masks, same values as CL_AVC_ME_INTRA_LUMA_PARTITION_MASK_*_INTEL:
+    // a set bit disables a block size, masks are combined with '&'.
+    static const cl_uchar kIntraPartitionMaskAll   = 0x0;
+    static const cl_uchar kIntraPartitionMask16x16 = 0x6;
+    static const cl_uchar kIntraPartitionMask8x8   = 0x5;
+    static const cl_uchar kIntraPartitionMask4x4   = 0x3;
+
+    // Luma block size an intra MB is divided into, same values as CLK_AVC_ME_INTRA_*_INTEL.
+    enum IntraShape
+    {
+        INTRA_SHAPE_16x16,
+        INTRA_SHAPE_8x8,
+        INTRA_SHAPE_4x4
+    };
+
+    // Entries per MB of the intra mode buffer: the 16x16 mode, the four 8x8
+    // modes, the sixteen 4x4 modes (VME sub-block order) and the chroma mode.
+    static const int kIntraModesPerMB = 22;
+
+    // Entries per MB of the per block size distortions: the 16x16, 8x8 and
+    // 4x4 luma distortions and the chroma distortion, as vme_advanced_chroma_ds.cl
+    // writes its intra_residuals.
+    static const int kIntraResidualsPerMB = 4;
+
+    // Host counterpart of the intra prediction engine (sic_evaluate_ipe): for
+    // every enabled block size, the best of the H.264 predictor modes (9 for
+    // 4x4 and 8x8 blocks, 4 for the 16x16 block and the 8x8 chroma blocks).
+    // As on the hardware, neighbors are source samples. They are read once
+    // per MB, and the predictors are generated with SIMD shuffles.
+    class IntraEstimator
+    {
+    public:
+        IntraEstimator(int width, int height, cl_uchar partitionMask = kIntraPartitionMaskAll,
+                       SadAdjustMode sadAdjustMode = SAD_ADJUST_MODE_NONE, int numThreads = 0);
+
+        // Same contract as block_intrapred_intel:
+        //  - modes receives kIntraModesPerMB entries per MB. Luma modes have the
+        //    values of CL_AVC_ME_LUMA_PREDICTOR_MODE_*_INTEL and the chroma mode
+        //    those of CL_AVC_ME_CHROMA_PREDICTOR_MODE_*_INTEL. Entries of a
+        //    disabled block size, and the chroma entry when there are no
+        //    chroma planes, are left untouched,
+        //  - residuals receives the distortion of the chosen block size, one per MB,
+        //  - shapes receives the chosen IntraShape, one per MB,
+        //  - blockResiduals (may be NULL) receives kIntraResidualsPerMB entries
+        //    per MB, 0 for a disabled block size or missing chroma.
+        // srcU and srcV are the (width + 1) / 2 x (height + 1) / 2 chroma planes;
+        // both may be NULL to skip the chroma search.
+        void EstimateFrame(
+            const Plane & src,
+            const Plane * srcU,
+            const Plane * srcV,
+            cl_char * modes,
+            cl_ushort * residuals,
+            cl_uchar * shapes,
+            cl_ushort * blockResiduals = NULL) const;
+
+    private:
+        void EstimateRows(
+            int firstRow,
+            int lastRow,
+            const Plane & src,
+            const Plane * srcU,
+            const Plane * srcV,
+            cl_char * modes,
+            cl_ushort * residuals,
+            cl_uchar * shapes,
+            cl_ushort * blockResiduals) const;
+
+        cl_uchar m_partitionMask;
+        SadAdjustMode m_sadAdjustMode;
+        int m_width;
+        int m_height;
+        int m_mbWidth;
+        int m_mbHeight;
+        int m_numThreads;
+    };
+
+    // Hierarchical search parameters. Level 0 is the full resolution picture,
+    // every further level is levelScale times smaller in both directions:
+    // the defaults give the 16x, 4x and 1x levels.
+    struct HierarchicalDesc
+    {
+        HierarchicalDesc() : numLevels(3), levelScale(4), refineRadius(2) {}
+
+        int numLevels;      // 1 to kMaxHierarchyLevels
+        int levelScale;     // 2 or 4
+        int refineRadius;   // [0, kSearchRadiusY], refinement window of the finer levels
+    };
+
+    static const int kMaxHierarchyLevels = 5;
+
+    // Box filtered pyramid of one picture, see HierarchicalDesc. The 4:1
+    // levels are decimated in two 2:1 stages, as downsample4x does.
+    class Pyramid
+    {
+    public:
+        Pyramid(int width, int height, const HierarchicalDesc & desc);
+
+        // Loads the width x height luma plane into level 0 and rebuilds the
+        // other levels from it.
+        void Load(const uint8_t * pSrc, int pitch);
+
+        const Plane & GetLevel(int level) const { return m_levels[level]; }
+        int GetNumLevels() const { return (int)m_levels.size(); }
+        int GetLevelScale() const { return m_levelScale; }
+
+    private:
+        // Planes point into their own storage: both vectors are reserved
+        // up front and never reallocate.
+        std::vector<Plane> m_levels;
+        std::vector<Plane> m_halfLevels;    // 2:1 intermediates of the 4:1 levels
+        int m_levelScale;
+    };
+
+    // Coarse to fine integer search of one 16x16 vector per MB: the coarsest
+    // level is searched over the whole [-16, 16] x [-12, 12] window around
+    // (0, 0), which covers levelScale ^ (numLevels - 1) times that distance at
+    // full resolution. Every finer level scales up the vector of the parent
+    // block and of its two nearest parent neighbours, refines them and (0, 0)
+    // within +/- refineRadius pixels and keeps the best match. MB rows of
+    // every level are distributed over numThreads worker threads; 0 selects
+    // the number of hardware threads.
+    class HierarchicalEstimator
+    {
+    public:
+        HierarchicalEstimator(int width, int height, const HierarchicalDesc & desc, int numThreads = 0);
+
+        // Fills predMVs with one QPEL vector per full resolution MB in raster
+        // order: the predictor layout of block_motion_estimate_intel.
+        void EstimateFrame(const Pyramid & src, const Pyramid & ref, cl_short2 * predMVs) const;
+
+    private:
+        void CheckPyramid(const Pyramid & pyramid) const;
+
+        void EstimateRows(
+            int level,
+            int firstRow,
+            int lastRow,
+            const Plane & src,
+            const Plane & ref,
+            const cl_short2 * parentMVs,
+            cl_short2 * mvs) const;
+
+        HierarchicalDesc m_desc;
+        int m_width;
+        int m_height;
+        int m_mbWidth[kMaxHierarchyLevels];
+        int m_mbHeight[kMaxHierarchyLevels];
+        int m_numThreads;
+    };
+
+} // namespace CPUVme
+
+#endif  // end of include guard
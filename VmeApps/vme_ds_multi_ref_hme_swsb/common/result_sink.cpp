@@ -0,0 +1,116 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "result_sink.hpp"
+
+using namespace YUVUtils;
+
+void MotionResults::Clear()
+{
+    std::fill(MVs.begin(), MVs.end(), cl_short2());
+    std::fill(Residuals.begin(), Residuals.end(), 0xFFFF);
+    std::fill(BestResiduals.begin(), BestResiduals.end(), 0xFFFF);
+    std::fill(Shapes.begin(), Shapes.end(), cl_uchar2());
+    std::fill(ReferenceIds.begin(), ReferenceIds.end(), 0xFFFFFFFF);
+
+    std::fill(IntraShapes.begin(), IntraShapes.end(), 0xFF);
+    std::fill(IntraResiduals.begin(), IntraResiduals.end(), 0xFFFF);
+    std::fill(IntraModes.begin(), IntraModes.end(), 0xFFFFFFFFFFFFFFFFull);
+}
+
+ResultWindow::ResultWindow(int size, size_t mvsPerFrame, size_t mbsPerFrame) :
+    m_slots(std::max(size, 1))
+{
+    for (size_t s = 0; s < m_slots.size(); s++)
+    {
+        MotionResults & slot = m_slots[s];
+        slot.frame = -1;
+        slot.MVs.resize(mvsPerFrame);
+        slot.Residuals.resize(mvsPerFrame);
+        slot.BestResiduals.resize(mbsPerFrame);
+        slot.Shapes.resize(mbsPerFrame);
+        slot.ReferenceIds.resize(mbsPerFrame);
+        slot.IntraShapes.resize(mbsPerFrame);
+        slot.IntraResiduals.resize(mbsPerFrame);
+        slot.IntraModes.resize(mbsPerFrame);
+        slot.Clear();
+    }
+}
+
+MotionResults & ResultWindow::Slot(int i)
+{
+    MotionResults & slot = m_slots[i % m_slots.size()];
+    slot.frame = i;
+    return slot;
+}
+
+bool ResultWindow::Contains(int i) const
+{
+    return i >= 0 && m_slots[i % m_slots.size()].frame == i;
+}
+
+const MotionResults & ResultWindow::Get(int i) const
+{
+    if (!Contains(i))
+    {
+        std::stringstream msg;
+        msg << "Results of frame " << i << " are no longer in the window";
+        throw std::runtime_error(msg.str());
+    }
+    return m_slots[i % m_slots.size()];
+}
+
+ResultDispatcher::ResultDispatcher(const std::vector<ResultSink *> & sinks, size_t mvsPerFrame, size_t mbsPerFrame, int inFlight) :
+    m_sinks(sinks),
+    m_window(WindowSize(sinks, inFlight), mvsPerFrame, mbsPerFrame)
+{
+}
+
+int ResultDispatcher::WindowSize(const std::vector<ResultSink *> & sinks, int inFlight)
+{
+    // A slot is refilled inFlight frames after the frame in it is consumed,
+    // the sinks may still look back History() frames by then
+    int history = 0;
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+        history = std::max(history, sinks[s]->History());
+    }
+    return history + std::max(inFlight, 1);
+}
+
+void ResultDispatcher::Publish(int i, PlanarImage * image)
+{
+    for (size_t s = 0; s < m_sinks.size(); s++)
+    {
+        m_sinks[s]->Consume(m_window, i, image);
+    }
+}
+
+void ResultDispatcher::Finish()
+{
+    for (size_t s = 0; s < m_sinks.size(); s++)
+    {
+        m_sinks[s]->Finish();
+    }
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// This file contains the per-frame consumers of the motion estimation
+// results. The backends write every frame into a slot of a small ring
+// (ResultWindow) and ResultDispatcher hands the finished frame to each sink
+// in turn, so only the frames still in flight plus the history the sinks
+// asked for are kept instead of the whole sequence.
+
+
+#ifndef _RESULT_SINK_HPP_
+#define _RESULT_SINK_HPP_
+
+#include <CL/cl.h>
+#include <vector>
+
+#include "yuv_utils.h"
+
+// Results of one frame, in the layout written by block_motion_estimate_intel
+struct MotionResults
+{
+    int frame;                          // -1 while the slot holds no frame
+    std::vector<cl_short2> MVs;
+    std::vector<cl_ushort> Residuals;
+    std::vector<cl_ushort> BestResiduals;
+    std::vector<cl_uchar2> Shapes;
+    std::vector<cl_uint> ReferenceIds;
+
+    std::vector<cl_uchar> IntraShapes;
+    std::vector<cl_ushort> IntraResiduals;
+    std::vector<cl_ulong> IntraModes;
+
+    // Marks every MB as not searched yet
+    void Clear();
+};
+
+// Ring of per-frame results. Slot(i) recycles the slot of frame i - Size().
+class ResultWindow
+{
+public:
+    ResultWindow(int size, size_t mvsPerFrame, size_t mbsPerFrame);
+
+    // Slot receiving the results of frame i
+    MotionResults & Slot(int i);
+
+    // Results of frame i, which has to be still in the window
+    const MotionResults & Get(int i) const;
+
+    bool Contains(int i) const;
+    int Size() const { return (int)m_slots.size(); }
+
+private:
+    std::vector<MotionResults> m_slots;
+};
+
+class ResultSink
+{
+public:
+    virtual ~ResultSink() {}
+
+    // Number of earlier frames the sink reads from the window when it
+    // consumes a frame.
+    virtual int History() const { return 0; }
+
+    // Called in frame order with the results of frame i in the window and the
+    // source frame, which sinks may draw on.
+    virtual void Consume(const ResultWindow & window, int i, YUVUtils::PlanarImage * image) = 0;
+
+    // Called once after the last frame.
+    virtual void Finish() {}
+};
+
+// Owns the window and feeds the sinks, in the order they were added.
+class ResultDispatcher
+{
+public:
+    // inFlight is the number of frames the backend holds in the window
+    // itself: the frame it writes and the earlier ones it still reads.
+    ResultDispatcher(const std::vector<ResultSink *> & sinks, size_t mvsPerFrame, size_t mbsPerFrame, int inFlight = 1);
+
+    // Slot to fill with the results of frame i
+    MotionResults & Begin(int i) { return m_window.Slot(i); }
+
+    // Results the backend reads back, e.g. the previous frame as predictors
+    const ResultWindow & Window() const { return m_window; }
+
+    // Hands frame i, filled through Begin, to every sink
+    void Publish(int i, YUVUtils::PlanarImage * image);
+
+    void Finish();
+
+private:
+    static int WindowSize(const std::vector<ResultSink *> & sinks, int inFlight);
+
+    std::vector<ResultSink *> m_sinks;
+    ResultWindow m_window;
+};
+
+// Discards the results, for timing the motion estimation alone.
+class NullSink : public ResultSink
+{
+public:
+    virtual void Consume(const ResultWindow &, int, YUVUtils::PlanarImage *) {}
+};
+
+#endif  // end of the include guard
@@ -31,6 +31,7 @@
 #include "yuv_utils.h"
 #include "cmdparser.hpp"
 #include "oclobject.hpp"
+#include "frame_pipeline.hpp"
 
 #define CL_EXT_DECLARE(name) static name##_fn pfn_##name = 0;
 
@@ -58,6 +59,9 @@ typedef cl_short2 MotionVector;
 // Specifies number of motion vectors per source pixel block (the value of CL_ME_MB_TYPE_16x16_INTEL specifies  just a single vector per block )
 static const cl_uint kMBBlockType = CL_ME_MB_TYPE_16x16_INTEL;
 
+// Number of image/buffer sets in flight: reading, estimation and readback overlap
+static const int kPipelineDepth = 3;
+
 #ifdef _MSC_VER
 #pragma warning (push)
 #pragma warning (disable : 4355)    // 'this': used in base member initializer list
@@ -74,15 +78,17 @@ public:
     CmdOption<int>      height;
     CmdOption<bool>		help;
     CmdOption<bool>		no_output_to_bmp;
+    CmdOption<bool>		zero_copy;
 
     CmdParserMV  (int argc, const char** argv) :
     CmdParser(argc, argv),
         no_output_to_bmp(*this, 0,"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is on"),
         help(*this,            'h',"help","","Show this help text and exit."),
-        fileName(*this,         0,"input", "<string>", "Input video sequence filename (.yuv file format)","video_1920x1080_5frames.yuv"),
+        fileName(*this,         0,"input", "<string>", "Input video sequence filename (.yuv or .y4m file format)","video_1920x1080_5frames.yuv"),
         overlayFileName(*this,  0,"output","<string>", "Output video sequence with overlaid motion vectors filename ","output.yuv"),
         width(*this,            0, "width",	"<integer>", "Frame width for the input file", 1920),
-        height(*this,           0, "height","<integer>", "Frame height for the input file",1080)
+        height(*this,           0, "height","<integer>", "Frame height for the input file",1080),
+        zero_copy(*this,        0, "zerocopy","","Read the frames straight into device images instead of copying them, where the device and the frame alignment allow it")
     {
     }
     virtual void parse ()
@@ -92,6 +98,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(FULL_PATH_A(fileName.getValue()), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -136,6 +155,69 @@ inline unsigned int ComputeSubBlockSize( cl_uint nMBType )
 
 void OverlayVectors(unsigned int subBlockSize, const MotionVector* pMV, PlanarImage* srcImage, const int& mvImageWidth, const int& mvImageHeight, const int& width, const int& height);
 
+// Frame stages of the sample: the built-in VME kernel estimates each frame
+// against the previous one, the vectors are drawn over the source picture
+// which is then appended to the output sequence.
+class OverlayPipelineClient : public FramePipelineClient
+{
+public:
+    OverlayPipelineClient(Capture * pCapture, FrameWriter * pWriter, cl::Kernel & kernel, cl_accelerator_intel accelerator,
+        unsigned int subBlockSize, int mvImageWidth, int mvImageHeight, int width, int height) :
+        m_pCapture(pCapture), m_pWriter(pWriter), m_kernel(kernel), m_accelerator(accelerator),
+        m_subBlockSize(subBlockSize), m_mvImageWidth(mvImageWidth), m_mvImageHeight(mvImageHeight),
+        m_width(width), m_height(height),
+        m_MVs(kPipelineDepth * mvImageWidth * mvImageHeight)
+    {
+    }
+
+    virtual void ReadFrame(int i, PlanarImage * image)
+    {
+        m_pCapture->GetSample(i, image);
+    }
+
+    virtual void EnqueueEstimation(cl::CommandQueue & queue, const cl::Image2D & src, const cl::Image2D & ref,
+        const std::vector<cl::Buffer> & outputs, const std::vector<cl::Event> & waitList, cl::Event & done)
+    {
+        // Schedule full-frame motion estimation
+        m_kernel.setArg(0, m_accelerator);
+        m_kernel.setArg(1, src);
+        m_kernel.setArg(2, ref);
+        m_kernel.setArg(3, sizeof(cl_mem), NULL);//in this simple tutorial we have no "prediction" vectors for the input (often, the motion vectors from downscaled image or from the prev. frame are used)
+        m_kernel.setArg(4, outputs[0]);
+        m_kernel.setArg(5, sizeof(cl_mem), NULL); //in this simple tutorial we don't want to compute residuals
+        queue.enqueueNDRangeKernel(m_kernel, cl::NullRange, cl::NDRange(m_width, m_height), cl::NullRange, &waitList, &done);
+    }
+
+    virtual void * OutputTarget(int i, int k)
+    {
+        return &m_MVs[(i % kPipelineDepth) * m_mvImageWidth * m_mvImageHeight];
+    }
+
+    virtual void FrameDone(int i, PlanarImage * image)
+    {
+        // The first frame is written unmodified
+        if (i > 0)
+        {
+            // Overlay MVs on Src picture
+            OverlayVectors(m_subBlockSize, &m_MVs[(i % kPipelineDepth) * m_mvImageWidth * m_mvImageHeight], image,
+                m_mvImageWidth, m_mvImageHeight, m_width, m_height);
+        }
+        m_pWriter->AppendFrame(image);
+    }
+
+private:
+    Capture * m_pCapture;
+    FrameWriter * m_pWriter;
+    cl::Kernel & m_kernel;
+    cl_accelerator_intel m_accelerator;
+    unsigned int m_subBlockSize;
+    int m_mvImageWidth;
+    int m_mvImageHeight;
+    int m_width;
+    int m_height;
+    std::vector<MotionVector> m_MVs;   // one set of vectors per pipeline slot
+};
+
 void ExtractMotionVectorsFullFrameWithOpenCL( Capture * pCapture, const CmdParserMV& cmd)
 {
 
@@ -185,83 +267,29 @@ void ExtractMotionVectorsFullFrameWithOpenCL( Capture * pCapture, const CmdParse
     const int numPics = pCapture->GetNumFrames();
     const int width = cmd.width.getValue();
     const int height = cmd.height.getValue();
-    FrameWriter * pWriter= FrameWriter::CreateFrameWriter(width, height, !cmd.no_output_to_bmp.getValue());
-    pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
+    // The overlaid frames are written out while the sequence is processed
+    FrameWriter * pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height, !cmd.no_output_to_bmp.getValue());
 
     int mvImageWidth, mvImageHeight;
     ComputeNumMVs(kMBBlockType, width, height, mvImageWidth, mvImageHeight);
     unsigned int subBlockSize = ComputeSubBlockSize(kMBBlockType);
     ComputeNumMVs(desc.mb_block_type, width, height, mvImageWidth, mvImageHeight);
-    std::vector<MotionVector> MVs;
-    MVs.resize(mvImageWidth*mvImageHeight);
-    // Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Buffer mvBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(MotionVector));
-
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-    pCapture->GetSample(0, currImage);
-    // Write the (unmodified) first frame to the output stream
-    pWriter->AppendFrame(currImage);
-    cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-    // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-
-    // Process all frames
-    double ioStat = 0;//file i/o
-    double meStat = 0;//motion estimation itself
 
     // Generate sequence with overlaid motion vectors
-    double overallStart  = time_stamp();
-    // First frame is already in srcImg, so we start with the second frame
-    for (int i = 1; i < numPics; i++)
-    {
-        double ioStart = time_stamp();
-        // Load next picture
-        pCapture->GetSample(i, currImage);
-
-        std::swap(refImage, srcImage);
-        // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-        queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-        ioStat += (time_stamp() -ioStart);
+    OverlayPipelineClient client(pCapture, pWriter, kernel, accelerator, subBlockSize, mvImageWidth, mvImageHeight, width, height);
+    FramePipeline pipeline(context, device, width, height,
+        std::vector<size_t>(1, mvImageWidth * mvImageHeight * sizeof(MotionVector)), kPipelineDepth, cmd.zero_copy.getValue());
 
-        double meStart = time_stamp();
-        // Schedule full-frame motion estimation
-        kernel.setArg(0, accelerator);
-        kernel.setArg(1, srcImage);
-        kernel.setArg(2, refImage);
-        kernel.setArg(3, sizeof(cl_mem), NULL);//in this simple tutorial we have no "prediction" vectors for the input (often, the motion vectors from downscaled image or from the prev. frame are used)
-        kernel.setArg(4, mvBuffer);
-        kernel.setArg(5, sizeof(cl_mem), NULL); //in this simple tutorial we don't want to compute residuals
-        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(width, height), cl::NullRange);
-        queue.finish();
-        meStat += (time_stamp() - meStart);
-        ioStart = time_stamp();
-        // Read back resulting motion vectors (in a sync way)
-        queue.enqueueReadBuffer(mvBuffer,CL_TRUE,0,sizeof(MotionVector) * MVs.size(), &MVs[0],0,0);
-        // Overlay MVs on Src picture
-        OverlayVectors(subBlockSize, &MVs[0], currImage, mvImageWidth, mvImageHeight, width, height);
-        pWriter->AppendFrame(currImage);
-        ioStat += (time_stamp() -ioStart);
-    }
+    double overallStart  = time_stamp();
+    pipeline.Run(numPics, client);
+    pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
     std::cout << std::endl << "Writing " << pCapture->GetNumFrames() << " frames to " << cmd.overlayFileName.getValue() << " finished!" << std::endl<< std::endl;
     double overallStat  = time_stamp() - overallStart;
     std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
     std::cout << "Overall time for " << numPics << " frames is " << overallStat << " sec\n" ;
-    std::cout << "      Average frame file I/O time per frame is " << 1000*ioStat/numPics << " ms\n";
-    std::cout << "      Average Motion Estimation time per frame is " << 1000*meStat/numPics << " ms\n";
+    pipeline.PrintStats(std::cout);
 
     pfn_clReleaseAcceleratorINTEL(accelerator);
-    ReleaseImage(currImage);
     FrameWriter::Release(pWriter);
 }
 
@@ -227,14 +227,14 @@ void destructorException ()
 }
 
 
-cl_uint zeroCopyPtrAlignment (cl_device_id device)
+cl_uint zeroCopyPtrAlignment ()
 {
     // Please refer to Intel Zero Copy Tutorial and OpenCL Performance Guide
     return 4096;
 }
 
 
-size_t zeroCopySizeAlignment (size_t requiredSize, cl_device_id device)
+size_t zeroCopySizeAlignment (size_t requiredSize)
 {
     // Please refer to Intel Zero Copy Tutorial and OpenCL Performance Guide
     // The following statement rounds requiredSize up to the next 64-byte boundary
@@ -179,11 +179,11 @@ void destructorException ();
 
 // Recomended alignment in bytes for memory used in clCreateBuffer with CL_MEM_USE_HOST_PTR.
 // Returned value is sufficiently large to enable zero-copy behaviour on Intel Processor Graphics.
-cl_uint zeroCopyPtrAlignment (cl_device_id device = 0);
+cl_uint zeroCopyPtrAlignment ();
 
 // Extends required buffer size to a value which is sufficient to enable
 // zero-copy behaviour for buffers created with CL_MEM_USE_HOST_PTR on Intel Processor Graphics.
-size_t zeroCopySizeAlignment (size_t requiredSize, cl_device_id device = 0);
+size_t zeroCopySizeAlignment (size_t requiredSize);
 
 // Verifies if ptr and sizeOfContentOfPtr satisfy alignment rules which
 // should be held to enable zero-copy behaviour on Intel Processor Graphics in case if an OpenCL buffer
@@ -0,0 +1,151 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// This file contains an asynchronous frame pipeline for the motion estimation
+// samples: reading a frame, uploading it to a tiled image, running the motion
+// estimation against the previous frame and reading the results back.
+// The pipeline rotates a fixed number of sets (host staging image, device
+// image, output buffers), chains non-blocking enqueues with events and only
+// blocks the host when a set is about to be reused. With three sets the
+// reading of frame i+1 overlaps the estimation of frame i and the readback of
+// frame i-1. Uploads, estimation and readbacks go to separate queues, so the
+// device can overlap copies with the VME work too.
+// In the zero-copy mode the device images of the sets are created over the
+// host staging images (CL_MEM_USE_HOST_PTR), so the frames are read straight
+// into device memory and the upload becomes a map/unmap pair. A set whose
+// staging image doesn't meet the zero-copy alignment rules falls back to the
+// copy.
+
+
+#ifndef _FRAME_PIPELINE_HPP_
+#define _FRAME_PIPELINE_HPP_
+
+#include <CL/cl.hpp>
+#include <iostream>
+#include <vector>
+
+#include "yuv_utils.h"
+
+// Per-frame work of a sample, called by FramePipeline::Run.
+class FramePipelineClient
+{
+public:
+    virtual ~FramePipelineClient() {}
+
+    // Reads frame i of the sequence into the host staging image.
+    virtual void ReadFrame(int i, YUVUtils::PlanarImage * image) = 0;
+
+    // Enqueues the motion estimation of src against ref into outputs.
+    // The command has to wait for waitList and signal done.
+    virtual void EnqueueEstimation(
+        cl::CommandQueue & queue,
+        const cl::Image2D & src,
+        const cl::Image2D & ref,
+        const std::vector<cl::Buffer> & outputs,
+        const std::vector<cl::Event> & waitList,
+        cl::Event & done) = 0;
+
+    // Host memory receiving output k of frame i. It has to stay valid until
+    // FrameDone is called for that frame.
+    virtual void * OutputTarget(int i, int k) = 0;
+
+    // Called in frame order once the outputs of frame i are on the host.
+    // The staging image still holds the frame and may be modified; in the
+    // zero-copy mode it is mapped for this call.
+    // Frame 0 is only a reference and has no outputs.
+    virtual void FrameDone(int i, YUVUtils::PlanarImage * image) {}
+};
+
+class FramePipeline
+{
+public:
+    // Creates depth sets of a width x height staging image, an R8 device image
+    // and one device buffer per entry of outputSizes (in bytes). Two sets are
+    // enough to run, three give the full upload/compute/readback overlap.
+    // With zeroCopy the device images share the staging memory wherever the
+    // device has unified host memory and the alignment rules allow it.
+    FramePipeline(
+        const cl::Context & context,
+        const cl::Device & device,
+        int width,
+        int height,
+        const std::vector<size_t> & outputSizes,
+        int depth = 3,
+        bool zeroCopy = false);
+
+    ~FramePipeline();
+
+    // Runs frames [0, numFrames) through the pipeline. Frame i is estimated
+    // against frame i - 1, so frame 0 is only read and uploaded.
+    void Run(int numFrames, FramePipelineClient & client);
+
+    // Prints the time spent in every stage during the last Run, and its
+    // occupancy: the share of the wall time the stage was busy. Host wait is
+    // the time the host was stalled on the device. Also reports how many
+    // frames went through the zero-copy path and how many were copied.
+    void PrintStats(std::ostream & out) const;
+
+private:
+    enum Stage
+    {
+        STAGE_READ,
+        STAGE_UPLOAD,
+        STAGE_ESTIMATION,
+        STAGE_READBACK,
+        STAGE_CONSUME,
+        STAGE_HOST_WAIT,
+        STAGE_COUNT
+    };
+
+    void Retire(int i, FramePipelineClient & client);
+    void AddDeviceTime(Stage stage, const cl::Event & event);
+    void MapStaging(int set, cl_map_flags flags, const std::vector<cl::Event> & waitList);
+
+    int m_width;
+    int m_height;
+    int m_depth;
+    std::vector<size_t> m_outputSizes;
+
+    cl::CommandQueue m_uploadQueue;
+    cl::CommandQueue m_computeQueue;
+    cl::CommandQueue m_readbackQueue;
+
+    std::vector<YUVUtils::PlanarImage *> m_staging;
+    std::vector<cl::Image2D> m_images;
+    std::vector<bool> m_zeroCopy;       // the device image of the set is its staging image
+    std::vector<std::vector<cl::Buffer> > m_outputs;
+
+    std::vector<cl::Event> m_uploadEvents;
+    std::vector<cl::Event> m_estimationEvents;
+    std::vector<std::vector<cl::Event> > m_readbackEvents;
+
+    int m_numFrames;
+    int m_zeroCopyFrames;
+    int m_copiedFrames;
+    double m_wallTime;
+    double m_stageTime[STAGE_COUNT];
+
+    // Disable copying and assignment to avoid incorrect resource deallocation.
+    FramePipeline(const FramePipeline &);
+    FramePipeline & operator=(const FramePipeline &);
+};
+
+#endif  // end of the include guard
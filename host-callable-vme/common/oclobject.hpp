@@ -73,6 +73,24 @@ cl_program createAndBuildProgram (
     const string& build_options
 );
 
+// Same as createAndBuildProgram for a single device, but goes through an
+// on-disk cache of program binaries. A cache entry is keyed by the device name,
+// device and driver versions, build options and a hash of the program text.
+// On a hit the program is created with clCreateProgramWithBinary; on a miss or
+// when the runtime rejects the stored binary, it is built from source and the
+// new binary is stored. The cache is opt-in: entries live in the directory
+// named by the OCL_PROGRAM_CACHE_DIR environment variable, and the program is
+// always built from source when it is unset or empty.
+// Unlike createAndBuildProgram it doesn't throw: the build status is returned
+// in errcode_ret and the program is kept, so the caller can query the build log.
+cl_program buildProgramWithCache (
+    cl_context context,
+    cl_device_id device,
+    const char* program_text,
+    const string& build_options,
+    cl_int* errcode_ret
+);
+
 // Helper structure to initialize and hold basic OpenCL objects.
 // Contains platform, device, context and queue.
 // Platfrom and device are selected by given attributes (see the constructor);
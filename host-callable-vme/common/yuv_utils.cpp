@@ -20,12 +20,24 @@
 
 #include "yuv_utils.h"
 #include "basic.hpp"
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <CL/cl.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "utils.h"
 #include <stdlib.h>
 #include <cstring>
@@ -39,14 +51,38 @@ namespace YUVUtils
     {
     public:
         YUVCapture(const std::string & fn, int width, int height);
+        virtual ~YUVCapture();
         virtual void GetSample(int frameNum, PlanarImage * im);
+        virtual PlanarImage ViewSample(int frameNum, PlanarImage * im);
 
     protected:
+        // Opens and maps fn, for captures that work out the layout themselves
+        explicit YUVCapture(const std::string & fn);
+
+        // Start of frame frameNum in the mapped file, NULL when the file isn't mapped
+        uint8_t * MappedFrame(int frameNum);
+        // Offset of the planes of frame frameNum in the file
+        virtual size_t FrameOffset(int frameNum) const;
+
         std::ifstream m_file;
+        uint8_t * m_map;        // whole file, read-only
+        size_t m_mapSize;
+        size_t m_fileSize;
     };
 
-    YUVCapture::YUVCapture( const std::string & fn, int width, int height )
-        :    m_file (fn.c_str(), std::ios::binary)
+    // Copies height rows of width bytes between planes of different pitches
+    static void CopyPlane(const uint8_t * pSrc, size_t srcPitch, size_t width, size_t height, uint8_t * pDst, size_t dstPitch)
+    {
+        for (size_t i = 0; i < height; ++i)
+        {
+            memcpy(pDst, pSrc, width);
+            pSrc += srcPitch;
+            pDst += dstPitch;
+        }
+    }
+
+    YUVCapture::YUVCapture( const std::string & fn )
+        :    m_file (fn.c_str(), std::ios::binary), m_map(NULL), m_mapSize(0), m_fileSize(0)
     {
         if (!m_file.good())
         {
@@ -59,27 +95,84 @@ namespace YUVUtils
         {
             throw Error("Exceeded limit of maximum size for the input file (limited by ifstream implementation and your OS).\nProbably you compiled in 32-bit?\nAlso if compiled with MS VS2008, consider VS2010 or later instead\n");
         }
-        size_t fileSize = static_cast<size_t>(m_file.tellg()
+        m_fileSize = static_cast<size_t>(m_file.tellg()
 #ifdef WIN32
         .seekpos()
 #endif        
         );
         m_file.clear();
+        m_file.seekg(0, std::ios::beg);
 
+#ifdef __linux__
+        // Map the file, so frames are copied straight out of the page cache
+        // instead of being read row by row, or not copied at all (ViewSample).
+        // The stream stays as the fallback for files that can't be mapped.
+        int fd = open(fn.c_str(), O_RDONLY);
+        if (fd >= 0)
+        {
+            void * map = (m_fileSize > 0) ? mmap(NULL, m_fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            close(fd);
+            if (map != MAP_FAILED)
+            {
+                m_map = (uint8_t *)map;
+                m_mapSize = m_fileSize;
+                // Frames are mostly read in order, let the kernel read ahead aggressively
+                madvise(m_map, m_mapSize, MADV_SEQUENTIAL);
+                m_file.close();
+            }
+        }
+#endif
+    }
 
+    YUVCapture::YUVCapture( const std::string & fn, int width, int height )
+        :    YUVCapture(fn)
+    {
         const size_t frameSize = width * height * 3 / 2 * sizeof(uint8_t);
-        if (fileSize % frameSize)
+        if (m_fileSize % frameSize)
         {
             throw Error("YUV file size error. Maybe you specified wrong dimensions?\nAlso if your file is large, try to compile 64bit version of the tutorial instead");
         }
-        m_file.clear();
-        m_file.seekg(0, std::ios::beg);
 
-        m_numFrames = int( (size_t) (fileSize) / (size_t) frameSize);
+        m_numFrames = int( (size_t) (m_fileSize) / (size_t) frameSize);
         m_width = width;
         m_height = height;
     }
 
+    YUVCapture::~YUVCapture()
+    {
+#ifdef __linux__
+        if (m_map)
+        {
+            munmap(m_map, m_mapSize);
+        }
+#endif
+    }
+
+    uint8_t * YUVCapture::MappedFrame(int frameNum)
+    {
+        if (!m_map)
+        {
+            return NULL;
+        }
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const size_t offset = (frameNum < 0) ? m_mapSize : FrameOffset(frameNum);
+        if (offset + frameSize > m_mapSize)
+        {
+            throw Error("Capture::GetFrame: frame number out of range.");
+        }
+        uint8_t * pFrame = m_map + offset;
+#ifdef __linux__
+        // Start paging in the next frame while this one is processed
+        if (offset + 2 * frameSize <= m_mapSize)
+        {
+            const size_t pageMask = (size_t)sysconf(_SC_PAGESIZE) - 1;
+            uint8_t * pNext = (uint8_t *)((size_t)(pFrame + frameSize) & ~pageMask);
+            madvise(pNext, pFrame + 2 * frameSize - pNext, MADV_WILLNEED);
+        }
+#endif
+        return pFrame;
+    }
+
     void YUVCapture::GetSample( int frameNum, PlanarImage * im )
     {
         if (im->Width != m_width || im->Height != m_height)
@@ -88,8 +181,27 @@ namespace YUVUtils
         }
 
         const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        const uint8_t * pFrame = MappedFrame(frameNum);
+        if (pFrame)
+        {
+            // One copy when the image is packed like the file, row by row for a padded pitch
+            const size_t lumaSize = m_width * m_height;
+            if (im->PitchY == m_width && im->U == im->Y + lumaSize && im->V == im->U + lumaSize / 4 &&
+                im->PitchU == m_width / 2 && im->PitchV == m_width / 2)
+            {
+                memcpy(im->Y, pFrame, frameSize);
+            }
+            else
+            {
+                CopyPlane(pFrame, m_width, m_width, m_height, im->Y, im->PitchY);
+                CopyPlane(pFrame + lumaSize, m_width / 2, m_width / 2, m_height / 2, im->U, im->PitchU);
+                CopyPlane(pFrame + lumaSize * 5 / 4, m_width / 2, m_width / 2, m_height / 2, im->V, im->PitchV);
+            }
+            return;
+        }
+
         m_file.clear();
-        m_file.seekg(frameNum * frameSize);
+        m_file.seekg(FrameOffset(frameNum));
 
         size_t inRowSize = m_width * sizeof(uint8_t);
         size_t outRowSize = im->PitchY * sizeof(uint8_t);
@@ -119,11 +231,195 @@ namespace YUVUtils
         }
     }
 
+    PlanarImage YUVCapture::ViewSample( int frameNum, PlanarImage * im )
+    {
+        uint8_t * pFrame = MappedFrame(frameNum);
+        // A padded pitch needs the copy
+        if (!pFrame || im->PitchY != m_width)
+        {
+            return Capture::ViewSample(frameNum, im);
+        }
+
+        PlanarImage view;
+        view.Y = pFrame;
+        view.U = view.Y + m_width * m_height;
+        view.V = view.U + m_width * m_height / 4;
+        view.Width = m_width;
+        view.Height = m_height;
+        view.PitchY = m_width;
+        view.PitchU = m_width / 2;
+        view.PitchV = m_width / 2;
+        return view;
+    }
+
+    size_t YUVCapture::FrameOffset( int frameNum ) const
+    {
+        return frameNum * (m_width * m_height * 3 / 2 * sizeof(uint8_t));
+    }
+
+    static const char kY4MMagic[] = "YUV4MPEG2";
+    static const char kY4MFrameMarker[] = "FRAME";
+
+    static bool IsY4M(const std::string & fn)
+    {
+        return strstr(fn.c_str(), ".y4m") != NULL;
+    }
+
+    // Parameters of a YUV4MPEG2 stream header
+    struct Y4MHeader
+    {
+        int width;
+        int height;
+        Capture::FieldOrder fieldOrder;
+    };
+
+    // Parses the header line, without its newline. The frames are read like
+    // YV12, so only 8-bit 4:2:0 chroma is accepted, with any chroma siting.
+    static Y4MHeader ParseY4MHeader(const std::string & line)
+    {
+        std::stringstream tokens(line);
+        std::string token;
+        if (!(tokens >> token) || token != kY4MMagic)
+        {
+            throw Error("Not a YUV4MPEG2 file.");
+        }
+
+        Y4MHeader header = { 0, 0, Capture::FIELD_ORDER_UNKNOWN };
+        std::string chroma = "420jpeg";
+        while (tokens >> token)
+        {
+            const std::string value = token.substr(1);
+            switch (token[0])
+            {
+            case 'W': header.width = atoi(value.c_str()); break;
+            case 'H': header.height = atoi(value.c_str()); break;
+            case 'C': chroma = value; break;
+            case 'I':
+                if (value == "p") header.fieldOrder = Capture::FIELD_ORDER_PROGRESSIVE;
+                else if (value == "t") header.fieldOrder = Capture::FIELD_ORDER_TOP_FIRST;
+                else if (value == "b") header.fieldOrder = Capture::FIELD_ORDER_BOTTOM_FIRST;
+                else if (value == "m") header.fieldOrder = Capture::FIELD_ORDER_MIXED;
+                break;
+            default:
+                // Frame rate, aspect ratio and extensions don't matter here
+                break;
+            }
+        }
+
+        if (header.width <= 0 || header.height <= 0 || header.width % 2 || header.height % 2)
+        {
+            throw Error("Y4M header without a valid frame size.");
+        }
+        if (chroma != "420jpeg" && chroma != "420paldv" && chroma != "420mpeg2" && chroma != "420")
+        {
+            throw Error("Unsupported Y4M chroma format C" + chroma + ", only 8-bit 4:2:0 can be read.");
+        }
+        return header;
+    }
+
+    // Header of the .y4m files written, the frame rate isn't known here
+    static std::string Y4MStreamHeader(int width, int height)
+    {
+        std::stringstream ss;
+        ss << kY4MMagic << " W" << width << " H" << height << " F30:1 Ip A0:0 C420jpeg\n";
+        return ss.str();
+    }
+
+    // YUV4MPEG2 file: a header line with the frame size and format, then every
+    // frame after a FRAME line of its own. The frames are indexed when the file
+    // is opened, so a frame is found in O(1) and read like in a raw file.
+    class Y4MCapture : public YUVCapture
+    {
+    public:
+        explicit Y4MCapture(const std::string & fn);
+
+    protected:
+        virtual size_t FrameOffset(int frameNum) const;
+
+    private:
+        // Line starting at offset, without its newline; offset moves past it
+        std::string ReadLine(size_t & offset);
+
+        std::vector<size_t> m_index;    // file offset of the planes of every frame
+    };
+
+    Y4MCapture::Y4MCapture( const std::string & fn )
+        :    YUVCapture(fn)
+    {
+        size_t offset = 0;
+        const Y4MHeader header = ParseY4MHeader(ReadLine(offset));
+        m_width = header.width;
+        m_height = header.height;
+        m_fieldOrder = header.fieldOrder;
+
+        // A FRAME line may carry parameters of its own, which are skipped
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        while (offset < m_fileSize)
+        {
+            if (ReadLine(offset).compare(0, sizeof(kY4MFrameMarker) - 1, kY4MFrameMarker) != 0)
+            {
+                throw Error("Y4M frame header missing. Corrupted file?");
+            }
+            if (offset + frameSize > m_fileSize)
+            {
+                throw Error("Y4M file ends in the middle of a frame.");
+            }
+            m_index.push_back(offset);
+            offset += frameSize;
+        }
+
+        m_numFrames = (int)m_index.size();
+    }
+
+    std::string Y4MCapture::ReadLine( size_t & offset )
+    {
+        // Longer lines are no Y4M header, whatever extensions they carry
+        static const size_t kMaxLine = 1024;
+
+        std::string line;
+        bool found = false;
+        if (m_map)
+        {
+            const char * pLine = (const char *)m_map + offset;
+            const char * pEnd = (const char *)memchr(pLine, '\n', std::min(kMaxLine, m_mapSize - offset));
+            if (pEnd)
+            {
+                line.assign(pLine, pEnd);
+                found = true;
+            }
+        }
+        else
+        {
+            m_file.clear();
+            m_file.seekg(offset);
+            found = std::getline(m_file, line) && !m_file.eof() && line.size() < kMaxLine;
+        }
+        if (!found)
+        {
+            throw Error("Y4M header line missing or too long. Corrupted file?");
+        }
+        offset += line.size() + 1;
+        return line;
+    }
+
+    size_t Y4MCapture::FrameOffset( int frameNum ) const
+    {
+        if (frameNum < 0 || frameNum >= (int)m_index.size())
+        {
+            throw Error("Capture::GetFrame: frame number out of range.");
+        }
+        return m_index[frameNum];
+    }
+
     Capture * Capture::CreateFileCapture(const std::string & fn, int width, int height)
     {
         Capture * cap = NULL;
 
-        if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
+        if (IsY4M(fn))
+        {
+            cap = new Y4MCapture(fn);
+        }
+        else if((strstr(fn.c_str(), ".yuv") != NULL) || (strstr(fn.c_str(), ".yv12") != NULL))
         {
             cap = new YUVCapture(fn, width, height);
         }
@@ -135,6 +431,27 @@ namespace YUVUtils
         return cap;
     }
 
+    bool Capture::ReadFileGeometry(const std::string & fn, int & width, int & height)
+    {
+        if (!IsY4M(fn))
+        {
+            return false;
+        }
+
+        std::ifstream file(fn.c_str(), std::ios::binary);
+        std::string line;
+        if (!std::getline(file, line))
+        {
+            std::stringstream ss;
+            ss << "Unable to load YUV file: " << fn;
+            throw Error(ss.str().c_str());
+        }
+        const Y4MHeader header = ParseY4MHeader(line);
+        width = header.width;
+        height = header.height;
+        return true;
+    }
+
     void Capture::Release(Capture * cap)
     {
         delete cap;
@@ -176,122 +493,362 @@ namespace YUVUtils
     }
 
 
+    // Copies the planes of im into pDst in the file layout, Y then U then V
+    static void PackFrame(PlanarImage * im, uint8_t * pDst)
+    {
+        uint8_t * pSrc = (uint8_t*)im->Y;
+        for (unsigned int y = 0; y < im->Height; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width);
+            pSrc += im->PitchY;
+            pDst += im->Width;
+        }
+
+        pSrc = (uint8_t*)im->U;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchU;
+            pDst += im->Width / 2;
+        }
+
+        pSrc = (uint8_t*)im->V;
+        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        {
+            memcpy(pDst, pSrc, im->Width / 2);
+            pSrc += im->PitchV;
+            pDst += im->Width / 2;
+        }
+    }
+
+    // Saves the packed frame pImgY as <fn up to the first '.'>_<frameNum>.bmp,
+    // bmp is the scratch buffer for the BGRA pixels
+    static void SaveFrameAsBMP(const uint8_t * pImgY, int width, int height, std::vector<cl_uchar4> & bmp,
+        const std::string & fn, int frameNum)
+    {
+        using namespace std;
+
+        std::string outfile = fn;
+        std::size_t found  = outfile.find('.');
+        //crop the name
+        outfile =  outfile.substr(0, found);
+        bmp.resize(width * height);
+        const int UVwidth  = width/2;
+        const int UVheight = height/2;
+        //U (a value per 4 pixels) and V (a value per 4 pixels)
+        const uint8_t * pImgU = pImgY + width * height;  //U plane is after Y plane (which is width * height)
+        const uint8_t * pImgV = pImgU + UVwidth * UVheight;//V plane is after U plane (which is UVwidth * UVheight)
+        for (int i = 0; i < height; ++i)
+        {
+            for (int j = 0; j < width; ++j)
+            {
+               //Y value
+               unsigned char Y = pImgY[j + width*(height-1-i)];
+               //the same U value 4 times, thus both i and j are divided by 2
+               unsigned char U = pImgU[j/2 + UVwidth*(UVheight-1-i/2)];
+               unsigned char V = pImgV[j/2 + UVwidth*(UVheight-1-i/2)];
+
+               //R is the 3rd component in the bitmap (which is actualy stored as BGRA)
+               const int R = (int)(1.164f*(float(Y) - 16) + 1.596f*(float(V) - 128));
+               bmp[j + width*i].s[2] = min(255, max(R,0));
+               //G
+               const int G = (int)(1.164f*(float(Y) - 16) - 0.813f*(float(V) - 128) - 0.391f*(float(U) - 128));
+               bmp[j + width*i].s[1] = min(255, max(G,0));
+               //B
+               const int B = (int)(1.164f*(float(Y) - 16) + 2.018f*(float(U) - 128));
+               bmp[j + width*i].s[0] = min(255, max(B,0));
+            }
+        }
+        std::stringstream number; number<<frameNum;
+        std::string filename = outfile + "_" + number.str() + std::string(".bmp");
+        if (!SaveImageAsBMP((unsigned int*)&bmp[0], width, height, filename.c_str()))
+        {
+            throw Error("Failed to write output bitmap file.");
+        }
+    }
+
+    // Keeps the appended frames in memory, WriteToFile writes them all
     class YUVWriter : public FrameWriter
     {
     public:
         YUVWriter(int width, int height, bool bToBMPs = false);
-        virtual ~YUVWriter();
         void AppendFrame(PlanarImage * im);
         void WriteToFile( const char * fn);
     private:
-        std::vector<uint8_t> m_data;//frame in YV12
+        std::vector<uint8_t> m_data;//frames in YV12
         std::vector<cl_uchar4> m_frameBMPOutput;
         bool m_bToBMPs;
-        std::ofstream m_outfile;
-        std::string m_outfileName;
     };
 
-    YUVWriter::~YUVWriter()
-    {
-        if (m_outfile.is_open())
-            m_outfile.close();
-    }
-
     void YUVWriter::WriteToFile( const char * fn )
     {
-        //close the previous output file
-        if (m_outfile.is_open())
-            m_outfile.close();
-        m_currFrame = 0;
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        if (m_bToBMPs)
+        {
+            for (int i = 0; i < m_currFrame; ++i)
+            {
+                SaveFrameAsBMP(&m_data[i * frameSize], m_width, m_height, m_frameBMPOutput, fn, i);
+            }
+        }
 
-        m_outfileName = std::string(fn);
-        m_outfile.open(fn, std::ios::binary);
-        if (!m_outfile.good())
+        std::ofstream outfile(fn, std::ios::binary);
+        if (!outfile.good())
         {
             throw Error("Failed opening output file.");
         }
+        if (IsY4M(fn))
+        {
+            const std::string header = Y4MStreamHeader(m_width, m_height);
+            outfile.write(header.c_str(), header.size());
+            for (int i = 0; i < m_currFrame; ++i)
+            {
+                outfile << kY4MFrameMarker << '\n';
+                outfile.write((char*)&m_data[i * frameSize], frameSize);
+            }
+        }
+        else
+        {
+            outfile.write((char*)&m_data[0], m_data.size());
+        }
+        outfile.close();
     }
 
     void YUVWriter::AppendFrame( PlanarImage * im )
     {
-	using namespace std;
-	
-        uint8_t * pSrc = (uint8_t*)im->Y;
-        uint8_t * pDst = &m_data[0];
-        for (unsigned int y = 0; y < im->Height; ++y)
-        {
-            memcpy(pDst, pSrc, im->Width);
-            pSrc += im->PitchY;
-            pDst += im->Width;
-        }
+        const size_t frameSize = m_width * m_height * 3 / 2 * sizeof(uint8_t);
+        m_data.resize((m_currFrame + 1) * frameSize);
+        PackFrame(im, &m_data[m_currFrame * frameSize]);
+        m_currFrame++;
+    }
 
-        pSrc = (uint8_t*)im->U;
-        for (unsigned int y = 0; y < im->Height / 2; ++y)
+    YUVWriter::YUVWriter( int width, int height, bool bToBMPs )
+        : FrameWriter(width, height), m_bToBMPs (bToBMPs)
+    {
+    }
+
+    // Size the frames are batched to before they are handed to the writer thread
+    static const size_t kStreamChunkSize = 4 << 20;
+
+    // Writes the frames to the file while the sequence is processed. AppendFrame
+    // packs the frame into a page-aligned chunk of several frames; full chunks
+    // go through a bounded queue to a writer thread, which writes each one with
+    // a single unbuffered write. AppendFrame only blocks when every chunk is
+    // still queued, so the memory use doesn't grow with the sequence.
+    // The bitmaps are saved by AppendFrame.
+    class StreamingYUVWriter : public FrameWriter
+    {
+    public:
+        StreamingYUVWriter(const std::string & fn, int width, int height, bool bToBMPs, int queueDepth);
+        virtual ~StreamingYUVWriter();
+
+        void AppendFrame(PlanarImage * im);
+        // Waits for the queued frames and closes the file
+        void WriteToFile(const char * fn);
+
+    private:
+        void WriteLoop();
+        void Submit();
+        void Close();
+
+        std::string m_fileName;
+        FILE * m_file;
+        bool m_bToBMPs;
+        std::vector<cl_uchar4> m_frameBMPOutput;
+        std::string m_frameHeader;  // goes before every frame, the FRAME line in a .y4m
+        size_t m_frameSize;         // of a frame in the file, with its header
+        size_t m_chunkCapacity;
+        std::vector<uint8_t *> m_chunks;
+        std::vector<size_t> m_chunkSizes;
+        std::deque<int> m_free;
+        std::deque<int> m_queued;
+        int m_current;          // chunk being filled, -1 when there is none
+        bool m_stop;
+        std::string m_error;    // set by the writer thread
+
+        std::mutex m_mutex;
+        std::condition_variable m_writerCond;  // a chunk was queued
+        std::condition_variable m_freeCond;    // a chunk was written
+        std::thread m_writer;
+    };
+
+    StreamingYUVWriter::StreamingYUVWriter( const std::string & fn, int width, int height, bool bToBMPs, int queueDepth )
+        : FrameWriter(width, height), m_fileName(fn), m_file(NULL), m_bToBMPs(bToBMPs),
+          m_frameSize(width * height * 3 / 2 * sizeof(uint8_t)), m_current(-1), m_stop(false)
+    {
+        m_file = fopen(fn.c_str(), "wb");
+        if (!m_file)
         {
-            memcpy(pDst, pSrc, im->Width / 2);
-            pSrc += im->PitchU;
-            pDst += im->Width / 2;
+            throw Error("Failed opening output file.");
         }
+        // The chunks are written straight from their pages
+        setvbuf(m_file, NULL, _IONBF, 0);
 
-        pSrc = (uint8_t*)im->V;
-        for (unsigned int y = 0; y < im->Height / 2; ++y)
+        if (IsY4M(fn))
         {
-            memcpy(pDst, pSrc, im->Width / 2);
-            pSrc += im->PitchV;
-            pDst += im->Width / 2;
+            const std::string header = Y4MStreamHeader(width, height);
+            if (fwrite(header.c_str(), 1, header.size(), m_file) != header.size())
+            {
+                fclose(m_file);
+                throw Error("Failed writing output file " + fn);
+            }
+            m_frameHeader = std::string(kY4MFrameMarker) + '\n';
+            m_frameSize += m_frameHeader.size();
         }
 
-        if(m_bToBMPs)
-        {
-            std::string outfile =  m_outfileName;
-            std::size_t found  = outfile.find('.');
-            //crop the name
-            outfile =  outfile.substr(0, found);
-            const int UVwidth  = m_width/2;
-            const int UVheight = m_height/2;
-            //Y (a value per pixel)
-            const uint8_t * pImgY = &m_data[0];
-            //U (a value per 4 pixels) and V (a value per 4 pixels)
-            const uint8_t * pImgU = pImgY + m_width * m_height;  //U plane is after Y plane (which is m_width * m_height)
-            const uint8_t * pImgV = pImgU + UVwidth * UVheight;//V plane is after U plane (which is UVwidth * UVheight)
-            for (int i = 0; i < m_height; ++i)
+        m_chunkCapacity = std::max(kStreamChunkSize / m_frameSize, (size_t)1) * m_frameSize;
+        m_chunks.resize(std::max(queueDepth, 2), NULL);
+        m_chunkSizes.resize(m_chunks.size(), 0);
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+            m_chunks[c] = (uint8_t *)aligned_malloc(m_chunkCapacity, 0x1000);
+            if (!m_chunks[c])
             {
-                for (int j = 0; j < m_width; ++j)
+                fclose(m_file);
+                for (size_t k = 0; k < c; ++k)
                 {
-                   //Y value
-                   unsigned char Y = pImgY[j + m_width*(m_height-1-i)];
-                   //the same U value 4 times, thus both i and j are divided by 2
-                   unsigned char U = pImgU[j/2 + UVwidth*(UVheight-1-i/2)];
-                   unsigned char V = pImgV[j/2 + UVwidth*(UVheight-1-i/2)];
-
-                   //R is the 3rd component in the bitmap (which is actualy stored as BGRA)
-                   const int R = (int)(1.164f*(float(Y) - 16) + 1.596f*(float(V) - 128));
-                   m_frameBMPOutput[j + m_width*i].s[2] = min(255, max(R,0));
-                   //G
-                   const int G = (int)(1.164f*(float(Y) - 16) - 0.813f*(float(V) - 128) - 0.391f*(float(U) - 128));
-                   m_frameBMPOutput[j + m_width*i].s[1] = min(255, max(G,0));
-                   //B
-                   const int B = (int)(1.164f*(float(Y) - 16) + 2.018f*(float(U) - 128));
-                   m_frameBMPOutput[j + m_width*i].s[0] = min(255, max(B,0));
+                    aligned_free(m_chunks[k]);
                 }
+                throw Error("Allocation failed");
+            }
+            m_free.push_back((int)c);
+        }
+        m_writer = std::thread(&StreamingYUVWriter::WriteLoop, this);
+    }
+
+    StreamingYUVWriter::~StreamingYUVWriter()
+    {
+        if (m_file)
+        {
+            try
+            {
+                Close();
             }
-            std::stringstream number; number<<m_currFrame;
-            std::string filename = outfile + "_" + number.str() + std::string(".bmp");
-            if (!SaveImageAsBMP((unsigned int*)&m_frameBMPOutput[0], m_width, m_height, filename.c_str()))
+            catch (...)
             {
-                throw Error("Failed to write output bitmap file.");
+                // Nothing to report to from a destructor, WriteToFile throws instead
             }
         }
-        m_outfile.write((char*)&m_data[0], m_data.size());
-        m_currFrame++;
+        for (size_t c = 0; c < m_chunks.size(); ++c)
+        {
+            aligned_free(m_chunks[c]);
+        }
     }
 
-    YUVWriter::YUVWriter( int width, int height, bool bToBMPs )
-        : FrameWriter(width, height), m_bToBMPs (bToBMPs)
+    void StreamingYUVWriter::WriteLoop()
     {
-        const size_t frameSize = width * height * 3 / 2 * sizeof(uint8_t);
-        m_data.resize(frameSize);
-        m_frameBMPOutput.resize(frameSize);
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;)
+        {
+            while (m_queued.empty() && !m_stop)
+            {
+                m_writerCond.wait(lock);
+            }
+            // Everything queued is written before stopping
+            if (m_queued.empty())
+            {
+                return;
+            }
+            const int c = m_queued.front();
+            m_queued.pop_front();
+            const bool failed = !m_error.empty();
+            lock.unlock();
+
+            const bool written = !failed && fwrite(m_chunks[c], 1, m_chunkSizes[c], m_file) == m_chunkSizes[c];
+
+            lock.lock();
+            if (!written && m_error.empty())
+            {
+                m_error = "Failed writing output file " + m_fileName;
+            }
+            m_free.push_back(c);
+            m_freeCond.notify_one();
+        }
+    }
+
+    void StreamingYUVWriter::AppendFrame( PlanarImage * im )
+    {
+        if (!m_file)
+        {
+            throw Error("StreamingYUVWriter: the output file is already closed.");
+        }
+        if (m_current < 0)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (m_free.empty())
+            {
+                m_freeCond.wait(lock);
+            }
+            if (!m_error.empty())
+            {
+                throw Error(m_error);
+            }
+            m_current = m_free.front();
+            m_free.pop_front();
+            m_chunkSizes[m_current] = 0;
+        }
+
+        uint8_t * pFrame = m_chunks[m_current] + m_chunkSizes[m_current];
+        memcpy(pFrame, m_frameHeader.data(), m_frameHeader.size());
+        pFrame += m_frameHeader.size();
+        PackFrame(im, pFrame);
+        if (m_bToBMPs)
+        {
+            SaveFrameAsBMP(pFrame, m_width, m_height, m_frameBMPOutput, m_fileName, m_currFrame);
+        }
+
+        m_chunkSizes[m_current] += m_frameSize;
+        ++m_currFrame;
+        if (m_chunkSizes[m_current] + m_frameSize > m_chunkCapacity)
+        {
+            Submit();
+        }
+    }
+
+    void StreamingYUVWriter::Submit()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queued.push_back(m_current);
+        }
+        m_current = -1;
+        m_writerCond.notify_one();
+    }
+
+    void StreamingYUVWriter::Close()
+    {
+        if (m_current >= 0)
+        {
+            Submit();
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_writerCond.notify_one();
+        m_writer.join();
+
+        const bool closed = fclose(m_file) == 0;
+        m_file = NULL;
+        if (!m_error.empty())
+        {
+            throw Error(m_error);
+        }
+        if (!closed)
+        {
+            throw Error("Failed writing output file " + m_fileName);
+        }
+    }
+
+    void StreamingYUVWriter::WriteToFile( const char * fn )
+    {
+        if (fn && m_fileName != fn)
+        {
+            throw Error("StreamingYUVWriter: the frames are written to " + m_fileName);
+        }
+        if (m_file)
+        {
+            Close();
+        }
     }
 
     FrameWriter * FrameWriter::CreateFrameWriter(int width, int height, bool bFormatBMPHint)
@@ -299,6 +856,11 @@ namespace YUVUtils
         return new YUVWriter(width, height, bFormatBMPHint);
     }
 
+    FrameWriter * FrameWriter::CreateStreamingFrameWriter(const std::string & fn, int width, int height, bool bFormatBMPHint, int queueDepth)
+    {
+        return new StreamingYUVWriter(fn, width, height, bFormatBMPHint, queueDepth);
+    }
+
     void FrameWriter::Release(FrameWriter * writer)
     {
         delete writer;
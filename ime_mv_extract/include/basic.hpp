@@ -164,6 +164,19 @@ void destructorException ();
 
 // Query for several frequently used device/kernel capabilities
 
+// Recomended alignment in bytes for memory used in clCreateBuffer with CL_MEM_USE_HOST_PTR.
+// Returned value is sufficiently large to enable zero-copy behaviour on Intel Processor Graphics.
+cl_uint zeroCopyPtrAlignment ();
+
+// Extends required buffer size to a value which is sufficient to enable
+// zero-copy behaviour for buffers created with CL_MEM_USE_HOST_PTR on Intel Processor Graphics.
+size_t zeroCopySizeAlignment (size_t requiredSize);
+
+// Verifies if ptr and sizeOfContentOfPtr satisfy alignment rules which
+// should be held to enable zero-copy behaviour on Intel Processor Graphics in case if an OpenCL buffer
+// is created using CL_MEM_USE_HOST_PTR flag and provided memory area.
+bool verifyZeroCopyPtr (void* ptr, size_t sizeOfContentsOfPtr);
+
 // Minimal alignment in bytes for memory used in clCreateBuffer with CL_MEM_USE_HOST_PTR
 cl_uint requiredOpenCLAlignment (cl_device_id device);
 
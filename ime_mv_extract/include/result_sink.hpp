@@ -0,0 +1,173 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// This file contains the per-frame consumers of the motion estimation
+// results. Instead of keeping the motion vectors, residuals and shapes of the
+// whole sequence, the backends write every frame into a slot of a small ring
+// (ResultWindow) and ResultDispatcher hands the finished frame to each sink
+// in turn. The ring only holds the frames still in flight plus the history
+// the sinks asked for, so the memory use doesn't grow with the sequence.
+
+
+#ifndef _RESULT_SINK_HPP_
+#define _RESULT_SINK_HPP_
+
+#include <CL/cl.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "yuv_utils.h"
+
+// Results of one frame, in the layout written by block_motion_estimate_intel:
+// macroblocks in raster order, the 16 motion vectors of a macroblock in the
+// zigzag order of its 4x4 blocks.
+struct MotionResults
+{
+    int frame;                          // -1 while the slot holds no frame
+    std::vector<cl_short2> MVs;
+    std::vector<cl_ushort> SADs;
+    std::vector<cl_uchar2> Shapes;
+
+    // Zeroes the results, for frames with no motion estimated
+    void Clear();
+};
+
+// Ring of per-frame results. Slot(i) recycles the slot of frame i - Size().
+class ResultWindow
+{
+public:
+    ResultWindow(int size, size_t mvsPerFrame, size_t mbsPerFrame);
+
+    // Slot receiving the results of frame i
+    MotionResults & Slot(int i);
+
+    // Results of frame i, which has to be still in the window
+    const MotionResults & Get(int i) const;
+
+    bool Contains(int i) const;
+    int Size() const { return (int)m_slots.size(); }
+
+private:
+    std::vector<MotionResults> m_slots;
+};
+
+class ResultSink
+{
+public:
+    virtual ~ResultSink() {}
+
+    // Number of earlier frames the sink reads from the window when it
+    // consumes a frame.
+    virtual int History() const { return 0; }
+
+    // Called in frame order with the results of frame i in the window and the
+    // source frame, which sinks may draw on. Frame 0 is only a reference, its
+    // results are all zero.
+    virtual void Consume(const ResultWindow & window, int i, YUVUtils::PlanarImage * image) = 0;
+
+    // Called once after the last frame.
+    virtual void Finish() {}
+};
+
+// Owns the window and feeds the sinks, in the order they were added.
+class ResultDispatcher
+{
+public:
+    // inFlight is the number of frames a backend writes ahead of the one
+    // being consumed, e.g. the depth of FramePipeline.
+    ResultDispatcher(const std::vector<ResultSink *> & sinks, size_t mvsPerFrame, size_t mbsPerFrame, int inFlight = 1);
+
+    // Slot to fill with the results of frame i
+    MotionResults & Begin(int i) { return m_window.Slot(i); }
+
+    // Hands frame i, filled through Begin, to every sink
+    void Publish(int i, YUVUtils::PlanarImage * image);
+
+    void Finish();
+
+private:
+    static int WindowSize(const std::vector<ResultSink *> & sinks, int inFlight);
+
+    std::vector<ResultSink *> m_sinks;
+    ResultWindow m_window;
+};
+
+// Discards the results, for timing the motion estimation alone.
+class NullSink : public ResultSink
+{
+public:
+    virtual void Consume(const ResultWindow &, int, YUVUtils::PlanarImage *) {}
+};
+
+// Accumulates motion statistics and prints them at the end: mean partition
+// distortion per 4x4 entry, share of zero vectors, mean vector length and how
+// much the vectors change from one frame to the next.
+class StatsSink : public ResultSink
+{
+public:
+    StatsSink();
+
+    virtual int History() const { return 1; }
+    virtual void Consume(const ResultWindow & window, int i, YUVUtils::PlanarImage * image);
+    virtual void Finish();
+
+private:
+    int m_frames;
+    double m_sadSum;
+    double m_lengthSum;
+    double m_changeSum;
+    size_t m_zeroMVs;
+    size_t m_MVs;
+    size_t m_changedMVs;
+};
+
+// Writes the motion vectors as a NumPy array of shape
+// (frames, mvImageHeight, mvImageWidth, 2), int16 in quarter pixels, in raster
+// order. The frame count is patched into the header by Finish.
+class NpySink : public ResultSink
+{
+public:
+    NpySink(const std::string & fileName, int mvImageWidth, int mvImageHeight);
+    ~NpySink();
+
+    virtual void Consume(const ResultWindow & window, int i, YUVUtils::PlanarImage * image);
+    virtual void Finish();
+
+private:
+    void WriteHeader(int frames);
+
+    FILE * m_file;
+    int m_mvImageWidth;
+    int m_mvImageHeight;
+    int m_frames;
+    std::vector<cl_short2> m_linear;
+
+    NpySink(const NpySink &);
+    NpySink & operator=(const NpySink &);
+};
+
+// Reorders the motion vectors of a frame from the kernel layout (16 per
+// macroblock, zigzag within the macroblock) to raster order. The size of the
+// vector image is a multiple of 4 in both directions.
+void LinearizeMVs(const cl_short2 * MVs, int mvImageWidth, int mvImageHeight, cl_short2 * linear);
+
+#endif  // end of the include guard
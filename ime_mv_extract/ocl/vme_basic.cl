@@ -83,4 +83,26 @@ void  block_motion_estimate_intel(
       }
       shapes_buffer [gid_0 + gid_1 * get_num_groups(0)] = shapes;
   }
+}
+
+/*************************************************************************************************\
+ Kernel:
+    get_default_cost_tables
+
+ Description:
+    Reads back the packed motion vector cost tables the driver returns for the low, medium and
+    high penalty (in that order), so the cpu backend can be given the same costs. The tables are
+    not documented, the device is the only source for them.
+\*************************************************************************************************/
+
+__kernel __attribute__((reqd_work_group_size(16,1,1)))
+void  get_default_cost_tables( __global uint2* tables ) {
+  uint2 low    = intel_sub_group_avc_mce_get_default_low_penalty_cost_table();
+  uint2 medium = intel_sub_group_avc_mce_get_default_medium_penalty_cost_table();
+  uint2 high   = intel_sub_group_avc_mce_get_default_high_penalty_cost_table();
+  if( get_local_id(0) == 0 ) {
+      tables[ 0 ] = low;
+      tables[ 1 ] = medium;
+      tables[ 2 ] = high;
+  }
 }
\ No newline at end of file
@@ -0,0 +1,650 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+
+// Scalar reference for the CPU motion search. Everything here is written
+// straight from the definitions (clamp-to-edge sampling, the H.264 6-tap
+// filter and quarter-pel averages, SAD/SATD, the partition shapes) and
+// reads the synthetic frames directly, so it shares no code with the SIMD
+// kernels it checks.
+
+#include "cpu_vme.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace CPUVme
+{
+    namespace
+    {
+        // Luma frame sampled with clamp-to-edge addressing
+        struct Frame
+        {
+            int width;
+            int height;
+            std::vector<uint8_t> pixels;
+
+            int At(int x, int y) const
+            {
+                x = std::min(std::max(x, 0), width - 1);
+                y = std::min(std::max(y, 0), height - 1);
+                return pixels[y * width + x];
+            }
+        };
+
+        // Deterministic noise, the check has to give the same frames everywhere
+        struct Lcg
+        {
+            uint32_t state;
+            explicit Lcg(uint32_t seed) : state(seed) {}
+            int Next(int range)
+            {
+                state = state * 1664525u + 1013904223u;
+                return (int)((state >> 8) % (uint32_t)range);
+            }
+        };
+
+        int Clip255(int v)
+        {
+            return std::min(std::max(v, 0), 255);
+        }
+
+        int Tap6(int a, int b, int c, int d, int e, int f)
+        {
+            return a - 5 * b + 20 * c + 20 * d - 5 * e + f;
+        }
+
+        int TapRow(const Frame & f, int x, int y)
+        {
+            return Tap6(f.At(x - 2, y), f.At(x - 1, y), f.At(x, y), f.At(x + 1, y), f.At(x + 2, y), f.At(x + 3, y));
+        }
+
+        // Half-pel samples at (x + 1/2, y), (x, y + 1/2) and (x + 1/2, y + 1/2)
+        int HalfH(const Frame & f, int x, int y)
+        {
+            return Clip255((TapRow(f, x, y) + 16) >> 5);
+        }
+
+        int HalfV(const Frame & f, int x, int y)
+        {
+            return Clip255((Tap6(f.At(x, y - 2), f.At(x, y - 1), f.At(x, y), f.At(x, y + 1), f.At(x, y + 2), f.At(x, y + 3)) + 16) >> 5);
+        }
+
+        int HalfC(const Frame & f, int x, int y)
+        {
+            // Vertical filter over the unrounded horizontal sums
+            return Clip255((Tap6(TapRow(f, x, y - 2), TapRow(f, x, y - 1), TapRow(f, x, y),
+                                 TapRow(f, x, y + 1), TapRow(f, x, y + 2), TapRow(f, x, y + 3)) + 512) >> 10);
+        }
+
+        int Avg(int a, int b)
+        {
+            return (a + b + 1) >> 1;
+        }
+
+        // Sample at the absolute QPEL position (qx, qy): full and half-pel
+        // samples as they are, quarter-pel ones the average of the two
+        // nearest, as in H.264 8.4.2.2.2
+        int Qpel(const Frame & f, int qx, int qy)
+        {
+            const int x = qx >> 2;
+            const int y = qy >> 2;
+            switch (((qy & 3) << 2) | (qx & 3))
+            {
+            case 0:  return f.At(x, y);
+            case 1:  return Avg(f.At(x, y), HalfH(f, x, y));
+            case 2:  return HalfH(f, x, y);
+            case 3:  return Avg(HalfH(f, x, y), f.At(x + 1, y));
+            case 4:  return Avg(f.At(x, y), HalfV(f, x, y));
+            case 5:  return Avg(HalfH(f, x, y), HalfV(f, x, y));
+            case 6:  return Avg(HalfH(f, x, y), HalfC(f, x, y));
+            case 7:  return Avg(HalfH(f, x, y), HalfV(f, x + 1, y));
+            case 8:  return HalfV(f, x, y);
+            case 9:  return Avg(HalfV(f, x, y), HalfC(f, x, y));
+            case 10: return HalfC(f, x, y);
+            case 11: return Avg(HalfC(f, x, y), HalfV(f, x + 1, y));
+            case 12: return Avg(HalfV(f, x, y), f.At(x, y + 1));
+            case 13: return Avg(HalfV(f, x, y), HalfH(f, x, y + 1));
+            case 14: return Avg(HalfC(f, x, y), HalfH(f, x, y + 1));
+            default: return Avg(HalfH(f, x, y + 1), HalfV(f, x + 1, y));
+            }
+        }
+
+        // SAD, or SATD (halved sum of the absolute 4x4 Hadamard coefficients)
+        // with haar, of the w x h block at (x, y) displaced by the QPEL vector
+        uint32_t Distortion(const Frame & src, const Frame & ref, int x, int y, int w, int h, int mvX, int mvY, bool haar)
+        {
+            int diff[16][16];
+            for (int r = 0; r < h; ++r)
+            {
+                for (int c = 0; c < w; ++c)
+                {
+                    const int pred = (mvX & 3) || (mvY & 3)
+                        ? Qpel(ref, (x + c) * 4 + mvX, (y + r) * 4 + mvY)
+                        : ref.At(x + c + (mvX >> 2), y + r + (mvY >> 2));
+                    diff[r][c] = src.At(x + c, y + r) - pred;
+                }
+            }
+
+            uint32_t sum = 0;
+            if (!haar)
+            {
+                for (int r = 0; r < h; ++r)
+                {
+                    for (int c = 0; c < w; ++c)
+                    {
+                        sum += abs(diff[r][c]);
+                    }
+                }
+                return sum;
+            }
+
+            static const int kHadamard[4][4] = { { 1, 1, 1, 1 }, { 1, 1, -1, -1 }, { 1, -1, -1, 1 }, { 1, -1, 1, -1 } };
+            for (int by = 0; by < h; by += 4)
+            {
+                for (int bx = 0; bx < w; bx += 4)
+                {
+                    for (int u = 0; u < 4; ++u)
+                    {
+                        for (int v = 0; v < 4; ++v)
+                        {
+                            int coef = 0;
+                            for (int r = 0; r < 4; ++r)
+                            {
+                                for (int c = 0; c < 4; ++c)
+                                {
+                                    coef += kHadamard[u][r] * diff[by + r][bx + c] * kHadamard[v][c];
+                                }
+                            }
+                            sum += abs(coef);
+                        }
+                    }
+                }
+            }
+            return (sum + 1) >> 1;
+        }
+
+        // Partitions of a MB by size, in the bit order of the partition mask;
+        // sub-partitions follow their 8x8 quadrant
+        const int kSizeWidth[7] = { 16, 16, 8, 8, 8, 4, 4 };
+        const int kSizeHeight[7] = { 16, 8, 16, 8, 4, 8, 4 };
+        const int kSizeCount[7] = { 1, 2, 2, 4, 8, 8, 16 };
+
+        void PartitionRect(int size, int i, int & x, int & y)
+        {
+            if (size < 3)
+            {
+                x = (16 / kSizeWidth[size] > 1) ? i * kSizeWidth[size] : 0;
+                y = (16 / kSizeHeight[size] > 1) ? i * kSizeHeight[size] : 0;
+                return;
+            }
+            const int perQuadrant = kSizeCount[size] / 4;
+            const int q = i / perQuadrant;
+            const int n = i % perQuadrant;
+            const int across = 8 / kSizeWidth[size];
+            x = (q & 1) * 8 + (n % across) * kSizeWidth[size];
+            y = (q >> 1) * 8 + (n / across) * kSizeHeight[size];
+        }
+
+        // Best integer vector of one partition: lowest distortion plus MV
+        // cost, then shortest vector. unique is false when another vector
+        // ties on both.
+        struct Best
+        {
+            uint32_t total;
+            int length;
+            int mvX;
+            int mvY;
+            bool unique;
+        };
+
+        // Where the output puts the 4x4 block at row, col of the MB: the
+        // order of block_motion_estimate_intel, as undone by LinearizeMVs
+        const int kZigzag[16] = { 0, 1, 4, 5, 2, 3, 6, 7, 8, 9, 12, 13, 10, 11, 14, 15 };
+
+        struct Config
+        {
+            const char * name;
+            SubPixelMode subPixelMode;
+            SadAdjustMode sadAdjustMode;
+            cl_uchar partitionMask;
+            bool cost;
+            CostPrecision costPrecision;
+        };
+
+        class Checker
+        {
+        public:
+            Checker(std::ostream & log, const char * path) : m_log(log), m_path(path), m_errors(0) {}
+
+            void Fail(const std::string & what, int mbIndex)
+            {
+                if (m_errors < 10)
+                {
+                    m_log << "  " << m_path << ": " << what;
+                    if (mbIndex >= 0)
+                    {
+                        m_log << " in MB " << mbIndex;
+                    }
+                    m_log << "\n";
+                }
+                m_errors++;
+            }
+
+            int Errors() const { return m_errors; }
+
+        private:
+            std::ostream & m_log;
+            const char * m_path;
+            int m_errors;
+        };
+
+        Frame MakeFrame(int width, int height)
+        {
+            Frame f;
+            f.width = width;
+            f.height = height;
+            f.pixels.resize(width * height);
+            return f;
+        }
+
+        // Textured reference and a source that moves differently in every
+        // region, with a flat patch where only the tie rules decide
+        void MakeFrames(int width, int height, Frame & src, Frame & ref)
+        {
+            Lcg rng(12345);
+            ref = MakeFrame(width, height);
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    ref.pixels[y * width + x] = (uint8_t)Clip255(((x * 7 + y * 3 + (x * y) / 5) & 127) + 40 + rng.Next(64));
+                }
+            }
+            src = MakeFrame(width, height);
+            for (int y = 0; y < height; ++y)
+            {
+                for (int x = 0; x < width; ++x)
+                {
+                    const int sx = (x < width / 2) ? 3 : -7;
+                    const int sy = (y < height / 2) ? 2 : -5;
+                    int v = ref.At(x + sx, y + sy) + rng.Next(9) - 4;
+                    if (x >= width - 20 && y >= height - 12)
+                    {
+                        v = 90;
+                    }
+                    src.pixels[y * width + x] = (uint8_t)Clip255(v);
+                }
+            }
+        }
+
+        void CheckPlanes(const Frame & frame, const Plane & plane, Checker & check)
+        {
+            const int paddedWidth = (frame.width + 15) & ~15;
+            const int paddedHeight = (frame.height + 15) & ~15;
+            for (int y = -kPlaneBorder; y < paddedHeight + kPlaneBorder; ++y)
+            {
+                for (int x = -kPlaneBorder; x < paddedWidth + kPlaneBorder; ++x)
+                {
+                    if (*plane.Ptr(x, y) != frame.At(x, y))
+                    {
+                        check.Fail("edge replication differs", -1);
+                        return;
+                    }
+                }
+            }
+
+            if (!plane.IsInterpolated())
+            {
+                return;
+            }
+
+            // The area the search and the refinement may read
+            const int first = -kPlaneBorder + kInterpolationMargin;
+            for (int y = first; y < paddedHeight - first; ++y)
+            {
+                for (int x = first; x < paddedWidth - first; ++x)
+                {
+                    if (*plane.SubpelPtr(1, x, y) != HalfH(frame, x, y) ||
+                        *plane.SubpelPtr(2, x, y) != HalfV(frame, x, y) ||
+                        *plane.SubpelPtr(3, x, y) != HalfC(frame, x, y))
+                    {
+                        check.Fail("half-pel filter differs", -1);
+                        return;
+                    }
+                }
+            }
+        }
+
+        void CheckConfig(const Config & config, SimdPath simd, const Frame & src, const Frame & ref,
+                         const Plane & srcPlane, const Plane & refPlane, Checker & check)
+        {
+            const int mbWidth = (src.width + 15) / 16;
+            const int mbHeight = (src.height + 15) / 16;
+            const int numMBs = mbWidth * mbHeight;
+            const bool haar = config.sadAdjustMode == SAD_ADJUST_MODE_HAAR;
+
+            SearchDesc desc;
+            desc.subPixelMode = config.subPixelMode;
+            desc.sadAdjustMode = config.sadAdjustMode;
+            desc.partitionMask = config.partitionMask;
+            desc.costPrecision = config.costPrecision;
+            // Any packed table does, this one costs something at every distance
+            desc.costTable.s[0] = config.cost ? 0x18141008 : 0;
+            desc.costTable.s[1] = config.cost ? 0x3A2C2A1C : 0;
+            const CostModel costModel(desc.costTable, desc.costPrecision);
+
+            // Predictors and cost centers all over the place, some far
+            // enough out to have the search center clamped
+            Lcg rng(777);
+            std::vector<cl_short2> predMVs(numMBs), costCenters(numMBs);
+            for (int i = 0; i < numMBs; ++i)
+            {
+                const int range = (i % 5 == 0) ? 1200 : 80;
+                predMVs[i].s[0] = (cl_short)(rng.Next(2 * range + 1) - range);
+                predMVs[i].s[1] = (cl_short)(rng.Next(2 * range + 1) - range);
+                costCenters[i].s[0] = (cl_short)(rng.Next(97) - 48);
+                costCenters[i].s[1] = (cl_short)(rng.Next(97) - 48);
+            }
+
+            std::vector<cl_short2> mvs(numMBs * 16);
+            std::vector<cl_ushort> residuals(numMBs * 16);
+            std::vector<cl_uchar2> shapes(numMBs);
+            MotionEstimator estimator(src.width, src.height, desc, 2, simd);
+            estimator.EstimateFrame(srcPlane, refPlane, &predMVs[0], &costCenters[0], &mvs[0], &residuals[0], &shapes[0]);
+
+            const unsigned enabled = ~config.partitionMask & 0x7F;
+            const int marginX = kPlaneBorder - kSearchRadiusX - kInterpolationMargin;
+            const int marginY = kPlaneBorder - kSearchRadiusY - kInterpolationMargin;
+            for (int mbIndex = 0; mbIndex < numMBs; ++mbIndex)
+            {
+                const int x0 = (mbIndex % mbWidth) * 16;
+                const int y0 = (mbIndex / mbWidth) * 16;
+                const int ccX = costCenters[mbIndex].s[0];
+                const int ccY = costCenters[mbIndex].s[1];
+
+                // Search center of the kernel (integer part of the predictor,
+                // even rows), kept far enough from the edge of the border
+                int centerX = predMVs[mbIndex].s[0] / 4;
+                int centerY = (predMVs[mbIndex].s[1] / 4) & ~1;
+                centerX = std::min(std::max(centerX, -marginX - x0), mbWidth * 16 - 16 + marginX - x0);
+                centerY = std::min(std::max(centerY, -marginY - y0), mbHeight * 16 - 16 + marginY - y0);
+
+                // Exhaustive search of every partition
+                Best best[7][16];
+                for (int size = 0; size < 7; ++size)
+                {
+                    for (int i = 0; i < kSizeCount[size]; ++i)
+                    {
+                        best[size][i].total = 0xFFFFFFFF;
+                    }
+                }
+                for (int dy = -kSearchRadiusY; dy <= kSearchRadiusY; ++dy)
+                {
+                    for (int dx = -kSearchRadiusX; dx <= kSearchRadiusX; ++dx)
+                    {
+                        const int mvX = centerX + dx;
+                        const int mvY = centerY + dy;
+                        const uint32_t cost = costModel.Cost(mvX * 4 - ccX, mvY * 4 - ccY);
+                        const int length = abs(mvX) + abs(mvY);
+                        for (int size = 0; size < 7; ++size)
+                        {
+                            if (!(enabled & (1 << size)))
+                            {
+                                continue;
+                            }
+                            for (int i = 0; i < kSizeCount[size]; ++i)
+                            {
+                                int px, py;
+                                PartitionRect(size, i, px, py);
+                                const uint32_t total = Distortion(src, ref, x0 + px, y0 + py, kSizeWidth[size], kSizeHeight[size],
+                                                                  mvX * 4, mvY * 4, false) + cost;
+                                Best & b = best[size][i];
+                                if (total < b.total || (total == b.total && length < b.length))
+                                {
+                                    b.total = total;
+                                    b.length = length;
+                                    b.mvX = mvX * 4;
+                                    b.mvY = mvY * 4;
+                                    b.unique = true;
+                                }
+                                else if (total == b.total && length == b.length)
+                                {
+                                    b.unique = false;
+                                }
+                            }
+                        }
+                    }
+                }
+
+                // Cost the shape decision compares: the search total, or
+                // with Haar the SATD of the winner plus its MV cost
+                bool decidable = true;
+                uint32_t decision[7][16];
+                for (int size = 0; size < 7; ++size)
+                {
+                    if (!(enabled & (1 << size)))
+                    {
+                        continue;
+                    }
+                    for (int i = 0; i < kSizeCount[size]; ++i)
+                    {
+                        const Best & b = best[size][i];
+                        decision[size][i] = b.total;
+                        if (haar)
+                        {
+                            int px, py;
+                            PartitionRect(size, i, px, py);
+                            decision[size][i] = Distortion(src, ref, x0 + px, y0 + py, kSizeWidth[size], kSizeHeight[size], b.mvX, b.mvY, true) +
+                                costModel.Cost(b.mvX - ccX, b.mvY - ccY);
+                            decidable = decidable && b.unique;
+                        }
+                    }
+                }
+
+                // Cheapest partitioning, ties to the larger partitions:
+                // the best sub-shape of every quadrant, then the major shape
+                int quadMinor[4] = { 0, 0, 0, 0 };
+                uint32_t cost8x8 = 0;
+                for (int q = 0; q < 4; ++q)
+                {
+                    uint32_t quadBest = 0xFFFFFFFF;
+                    for (int m = 0; m < 4; ++m)
+                    {
+                        const int size = 3 + m;
+                        if (!(enabled & (1 << size)))
+                        {
+                            continue;
+                        }
+                        uint32_t sum = 0;
+                        const int n = kSizeCount[size] / 4;
+                        for (int i = 0; i < n; ++i)
+                        {
+                            sum += decision[size][q * n + i];
+                        }
+                        if (sum < quadBest)
+                        {
+                            quadBest = sum;
+                            quadMinor[q] = m;
+                        }
+                    }
+                    cost8x8 += quadBest;
+                }
+                int major = 0;
+                uint32_t majorBest = 0xFFFFFFFF;
+                for (int m = 0; m < 4; ++m)
+                {
+                    const bool on = (m < 3) ? (enabled & (1 << m)) != 0 : (enabled & 0x78) != 0;
+                    if (!on)
+                    {
+                        continue;
+                    }
+                    uint32_t sum = cost8x8;
+                    if (m < 3)
+                    {
+                        sum = 0;
+                        for (int i = 0; i < kSizeCount[m]; ++i)
+                        {
+                            sum += decision[m][i];
+                        }
+                    }
+                    if (sum < majorBest)
+                    {
+                        majorBest = sum;
+                        major = m;
+                    }
+                }
+                cl_uchar minor = 0;
+                if (major == 3)
+                {
+                    for (int q = 0; q < 4; ++q)
+                    {
+                        minor |= (cl_uchar)(quadMinor[q] << (2 * q));
+                    }
+                }
+
+                if (!decidable)
+                {
+                    // Tied candidates may differ in SATD, then the shape isn't
+                    // determined; the vectors and residuals are still checked
+                    // against the shape the engine chose
+                    major = shapes[mbIndex].s[0];
+                    minor = shapes[mbIndex].s[1];
+                }
+                else if (shapes[mbIndex].s[0] != major || shapes[mbIndex].s[1] != minor)
+                {
+                    check.Fail("shape differs", mbIndex);
+                    continue;
+                }
+
+                // Every 4x4 block carries the vector and residual of the
+                // partition covering it
+                for (int row = 0; row < 4; ++row)
+                {
+                    for (int col = 0; col < 4; ++col)
+                    {
+                        int size = major;
+                        if (major == 3)
+                        {
+                            size = 3 + ((minor >> (2 * ((row / 2) * 2 + col / 2))) & 3);
+                        }
+                        int part = 0;
+                        for (int i = 0; i < kSizeCount[size]; ++i)
+                        {
+                            int px, py;
+                            PartitionRect(size, i, px, py);
+                            if (col * 4 >= px && col * 4 < px + kSizeWidth[size] && row * 4 >= py && row * 4 < py + kSizeHeight[size])
+                            {
+                                part = i;
+                            }
+                        }
+                        int px, py;
+                        PartitionRect(size, part, px, py);
+                        const Best & b = best[size][part];
+                        const int entry = mbIndex * 16 + kZigzag[row * 4 + col];
+                        const int mvX = mvs[entry].s[0];
+                        const int mvY = mvs[entry].s[1];
+
+                        const int step = (config.subPixelMode == SUBPIXEL_MODE_INTEGER) ? 4 : (config.subPixelMode == SUBPIXEL_MODE_HPEL) ? 2 : 1;
+                        if (mvX % step || mvY % step)
+                        {
+                            check.Fail("vector finer than the precision", mbIndex);
+                        }
+
+                        const uint32_t dist = Distortion(src, ref, x0 + px, y0 + py, kSizeWidth[size], kSizeHeight[size], mvX, mvY, haar);
+                        if (residuals[entry] != std::min(dist, 0xFFFFu))
+                        {
+                            check.Fail("residual differs from the distortion of the vector", mbIndex);
+                        }
+
+                        const uint32_t cost = costModel.Cost(mvX - ccX, mvY - ccY);
+                        if (config.subPixelMode == SUBPIXEL_MODE_INTEGER)
+                        {
+                            const uint32_t sad = haar ? Distortion(src, ref, x0 + px, y0 + py, kSizeWidth[size], kSizeHeight[size], mvX, mvY, false) : dist;
+                            if (sad + cost != b.total || abs(mvX / 4) + abs(mvY / 4) != b.length)
+                            {
+                                check.Fail("integer vector isn't the best of the window", mbIndex);
+                            }
+                        }
+                        else if (!haar && dist + cost > b.total)
+                        {
+                            // The refinement only ever moves to a cheaper vector
+                            check.Fail("refined vector costs more than the integer one", mbIndex);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    bool SelfCheck(std::ostream & log)
+    {
+        // Not a whole number of MBs, to cover the padding too
+        const int width = 72;
+        const int height = 40;
+        Frame src, ref;
+        MakeFrames(width, height, src, ref);
+        Plane srcPlane(width, height);
+        Plane refPlane(width, height);
+        srcPlane.Load(&src.pixels[0], width);
+        refPlane.Load(&ref.pixels[0], width);
+        refPlane.Interpolate();
+
+        static const Config kConfigs[] = {
+            { "all partitions, integer",              SUBPIXEL_MODE_INTEGER, SAD_ADJUST_MODE_NONE, kPartitionMaskAll,   false, COST_PRECISION_QPEL },
+            { "all partitions, integer, MV cost",     SUBPIXEL_MODE_INTEGER, SAD_ADJUST_MODE_NONE, kPartitionMaskAll,   true,  COST_PRECISION_HPEL },
+            { "16x16, integer, MV cost",              SUBPIXEL_MODE_INTEGER, SAD_ADJUST_MODE_NONE, kPartitionMask16x16, true,  COST_PRECISION_QPEL },
+            { "16x8 and 8x8, integer, MV cost",       SUBPIXEL_MODE_INTEGER, SAD_ADJUST_MODE_NONE, kPartitionMask16x8 & kPartitionMask8x8, true, COST_PRECISION_PEL },
+            { "all partitions, integer, Haar",        SUBPIXEL_MODE_INTEGER, SAD_ADJUST_MODE_HAAR, kPartitionMaskAll,   true,  COST_PRECISION_QPEL },
+            { "all partitions, qpel, MV cost",        SUBPIXEL_MODE_QPEL,    SAD_ADJUST_MODE_NONE, kPartitionMaskAll,   true,  COST_PRECISION_QPEL },
+            { "all partitions, qpel, Haar",           SUBPIXEL_MODE_QPEL,    SAD_ADJUST_MODE_HAAR, kPartitionMaskAll,   true,  COST_PRECISION_QPEL },
+            { "16x16, hpel, MV cost",                 SUBPIXEL_MODE_HPEL,    SAD_ADJUST_MODE_NONE, kPartitionMask16x16, true,  COST_PRECISION_DPEL },
+        };
+
+        bool passed = true;
+        for (int path = 0; path < 2; ++path)
+        {
+            const SimdPath simd = path ? SIMD_PATH_AVX2 : SIMD_PATH_SSE41;
+            const char * name = path ? "AVX2" : "SSE4.1";
+            if (simd == SIMD_PATH_AVX2 && !HasAVX2())
+            {
+                log << name << ": not supported by this CPU, skipped\n";
+                continue;
+            }
+
+            Checker planes(log, name);
+            CheckPlanes(src, srcPlane, planes);
+            CheckPlanes(ref, refPlane, planes);
+            log << name << ", border and half-pel planes: " << (planes.Errors() ? "FAILED" : "ok") << "\n";
+            passed = passed && planes.Errors() == 0;
+            for (size_t c = 0; c < sizeof(kConfigs) / sizeof(kConfigs[0]); ++c)
+            {
+                Checker check(log, name);
+                CheckConfig(kConfigs[c], simd, src, ref, srcPlane, refPlane, check);
+                log << name << ", " << kConfigs[c].name << ": " << (check.Errors() ? "FAILED" : "ok") << "\n";
+                passed = passed && check.Errors() == 0;
+            }
+        }
+        return passed;
+    }
+
+} // namespace CPUVme
@@ -0,0 +1,330 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <algorithm>
+#include <iomanip>
+#include <stdexcept>
+
+#include "frame_pipeline.hpp"
+#include "basic.hpp"
+
+using namespace YUVUtils;
+
+FramePipeline::FramePipeline(
+    const cl::Context & context,
+    const cl::Device & device,
+    int width,
+    int height,
+    const std::vector<size_t> & outputSizes,
+    int depth,
+    bool zeroCopy) :
+    m_width(width),
+    m_height(height),
+    m_depth(depth),
+    m_outputSizes(outputSizes),
+    m_numFrames(0),
+    m_zeroCopyFrames(0),
+    m_copiedFrames(0),
+    m_wallTime(0)
+{
+    if (depth < 2)
+    {
+        throw std::runtime_error("FramePipeline: at least two sets are needed, one for the reference frame");
+    }
+
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        m_stageTime[s] = 0;
+    }
+
+    // Separate in-order queues, so that an upload or a readback never waits
+    // behind an unrelated estimation; the events carry the real dependencies
+    m_uploadQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+    m_computeQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+    m_readbackQueue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+    // Sharing the memory only saves the copy when the device works on host memory
+    if (zeroCopy && !device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>())
+    {
+        zeroCopy = false;
+    }
+
+    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
+    m_staging.resize(depth, NULL);
+    m_zeroCopy.resize(depth, false);
+    m_outputs.resize(depth);
+    for (int s = 0; s < depth; s++)
+    {
+        m_staging[s] = CreatePlanarImage(width, height);
+        PlanarImage * staging = m_staging[s];
+        if (zeroCopy && verifyZeroCopyPtr(staging->Y, staging->PitchY * height))
+        {
+            // The luma plane is the image, the chroma planes behind it stay host-only
+            m_zeroCopy[s] = true;
+            m_images.push_back(cl::Image2D(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, imageFormat,
+                width, height, staging->PitchY, staging->Y));
+        }
+        else
+        {
+            m_images.push_back(cl::Image2D(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0));
+        }
+        for (size_t k = 0; k < outputSizes.size(); k++)
+        {
+            m_outputs[s].push_back(cl::Buffer(context, CL_MEM_WRITE_ONLY, outputSizes[k]));
+        }
+    }
+}
+
+FramePipeline::~FramePipeline()
+{
+    // Zero-copy images use the staging memory, so they go first
+    m_images.clear();
+    for (size_t s = 0; s < m_staging.size(); s++)
+    {
+        ReleaseImage(m_staging[s]);
+    }
+}
+
+void FramePipeline::AddDeviceTime(Stage stage, const cl::Event & event)
+{
+    cl_ulong start = event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong end = event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    m_stageTime[stage] += (end - start) * 1e-9;
+}
+
+// Maps the device image of a zero-copy set for host access, blocking until
+// the commands of waitList are done. The mapping is the staging luma plane.
+void FramePipeline::MapStaging(int set, cl_map_flags flags, const std::vector<cl::Event> & waitList)
+{
+    cl::size_t<3> origin;
+    origin[0] = 0;
+    origin[1] = 0;
+    origin[2] = 0;
+    cl::size_t<3> region;
+    region[0] = m_width;
+    region[1] = m_height;
+    region[2] = 1;
+
+    size_t rowPitch = 0;
+    double waitStart = time_stamp();
+    void * mapped = m_uploadQueue.enqueueMapImage(m_images[set], CL_TRUE, flags, origin, region, &rowPitch, NULL,
+        waitList.empty() ? NULL : &waitList);
+    m_stageTime[STAGE_HOST_WAIT] += time_stamp() - waitStart;
+
+    if (mapped != m_staging[set]->Y)
+    {
+        throw std::runtime_error("FramePipeline: the runtime mapped a zero-copy image to a different address");
+    }
+}
+
+// Waits for the last command of frame i and hands its outputs to the client.
+// After this the set of frame i may be refilled, except for its device image,
+// which the estimation of frame i + 1 still reads as the reference.
+void FramePipeline::Retire(int i, FramePipelineClient & client)
+{
+    const int set = i % m_depth;
+    double waitStart = time_stamp();
+    if (i == 0)
+    {
+        m_uploadEvents[set].wait();
+    }
+    else
+    {
+        cl::Event::waitForEvents(m_readbackEvents[set]);
+    }
+    m_stageTime[STAGE_HOST_WAIT] += time_stamp() - waitStart;
+
+    AddDeviceTime(STAGE_UPLOAD, m_uploadEvents[set]);
+    if (i > 0)
+    {
+        AddDeviceTime(STAGE_ESTIMATION, m_estimationEvents[set]);
+        for (size_t k = 0; k < m_readbackEvents[set].size(); k++)
+        {
+            AddDeviceTime(STAGE_READBACK, m_readbackEvents[set][k]);
+        }
+    }
+
+    if (m_zeroCopy[set])
+    {
+        // The client may modify the frame, which is still the reference of frame i + 1
+        std::vector<cl::Event> mapWait;
+        if (i + 1 < m_numFrames)
+        {
+            mapWait.push_back(m_estimationEvents[(i + 1) % m_depth]);
+        }
+        MapStaging(set, CL_MAP_READ | CL_MAP_WRITE, mapWait);
+    }
+
+    double consumeStart = time_stamp();
+    client.FrameDone(i, m_staging[set]);
+    m_stageTime[STAGE_CONSUME] += time_stamp() - consumeStart;
+
+    if (m_zeroCopy[set])
+    {
+        // The next map of the set is ordered after this on the upload queue
+        m_uploadQueue.enqueueUnmapMemObject(m_images[set], m_staging[set]->Y);
+        m_uploadQueue.flush();
+    }
+}
+
+int FramePipeline::Run(int numFrames, FramePipelineClient & client)
+{
+    m_numFrames = numFrames;
+    m_zeroCopyFrames = 0;
+    m_copiedFrames = 0;
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        m_stageTime[s] = 0;
+    }
+
+    // Only the frames in flight need their events, which keeps a run over an
+    // input of unknown length from growing
+    m_uploadEvents.assign(m_depth, cl::Event());
+    m_estimationEvents.assign(m_depth, cl::Event());
+    m_readbackEvents.assign(m_depth, std::vector<cl::Event>());
+
+    cl::size_t<3> origin;
+    origin[0] = 0;
+    origin[1] = 0;
+    origin[2] = 0;
+    cl::size_t<3> region;
+    region[0] = m_width;
+    region[1] = m_height;
+    region[2] = 1;
+
+    // Frames retire depth - 1 iterations after being read, which keeps one
+    // frame in each of read, estimation and readback at depth 3
+    const int lag = m_depth - 1;
+
+    double runStart = time_stamp();
+    for (int i = 0; i < numFrames; i++)
+    {
+        const int set = i % m_depth;
+        PlanarImage * staging = m_staging[set];
+
+        // The device image of frame i - depth is the reference of frame i - depth + 1
+        std::vector<cl::Event> uploadWait;
+        if (i - m_depth + 1 >= 1)
+        {
+            uploadWait.push_back(m_estimationEvents[(i - m_depth + 1) % m_depth]);
+        }
+
+        if (m_zeroCopy[set])
+        {
+            // The frame is read straight into the device image, so the host
+            // has to wait until the image is no longer a reference
+            MapStaging(set, CL_MAP_WRITE, uploadWait);
+
+            double readStart = time_stamp();
+            const bool read = client.ReadFrame(i, staging);
+            m_stageTime[STAGE_READ] += time_stamp() - readStart;
+            if (!read)
+            {
+                m_uploadQueue.enqueueUnmapMemObject(m_images[set], staging->Y);
+                numFrames = i;
+                break;
+            }
+
+            m_uploadQueue.enqueueUnmapMemObject(m_images[set], staging->Y, NULL, &m_uploadEvents[set]);
+            m_zeroCopyFrames++;
+        }
+        else
+        {
+            // The staging image is free: frame i - depth retired in an earlier iteration
+            double readStart = time_stamp();
+            const bool read = client.ReadFrame(i, staging);
+            m_stageTime[STAGE_READ] += time_stamp() - readStart;
+            if (!read)
+            {
+                numFrames = i;
+                break;
+            }
+
+            // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
+            m_uploadQueue.enqueueWriteImage(m_images[set], CL_FALSE, origin, region, staging->PitchY, 0, staging->Y,
+                uploadWait.empty() ? NULL : &uploadWait, &m_uploadEvents[set]);
+            m_copiedFrames++;
+        }
+        m_uploadQueue.flush();
+
+        if (i > 0)
+        {
+            // Outputs of the set were last read back for frame i - depth
+            std::vector<cl::Event> estimationWait;
+            estimationWait.push_back(m_uploadEvents[set]);
+            estimationWait.push_back(m_uploadEvents[(i - 1) % m_depth]);
+            if (i - m_depth >= 1)
+            {
+                // Still the events of frame i - depth, the entry is refilled below
+                estimationWait.insert(estimationWait.end(),
+                    m_readbackEvents[set].begin(), m_readbackEvents[set].end());
+            }
+
+            client.EnqueueEstimation(m_computeQueue, m_images[set], m_images[(i - 1) % m_depth],
+                m_outputs[set], estimationWait, m_estimationEvents[set]);
+            m_computeQueue.flush();
+
+            std::vector<cl::Event> readbackWait(1, m_estimationEvents[set]);
+            m_readbackEvents[set].resize(m_outputSizes.size());
+            for (size_t k = 0; k < m_outputSizes.size(); k++)
+            {
+                m_readbackQueue.enqueueReadBuffer(m_outputs[set][k], CL_FALSE, 0, m_outputSizes[k],
+                    client.OutputTarget(i, (int)k), &readbackWait, &m_readbackEvents[set][k]);
+            }
+            m_readbackQueue.flush();
+        }
+
+        if (i - lag >= 0)
+        {
+            Retire(i - lag, client);
+        }
+    }
+
+    // Drain the frames still in flight, the last one has no successor now
+    m_numFrames = numFrames;
+    for (int i = std::max(numFrames - lag, 0); i < numFrames; i++)
+    {
+        Retire(i, client);
+    }
+    m_wallTime = time_stamp() - runStart;
+    return numFrames;
+}
+
+void FramePipeline::PrintStats(std::ostream & out) const
+{
+    static const char * names[STAGE_COUNT] =
+    {
+        "read", "upload", "estimation", "readback", "consume", "host wait"
+    };
+
+    const int frames = m_numFrames > 0 ? m_numFrames : 1;
+    out << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    out << "Pipeline of " << m_depth << " sets, " << m_numFrames << " frames in " << m_wallTime << " sec\n";
+    out << "Frames uploaded zero-copy " << m_zeroCopyFrames << ", copied " << m_copiedFrames << "\n";
+    out << "      stage         per frame ms   occupancy %\n";
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        out << "      " << std::left << std::setw(12) << names[s] << std::right
+            << std::setw(14) << 1000 * m_stageTime[s] / frames
+            << std::setw(14) << (m_wallTime > 0 ? 100 * m_stageTime[s] / m_wallTime : 0.0) << "\n";
+    }
+}
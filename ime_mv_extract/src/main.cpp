@@ -25,13 +25,26 @@
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <iomanip>
+#ifndef CPU_BACKEND_ONLY
 #include <CL/cl.hpp>
+#else
+// The cpu backend only uses the OpenCL types, the binary doesn't need the runtime
+#include <CL/cl.h>
+#endif
 #include <CL/cl_ext_intel.h>
 #include <map>
 
 #include "yuv_utils.h"
 #include "cmdparser.hpp"
+#ifndef CPU_BACKEND_ONLY
 #include "oclobject.hpp"
+#include "frame_pipeline.hpp"
+#else
+#include "basic.hpp"
+#endif
+#include "result_sink.hpp"
+#include "cpu_vme.hpp"
 #include "opencv2/core.hpp"
 
 using namespace std;
@@ -71,6 +84,15 @@ static const cl_uint kMSubPixelMode = CL_ME_SUBPIXEL_MODE_QPEL_INTEL;
 static const cl_uint kMSadAdjustMode = CL_ME_SAD_ADJUST_MODE_NONE_INTEL;
 static const cl_uint kMSearchPathRadius = CL_ME_SEARCH_PATH_RADIUS_16_12_INTEL;
 
+// Number of image/buffer sets in flight: reading, estimation and readback overlap
+static const int kPipelineDepth = 3;
+
+#ifndef CPU_BACKEND_ONLY
+static const char kDefaultBackend[] = "gpu";
+#else
+static const char kDefaultBackend[] = "cpu";
+#endif
+
 #ifdef _MSC_VER
 #pragma warning (push)
 #pragma warning (disable : 4355)    // 'this': used in base member initializer list
@@ -128,16 +150,60 @@ public:
     CmdOption<int>      width;
     CmdOption<int>      height;
     CmdOption<int>      frames;
+    CmdOption<bool>     zero_copy;
+    CmdOption<std::string>  results;
+    CmdOption<std::string>  backend;
+    CmdEnum<std::string>    backend_gpu;
+    CmdEnum<std::string>    backend_cpu;
+    CmdOption<int>      threads;
+    CmdOption<std::string>  subpel;
+    CmdEnum<std::string>    subpel_integer;
+    CmdEnum<std::string>    subpel_hpel;
+    CmdEnum<std::string>    subpel_qpel;
+    CmdOption<int>      partition_mask;
+    CmdOption<std::string>  sad_adjust;
+    CmdEnum<std::string>    sad_adjust_none;
+    CmdEnum<std::string>    sad_adjust_haar;
+    CmdOption<std::string>  cost_penalty;
+    CmdEnum<std::string>    cost_penalty_none;
+    CmdEnum<std::string>    cost_penalty_low;
+    CmdEnum<std::string>    cost_penalty_normal;
+    CmdEnum<std::string>    cost_penalty_high;
+    CmdOption<std::string>  cost_table;
+    CmdOption<bool>     print_cost_tables;
+    CmdOption<bool>     selfcheck;
     
     CmdParserMV  (int argc, const char** argv) :
     CmdParser(argc, argv),
         out_to_bmp(*this,        'b',"nobmp","","Do not output frames to the sequence of bmp files (in addition to the yuv file), by default the output is on", ""),
         help(*this,              'h',"help","","Show this help text and exit."),
-        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv file format)","video_1920x1080_5frames.yuv"),
+        fileName(*this,          0,"input", "string", "Input video sequence filename (.yuv or .y4m file format), or - to read raw frames from stdin","video_1920x1080_5frames.yuv"),
         overlayFileName(*this,   0,"output","string", "Output video sequence with overlaid motion vectors filename ","output.yuv"),
         width(*this,             0, "width",    "<integer>", "Frame width for the input file", 1920),
         height(*this,            0, "height","<integer>", "Frame height for the input file",1080),
-        frames(*this,            0, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 0)
+        frames(*this,            0, "frames", "<integer>", "Number of frame to use for motion estimation -- 0 represents entire video", 0),
+        zero_copy(*this,         0, "zerocopy", "", "Read the frames straight into device images instead of copying them, where the device and the frame alignment allow it"),
+        results(*this,           0, "results", "string", "Comma-separated consumers of the per-frame results: overlay (output sequence), flo (.flo files), npy (motion vectors as a NumPy array), stats (motion statistics) or null", "overlay,flo"),
+        backend(*this,           0, "backend", "string", "Motion estimation backend: VME on an Intel GPU or the host CPU implementation", kDefaultBackend),
+        backend_gpu(backend, "gpu"),
+        backend_cpu(backend, "cpu"),
+        threads(*this,           0, "threads", "<integer>", "Number of worker threads for the cpu backend -- 0 uses all hardware threads", 0),
+        subpel(*this,            0, "subpel", "string", "Motion vector precision of the cpu backend -- lower precision is faster", "qpel"),
+        subpel_integer(subpel, "integer"),
+        subpel_hpel(subpel, "hpel"),
+        subpel_qpel(subpel, "qpel"),
+        partition_mask(*this,    0, "partition_mask", "<integer>", "Partition sizes disabled in the cpu backend, as a CL_AVC_ME_PARTITION_MASK_* value -- 126 searches 16x16 only", 0),
+        sad_adjust(*this,        0, "sad_adjust", "string", "Distortion metric of the cpu backend: plain SAD or Haar transformed (SATD)", "none"),
+        sad_adjust_none(sad_adjust, "none"),
+        sad_adjust_haar(sad_adjust, "haar"),
+        cost_penalty(*this,      0, "cost_penalty", "string", "Motion vector cost table of the cpu backend -- approximations of growing strength, not the driver's tables", "normal"),
+        cost_penalty_none(cost_penalty, "none"),
+        cost_penalty_low(cost_penalty, "low"),
+        cost_penalty_normal(cost_penalty, "normal"),
+        cost_penalty_high(cost_penalty, "high"),
+        cost_table(*this,        0, "cost_table", "string", "Packed motion vector cost table of the cpu backend as its two 32-bit words s0,s1, overrides --cost_penalty -- --print_cost_tables gives the device's tables in this form", ""),
+        print_cost_tables(*this, 0, "print_cost_tables", "", "Read the driver's default cost tables back from the device and print them in the form --cost_table takes (gpu backend)"),
+        selfcheck(*this,         0, "selfcheck", "", "Compare the cpu backend against a plain scalar reference on synthetic frames and exit")
     {
     }
     virtual void parse ()
@@ -147,6 +213,19 @@ public:
         {
             printUsage(std::cout);
         }
+
+        // A .y4m input carries its frame size, --width and --height only have to agree with it
+        int inputWidth = 0;
+        int inputHeight = 0;
+        if(!help.isSet() && YUVUtils::Capture::ReadFileGeometry(fileName.getValue(), inputWidth, inputHeight))
+        {
+            if((width.isSet() && width.getValue() != inputWidth) || (height.isSet() && height.getValue() != inputHeight))
+            {
+                throw std::runtime_error("--width/--height don't match the frame size in the header of " + fileName.getValue());
+            }
+            width.setDefaultValue(inputWidth);
+            height.setDefaultValue(inputHeight);
+        }
     }
 };
 #ifdef _MSC_VER
@@ -195,8 +274,93 @@ inline unsigned int ComputeSubBlockSize( cl_uint nMBType )
     }
 }
 
-void ExtractMotionVectorsFullFrameWithOpenCL( 
-    Capture * pCapture, std::vector<MotionVector> & MVs, std::vector<cl_ushort> & SADs, std::vector<cl_uchar2> & Shapes, const CmdParserMV& cmd)
+#ifndef CPU_BACKEND_ONLY
+// Feeds the sequence through FramePipeline, reads the results of frame i
+// straight into its slot of the result window and publishes the frame to the
+// sinks once it is on the host
+class VmePipelineClient : public FramePipelineClient
+{
+public:
+    VmePipelineClient(Capture * pCapture, cl::Kernel & kernel, const cl::Buffer & predBuffer,
+        ResultDispatcher & results, int width, int mbImageHeight) :
+        m_pCapture(pCapture), m_kernel(kernel), m_predBuffer(predBuffer),
+        m_results(results), m_width(width), m_mbImageHeight(mbImageHeight)
+    {
+    }
+
+    virtual bool ReadFrame(int i, PlanarImage * image)
+    {
+        return m_pCapture->TryGetSample(i, image);
+    }
+
+    virtual void EnqueueEstimation(cl::CommandQueue & queue, const cl::Image2D & src, const cl::Image2D & ref,
+        const std::vector<cl::Buffer> & outputs, const std::vector<cl::Event> & waitList, cl::Event & done)
+    {
+        // Schedule full-frame motion estimation
+        m_kernel.setArg(0, src);
+        m_kernel.setArg(1, ref);
+        m_kernel.setArg(2, m_predBuffer);
+        m_kernel.setArg(3, outputs[0]);
+        m_kernel.setArg(4, outputs[1]);
+        m_kernel.setArg(5, outputs[2]);
+        m_kernel.setArg(6, sizeof(cl_int), &m_mbImageHeight);
+        queue.enqueueNDRangeKernel(m_kernel, cl::NullRange, cl::NDRange(PAD(m_width,16), 1, 1), cl::NDRange(16, 1, 1), &waitList, &done);
+    }
+
+    virtual void * OutputTarget(int i, int k)
+    {
+        MotionResults & slot = m_results.Begin(i);
+        switch (k)
+        {
+        case 0: return &slot.MVs[0];
+        case 1: return &slot.SADs[0];
+        default: return &slot.Shapes[0];
+        }
+    }
+
+    virtual void FrameDone(int i, PlanarImage * image)
+    {
+        // Frame 0 is only a reference, the sinks get it with no motion
+        if (i == 0)
+        {
+            m_results.Begin(0).Clear();
+        }
+        m_results.Publish(i, image);
+    }
+
+private:
+    Capture * m_pCapture;
+    cl::Kernel & m_kernel;
+    cl::Buffer m_predBuffer;
+    ResultDispatcher & m_results;
+    int m_width;
+    cl_int m_mbImageHeight;
+};
+
+// The driver's default cost tables aren't documented: read them back once and
+// print them in the form --cost_table takes, so the cpu backend can use the
+// exact costs of the kernel
+void PrintDeviceCostTables(const cl::Context & context, cl::CommandQueue & queue, const cl::Program & p)
+{
+    cl::Kernel kernel(p, "get_default_cost_tables");
+    cl::Buffer tables(context, CL_MEM_WRITE_ONLY, 3 * sizeof(cl_uint2), NULL, NULL);
+    kernel.setArg(0, tables);
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(16, 1, 1), cl::NDRange(16, 1, 1));
+    cl_uint2 values[3];
+    queue.enqueueReadBuffer(tables, CL_TRUE, 0, sizeof(values), values);
+
+    static const char * kNames[3] = { "low", "medium", "high" };
+    for (int i = 0; i < 3; ++i)
+    {
+        std::cout << "Device cost table, " << kNames[i] << " penalty: --cost_table " << std::hex << std::setfill('0')
+            << "0x" << std::setw(8) << values[i].s[0] << ",0x" << std::setw(8) << values[i].s[1]
+            << std::dec << std::setfill(' ') << std::endl;
+    }
+}
+
+// Returns the number of frames processed, which for a stream is only known at the end
+int ExtractMotionVectorsFullFrameWithOpenCL( 
+    Capture * pCapture, ResultDispatcher & results, const CmdParserMV& cmd)
 {
 
     // OpenCL initialization
@@ -223,9 +387,8 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     // Create a built-in VME kernel
     cl_int err = 0;
     const cl_device_id & d = device();    
-    cl::Program p(clCreateProgramWithSource(context(),1,( const char** )&programSource,NULL,&err));
-
-    err = clBuildProgram(p(), 1, &d, "", NULL, NULL);
+    // Reuse the program binary cached by an earlier run when there is one
+    cl::Program p(buildProgramWithCache(context(), d, programSource, "", &err));
 
      size_t  buildLogSize = 0;
     clGetProgramBuildInfo(p(),d,CL_PROGRAM_BUILD_LOG,0,NULL,&buildLogSize );
@@ -241,6 +404,11 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
     }
 
 
+    if (cmd.print_cost_tables.isSet())
+    {
+        PrintDeviceCostTables(context, queue, p);
+    }
+
     cl::Kernel kernel(p, "block_motion_estimate_intel");
 
     // VME API configuration knobs
@@ -251,27 +419,15 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         kMSearchPathRadius                                  // Search window radius
     };
 
-    const int numPics = pCapture->GetNumFrames();
     const int width = cmd.width.getValue();
     const int height = cmd.height.getValue();
     int mvImageWidth, mvImageHeight;
     int mbImageWidth, mbImageHeight;
     ComputeNumMVs(desc.mb_block_type, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
-    MVs.resize(numPics * mvImageWidth * mvImageHeight);
-    SADs.resize(numPics * mvImageWidth * mvImageHeight);
-    Shapes.resize(numPics * mbImageWidth * mbImageHeight);
 
     std::cout << "mvImageWidth=" << mvImageWidth << std::endl;
     std::cout << "mvImageHeight=" << mvImageHeight << std::endl;
 
-    // Set up OpenCL surfaces
-    cl::ImageFormat imageFormat(CL_R, CL_UNORM_INT8);
-    cl::Image2D refImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Image2D srcImage(context, CL_MEM_READ_ONLY, imageFormat, width, height, 0, 0);
-    cl::Buffer mvBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(MotionVector));
-    cl::Buffer sad(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(cl_ushort));
-    cl::Buffer ShapeBuffer(context, CL_MEM_WRITE_ONLY, mvImageWidth * mvImageHeight * sizeof(cl_uchar2));
-
     cl_short2 *predMem = new cl_short2[ mbImageWidth * mbImageHeight ];
     for( int i = 0; i < mbImageWidth * mbImageHeight; i++ )
     {        
@@ -283,68 +439,147 @@ void ExtractMotionVectorsFullFrameWithOpenCL(
         context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
         mbImageWidth * mbImageHeight * sizeof(cl_short2), predMem, NULL);
 
-    // Bootstrap video sequence reading
-    PlanarImage * currImage = CreatePlanarImage(width, height);
-    pCapture->GetSample(0, currImage);
-    cl::size_t<3> origin;
-    origin[0] = 0;
-    origin[1] = 0;
-    origin[2] = 0;
-    cl::size_t<3> region;
-    region[0] = width;
-    region[1] = height;
-    region[2] = 1;
-    // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-    queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
+    // Motion vector, residual and shape buffers of every frame in flight
+    std::vector<size_t> outputSizes;
+    outputSizes.push_back(mvImageWidth * mvImageHeight * sizeof(MotionVector));
+    outputSizes.push_back(mvImageWidth * mvImageHeight * sizeof(cl_ushort));
+    outputSizes.push_back(mbImageWidth * mbImageHeight * sizeof(cl_uchar2));
+
+    // The frames are read ahead on a background thread, the pipeline copies them
+    // out of the ring into its staging images
+    PrefetchCapture prefetch(pCapture, kPipelineDepth + 1, kPipelineDepth);
+    VmePipelineClient client(&prefetch, kernel, predBuffer, results, width, mbImageHeight);
+    FramePipeline pipeline(context, device, width, height, outputSizes, kPipelineDepth, cmd.zero_copy.getValue());
+
+    // Process all frames, the results are read back straight into the result window
+    double overallStart  = time_stamp();
+    const int numPics = pipeline.Run(pCapture->GetNumFrames(), client);
+    results.Finish();
+    double overallStat  = time_stamp() - overallStart;
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
+    pipeline.PrintStats(std::cout);
+    std::cout << "Average frame file read time per frame (background) " << 1000*prefetch.GetReadTime()/std::max(numPics, 1) << " ms\n";
+    return numPics;
+}
+#endif
+
+// Returns the number of frames processed, which for a stream is only known at the end
+int ExtractMotionVectorsFullFrameWithCPU(
+    Capture * pCapture, ResultDispatcher & results, const CmdParserMV& cmd)
+{
+    const int width = cmd.width.getValue();
+    const int height = cmd.height.getValue();
+    int mvImageWidth, mvImageHeight;
+    int mbImageWidth, mbImageHeight;
+    ComputeNumMVs(kMBBlockType, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
+
+    std::cout << "mvImageWidth=" << mvImageWidth << std::endl;
+    std::cout << "mvImageHeight=" << mvImageHeight << std::endl;
+
+    // Host counterparts of the source/reference images
+    CPUVme::Plane refPlane(width, height);
+    CPUVme::Plane srcPlane(width, height);
+    CPUVme::SearchDesc desc;
+    if (cmd.subpel_integer.isSet())
+    {
+        desc.subPixelMode = CPUVme::SUBPIXEL_MODE_INTEGER;
+    }
+    else if (cmd.subpel_hpel.isSet())
+    {
+        desc.subPixelMode = CPUVme::SUBPIXEL_MODE_HPEL;
+    }
+    desc.partitionMask = (cl_uchar)cmd.partition_mask.getValue();
+    if (cmd.sad_adjust_haar.isSet())
+    {
+        desc.sadAdjustMode = CPUVme::SAD_ADJUST_MODE_HAAR;
+    }
+    if (!cmd.cost_table.getValue().empty())
+    {
+        desc.costTable = CPUVme::ParseCostTable(cmd.cost_table.getValue());
+    }
+    else if (cmd.cost_penalty_none.isSet())
+    {
+        desc.costTable = CPUVme::GetCostTable(CPUVme::COST_PENALTY_NONE);
+    }
+    else if (cmd.cost_penalty_low.isSet())
+    {
+        desc.costTable = CPUVme::GetCostTable(CPUVme::COST_PENALTY_LOW);
+    }
+    else if (cmd.cost_penalty_high.isSet())
+    {
+        desc.costTable = CPUVme::GetCostTable(CPUVme::COST_PENALTY_HIGH);
+    }
+    CPUVme::MotionEstimator estimator(width, height, desc, cmd.threads.getValue());
+
+    std::vector<cl_short2> predMem(mbImageWidth * mbImageHeight);
+    for( int i = 0; i < mbImageWidth * mbImageHeight; i++ )
+    {
+        predMem[ i ].s[ 0 ] = 0;
+        predMem[ i ].s[ 1 ] = 0;
+    }
+
+    // Bootstrap video sequence reading, the frames are read ahead on a background thread
+    PrefetchCapture prefetch(pCapture);
+    PlanarImage * currImage = prefetch.Acquire(0);
+    if (!currImage)
+    {
+        throw std::runtime_error("The input sequence has no frames.");
+    }
+    srcPlane.Load(currImage->Y, currImage->PitchY);
 
     // Process all frames
-    double ioStat = 0;//file i/o
     double meStat = 0;//motion estimation itself
+    double sinkStat = 0;//consuming the results
 
     double overallStart  = time_stamp();
-    // First frame is already in srcImg, so we start with the second frame
-    for (int i = 1; i < numPics; i++)
+    // Frame 0 is only a reference, the sinks get it with no motion
+    results.Begin(0).Clear();
+    results.Publish(0, currImage);
+    prefetch.Release(0);
+    // First frame is already in srcPlane, so we start with the second frame
+    // and run until the end of the input
+    int numPics = 1;
+    for (int i = 1; i < pCapture->GetNumFrames(); i++)
     {
-        double ioStart = time_stamp();
-        // Load next picture
-        pCapture->GetSample(i, currImage);
-
-        std::swap(refImage, srcImage);
-        // Copy to tiled image memory - this copy (and its overhead) is not necessary in a full GPU pipeline
-        queue.enqueueWriteImage(srcImage, CL_TRUE, origin, region, currImage->PitchY, 0, currImage->Y);
-        ioStat += (time_stamp() -ioStart);
+        // Next picture, normally read already
+        currImage = prefetch.Acquire(i);
+        if (!currImage)
+        {
+            break;
+        }
+        numPics++;
 
         double meStart = time_stamp();
-        // Schedule full-frame motion estimation
-        kernel.setArg(0, srcImage);
-        kernel.setArg(1, refImage);
-        kernel.setArg(2, predBuffer);
-        kernel.setArg(3, mvBuffer);
-        kernel.setArg(4, sad);
-        kernel.setArg(5, ShapeBuffer);
-        kernel.setArg(6, sizeof(cl_int), &mbImageHeight);
-        queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(PAD(width,16), 1, 1), cl::NDRange(16, 1, 1));
-        queue.finish();
+        std::swap(refPlane, srcPlane);
+        srcPlane.Load(currImage->Y, currImage->PitchY);
+        // Half-pel planes are built once per reference and shared by all MBs
+        if (desc.subPixelMode != CPUVme::SUBPIXEL_MODE_INTEGER)
+        {
+            refPlane.Interpolate();
+        }
+        // Results go straight to the slot of the frame in the result window, no read back needed
+        MotionResults & slot = results.Begin(i);
+        // Cost center is (0, 0) for every MB, like the kernel's cost_center
+        estimator.EstimateFrame(srcPlane, refPlane, &predMem[0], NULL, &slot.MVs[0], &slot.SADs[0], &slot.Shapes[0]);
         meStat += (time_stamp() - meStart);
 
-        ioStart = time_stamp();
-        // Read back resulting motion vectors (in a sync way)
-        void * pMVs = &MVs[i * mvImageWidth * mvImageHeight];
-        void * pSADs = &SADs[i * mvImageWidth * mvImageHeight];
-        void * pShapes = &Shapes[i * mbImageWidth * mbImageHeight];
-
-        queue.enqueueReadBuffer(mvBuffer,CL_TRUE,0,sizeof(MotionVector) * mvImageWidth * mvImageHeight,pMVs,0,0);
-        queue.enqueueReadBuffer(sad,CL_TRUE,0,sizeof(cl_ushort) * mvImageWidth * mvImageHeight,pSADs,0,0);
-        queue.enqueueReadBuffer(ShapeBuffer, CL_TRUE, 0, sizeof(cl_uchar2)* mbImageWidth * mbImageHeight, pShapes, 0, 0);
-
-        ioStat += (time_stamp() -ioStart);
+        // srcPlane holds its own copy of the frame, so the sinks may draw on currImage
+        // until it goes back to the ring
+        double sinkStart = time_stamp();
+        results.Publish(i, currImage);
+        sinkStat += (time_stamp() - sinkStart);
+        prefetch.Release(i);
     }
+    results.Finish();
     double overallStat  = time_stamp() - overallStart;
     std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
     std::cout << "Overall time for " << numPics << " frames " << overallStat << " sec\n" ;
-    std::cout << "Average frame file I/O time per frame " << 1000*ioStat/numPics << " ms\n";
+    std::cout << "Average wait for frame time per frame " << 1000*prefetch.GetWaitTime()/numPics << " ms\n";
+    std::cout << "Average frame file read time per frame (background) " << 1000*prefetch.GetReadTime()/numPics << " ms\n";
     std::cout << "Average Motion Estimation time per frame is " << 1000*meStat/numPics << " ms\n";
-    ReleaseImage(currImage);
+    std::cout << "Average result consumption time per frame is " << 1000*sinkStat/numPics << " ms\n";
+    return numPics;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -404,15 +639,13 @@ void DrawLine(int x0, int y0, int dx, int dy, U8 *pPic, int nPicWidth, int nPicH
     }
 }
 
-void OverlayVectors(unsigned int subBlockSize, std::vector<MotionVector>& MVs,
-                    std::vector<cl_uchar2>& Shapes, PlanarImage* srcImage,
-                    int frame, int width, int height) {
+void OverlayVectors(unsigned int subBlockSize, const MotionVector* pMV,
+                    const cl_uchar2* pShapes, PlanarImage* srcImage,
+                    int width, int height) {
   int mvImageWidth, mvImageHeight;
   int mbImageWidth, mbImageHeight;
   ComputeNumMVs(kMBBlockType, width, height, mvImageWidth, mvImageHeight,
                 mbImageWidth, mbImageHeight);
-  MotionVector* pMV = &MVs[frame * mvImageWidth * mvImageHeight];
-  cl_uchar2* pShapes = &Shapes[frame * mbImageWidth * mbImageHeight];
 
 #define OFF(P) (P + 2) >> 2
   for (int i = 0; i < mbImageHeight; i++) {
@@ -548,6 +781,78 @@ static void upsample_flow_4x4_per_pix(const Mat_<Point2f>& flow, Mat_<Point2f> d
             dense_flow.at<Point2f>(r, c) = flow.at<Point2f>(r/4, c/4);
 }
 
+// Draws the motion vectors on the source frame and appends it to the output sequence
+class OverlaySink : public ResultSink
+{
+public:
+    OverlaySink(FrameWriter * pWriter, int width, int height) :
+        m_pWriter(pWriter), m_width(width), m_height(height), m_subBlockSize(ComputeSubBlockSize(kMBBlockType))
+    {
+    }
+
+    virtual void Consume(const ResultWindow & window, int i, PlanarImage * image)
+    {
+        // Overlay MVs on Src picture, except the very first one
+        if (i > 0)
+        {
+            const MotionResults & results = window.Get(i);
+            OverlayVectors(m_subBlockSize, &results.MVs[0], &results.Shapes[0], image, m_width, m_height);
+        }
+        m_pWriter->AppendFrame(image);
+    }
+
+private:
+    FrameWriter * m_pWriter;
+    int m_width;
+    int m_height;
+    unsigned int m_subBlockSize;
+};
+
+// Writes the motion vectors of every frame as a .flo file, one vector per 4x4
+// block, and upsampled to one vector per pixel as a .dense.flo file
+class FloSink : public ResultSink
+{
+public:
+    FloSink(const string & baseName, int mvImageWidth, int mvImageHeight) :
+        m_baseName(baseName), m_mvImageWidth(mvImageWidth), m_mvImageHeight(mvImageHeight),
+        m_linear(mvImageWidth * mvImageHeight),
+        m_flow(mvImageHeight, mvImageWidth, Point2f(0, 0)),
+        m_denseFlow(mvImageHeight * 4, mvImageWidth * 4, Point2f(0, 0))
+    {
+    }
+
+    virtual void Consume(const ResultWindow & window, int i, PlanarImage *)
+    {
+        // OCL VME Ext packs MV output in MB raster order, with the MVs of a MB
+        // in zigzag order, so pack all MVs in a frame with raster order first
+        LinearizeMVs(&window.Get(i).MVs[0], m_mvImageWidth, m_mvImageHeight, &m_linear[0]);
+        for (int row = 0; row < m_mvImageHeight; row++)
+        {
+            for (int col = 0; col < m_mvImageWidth; col++)
+            {
+                const MotionVector & mv = m_linear[row * m_mvImageWidth + col];
+                m_flow(row, col) = Point2f((float)(-1*OFF(mv.s[0])), (float)(-1*OFF(mv.s[1])));
+            }
+        }
+
+#if !SHOW_BLOCKS
+        writeOpticalFlowToFile(m_flow, m_baseName + ".frame_" + to_string(i) + ".ime.flo");
+
+        // upsampling MVs
+        upsample_flow_4x4_per_pix(m_flow, m_denseFlow);
+        writeOpticalFlowToFile(m_denseFlow, m_baseName + ".frame_" + to_string(i) + ".ime.dense.flo");
+#endif
+    }
+
+private:
+    string m_baseName;
+    int m_mvImageWidth;
+    int m_mvImageHeight;
+    std::vector<MotionVector> m_linear;
+    Mat_<Point2f> m_flow;
+    Mat_<Point2f> m_denseFlow;
+};
+
 
 int main( int argc, const char** argv )
 {
@@ -561,167 +866,131 @@ int main( int argc, const char** argv )
         {
             return 0;
         }
+        if(cmd.selfcheck.isSet())
+        {
+            return CPUVme::SelfCheck(std::cout) ? 0 : 1;
+        }
+#ifdef CPU_BACKEND_ONLY
+        if(!cmd.backend_cpu.isSet())
+        {
+            throw std::runtime_error("This build has no OpenCL support, only --backend cpu is available");
+        }
+#endif
 
         const int width = cmd.width.getValue();
         const int height = cmd.height.getValue();
         const int frames = cmd.frames.getValue();
-        // Open input sequence
-        Capture * pCapture = Capture::CreateFileCapture(cmd.fileName.getValue(), width, height, frames);
+        // Open input sequence, a stream with no frame count runs until it ends
+        Capture * pCapture = Capture::CreateFileCapture(cmd.fileName.getValue(), width, height, frames, true);
         if (!pCapture)
         {
             throw std::runtime_error("Failed opening video input sequence...");
         }
 
-        // Process sequence
-        std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
-        std::vector<MotionVector> MVs;
-        std::vector<cl_ushort> SADs;
-        std::vector<cl_uchar2> Shapes;
-        ExtractMotionVectorsFullFrameWithOpenCL(pCapture, MVs, SADs, Shapes, cmd);
-#if 0
-        for (int i = 8160*16; i < 8176*16; i++ )
-        {
-            std::cout << "(" << MVs[i].s[0] << "," << MVs[i].s[1] << ") --- " << SADs[i] << std::endl;
-
-        }
-#endif
-        // Generate sequence with overlaid motion vectors
-        FrameWriter * pWriter = FrameWriter::CreateFrameWriter(width, height, pCapture->GetNumFrames(), cmd.out_to_bmp.getValue());
-        PlanarImage * srcImage = CreatePlanarImage(width, height);
-
         int mvImageWidth, mvImageHeight;
         int mbImageWidth, mbImageHeight;
         ComputeNumMVs(kMBBlockType, width, height, mvImageWidth, mvImageHeight, mbImageWidth, mbImageHeight);
-        unsigned int subBlockSize = ComputeSubBlockSize(kMBBlockType);
-
-        // Linearize MVs - OCL VME Ext packs MV output in MB raster order.
-        // In each MB, MVs (say 1 MV per 4x4) arranged in zigzag pattern.
-        // In other words, in the frame context, MVs are not packed in sequential order,
-        // The following routine is to pack all MVs in a frame with raster order.
-
-        std::map<uint8_t, uint8_t> zigzag_id_map;
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  0,  0));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  1,  1));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  2,  4));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  3,  5));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  4,  2));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  5,  3));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  6,  6));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  7,  7));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  8,  8));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>(  9,  9));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 10,  12));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 11,  13));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 12,  10));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 13,  11));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 14,  14));
-        zigzag_id_map.insert(std::pair<uint8_t, uint8_t>( 15,  15));
-
-        std::vector<MotionVector> MVs_linear;
-        MVs_linear.resize(MVs.size());
-
-        Point2f zero_mv(0, 0);
-        Mat ime_mat = Mat_<Point2f>(mvImageHeight,mvImageWidth, zero_mv);
-        Mat ime_mat_dense = Mat_<Point2f>(mvImageHeight*4,mvImageWidth*4, zero_mv);
-//        Mat ime_mat = Mat_<Point2f>(mvImageHeight,mvImageWidth); //construction without zero initialization
-
-
-//        for (int j=0; j<mvImageHeight; j++)
-//        {
-//            for (int i=0; i<mvImageWidth; i++)
-//            {
-//                Point2f mv=ime_mat.at<Point2f>(j, i);
-//                printf("(R,C):(%d, %d) => (u, v):(%.3f, %.3f)\n", j, i, mv.x, mv.y);
-//            }
-//        }
-
-
-        for (int k = 0; k < pCapture->GetNumFrames(); k++)
+
+        // Output files are named after the output sequence
+        string baseName = cmd.overlayFileName.getValue();
+        baseName.erase(baseName.find_last_of("."), string::npos);
+
+        // Consumers of the per-frame results, in the order they see a frame.
+        // The list is checked before any of them opens its output: a second
+        // overlay would replace the writer of the first one
+        static const char * const kSinkNames[] = { "overlay", "flo", "npy", "stats", "null" };
+        static const char * const * kSinkNamesEnd = kSinkNames + sizeof(kSinkNames) / sizeof(kSinkNames[0]);
+        std::vector<string> sinkNames;
+        std::stringstream names(cmd.results.getValue());
+        string token;
+        while (std::getline(names, token, ','))
         {
-            pCapture->GetSample(k, srcImage);
-            // Overlay MVs on Src picture, except the very first one
-            if(k>0)
+            if (std::find(kSinkNames, kSinkNamesEnd, token) == kSinkNamesEnd)
             {
-                OverlayVectors(subBlockSize, MVs, Shapes, srcImage, k, width, height);
+                throw std::runtime_error("Unknown result consumer " + token);
             }
+            if (std::find(sinkNames.begin(), sinkNames.end(), token) != sinkNames.end())
+            {
+                throw std::runtime_error("Result consumer " + token + " is listed twice");
+            }
+            sinkNames.push_back(token);
+        }
 
-            pWriter->AppendFrame(srcImage);
-
-            // unpack MVs and generate flo and dense flo
-            for (int i=0; i<(mvImageHeight*mvImageWidth); i++)
+        FrameWriter * pWriter = NULL;
+        std::vector<ResultSink *> sinks;
+        for (size_t s = 0; s < sinkNames.size(); s++)
+        {
+            const string & name = sinkNames[s];
+            if (name == "overlay")
             {
-                // Get 4x4 coord in y,x
-                int mv_row = i/mvImageWidth;
-                int mv_col = i%mvImageWidth;
-
-                int mb_row = mv_row/4;
-                int mb_col = mv_col/4;
-
-                int subMB_row = mv_row%4;  // overflow of last MB in y direction
-                int subMB_col = mv_col%4;  // overflow of last MB in x direction
-
-                int id_in_MB = subMB_row*4 + subMB_col;
-
-                int mbIndex =  (mb_row * mbImageWidth) + mb_col;
-
-                // mbIndex * 16 - each MB has 16 MVs if 1MV per 4x4
-                int lookup_index = k*(mvImageHeight*mvImageWidth) + mbIndex*16 + zigzag_id_map[id_in_MB];
-
-                MVs_linear[i]=MVs[lookup_index];
-
-                ime_mat.at<Point2f>(mv_row, mv_col) = Point2f((float)(-1*OFF(MVs[lookup_index].s[0])), (float)(-1*OFF(MVs[lookup_index].s[1])));
-
-//                    printf("(R,C):(%d, %d) => (u, v):(%.3f, %.3f)\n", j, i, mv.x, mv.y);
-//                    if ((i>=0) && (i < 480))
-//                    if ((i>=480) && (i < 960))
-//                    if ((i>=960) && (i < 1340))
-//                    if ((i>=1340) && (i < 1920))
-                if ((i>=1920) && (i < 2400))
-                {
-                    printf("i: %d, "
-                           "mv_row: %d, "
-                           "mv_col: %d, "
-                           "mb_row: %d, "
-                           "mb_col: %d, "
-                           "id_in_MB: %d, "
-                           "zigzag_map: %d, "
-                           "frame: %d, lookup: %d, "
-                           "old (%d, %d) <=> "
-                           "new (%d, %d),"
-                           "mat (%.2f, %.2f) \n",
-                           i, mv_row, mb_col, mb_row, mb_col, id_in_MB, zigzag_id_map[id_in_MB], k, lookup_index,
-                           OFF(MVs[lookup_index].s[0]), OFF(MVs[lookup_index].s[1]),
-                           OFF(MVs_linear[i].s[0]), OFF(MVs_linear[i].s[1]),
-                           ime_mat.at<Point2f>(mv_row, mv_col).x,ime_mat.at<Point2f>(mv_row, mv_col).y);
-                }
+                // Generate sequence with overlaid motion vectors
+                pWriter = FrameWriter::CreateStreamingFrameWriter(cmd.overlayFileName.getValue(), width, height);
+                sinks.push_back(new OverlaySink(pWriter, width, height));
+            }
+            else if (name == "flo")
+            {
+                sinks.push_back(new FloSink(baseName, mvImageWidth, mvImageHeight));
+            }
+            else if (name == "npy")
+            {
+                sinks.push_back(new NpySink(baseName + ".ime.npy", mvImageWidth, mvImageHeight));
+            }
+            else if (name == "stats")
+            {
+                sinks.push_back(new StatsSink());
+            }
+            else if (name == "null")
+            {
+                sinks.push_back(new NullSink());
+            }
+            else
+            {
+                throw std::runtime_error("Unknown result consumer " + name);
             }
+        }
 
-#if !SHOW_BLOCKS
-            string flo_file = cmd.overlayFileName.getValue();
-            flo_file.erase(flo_file.find_last_of("."), string::npos);
-            flo_file.append(".frame_" + to_string(k) + ".ime.flo");
-            writeOpticalFlowToFile(ime_mat, flo_file);
-
-            // upsampling MVs
-            upsample_flow_4x4_per_pix(ime_mat, ime_mat_dense);
-            string flo_dense_file = cmd.overlayFileName.getValue();
-            flo_dense_file.erase(flo_dense_file.find_last_of("."), string::npos);
-            flo_dense_file.append(".frame_" + to_string(k) + ".ime.dense.flo");
-            writeOpticalFlowToFile(ime_mat_dense, flo_dense_file);
-#endif
+        // Process sequence, only the frames in flight and the history the sinks need are kept
+        if (pCapture->GetNumFrames() == Capture::kUnboundedFrames)
+        {
+            std::cout << "Processing frames until the end of the input ..." << std::endl;
         }
-        std::cout << "Writing " << pCapture->GetNumFrames() << " frames to " << cmd.overlayFileName.getValue() << "..." << std::endl;
-        pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
+        else
+        {
+            std::cout << "Processing " << pCapture->GetNumFrames() << " frames ..." << std::endl;
+        }
+        int numPics = 0;
+        if (cmd.backend_cpu.isSet())
+        {
+            ResultDispatcher results(sinks, mvImageWidth * mvImageHeight, mbImageWidth * mbImageHeight);
+            numPics = ExtractMotionVectorsFullFrameWithCPU(pCapture, results, cmd);
+        }
+#ifndef CPU_BACKEND_ONLY
+        else
+        {
+            ResultDispatcher results(sinks, mvImageWidth * mvImageHeight, mbImageWidth * mbImageHeight, kPipelineDepth);
+            numPics = ExtractMotionVectorsFullFrameWithOpenCL(pCapture, results, cmd);
+        }
+#endif
 
-        FrameWriter::Release(pWriter);
+        if (pWriter)
+        {
+            std::cout << "Writing " << numPics << " frames to " << cmd.overlayFileName.getValue() << "..." << std::endl;
+            pWriter->WriteToFile(cmd.overlayFileName.getValue().c_str());
+            FrameWriter::Release(pWriter);
+        }
+        for (size_t s = 0; s < sinks.size(); s++)
+        {
+            delete sinks[s];
+        }
         Capture::Release(pCapture);
-        ReleaseImage(srcImage);
     }
+#ifndef CPU_BACKEND_ONLY
     catch (cl::Error & err)
     {
         std::cout << err.what() << "(" << err.err() << ")" << std::endl;
         return 1;
     }
+#endif
     catch (std::exception & err)
     {
         std::cout << err.what() << std::endl;
@@ -0,0 +1,241 @@
+// Copyright (c) 2009-2013 Intel Corporation
+// All rights reserved.
+//
+// WARRANTY DISCLAIMER
+//
+// THESE MATERIALS ARE PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL INTEL OR ITS
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY
+// OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THESE
+// MATERIALS, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+// Intel Corporation is the author of the Materials, and requests that all
+// problem reports or change requests be submitted to it directly
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "result_sink.hpp"
+
+using namespace YUVUtils;
+
+void MotionResults::Clear()
+{
+    std::fill(MVs.begin(), MVs.end(), cl_short2());
+    std::fill(SADs.begin(), SADs.end(), 0);
+    std::fill(Shapes.begin(), Shapes.end(), cl_uchar2());
+}
+
+ResultWindow::ResultWindow(int size, size_t mvsPerFrame, size_t mbsPerFrame) :
+    m_slots(std::max(size, 1))
+{
+    for (size_t s = 0; s < m_slots.size(); s++)
+    {
+        m_slots[s].frame = -1;
+        m_slots[s].MVs.resize(mvsPerFrame);
+        m_slots[s].SADs.resize(mvsPerFrame);
+        m_slots[s].Shapes.resize(mbsPerFrame);
+    }
+}
+
+MotionResults & ResultWindow::Slot(int i)
+{
+    MotionResults & slot = m_slots[i % m_slots.size()];
+    slot.frame = i;
+    return slot;
+}
+
+bool ResultWindow::Contains(int i) const
+{
+    return i >= 0 && m_slots[i % m_slots.size()].frame == i;
+}
+
+const MotionResults & ResultWindow::Get(int i) const
+{
+    if (!Contains(i))
+    {
+        std::stringstream msg;
+        msg << "Results of frame " << i << " are no longer in the window";
+        throw std::runtime_error(msg.str());
+    }
+    return m_slots[i % m_slots.size()];
+}
+
+ResultDispatcher::ResultDispatcher(const std::vector<ResultSink *> & sinks, size_t mvsPerFrame, size_t mbsPerFrame, int inFlight) :
+    m_sinks(sinks),
+    m_window(WindowSize(sinks, inFlight), mvsPerFrame, mbsPerFrame)
+{
+}
+
+int ResultDispatcher::WindowSize(const std::vector<ResultSink *> & sinks, int inFlight)
+{
+    // A slot is refilled inFlight frames after the frame in it is consumed,
+    // the sinks may still look back History() frames by then
+    int history = 0;
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+        history = std::max(history, sinks[s]->History());
+    }
+    return history + std::max(inFlight, 1);
+}
+
+void ResultDispatcher::Publish(int i, PlanarImage * image)
+{
+    for (size_t s = 0; s < m_sinks.size(); s++)
+    {
+        m_sinks[s]->Consume(m_window, i, image);
+    }
+}
+
+void ResultDispatcher::Finish()
+{
+    for (size_t s = 0; s < m_sinks.size(); s++)
+    {
+        m_sinks[s]->Finish();
+    }
+}
+
+StatsSink::StatsSink() :
+    m_frames(0), m_sadSum(0), m_lengthSum(0), m_changeSum(0),
+    m_zeroMVs(0), m_MVs(0), m_changedMVs(0)
+{
+}
+
+void StatsSink::Consume(const ResultWindow & window, int i, PlanarImage *)
+{
+    // Frame 0 has no motion
+    if (i == 0)
+    {
+        return;
+    }
+    const MotionResults & curr = window.Get(i);
+    // The previous frame is only compared when it was estimated too
+    const MotionResults * prev = (i > 1) ? &window.Get(i - 1) : NULL;
+
+    for (size_t m = 0; m < curr.MVs.size(); m++)
+    {
+        const cl_short2 & mv = curr.MVs[m];
+        m_sadSum += curr.SADs[m];
+        m_lengthSum += std::sqrt((double)mv.s[0] * mv.s[0] + (double)mv.s[1] * mv.s[1]) / 4;
+        if (mv.s[0] == 0 && mv.s[1] == 0)
+        {
+            m_zeroMVs++;
+        }
+        if (prev)
+        {
+            const cl_short2 & prevMV = prev->MVs[m];
+            m_changeSum += (std::abs(mv.s[0] - prevMV.s[0]) + std::abs(mv.s[1] - prevMV.s[1])) / 4.0;
+            m_changedMVs++;
+        }
+    }
+    m_MVs += curr.MVs.size();
+    m_frames++;
+}
+
+void StatsSink::Finish()
+{
+    if (!m_MVs)
+    {
+        return;
+    }
+    std::cout << std::setiosflags(std::ios_base::fixed) << std::setprecision(3);
+    std::cout << "Motion statistics over " << m_frames << " estimated frames\n";
+    // Every 4x4 entry holds the distortion of the whole partition it belongs to
+    std::cout << "    Mean partition distortion per 4x4 entry " << m_sadSum / m_MVs << "\n";
+    std::cout << "    Zero motion vectors " << 100.0 * m_zeroMVs / m_MVs << " %\n";
+    std::cout << "    Mean motion vector length " << m_lengthSum / m_MVs << " pixels\n";
+    if (m_changedMVs)
+    {
+        std::cout << "    Mean motion vector change between frames " << m_changeSum / m_changedMVs << " pixels\n";
+    }
+}
+
+// Room for the header of any shape, the format wants the data 16-byte aligned
+static const size_t kNpyHeaderSize = 128;
+
+NpySink::NpySink(const std::string & fileName, int mvImageWidth, int mvImageHeight) :
+    m_file(NULL), m_mvImageWidth(mvImageWidth), m_mvImageHeight(mvImageHeight), m_frames(0),
+    m_linear(mvImageWidth * mvImageHeight)
+{
+    m_file = fopen(fileName.c_str(), "wb");
+    if (!m_file)
+    {
+        throw std::runtime_error("Failed opening " + fileName);
+    }
+    // The frame count isn't known until the end, Finish rewrites the header
+    WriteHeader(0);
+}
+
+NpySink::~NpySink()
+{
+    if (m_file)
+    {
+        fclose(m_file);
+    }
+}
+
+void NpySink::WriteHeader(int frames)
+{
+    std::stringstream dict;
+    dict << "{'descr': '<i2', 'fortran_order': False, 'shape': ("
+         << frames << ", " << m_mvImageHeight << ", " << m_mvImageWidth << ", 2), }";
+    std::string header = dict.str();
+    // magic, version 1.0, 2-byte length, then the dict padded with spaces and ended with a newline
+    const size_t preamble = 10;
+    header.append(kNpyHeaderSize - preamble - header.size() - 1, ' ');
+    header += '\n';
+    unsigned short headerLength = (unsigned short)header.size();
+    unsigned char lengthBytes[2] = { (unsigned char)(headerLength & 0xff), (unsigned char)(headerLength >> 8) };
+
+    fseek(m_file, 0, SEEK_SET);
+    fwrite("\x93NUMPY\x01\x00", 1, 8, m_file);
+    fwrite(lengthBytes, 1, 2, m_file);
+    fwrite(header.c_str(), 1, header.size(), m_file);
+}
+
+void NpySink::Consume(const ResultWindow & window, int i, PlanarImage *)
+{
+    const MotionResults & results = window.Get(i);
+    LinearizeMVs(&results.MVs[0], m_mvImageWidth, m_mvImageHeight, &m_linear[0]);
+    // cl_short2 is two little-endian int16 on every device we run on
+    if (fwrite(&m_linear[0], sizeof(cl_short2), m_linear.size(), m_file) != m_linear.size())
+    {
+        throw std::runtime_error("Failed writing the motion vectors");
+    }
+    m_frames++;
+}
+
+void NpySink::Finish()
+{
+    WriteHeader(m_frames);
+    fclose(m_file);
+    m_file = NULL;
+}
+
+void LinearizeMVs(const cl_short2 * MVs, int mvImageWidth, int mvImageHeight, cl_short2 * linear)
+{
+    // Position in the kernel output of the 4x4 block at (row, col) of the
+    // macroblock, indexed by row * 4 + col
+    static const int kZigzag[16] = { 0, 1, 4, 5, 2, 3, 6, 7, 8, 9, 12, 13, 10, 11, 14, 15 };
+
+    const int mbImageWidth = mvImageWidth / 4;
+    for (int row = 0; row < mvImageHeight; row++)
+    {
+        for (int col = 0; col < mvImageWidth; col++)
+        {
+            int mbIndex = (row / 4) * mbImageWidth + col / 4;
+            linear[row * mvImageWidth + col] = MVs[mbIndex * 16 + kZigzag[(row % 4) * 4 + col % 4]];
+        }
+    }
+}
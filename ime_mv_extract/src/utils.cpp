@@ -84,6 +84,7 @@ char *ReadSources(const char *fileName)
     return src;
 }
 
+#ifndef CPU_BACKEND_ONLY
 cl_platform_id GetIntelOCLPlatform()
 {
     cl_platform_id pPlatforms[10] = { 0 };
@@ -127,6 +128,7 @@ void BuildFailLog( cl_program program,
         free(buildLogMsgBuf);
     }
 }
+#endif
 #ifndef __linux__
 bool SaveImageAsBMP ( unsigned int* ptr, int width, int height, const char* fileName)
 {
@@ -250,6 +252,7 @@ bool SaveImageAsBMP_32FC4(cl_float* p_buf, cl_float scale, cl_uint array_width,
 }
 #endif
 
+#ifndef CPU_BACKEND_ONLY
 cl_kernel createKernelFromString(cl_context* context,
                                  OCL_DeviceAndQueue* cl_devandqueue,
                                  const char* codeString,
@@ -359,6 +362,7 @@ cl_kernel createKernelFromFile(cl_context* context,
 
     return tmpKernel;
 }
+#endif
 
 // return random number of any size
 #define RAND_FLOAT(max) max*2.0f*((float)rand() / (float)RAND_MAX) - max
@@ -425,6 +429,7 @@ void line_clfloatn(void* out, float frand, size_t type_size)
     memcpy(out,&val,type_size);
 }
 
+#ifndef CPU_BACKEND_ONLY
 cl_mem createRandomFloatVecBuffer(cl_context* context,
                                   cl_mem_flags flags,
                                   size_t atomic_size,
@@ -489,6 +494,7 @@ cl_int fillRandomFloatVecBuffer(cl_command_queue* cmdqueue,
 
     return err;
 }
+#endif
 
 
 